@@ -315,6 +315,153 @@ protected:
 	std::vector<PatternSourcePerThread *>* patsrcs_;
 };
 
+/**
+ * Searches each read against several indexes in turn, one aligner per
+ * index.  The aligners' sinks set their hits aside in this aligner's
+ * merging sinks, which report them once the last index has been
+ * searched (or once the hits found so far settle the outcome).
+ */
+class ShardedAligner : public Aligner {
+public:
+	ShardedAligner(
+			const HitSinkPerThreadFactory& sinkPtFactory,
+			bool anyHits) :
+			Aligner(true, false),
+			sinkPtFactory_(sinkPtFactory),
+			anyHits_(anyHits),
+			cur_(0)
+	{ }
+
+	virtual ~ShardedAligner() {
+		for(size_t i = 0; i < aligners_.size(); i++) {
+			delete aligners_[i];
+		}
+		for(size_t i = 0; i < merges_.size(); i++) {
+			sinkPtFactory_.destroy(merges_[i]);
+		}
+	}
+
+	/// Add the aligner for the next index
+	void addShard(Aligner* al) {
+		assert(al != NULL);
+		aligners_.push_back(al);
+	}
+
+	/// Merging sinks; the first index's aligner creates them
+	std::vector<HitSinkPerThread*>& merges() {
+		return merges_;
+	}
+
+	virtual void setQuery(PatternSourcePerThread* patsrc) {
+		assert(!aligners_.empty());
+		Aligner::setQuery(patsrc);
+		this->done = false;
+		cur_ = 0;
+		aligners_[0]->setQuery(patsrc);
+		nextShard();
+	}
+
+	virtual bool advance() {
+		assert(!this->done);
+		aligners_[cur_]->advance();
+		nextShard();
+		return this->done;
+	}
+
+protected:
+
+	/**
+	 * Once the current index is done with the read, move on to the
+	 * next one, or report the merged hits if that was the last.
+	 */
+	void nextShard() {
+		while(aligners_[cur_]->done) {
+			if(++cur_ == aligners_.size() || merges_[0]->shardsDone(anyHits_)) {
+				// As with paired-end aligners, any additional sinks
+				// hold unpaired alignments for the mates, which are
+				// reported only if no paired alignment is
+				bool reported = merges_[0]->finishRead(*patsrc_, true, true) > 0;
+				for(size_t i = 1; i < merges_.size(); i++) {
+					merges_[i]->finishRead(*patsrc_, !reported, false);
+				}
+				this->done = true;
+				return;
+			}
+			aligners_[cur_]->setQuery(patsrc_);
+		}
+	}
+
+	const HitSinkPerThreadFactory& sinkPtFactory_;
+	bool anyHits_; /// stop once we have -k hits, best or not
+	std::vector<Aligner*> aligners_;
+	std::vector<HitSinkPerThread*> merges_;
+	size_t cur_; /// index currently being searched
+};
+
+/**
+ * Factory for ShardedAligners.  Add one aligner factory per index,
+ * each built with the sink factory returned by shardSinks() just
+ * before.  With a single index this simply creates that index's
+ * aligners.
+ */
+class ShardedAlignerFactory : public AlignerFactory {
+public:
+	ShardedAlignerFactory(
+			const HitSinkPerThreadFactory& sinkPtFactory,
+			size_t nshards,
+			bool anyHits) :
+			sinkPtFactory_(sinkPtFactory),
+			nshards_(nshards),
+			anyHits_(anyHits)
+	{
+		assert_gt(nshards_, 0);
+	}
+
+	virtual ~ShardedAlignerFactory() {
+		for(size_t i = 0; i < factories_.size(); i++) {
+			delete factories_[i];
+		}
+		for(size_t i = 0; i < sinkFactories_.size(); i++) {
+			delete sinkFactories_[i];
+		}
+	}
+
+	/**
+	 * Return the sink factory to build the next index's aligner
+	 * factory with; 'refBase' is the number of references in the
+	 * indexes before it.
+	 */
+	const HitSinkPerThreadFactory& shardSinks(TIndexOffU refBase) {
+		if(nshards_ == 1) return sinkPtFactory_;
+		sinkFactories_.push_back(new ShardHitSinkPerThreadFactory(sinkPtFactory_, refBase));
+		return *sinkFactories_.back();
+	}
+
+	/// Add the next index's aligner factory; takes ownership
+	void addShard(AlignerFactory* f) {
+		assert(f != NULL);
+		factories_.push_back(f);
+	}
+
+	virtual Aligner* create() const {
+		assert_eq(nshards_, factories_.size());
+		if(nshards_ == 1) return factories_[0]->create();
+		ShardedAligner* al = new ShardedAligner(sinkPtFactory_, anyHits_);
+		for(size_t i = 0; i < factories_.size(); i++) {
+			sinkFactories_[i]->setMerges(&al->merges());
+			al->addShard(factories_[i]->create());
+		}
+		return al;
+	}
+
+private:
+	const HitSinkPerThreadFactory& sinkPtFactory_;
+	size_t nshards_;
+	bool anyHits_;
+	std::vector<AlignerFactory*> factories_;
+	std::vector<ShardHitSinkPerThreadFactory*> sinkFactories_;
+};
+
 /**
  * An aligner for finding exact matches of unpaired reads.  Always
  * tries the forward-oriented version of the read before the reverse-
@@ -416,10 +563,10 @@ public:
 		params_->setFw(ra.fw);
 		assert_eq(bufa_->color, color);
 		return params_->reportHit(
-				ra.fw ? (ebwtFw? bufa_->patFw    : bufa_->patFwRev) :
-				        (ebwtFw? bufa_->patRc    : bufa_->patRcRev),
-				ra.fw ? (ebwtFw? &bufa_->qual    : &bufa_->qualRev) :
-				        (ebwtFw? &bufa_->qualRev : &bufa_->qual),
+				ra.fw ? (ebwtFw? bufa_->patFw         : bufa_->getPatFwRev()) :
+				        (ebwtFw? bufa_->getPatRc()    : bufa_->getPatRcRev()),
+				ra.fw ? (ebwtFw? &bufa_->qual         : &bufa_->getQualRev()) :
+				        (ebwtFw? &bufa_->getQualRev() : &bufa_->qual),
 				&bufa_->name,
 				bufa_->color,
 				bufa_->primer,
@@ -831,10 +978,10 @@ protected:
 		assert_eq(bufL->color, color);
 		// Print upstream mate first
 		ret = params_->reportHit(
-				rL.fw ? (ebwtFwL?  bufL->patFw  :  bufL->patFwRev) :
-					    (ebwtFwL?  bufL->patRc  :  bufL->patRcRev),
-				rL.fw ? (ebwtFwL? &bufL->qual    : &bufL->qualRev) :
-				        (ebwtFwL? &bufL->qualRev : &bufL->qual),
+				rL.fw ? (ebwtFwL?  bufL->patFw        :  bufL->getPatFwRev()) :
+					    (ebwtFwL?  bufL->getPatRc()   :  bufL->getPatRcRev()),
+				rL.fw ? (ebwtFwL? &bufL->qual         : &bufL->getQualRev()) :
+				        (ebwtFwL? &bufL->getQualRev() : &bufL->qual),
 				&bufL->name,
 				bufL->color,
 				bufL->primer,
@@ -866,10 +1013,10 @@ protected:
 		params_->setFw(rR.fw);
 		assert_eq(bufR->color, color);
 		ret = params_->reportHit(
-				rR.fw ? (ebwtFwR?  bufR->patFw  :  bufR->patFwRev) :
-					    (ebwtFwR?  bufR->patRc  :  bufR->patRcRev),
-				rR.fw ? (ebwtFwR? &bufR->qual    : &bufR->qualRev) :
-				        (ebwtFwR? &bufR->qualRev : &bufR->qual),
+				rR.fw ? (ebwtFwR?  bufR->patFw        :  bufR->getPatFwRev()) :
+					    (ebwtFwR?  bufR->getPatRc()   :  bufR->getPatRcRev()),
+				rR.fw ? (ebwtFwR? &bufR->qual         : &bufR->getQualRev()) :
+				        (ebwtFwR? &bufR->getQualRev() : &bufR->qual),
 				&bufR->name,
 				bufR->color,
 				bufR->primer,
@@ -936,14 +1083,14 @@ protected:
 		// reference strand
 		const String<Dna5>& seq  = fw ? (off1 ? patsrc_->bufb().patFw   :
 		                                        patsrc_->bufa().patFw)  :
-		                                (off1 ? patsrc_->bufb().patRc   :
-		                                        patsrc_->bufa().patRc);
+		                                (off1 ? patsrc_->bufb().getPatRc() :
+		                                        patsrc_->bufa().getPatRc());
 		// 'seq' gets qualities of outstanding mate w/r/t the forward
 		// reference strand
 		const String<char>& qual = fw ? (off1 ? patsrc_->bufb().qual  :
 		                                        patsrc_->bufa().qual) :
-		                                (off1 ? patsrc_->bufb().qualRev  :
-		                                        patsrc_->bufa().qualRev);
+		                                (off1 ? patsrc_->bufb().getQualRev() :
+		                                        patsrc_->bufa().getQualRev());
 		uint32_t qlen = (uint32_t)seqan::length(seq);  // length of outstanding mate
 		uint32_t alen = (off1 ? patsrc_->bufa().length() :
 		                        patsrc_->bufb().length());
@@ -1710,10 +1857,10 @@ protected:
 		assert_eq(bufL->color, color);
 		// Print upstream mate first
 		ret = params_->reportHit(
-				rL.fw ? (ebwtFwL?  bufL->patFw  :  bufL->patFwRev) :
-				        (ebwtFwL?  bufL->patRc  :  bufL->patRcRev),
-				rL.fw ? (ebwtFwL? &bufL->qual    : &bufL->qualRev) :
-				        (ebwtFwL? &bufL->qualRev : &bufL->qual),
+				rL.fw ? (ebwtFwL?  bufL->patFw        :  bufL->getPatFwRev()) :
+				        (ebwtFwL?  bufL->getPatRc()   :  bufL->getPatRcRev()),
+				rL.fw ? (ebwtFwL? &bufL->qual         : &bufL->getQualRev()) :
+				        (ebwtFwL? &bufL->getQualRev() : &bufL->qual),
 				&bufL->name,
 				bufL->color,
 				bufL->primer,
@@ -1745,10 +1892,10 @@ protected:
 		params_->setFw(rR.fw);
 		assert_eq(bufR->color, color);
 		ret = params_->reportHit(
-				rR.fw ? (ebwtFwR?  bufR->patFw  :  bufR->patFwRev) :
-				        (ebwtFwR?  bufR->patRc  :  bufR->patRcRev),
-				rR.fw ? (ebwtFwR? &bufR->qual    : &bufR->qualRev) :
-				        (ebwtFwR? &bufR->qualRev : &bufR->qual),
+				rR.fw ? (ebwtFwR?  bufR->patFw        :  bufR->getPatFwRev()) :
+				        (ebwtFwR?  bufR->getPatRc()   :  bufR->getPatRcRev()),
+				rR.fw ? (ebwtFwR? &bufR->qual         : &bufR->getQualRev()) :
+				        (ebwtFwR? &bufR->getQualRev() : &bufR->qual),
 				&bufR->name,
 				bufR->color,
 				bufR->primer,
@@ -1792,10 +1939,10 @@ protected:
 		assert_eq(buf->color, color);
 		// Print upstream mate first
 		if(params->reportHit(
-			r.fw ? (ebwtFw?  buf->patFw   :  buf->patFwRev) :
-			       (ebwtFw?  buf->patRc   :  buf->patRcRev),
-			r.fw ? (ebwtFw? &buf->qual    : &buf->qualRev) :
-			       (ebwtFw? &buf->qualRev : &buf->qual),
+			r.fw ? (ebwtFw?  buf->patFw        :  buf->getPatFwRev()) :
+			       (ebwtFw?  buf->getPatRc()   :  buf->getPatRcRev()),
+			r.fw ? (ebwtFw? &buf->qual         : &buf->getQualRev()) :
+			       (ebwtFw? &buf->getQualRev() : &buf->qual),
 			&buf->name,
 			buf->color,
 			buf->primer,
@@ -1886,14 +2033,14 @@ protected:
 		const String<Dna5>& seq  =
 			fw ? (range.mate1 ? patsrc_->bufb().patFw   :
 		                        patsrc_->bufa().patFw)  :
-		         (range.mate1 ? patsrc_->bufb().patRc   :
-		                        patsrc_->bufa().patRc);
+		         (range.mate1 ? patsrc_->bufb().getPatRc() :
+		                        patsrc_->bufa().getPatRc());
 		// 'qual' = qualities for opposite mate
 		const String<char>& qual =
 			fw ? (range.mate1 ? patsrc_->bufb().qual  :
 			                    patsrc_->bufa().qual) :
-			     (range.mate1 ? patsrc_->bufb().qualRev :
-			                    patsrc_->bufa().qualRev);
+			     (range.mate1 ? patsrc_->bufb().getQualRev() :
+			                    patsrc_->bufa().getQualRev());
 		uint32_t qlen = (uint32_t)seqan::length(seq);  // length of outstanding mate
 		uint32_t alen = (range.mate1 ? patsrc_->bufa().length() :
 		                               patsrc_->bufb().length());
@@ -0,0 +1,309 @@
+/*
+ * bgzf.cpp
+ *
+ * Parallel inflating of BGZF and indexed multi-member gzip read files;
+ * see bgzf.h.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <zlib.h>
+#include "bgzf.h"
+
+using namespace std;
+
+int gInflateThreads = 1;
+
+/// Inflated text per job of BGZF blocks (a block holds at most 64K)
+static const uint64_t BGZF_JOB_TEXT = 1024 * 1024;
+/// Compressed bytes per job of indexed gzip members
+static const uint64_t INDEXED_JOB_BYTES = 256 * 1024;
+
+static inline uint32_t le16(const unsigned char *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static inline uint32_t le32(const unsigned char *p) {
+	return le16(p) | (le16(p + 2) << 16);
+}
+
+static inline uint64_t le64(const unsigned char *p) {
+	uint64_t v = 0;
+	for(int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+	return v;
+}
+
+/**
+ * Read a bgzip-style block index: a count followed by that many
+ * (compressed offset, inflated offset) pairs, all 64-bit little-endian.
+ * Fill 'index' with the compressed offsets at which members start.
+ */
+static bool readGzIndex(const string& fname, vector<uint64_t>& index) {
+	FILE *f = fopen(fname.c_str(), "rb");
+	if(f == NULL) return false;
+	unsigned char buf[16];
+	bool ok = (fread(buf, 1, 8, f) == 8);
+	uint64_t n = ok ? le64(buf) : 0;
+	index.clear();
+	index.push_back(0);
+	for(uint64_t i = 0; ok && i < n; i++) {
+		ok = (fread(buf, 1, 16, f) == 16);
+		if(ok) index.push_back(le64(buf));
+	}
+	fclose(f);
+	if(!ok) {
+		cerr << "Warning: Could not read gzip block index \"" << fname << "\"; ignoring it" << endl;
+		return false;
+	}
+	sort(index.begin(), index.end());
+	index.erase(unique(index.begin(), index.end()), index.end());
+	return true;
+}
+
+BgzfReader* BgzfReader::open(const string& fname, int nthreads) {
+	FILE *f = fopen(fname.c_str(), "rb");
+	if(f == NULL) return NULL;
+	// A BGZF block is a gzip member with a 'BC' extra subfield
+	// holding the block size
+	unsigned char h[18];
+	bool bgzf = fread(h, 1, 18, f) == 18 &&
+	            h[0] == 0x1f && h[1] == 0x8b && h[2] == 8 && (h[3] & 4) != 0 &&
+	            h[12] == 'B' && h[13] == 'C' && le16(h + 14) == 2;
+	vector<uint64_t> index;
+	if(!bgzf && !readGzIndex(fname + ".gzi", index)) {
+		fclose(f);
+		return NULL;
+	}
+	if(fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	return new BgzfReader(f, nthreads, bgzf, index);
+}
+
+BgzfReader::BgzfReader(FILE *f, int nthreads, bool bgzf, const vector<uint64_t>& index) :
+	f_(f), bgzf_(bgzf), index_(index), idxCur_(0), eof_(false),
+	head_(0), next_(0), fill_(0), outCur_(0), quit_(false)
+{
+	if(nthreads < 1) nthreads = 1;
+	// Enough jobs in flight to keep every worker busy while the
+	// caller reads from the oldest
+	jobs_.resize(2 * nthreads);
+	for(int i = 0; i < nthreads; i++) {
+		threads_.push_back(new tthread::thread(workerWrapper, (void*)this));
+	}
+}
+
+BgzfReader::~BgzfReader() {
+	mutex_.lock();
+	quit_ = true;
+	workCond_.notify_all();
+	mutex_.unlock();
+	for(size_t i = 0; i < threads_.size(); i++) {
+		threads_[i]->join();
+		delete threads_[i];
+	}
+	fclose(f_);
+}
+
+size_t BgzfReader::read(uint8_t *dst, size_t len) {
+	size_t got = 0;
+	while(got < len) {
+		dispatch();
+		if(head_ == fill_) break; // input exhausted
+		Job& j = slot(head_);
+		mutex_.lock();
+		while(!j.done) doneCond_.wait(mutex_);
+		mutex_.unlock();
+		if(!j.ok) {
+			cerr << "Error: Could not inflate gzip'ed read file; it may be truncated or corrupt" << endl;
+			throw 1;
+		}
+		size_t n = min(len - got, j.len - outCur_);
+		memcpy(dst + got, j.out.data() + outCur_, n);
+		got += n;
+		outCur_ += n;
+		if(outCur_ == j.len) {
+			// Free the slot
+			head_++;
+			outCur_ = 0;
+		}
+	}
+	return got;
+}
+
+void BgzfReader::rewind() {
+	// Let the workers finish what they have
+	mutex_.lock();
+	for(uint64_t i = head_; i < fill_; i++) {
+		while(!slot(i).done) doneCond_.wait(mutex_);
+	}
+	head_ = next_ = fill_ = 0;
+	mutex_.unlock();
+	outCur_ = 0;
+	idxCur_ = 0;
+	eof_ = false;
+	fseek(f_, 0, SEEK_SET);
+}
+
+/**
+ * Fill free slots with compressed input and wake workers for them.
+ */
+void BgzfReader::dispatch() {
+	while(!eof_ && fill_ - head_ < jobs_.size()) {
+		Job& j = slot(fill_);
+		if(!readJob(j)) {
+			eof_ = true;
+			break;
+		}
+		mutex_.lock();
+		j.done = false;
+		fill_++;
+		workCond_.notify_one();
+		mutex_.unlock();
+	}
+}
+
+bool BgzfReader::readJob(Job& j) {
+	j.in.clear();
+	j.isize = 0;
+	return bgzf_ ? readBgzfJob(j) : readIndexedJob(j);
+}
+
+/**
+ * Append whole BGZF blocks to j.in until they hold BGZF_JOB_TEXT
+ * characters of text.  A malformed block is handed on as-is so that
+ * inflating it reports the error.
+ */
+bool BgzfReader::readBgzfJob(Job& j) {
+	bool sized = true;
+	while(j.isize < BGZF_JOB_TEXT) {
+		unsigned char h[12];
+		size_t r = fread(h, 1, 12, f_);
+		if(r == 0) break;
+		j.in.append((const char*)h, r);
+		if(r < 12 || h[0] != 0x1f || h[1] != 0x8b || (h[3] & 4) == 0) {
+			eof_ = true;
+			sized = false;
+			break;
+		}
+		// Look for the 'BC' subfield among the extra fields
+		uint32_t xlen = le16(h + 10);
+		string extra(xlen, '\0');
+		if(fread(&extra[0], 1, xlen, f_) != xlen) {
+			eof_ = true;
+			sized = false;
+			break;
+		}
+		j.in.append(extra);
+		uint32_t bsize = 0;
+		for(uint32_t i = 0; i + 4 <= xlen; ) {
+			const unsigned char *x = (const unsigned char*)extra.data() + i;
+			uint32_t slen = le16(x + 2);
+			if(x[0] == 'B' && x[1] == 'C' && slen == 2 && i + 6 <= xlen) {
+				bsize = le16(x + 4) + 1;
+			}
+			i += 4 + slen;
+		}
+		if(bsize < 12 + xlen + 8) {
+			eof_ = true;
+			sized = false;
+			break;
+		}
+		size_t rest = bsize - 12 - xlen;
+		size_t off = j.in.length();
+		j.in.resize(off + rest);
+		if(fread(&j.in[off], 1, rest, f_) != rest) {
+			eof_ = true;
+			sized = false;
+			break;
+		}
+		// The member ends with the length of its text
+		j.isize += le32((const unsigned char*)j.in.data() + j.in.length() - 4);
+	}
+	if(!sized) j.isize = 0;
+	return !j.in.empty();
+}
+
+/**
+ * Append the members from index_[idxCur_] on to j.in until they hold
+ * INDEXED_JOB_BYTES bytes, or the rest of the file after the last
+ * indexed member.
+ */
+bool BgzfReader::readIndexedJob(Job& j) {
+	if(idxCur_ >= index_.size()) return false;
+	uint64_t start = index_[idxCur_++];
+	while(idxCur_ < index_.size() && index_[idxCur_] - start < INDEXED_JOB_BYTES) {
+		idxCur_++;
+	}
+	if(idxCur_ < index_.size()) {
+		size_t n = (size_t)(index_[idxCur_] - start);
+		j.in.resize(n);
+		j.in.resize(fread(&j.in[0], 1, n, f_));
+	} else {
+		char buf[64 * 1024];
+		size_t r;
+		while((r = fread(buf, 1, sizeof(buf), f_)) > 0) {
+			j.in.append(buf, r);
+		}
+	}
+	return !j.in.empty();
+}
+
+/**
+ * Inflate the gzip members in j.in into j.out.  Returns false if they
+ * are malformed, truncated or don't add up to j.isize characters.
+ */
+bool BgzfReader::inflateJob(Job& j) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if(inflateInit2(&z, 15 + 16) != Z_OK) return false; // gzip wrapper
+	z.next_in = (Bytef*)j.in.data();
+	z.avail_in = (uInt)j.in.length();
+	size_t want = (j.isize > 0) ? (size_t)j.isize : max<size_t>(j.in.length() * 4, 64 * 1024);
+	if(j.out.length() < want) j.out.resize(want);
+	j.len = 0;
+	bool ok = true;
+	while(true) {
+		if(j.len == j.out.length()) j.out.resize(j.out.length() * 2);
+		z.next_out = (Bytef*)&j.out[j.len];
+		z.avail_out = (uInt)(j.out.length() - j.len);
+		int ret = inflate(&z, Z_NO_FLUSH);
+		j.len = j.out.length() - z.avail_out;
+		if(ret == Z_STREAM_END) {
+			if(z.avail_in == 0) break;
+			inflateReset(&z); // on to the next member
+		} else if(ret != Z_OK && !(ret == Z_BUF_ERROR && z.avail_out == 0)) {
+			ok = false;
+			break;
+		}
+	}
+	inflateEnd(&z);
+	if(j.isize > 0 && j.len != j.isize) ok = false;
+	return ok;
+}
+
+void BgzfReader::workerWrapper(void *vp) {
+	((BgzfReader*)vp)->work();
+}
+
+/**
+ * Worker body: inflate jobs in the order they were filled until told
+ * to quit.
+ */
+void BgzfReader::work() {
+	mutex_.lock();
+	while(true) {
+		while(!quit_ && next_ == fill_) workCond_.wait(mutex_);
+		if(quit_) break;
+		Job& j = slot(next_++);
+		mutex_.unlock();
+		bool ok = inflateJob(j);
+		mutex_.lock();
+		j.ok = ok;
+		j.done = true;
+		doneCond_.notify_all();
+	}
+	mutex_.unlock();
+}
@@ -0,0 +1,93 @@
+/*
+ * bgzf.h
+ *
+ * Inflates gzip'ed read files on a small pool of worker threads.  That
+ * works when the file is a run of independent gzip members whose
+ * boundaries can be found up front: BGZF files (as written by bgzip
+ * and most sequencers) record each block's size in its header, and
+ * other multi-member gzip files can come with a block index
+ * (<file>.gzi, in bgzip's format) listing where the members start.
+ */
+
+#ifndef BGZF_H_
+#define BGZF_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "threading.h"
+
+extern int gInflateThreads; /// # threads inflating gzip'ed reads; 1 = serial (gzread)
+
+/**
+ * Reads the inflated text of a BGZF or indexed multi-member gzip file.
+ * The caller's thread reads the compressed members in order and hands
+ * them out in jobs of several members each; the workers inflate jobs
+ * in any order and read() returns their text in file order, so record
+ * boundaries that straddle members are no concern of the caller's.
+ */
+class BgzfReader {
+public:
+	/**
+	 * Open 'fname' for inflating on 'nthreads' threads.  Return NULL
+	 * (and leave it to gzread) if it can't be opened or isn't made of
+	 * members we know the boundaries of.
+	 */
+	static BgzfReader* open(const std::string& fname, int nthreads);
+
+	~BgzfReader();
+
+	/**
+	 * Copy up to 'len' inflated characters to 'dst' and return how
+	 * many; fewer than 'len' only at the end of the file.
+	 */
+	size_t read(uint8_t *dst, size_t len);
+
+	/**
+	 * Start over from the beginning of the file.
+	 */
+	void rewind();
+
+private:
+
+	/// Several whole gzip members, and their inflated text
+	struct Job {
+		Job() : isize(0), len(0), done(false), ok(false) { }
+		std::string in;   // compressed members
+		std::string out;  // inflated text; only the first 'len' chars are valid
+		uint64_t    isize;// expected inflated length, or 0 if unknown
+		size_t      len;
+		bool        done; // inflated; guarded by mutex_
+		bool        ok;
+	};
+
+	BgzfReader(FILE *f, int nthreads, bool bgzf, const std::vector<uint64_t>& index);
+
+	Job& slot(uint64_t i) { return jobs_[i % jobs_.size()]; }
+	void dispatch();
+	bool readJob(Job& j);
+	bool readBgzfJob(Job& j);
+	bool readIndexedJob(Job& j);
+	static bool inflateJob(Job& j);
+	static void workerWrapper(void *vp);
+	void work();
+
+	FILE *f_;
+	bool  bgzf_;                   // true -> find blocks from their headers
+	std::vector<uint64_t> index_;  // otherwise, offsets where members start
+	size_t idxCur_;                // next element of index_
+	bool  eof_;                    // all compressed input handed out
+	std::vector<Job> jobs_;        // ring of jobs in flight
+	uint64_t head_;                // oldest job; the one being read from
+	uint64_t next_;                // next job for a worker
+	uint64_t fill_;                // next job to fill
+	size_t   outCur_;              // offset into slot(head_).out
+	bool     quit_;
+	tthread::mutex mutex_;
+	tthread::condition_variable workCond_; // jobs to inflate, or quit_
+	tthread::condition_variable doneCond_; // a job was inflated
+	std::vector<tthread::thread*> threads_;
+};
+
+#endif /* BGZF_H_ */
@@ -2,6 +2,7 @@
 #define BITPACK_H_
 
 #include <stdint.h>
+#include <stddef.h>
 #include "assert_helpers.h"
 
 /**
@@ -31,4 +32,45 @@ static inline int unpack_2b_from_32b(const uint32_t thirty2, const int off) {
 	return ((thirty2 >> (off*2)) & 0x3);
 }
 
+/**
+ * Routines for storing values of a fixed width of 'bits' bits (less
+ * than the width of T) back to back in an array of T words.  A value
+ * may straddle two words, so the array holds one word of padding past
+ * the last value; see packed_words().
+ */
+
+template<typename T>
+static inline size_t packed_words(size_t n, int bits) {
+	const size_t W = sizeof(T) * 8;
+	return (n * bits + W - 1) / W + 1;
+}
+
+template<typename T>
+static inline void pack_bits(T *words, size_t i, int bits, T v) {
+	const int W = sizeof(T) * 8;
+	assert_lt(bits, W);
+	const T mask = ((T)1 << bits) - 1;
+	assert_eq(v & mask, v);
+	size_t bit = i * bits;
+	size_t w = bit / W;
+	int b = (int)(bit % W);
+	words[w] = (words[w] & ~(mask << b)) | (v << b);
+	if(b + bits > W) {
+		int lo = W - b; // # bits that went into words[w]
+		words[w+1] = (words[w+1] & ~(mask >> lo)) | (v >> lo);
+	}
+}
+
+template<typename T>
+static inline T unpack_bits(const T *words, size_t i, int bits) {
+	const int W = sizeof(T) * 8;
+	size_t bit = i * bits;
+	size_t w = bit / W;
+	int b = (int)(bit % W);
+	// Shift the next word in two steps so that b == 0 doesn't shift
+	// by W; its bits fall above 'bits' unless the value straddles
+	return ((words[w] >> b) | ((words[w+1] << 1) << (W - 1 - b))) &
+	       (((T)1 << bits) - 1);
+}
+
 #endif /*BITPACK_H_*/
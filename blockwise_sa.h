@@ -18,6 +18,7 @@
 #include "alphabet.h"
 #include "timer.h"
 #include "auto_array.h"
+#include "threading.h"
 
 using namespace std;
 using namespace seqan;
@@ -192,6 +193,7 @@ public:
 
 	KarkkainenBlockwiseSA(const TStr& __text,
 	                      TIndexOffU __bucketSz,
+	                      int __nthreads,
 	                      uint32_t __dcV,
 	                      uint32_t __seed = 0,
 	      	              bool __sanityCheck = false,
@@ -199,10 +201,13 @@ public:
 	      	              bool __verbose = false,
 	      	              ostream& __logger = cout) :
 	InorderBlockwiseSA<TStr>(__text, __bucketSz, __sanityCheck, __passMemExc, __verbose, __logger),
-	_sampleSuffs(), _cur(0), _dcV(__dcV), _dc(NULL), _built(false)
+	_sampleSuffs(), _cur(0), _dcV(__dcV), _dc(NULL), _built(false),
+	_nthreads(max<int>(__nthreads, 1)), _started(0), _nextClaim(0),
+	_stop(false), _failed(BLOCK_OK)
 	{ _randomSrc.init(__seed); reset(); }
 
 	~KarkkainenBlockwiseSA() {
+		joinWorkers();
 		if(_dc != NULL) delete _dc; _dc = NULL; // difference cover sample
 	}
 
@@ -212,10 +217,14 @@ public:
 	 * Throws bad_alloc if it's not going to fit in memory.  Returns
 	 * the approximate number of bytes the Cover takes at all times.
 	 */
-	static size_t simulateAllocs(const TStr& text, TIndexOffU bucketSz) {
+	static size_t simulateAllocs(const TStr& text, TIndexOffU bucketSz, int nthreads = 1) {
 		size_t len = length(text);
-		// _sampleSuffs and _itrBucket are in memory at the peak
-		size_t bsz = bucketSz;
+		// _sampleSuffs and _itrBucket are in memory at the peak, plus
+		// one block per worker thread when sorting concurrently, plus
+		// each sorting thread's bucket-sort scratch space
+		nthreads = max<int>(nthreads, 1);
+		size_t bsz = (size_t)bucketSz * (nthreads > 1 ? nthreads + 1 : 1);
+		bsz += mkeyQSortSufDcU8Scratch(bucketSz) * nthreads;
 		size_t sssz = len / max<TIndexOffU>(bucketSz-1, 1);
 		AutoArray<TIndexOffU> tmp(bsz + sssz + (1024 * 1024 /*out of caution*/));
 		return bsz;
@@ -224,8 +233,10 @@ public:
 	/// Defined in blockwise_sa.cpp
 	virtual void nextBlock();
 
-	/// Defined in blockwise_sa.cpp
-	virtual void qsort(String<TIndexOffU>& bucket);
+	/// Qsort the suffixes in 'bucket', allocating scratch space as needed
+	virtual void qsort(String<TIndexOffU>& bucket) {
+		qsort(bucket, NULL, "");
+	}
 
 	/// Return true iff more blocks are available
 	virtual bool hasMoreBlocks() const {
@@ -235,6 +246,9 @@ public:
 	/// Return the difference-cover period
 	uint32_t dcV() const { return _dcV; }
 
+	/// Return the number of threads sorting blocks
+	int nthreads() const { return _nthreads; }
+
 protected:
 
 	/**
@@ -244,6 +258,7 @@ protected:
 	 * the first block.
 	 */
 	virtual void reset() {
+		joinWorkers();
 		if(!_built) {
 			build();
 		}
@@ -265,7 +280,7 @@ private:
 		// Calculate difference-cover sample
 		assert(_dc == NULL);
 		if(_dcV != 0) {
-			_dc = new TDC(this->text(), _dcV, this->verbose(), this->sanityCheck());
+			_dc = new TDC(this->text(), _dcV, _nthreads, this->verbose(), this->sanityCheck());
 			_dc->build();
 		}
 		// Calculate sample suffixes
@@ -304,19 +319,89 @@ private:
 
 	void buildSamples();
 
+	/// # representatives kept per bucket for splitting it
+	static const size_t BUCKET_REPS = 8;
+
+	/// Per-thread state for counting bucket sizes in buildSamples
+	struct BucketCountChunk {
+		KarkkainenBlockwiseSA<TStr>* bsa;
+		TIndexOffU         begin;    /// first text offset to place
+		TIndexOffU         end;      /// one past the last
+		bool               progress; /// print progress messages
+		String<TIndexOffU> szs;      /// # suffixes in each bucket
+		String<TIndexOffU> reps;     /// BUCKET_REPS members of each bucket
+		RandomSource       rnd;      /// for reservoir sampling
+	};
+
+	/// Body of a bucket-counting thread
+	static void countBucketsWorker(void *vp);
+
+	/// Qsort the suffixes in 'bucket' using the given bucket-sort
+	/// scratch space, or allocating it if 'scratch' is NULL
+	void qsort(String<TIndexOffU>& bucket, String<TIndexOffU>* scratch, const string& pre);
+
+	/// Build and sort block number 'cur' into 'bucket'; 'tid' is the
+	/// worker thread building it, or -1 for the consumer
+	void buildBlock(TIndexOffU cur, String<TIndexOffU>& bucket,
+	                String<TIndexOffU>& scratch, int tid);
+
+	/// Wait for the worker threads to finish block _cur, then make it
+	/// the current bucket
+	void takeBlock();
+
+	/// Stop and join any block-sorting worker threads
+	void joinWorkers();
+
+	/// Body of a block-sorting worker thread
+	static void blockWorker(void *vp);
+
+	/// Why a worker thread gave up, if it did
+	enum { BLOCK_OK = 0, BLOCK_BAD_ALLOC, BLOCK_ERROR };
+
 	String<TIndexOffU> _sampleSuffs; /// sample suffixes
 	TIndexOffU         _cur;         /// offset to 1st elt of next block
 	const uint32_t   _dcV;         /// difference-cover periodicity
 	TDC*             _dc;          /// queryable difference-cover data
 	bool             _built;       /// whether samples/DC have been built
 	RandomSource     _randomSrc;   /// source of pseudo-randoms
+	// Concurrent block sorting.  Workers claim blocks in order but may
+	// run at most _nthreads blocks ahead of the consumer, so at most
+	// _nthreads sorted blocks are in memory besides the current one.
+	// Block b is built in slot b % _nthreads.
+	const int                   _nthreads;  /// # block-sorting threads
+	vector<tthread::thread*>    _threads;   /// worker threads, if started
+	vector<String<TIndexOffU> > _slots;     /// per-slot block buffers
+	String<TIndexOffU>          _scratch;   /// bucket-sort scratch when serial
+	int                         _started;   /// # workers that took a thread id
+	vector<bool>                _ready;     /// slot holds a sorted block
+	TIndexOffU                  _nextClaim; /// next block to hand out
+	bool                        _stop;      /// workers should exit
+	int                         _failed;    /// BLOCK_OK unless a worker failed
+	tthread::mutex              _mutex;     /// protects the above
+	tthread::condition_variable _cond;      /// signals state changes
 };
 
+/**
+ * Return the bucket-sort scratch space for sorting slen suffixes,
+ * growing 'scratch' if it's too small, or NULL if 'scratch' is NULL.
+ */
+static inline TIndexOffU* bucketScratch(String<TIndexOffU>* scratch, size_t slen) {
+	if(scratch == NULL) return NULL;
+	size_t sz = mkeyQSortSufDcU8Scratch(slen);
+	if(length(*scratch) < sz) {
+		resize(*scratch, sz, Exact());
+	}
+	return begin(*scratch);
+}
+
 /**
  * Qsort the set of suffixes whose offsets are in 'bucket'.
  */
 template<typename TStr>
-void KarkkainenBlockwiseSA<TStr>::qsort(String<TIndexOffU>& bucket) {
+void KarkkainenBlockwiseSA<TStr>::qsort(String<TIndexOffU>& bucket,
+                                        String<TIndexOffU>* scratch,
+                                        const string& pre)
+{
 	typedef typename Value<TStr>::Type TAlphabet;
 	const TStr& t = this->text();
 	TIndexOffU *s = begin(bucket);
@@ -324,15 +409,22 @@ void KarkkainenBlockwiseSA<TStr>::qsort(String<TIndexOffU>& bucket) {
 	TIndexOffU len = (TIndexOffU)seqan::length(t);
 	if(_dc != NULL) {
 		// Use the difference cover as a tie-breaker if we have it
-		VMSG_NL("  (Using difference cover)");
+		VMSG_NL(pre << "  (Using difference cover)");
 		// Extract the 'host' array because it's faster to work
 		// with than the String<> container
 		uint8_t *host = (uint8_t*)t.data_begin;
-		mkeyQSortSufDcU8(t, host, len, s, slen, *_dc,
-		                 ValueSize<TAlphabet>::VALUE,
-		                 this->verbose(), this->sanityCheck());
+		TIndexOffU *bkts = bucketScratch(scratch, slen);
+		if(bkts != NULL) {
+			mkeyQSortSufDcU8(t, host, len, s, slen, *_dc,
+			                 ValueSize<TAlphabet>::VALUE, bkts,
+			                 this->verbose(), this->sanityCheck());
+		} else {
+			mkeyQSortSufDcU8(t, host, len, s, slen, *_dc,
+			                 ValueSize<TAlphabet>::VALUE,
+			                 this->verbose(), this->sanityCheck());
+		}
 	} else {
-		VMSG_NL("  (Not using difference cover)");
+		VMSG_NL(pre << "  (Not using difference cover)");
 		// We don't have a difference cover - just do a normal
 		// suffix sort
 		mkeyQSortSuf(t, s, slen, ValueSize<TAlphabet>::VALUE,
@@ -347,21 +439,31 @@ void KarkkainenBlockwiseSA<TStr>::qsort(String<TIndexOffU>& bucket) {
  * packed means that the array cannot be sorted directly.
  */
 template<>
-void KarkkainenBlockwiseSA<String<Dna, Packed<> > >::qsort(String<TIndexOffU>& bucket) {
+void KarkkainenBlockwiseSA<String<Dna, Packed<> > >::qsort(String<TIndexOffU>& bucket,
+                                                           String<TIndexOffU>* scratch,
+                                                           const string& pre)
+{
 	const String<Dna, Packed<> >& t = this->text();
 	TIndexOffU *s = begin(bucket);
 	TIndexOffU slen = (TIndexOffU)seqan::length(bucket);
 	TIndexOffU len = (TIndexOffU)seqan::length(t);
 	if(_dc != NULL) {
 		// Use the difference cover as a tie-breaker if we have it
-		VMSG_NL("  (Using difference cover)");
+		VMSG_NL(pre << "  (Using difference cover)");
 		// Can't use the text's 'host' array because the backing
 		// store for the packed string is not one-char-per-elt.
-		mkeyQSortSufDcU8(t, t, len, s, slen, *_dc,
-		                 ValueSize<Dna>::VALUE,
-		                 this->verbose(), this->sanityCheck());
+		TIndexOffU *bkts = bucketScratch(scratch, slen);
+		if(bkts != NULL) {
+			mkeyQSortSufDcU8(t, t, len, s, slen, *_dc,
+			                 ValueSize<Dna>::VALUE, bkts,
+			                 this->verbose(), this->sanityCheck());
+		} else {
+			mkeyQSortSufDcU8(t, t, len, s, slen, *_dc,
+			                 ValueSize<Dna>::VALUE,
+			                 this->verbose(), this->sanityCheck());
+		}
 	} else {
-		VMSG_NL("  (Not using difference cover)");
+		VMSG_NL(pre << "  (Not using difference cover)");
 		// We don't have a difference cover - just do a normal
 		// suffix sort
 		mkeyQSortSuf(t, s, slen, ValueSize<Dna>::VALUE,
@@ -369,6 +471,15 @@ void KarkkainenBlockwiseSA<String<Dna, Packed<> > >::qsort(String<TIndexOffU>& b
 	}
 }
 
+/**
+ * Swap the contents of two strings of offsets without copying.
+ */
+static inline void swapOffStrings(String<TIndexOffU>& a, String<TIndexOffU>& b) {
+	std::swap(a.data_begin,    b.data_begin);
+	std::swap(a.data_end,      b.data_end);
+	std::swap(a.data_capacity, b.data_capacity);
+}
+
 /**
  * Select a set of bucket-delineating sample suffixes such that no
  * bucket is greater than the requested upper limit.  Some care is
@@ -378,7 +489,6 @@ void KarkkainenBlockwiseSA<String<Dna, Packed<> > >::qsort(String<TIndexOffU>& b
 template<typename TStr>
 void KarkkainenBlockwiseSA<TStr>::buildSamples() {
 	typedef typename Value<TStr>::Type TAlphabet;
-	const TStr& t = this->text();
 	TIndexOffU bsz = this->bucketSz()-1; // subtract 1 to leave room for sample
 	size_t len = length(this->text());
 	// Prepare _sampleSuffs array
@@ -452,98 +562,137 @@ void KarkkainenBlockwiseSA<TStr>::buildSamples() {
 		// suffix and noting where it lands
 		TIndexOffU numBuckets = TIndexOffU(length(_sampleSuffs))+1;
 		String<TIndexOffU> bucketSzs; // holds computed bucket sizes
-		String<TIndexOffU> bucketReps; // holds 1 member of each bucket (for splitting)
+		String<TIndexOffU> bucketReps; // holds BUCKET_REPS members of each bucket (for splitting)
+		// Iterate through every suffix in the text, determine which
+		// bucket it falls into by doing a binary search across the
+		// sorted list of samples, and increment a counter associated
+		// with that bucket.  Also, keep a few representatives for each
+		// bucket so that we can split it later.  Each thread handles
+		// one stretch of the text with its own counters; they are
+		// summed afterward.  (This step can take a long time.)
+		size_t nchunks = min<size_t>(_nthreads, max<size_t>(len / 1024, 1));
+		vector<BucketCountChunk> chunks(nchunks);
 		try {
 			// Allocate and initialize containers for holding bucket
 			// sizes and representatives.
-			fill(bucketSzs, numBuckets, 0, Exact());
-			fill(bucketReps, numBuckets, OFF_MASK, Exact());
+			for(size_t i = 0; i < nchunks; i++) {
+				BucketCountChunk& c = chunks[i];
+				c.bsa = this;
+				c.begin = (TIndexOffU)(len * i / nchunks);
+				c.end = (TIndexOffU)(len * (i+1) / nchunks);
+				c.progress = (i == 0);
+				fill(c.szs, numBuckets, 0, Exact());
+				fill(c.reps, numBuckets * BUCKET_REPS, OFF_MASK, Exact());
+				c.rnd.init(_randomSrc.nextU32());
+			}
 		} catch(bad_alloc &e) {
 			if(this->_passMemExc) {
 				throw e; // rethrow immediately
 			} else {
-				cerr << "Could not allocate sizes, representatives (" << ((numBuckets*8)>>10) << " KB) for blocks." << endl
+				cerr << "Could not allocate sizes, representatives (" << ((numBuckets*nchunks*(BUCKET_REPS+1)*OFF_SIZE)>>10) << " KB) for blocks." << endl
 				     << "Please try using a smaller number of blocks by specifying a larger --bmax or a" << endl
 				     << "smaller --bmaxdivn." << endl;
 				throw 1;
 			}
 		}
-		// Iterate through every suffix in the text, determine which
-		// bucket it falls into by doing a binary search across the
-		// sorted list of samples, and increment a counter associated
-		// with that bucket.  Also, keep one representative for each
-		// bucket so that we can split it later.  We loop in ten
-		// stretches so that we can print out a helpful progress
-		// message.  (This step can take a long time.)
 		{
 			VMSG_NL("  Binary sorting into buckets");
 			Timer timer(cout, "  Binary sorting into buckets time: ", this->verbose());
-			TIndexOffU lenDiv10 = (TIndexOffU)((len + 9) / 10);
-			for(TIndexOffU iten = 0, ten = 0; iten < len; iten += lenDiv10, ten++) {
-				TIndexOffU itenNext = iten + lenDiv10;
-				if(ten > 0) VMSG_NL("  " << (ten * 10) << "%");
-				for(TIndexOffU i = iten; i < itenNext && i < len; i++) {
-					TIndexOffU r = binarySASearch(t, i, _sampleSuffs);
-					if(r == std::numeric_limits<TIndexOffU>::max()) continue; // r was one of the samples
-					assert_lt(r, numBuckets);
-					bucketSzs[r]++;
-					assert_lt(bucketSzs[r], len);
-					if(bucketReps[r] == OFF_MASK ||
-					   (_randomSrc.nextU32() & 100) == 0)
-					{
-						bucketReps[r] = i; // clobbers previous one, but that's OK
-					}
+			if(nchunks == 1) {
+				countBucketsWorker((void*)&chunks[0]);
+			} else {
+				vector<tthread::thread*> threads;
+				for(size_t i = 0; i < nchunks; i++) {
+					threads.push_back(new tthread::thread(countBucketsWorker, (void*)&chunks[i]));
+				}
+				for(size_t i = 0; i < nchunks; i++) {
+					threads[i]->join();
+					delete threads[i];
 				}
 			}
 			VMSG_NL("  100%");
+			// Merge per-thread counters into the first chunk's
+			swapOffStrings(bucketSzs, chunks[0].szs);
+			swapOffStrings(bucketReps, chunks[0].reps);
+			for(size_t i = 1; i < nchunks; i++) {
+				for(TIndexOffU b = 0; b < numBuckets; b++) {
+					bucketSzs[b] += chunks[i].szs[b];
+					// Fill empty representative slots with this
+					// thread's representatives
+					size_t k = 0;
+					for(size_t j = 0; j < BUCKET_REPS; j++) {
+						TIndexOffU r = chunks[i].reps[b * BUCKET_REPS + j];
+						if(r == OFF_MASK) break;
+						while(k < BUCKET_REPS && bucketReps[b * BUCKET_REPS + k] != OFF_MASK) k++;
+						if(k == BUCKET_REPS) break;
+						bucketReps[b * BUCKET_REPS + k] = r;
+					}
+				}
+			}
+			chunks.clear();
 		}
 		// Check for large buckets and mergeable pairs of small buckets
-		// and split/merge as necessary
+		// and split/merge as necessary.  A bucket of size sz is split
+		// at up to ceil(sz/bsz)-1 of its representatives, chosen at
+		// evenly spaced ranks, so one pass usually suffices.
 		TIndexOff added = 0;
 		TIndexOff merged = 0;
 		assert_eq(length(bucketSzs), numBuckets);
-		assert_eq(length(bucketReps), numBuckets);
+		assert_eq(length(bucketReps), numBuckets * BUCKET_REPS);
 		{
 			Timer timer(cout, "  Splitting and merging time: ", this->verbose());
 			VMSG_NL("Splitting and merging");
+			// Sort the representatives of all oversized buckets at
+			// once; since the buckets are in suffix order, each
+			// bucket's representatives form a contiguous sorted run
+			String<TIndexOffU> splits;
 			for(TIndexOffU i = 0; i < numBuckets; i++) {
-				TIndexOffU mergedSz = bsz + 1;
-				assert(bucketSzs[i] == 0 || bucketReps[i] != OFF_MASK);
-				if(i < (TIndexOffU)numBuckets-1) {
-					mergedSz = bucketSzs[(size_t)i] + bucketSzs[(size_t)i+1] + 1;
+				assert(bucketSzs[i] == 0 || bucketReps[i * BUCKET_REPS] != OFF_MASK);
+				if(bucketSzs[i] <= bsz) continue;
+				for(size_t j = 0; j < BUCKET_REPS; j++) {
+					TIndexOffU r = bucketReps[i * BUCKET_REPS + j];
+					if(r != OFF_MASK) appendValue(splits, r);
 				}
+			}
+			if(length(splits) > 1) {
+				this->qsort(splits);
+			}
+			String<TIndexOffU> newSamples;
+			reserve(newSamples, length(_sampleSuffs) + length(splits), Exact());
+			size_t nsplit = 0; // next unused element of splits
+			TIndexOffU curSz = bucketSzs[0]; // size of bucket i, after any merges
+			for(TIndexOffU i = 0; i < numBuckets; i++) {
 				// Merge?
-				if(mergedSz <= bsz) {
-					bucketSzs[i+1] += (bucketSzs[i]+1);
-					// The following may look strange, but it's necessary
-					// to ensure that the merged bucket has a representative
-					bucketReps[i+1] = _sampleSuffs[i+added];
-					erase(_sampleSuffs, i+added);
-					erase(bucketSzs, i);
-					erase(bucketReps, i);
-					i--; // might go to -1 but ++ will overflow back to 0
-					numBuckets--;
+				if(i < numBuckets-1 && curSz + bucketSzs[i+1] + 1 <= bsz) {
+					// Drop the sample between bucket i and i+1
+					curSz += bucketSzs[i+1] + 1;
 					merged++;
-					assert_eq(numBuckets, length(_sampleSuffs)+1-added);
-					assert_eq(numBuckets, length(bucketSzs));
+					continue;
 				}
 				// Split?
-				else if(bucketSzs[i] > bsz) {
-					// Add an additional sample from the bucketReps[]
-					// set accumulated in the binarySASearch loop; this
-					// effectively splits the bucket
-					insertValue(_sampleSuffs, TIndexOffU(i + (added++)), bucketReps[i]);
+				if(curSz > bsz) {
+					// Not merged, so curSz == bucketSzs[i]
+					assert_eq(curSz, bucketSzs[i]);
+					size_t nreps = 0;
+					while(nreps < BUCKET_REPS && bucketReps[i * BUCKET_REPS + nreps] != OFF_MASK) nreps++;
+					size_t pieces = (size_t)((curSz + bsz - 1) / bsz);
+					size_t m = min<size_t>(pieces - 1, nreps);
+					for(size_t j = 1; j <= m; j++) {
+						appendValue(newSamples, splits[nsplit + j * nreps / (m+1)]);
+						added++;
+					}
+					nsplit += nreps;
+				}
+				if(i < numBuckets-1) {
+					appendValue(newSamples, _sampleSuffs[i]);
+					curSz = bucketSzs[i+1];
 				}
 			}
+			assert_eq(nsplit, length(splits));
+			assert_eq(length(newSamples), length(_sampleSuffs) + added - merged);
+			swapOffStrings(_sampleSuffs, newSamples);
 		}
 		if(added == 0) {
-			//if(this->verbose()) {
-			//	cout << "Final bucket sizes:" << endl;
-			//	cout << "  (begin): " << bucketSzs[0] << " (" << (int)(bsz - bucketSzs[0]) << ")" << endl;
-			//	for(uint32_t i = 1; i < numBuckets; i++) {
-			//		cout << "  " << bucketSzs[i] << " (" << (int)(bsz - bucketSzs[i]) << ")" << endl;
-			//	}
-			//}
 			break;
 		}
 		// Otherwise, continue until no more buckets need to be
@@ -558,6 +707,49 @@ void KarkkainenBlockwiseSA<TStr>::buildSamples() {
 	VMSG_NL("Avg bucket size: " << ((double)(len-length(_sampleSuffs)) / (length(_sampleSuffs)+1)) << " (target: " << bsz << ")");
 }
 
+/**
+ * Place each suffix in one stretch of the text into its bucket,
+ * counting bucket sizes and reservoir-sampling up to BUCKET_REPS
+ * representatives of each bucket.
+ */
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::countBucketsWorker(void *vp) {
+	BucketCountChunk& c = *(BucketCountChunk*)vp;
+	KarkkainenBlockwiseSA<TStr>* bsa = c.bsa;
+	const TStr& t = bsa->text();
+	const String<TIndexOffU>& sampleSuffs = bsa->_sampleSuffs;
+	ASSERT_ONLY(TIndexOffU numBuckets = (TIndexOffU)length(sampleSuffs)+1);
+	// Loop in ten stretches so that we can print out a helpful
+	// progress message
+	TIndexOffU lenDiv10 = (c.end - c.begin + 9) / 10;
+	if(lenDiv10 == 0) lenDiv10 = 1;
+	for(TIndexOffU iten = c.begin, ten = 0; iten < c.end; iten += lenDiv10, ten++) {
+		TIndexOffU itenNext = iten + lenDiv10;
+		if(c.progress && ten > 0 && bsa->verbose()) {
+			stringstream tmp;
+			tmp << "  " << (ten * 10) << "%" << endl;
+			bsa->verbose(tmp.str());
+		}
+		for(TIndexOffU i = iten; i < itenNext && i < c.end; i++) {
+			TIndexOffU r = binarySASearch(t, i, sampleSuffs);
+			if(r == std::numeric_limits<TIndexOffU>::max()) continue; // r was one of the samples
+			assert_lt(r, numBuckets);
+			TIndexOffU n = ++c.szs[r];
+			assert_lt(n, length(t));
+			if(n <= BUCKET_REPS) {
+				c.reps[r * BUCKET_REPS + n - 1] = i;
+			} else {
+#ifdef BOWTIE_64BIT_INDEX
+				TIndexOffU j = (TIndexOffU)(c.rnd.nextU64() % n);
+#else
+				TIndexOffU j = c.rnd.nextU32() % n;
+#endif
+				if(j < BUCKET_REPS) c.reps[r * BUCKET_REPS + j] = i;
+			}
+		}
+	}
+}
+
 /**
  * Do a simple LCP calculation on two strings.
  */
@@ -747,17 +939,143 @@ bool KarkkainenBlockwiseSA<TStr>::suffixCmp(
 }
 
 /**
- * Retrieve the next block.  This is the most performance-critical part
- * of the blockwise suffix sorting process.
+ * Retrieve the next block.  With one thread, build it here; otherwise
+ * collect it from the worker threads, starting them if necessary.
  */
 template<typename TStr>
 void KarkkainenBlockwiseSA<TStr>::nextBlock() {
-	typedef typename Value<TStr>::Type TAlphabet;
-	String<TIndexOffU>& bucket = this->_itrBucket;
-	VMSG_NL("Getting block " << (_cur+1) << " of " << length(_sampleSuffs)+1);
 	assert(_built);
-	assert_gt(_dcV, 3);
 	assert_leq(_cur, length(_sampleSuffs));
+	if(_nthreads > 1 && length(_sampleSuffs) > 0) {
+		takeBlock();
+	} else {
+		buildBlock(_cur, this->_itrBucket, _scratch, -1);
+		_cur++; // advance to next bucket
+	}
+}
+
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::takeBlock() {
+	tthread::lock_guard<tthread::mutex> guard(_mutex);
+	TIndexOffU nblocks = (TIndexOffU)length(_sampleSuffs)+1;
+	if(_threads.empty() && _cur == 0) {
+		_slots.resize(_nthreads);
+		_ready.assign(_nthreads, false);
+		_nextClaim = 0;
+		_started = 0;
+		_stop = false;
+		_failed = BLOCK_OK;
+		int nworkers = (int)min<TIndexOffU>((TIndexOffU)_nthreads, nblocks);
+		VMSG_NL("Sorting blocks with " << nworkers << " threads");
+		for(int i = 0; i < nworkers; i++) {
+			_threads.push_back(new tthread::thread(blockWorker, (void*)this));
+		}
+	}
+	size_t slot = _cur % _nthreads;
+	while(!_ready[slot] && _failed == BLOCK_OK) {
+		_cond.wait(_mutex);
+	}
+	if(_failed != BLOCK_OK) {
+		// Leave the workers for joinWorkers() and pass the failure on
+		// as the serial code would have
+		if(_failed == BLOCK_BAD_ALLOC) throw bad_alloc();
+		throw 1;
+	}
+	swapOffStrings(this->_itrBucket, _slots[slot]);
+	_ready[slot] = false;
+	_cur++; // advance to next bucket; frees a slot for the workers
+	_cond.notify_all();
+}
+
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::blockWorker(void *vp) {
+	KarkkainenBlockwiseSA<TStr>* bsa = (KarkkainenBlockwiseSA<TStr>*)vp;
+	TIndexOffU nblocks = (TIndexOffU)length(bsa->_sampleSuffs)+1;
+	// Bucket-sort scratch space, reused for every block this thread sorts
+	String<TIndexOffU> scratch;
+	int tid;
+	{
+		tthread::lock_guard<tthread::mutex> guard(bsa->_mutex);
+		tid = bsa->_started++;
+	}
+	while(true) {
+		TIndexOffU b;
+		{
+			tthread::lock_guard<tthread::mutex> guard(bsa->_mutex);
+			while(!bsa->_stop && bsa->_failed == BLOCK_OK &&
+			      bsa->_nextClaim < nblocks &&
+			      bsa->_nextClaim >= bsa->_cur + bsa->_nthreads)
+			{
+				bsa->_cond.wait(bsa->_mutex);
+			}
+			if(bsa->_stop || bsa->_failed != BLOCK_OK || bsa->_nextClaim >= nblocks) {
+				return;
+			}
+			b = bsa->_nextClaim++;
+		}
+		// The slot was freed when the consumer took block b-_nthreads
+		String<TIndexOffU>& bucket = bsa->_slots[b % bsa->_nthreads];
+		int failed = BLOCK_OK;
+		try {
+			bsa->buildBlock(b, bucket, scratch, tid);
+		} catch(bad_alloc& e) {
+			failed = BLOCK_BAD_ALLOC;
+		} catch(...) {
+			failed = BLOCK_ERROR;
+		}
+		tthread::lock_guard<tthread::mutex> guard(bsa->_mutex);
+		if(failed != BLOCK_OK) {
+			bsa->_failed = failed;
+		} else {
+			bsa->_ready[b % bsa->_nthreads] = true;
+		}
+		bsa->_cond.notify_all();
+		if(failed != BLOCK_OK) return;
+	}
+}
+
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::joinWorkers() {
+	if(_threads.empty()) return;
+	{
+		tthread::lock_guard<tthread::mutex> guard(_mutex);
+		_stop = true;
+		_cond.notify_all();
+	}
+	for(size_t i = 0; i < _threads.size(); i++) {
+		_threads[i]->join();
+		delete _threads[i];
+	}
+	_threads.clear();
+	_slots.clear();
+	_ready.clear();
+}
+
+/**
+ * Build block number 'cur' into 'bucket'.  This is the most
+ * performance-critical part of the blockwise suffix sorting process.
+ * Several blocks may be built at once, so this reads but never
+ * modifies the sorter's state, and a worker prefixes its verbose
+ * messages with its thread id so that they can be told apart.
+ */
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::buildBlock(TIndexOffU cur,
+                                             String<TIndexOffU>& bucket,
+                                             String<TIndexOffU>& scratch,
+                                             int tid)
+{
+	string pre;
+	if(tid >= 0) {
+		stringstream ss;
+		ss << "[thread " << tid << "] ";
+		pre = ss.str();
+	}
+	// Timers print to here; we pass it on as one verbose message
+	stringstream tout;
+	VMSG_NL(pre << "Getting block " << (cur+1) << " of " << length(_sampleSuffs)+1);
+	assert(_built);
+	assert_gt(_dcV, 3);
+	assert_leq(cur, length(_sampleSuffs));
 	const TStr& t = this->text();
 	TIndexOffU len = TIndexOffU(length(t));
 	// Set up the bucket
@@ -766,8 +1084,8 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 	if(length(_sampleSuffs) == 0) {
 		// Special case: if _sampleSuffs is 0, then multikey-quicksort
 		// everything
-		VMSG_NL("  No samples; assembling all-inclusive block");
-		assert_eq(0, _cur);
+		VMSG_NL(pre << "  No samples; assembling all-inclusive block");
+		assert_eq(0, cur);
 		try {
 			if(capacity(bucket) < this->bucketSz()) {
 				reserve(bucket, len+1, Exact());
@@ -785,7 +1103,7 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 		}
 	} else {
 		try {
-			VMSG_NL("  Reserving size (" << this->bucketSz() << ") for bucket");
+			VMSG_NL(pre << "  Reserving size (" << this->bucketSz() << ") for bucket");
 			// BTL: Add a +100 fudge factor; there seem to be instances
 			// where a bucket ends up having one more elt than bucketSz()
 			if(capacity(bucket) < this->bucketSz()+100) {
@@ -805,26 +1123,26 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 		// calculate the Z array up to the difference-cover periodicity
 		// for both.  Be careful about first/last buckets.
 		String<TIndexOffU> zLo, zHi;
-		assert_geq(_cur, 0);
-		assert_leq(_cur, length(_sampleSuffs));
-		bool first = (_cur == 0);
-		bool last  = (_cur == length(_sampleSuffs));
+		assert_geq(cur, 0);
+		assert_leq(cur, length(_sampleSuffs));
+		bool first = (cur == 0);
+		bool last  = (cur == length(_sampleSuffs));
 		try {
-			Timer timer(cout, "  Calculating Z arrays time: ", this->verbose());
-			VMSG_NL("  Calculating Z arrays");
+			Timer timer(tout, "  Calculating Z arrays time: ", this->verbose());
+			VMSG_NL(pre << "  Calculating Z arrays");
 			if(!last) {
 				// Not the last bucket
-				assert_lt(_cur, length(_sampleSuffs));
-				hi = _sampleSuffs[_cur];
+				assert_lt(cur, length(_sampleSuffs));
+				hi = _sampleSuffs[cur];
 				fill(zHi, _dcV, 0, Exact());
 				assert_eq(zHi[0], 0);
 				calcZ(t, hi, zHi, this->verbose(), this->sanityCheck());
 			}
 			if(!first) {
 				// Not the first bucket
-				assert_gt(_cur, 0);
-				assert_leq(_cur, length(_sampleSuffs));
-				lo = _sampleSuffs[_cur-1];
+				assert_gt(cur, 0);
+				assert_leq(cur, length(_sampleSuffs));
+				lo = _sampleSuffs[cur-1];
 				fill(zLo, _dcV, 0, Exact());
 				assert_gt(_dcV, 3);
 				assert_eq(zLo[0], 0);
@@ -840,6 +1158,7 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 				throw 1;
 			}
 		}
+		VMSG(pre << tout.str()); tout.str("");
 
 		// This is the most critical loop in the algorithm; this is where
 		// we iterate over all suffixes in the text and pick out those that
@@ -853,12 +1172,12 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 		bool kHiSoft = false, kLoSoft = false;
 		assert_eq(0, length(bucket));
 		{
-			Timer timer(cout, "  Block accumulator loop time: ", this->verbose());
-			VMSG_NL("  Entering block accumulator loop:");
+			Timer timer(tout, "  Block accumulator loop time: ", this->verbose());
+			VMSG_NL(pre << "  Entering block accumulator loop:");
 			TIndexOffU lenDiv10 = (len + 9) / 10;
 			for(TIndexOffU iten = 0, ten = 0; iten < len; iten += lenDiv10, ten++) {
 				TIndexOffU itenNext = iten + lenDiv10;
-			if(ten > 0) VMSG_NL("  " << (ten * 10) << "%");
+			if(ten > 0) VMSG_NL(pre << "  " << (ten * 10) << "%");
 			for(TIndexOffU i = iten; i < itenNext && i < len; i++) {
 				assert_lt(jLo, (TIndexOff)i); assert_lt(jHi, (TIndexOff)i);
 				// Advance the upper-bound comparison by one character
@@ -889,14 +1208,18 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 				//assert_lt(length(bucket), this->bucketSz());
 			}
 			} // end loop over all suffixes of t
-			VMSG_NL("  100%");
+			VMSG_NL(pre << "  100%");
 		}
+		VMSG(pre << tout.str()); tout.str("");
 	} // end else clause of if(length(_sampleSuffs) == 0)
 	// Sort the bucket
 	if(length(bucket) > 0) {
-		Timer timer(cout, "  Sorting block time: ", this->verbose());
-		VMSG_NL("  Sorting block of length " << length(bucket));
-		this->qsort(bucket);
+		{
+			Timer timer(tout, "  Sorting block time: ", this->verbose());
+			VMSG_NL(pre << "  Sorting block of length " << length(bucket));
+			qsort(bucket, &scratch, pre);
+		}
+		VMSG(pre << tout.str()); tout.str("");
 	}
 	if(hi != OFF_MASK) {
 		// Not the final bucket; throw in the sample on the RHS
@@ -905,8 +1228,7 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 		// Final bucket; throw in $ suffix
 		appendValue(bucket, len);
 	}
-	VMSG_NL("Returning block of " << length(bucket));
-	_cur++; // advance to next bucket
+	VMSG_NL(pre << "Returning block of " << length(bucket));
 }
 
 #endif /*BLOCKWISE_SA_H_*/
@@ -392,6 +392,7 @@ void print_index_summary(
 		cout << "refnames.size()" << '\t' << p_refnames.size() << endl;
 		cout << "refs.numRefs()" << '\t' << refs.numRefs() << endl;
 		cout << "refs.numNonGapRefs()" << '\t' << refs.numNonGapRefs() << endl;
+		cout << "Interleaved" << '\t' << (ebwt.eh().interleaved() ? "1" : "0") << endl;
 	}
 	cout << "SA-Sample" << "\t1 in " << (1 << ebwt.eh().offRate()) << endl;
 	cout << "FTab-Chars" << '\t' << ebwt.eh().ftabChars() << endl;
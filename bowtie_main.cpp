@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <vector>
 #include "tokenize.h"
+#include "server.h"
 
 using namespace std;
 
@@ -26,6 +27,10 @@ extern "C" {
  * will interpret that file as having one set of command-line arguments
  * per line, and will dispatch each batch of arguments one at a time to
  * bowtie.
+ *
+ * --server <socket> and --client <socket> as the first two arguments
+ * (after the wrapper script's) start a server that keeps the given
+ * indexes loaded, or send it a job; see server.cpp.
  */
 int main(int argc, const char **argv) {
 	if(argc > 2 && strcmp(argv[1], "-A") == 0) {
@@ -51,6 +56,19 @@ int main(int argc, const char **argv) {
 			return 0;
 		}
 		return lastret;
+	}
+	// The wrapper script puts --wrapper <name> before everything else
+	int first = (argc > 3 && strcmp(argv[1], "--wrapper") == 0) ? 3 : 1;
+	if(argc > first + 1 && (strcmp(argv[first], "--server") == 0 ||
+	                        strcmp(argv[first], "--client") == 0))
+	{
+		// Pass on the command line without --server/--client <socket>
+		vector<const char*> args(argv, argv + first);
+		args.insert(args.end(), argv + first + 2, argv + argc);
+		if(strcmp(argv[first], "--server") == 0) {
+			return bowtieServer(argv[first+1], (int)args.size(), &args[0]);
+		}
+		return bowtieClient(argv[first+1], (int)args.size(), &args[0]);
 	} else {
 		return bowtie(argc, argv);
 	}
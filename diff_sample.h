@@ -9,6 +9,7 @@
 #include "timer.h"
 #include "auto_array.h"
 #include "btypes.h"
+#include "threading.h"
 
 using namespace std;
 using namespace seqan;
@@ -49,6 +50,7 @@ struct sampleEntry {
 /// r = 16 (maxV = 5953)
 static struct sampleEntry clDCs[16];
 static bool clDCs_calced = false; /// have clDCs been calculated?
+static tthread::mutex clDCs_mutex; /// guards calculation of clDCs
 
 /**
  * Check that the given difference cover 'ds' actually covers all
@@ -413,10 +415,15 @@ static String<T> getDiffCover(T v,
 		return ret;
 	}
 
-	// Can we look it up in our calcColbournAndLingDCs array?
-	if(!clDCs_calced) {
-		calcColbournAndLingDCs<uint32_t>(verbose, sanityCheck);
-		assert(clDCs_calced);
+	// Can we look it up in our calcColbournAndLingDCs array?  The
+	// forward and mirror indexes may be built at once, so take the
+	// lock before checking.
+	{
+		tthread::lock_guard<tthread::mutex> guard(clDCs_mutex);
+		if(!clDCs_calced) {
+			calcColbournAndLingDCs<uint32_t>(verbose, sanityCheck);
+			assert(clDCs_calced);
+		}
 	}
 	for(size_t i = 0; i < 16; i++) {
 		if(v <= clDCs[i].maxV) {
@@ -512,11 +519,13 @@ public:
 
 	DifferenceCoverSample(const TStr& __text,
 	                      uint32_t __v,
+	                      int __nthreads = 1,
 	                      bool __verbose = false,
 	                      bool __sanity = false,
 	                      ostream& __logger = cout) :
 		_text(__text),
 		_v(__v),
+		_nthreads(max<int>(__nthreads, 1)),
 		_verbose(__verbose),
 		_sanity(__sanity),
 		_ds(getDiffCover(_v, _verbose, _sanity)),
@@ -596,6 +605,21 @@ private:
 
 	void doBuiltSanityCheck() const;
 	void buildSPrime(String<TIndexOffU>& sPrime);
+	void rankSPrime(const String<TIndexOffU>& sPrime,
+	                const String<TIndexOffU>& sPrimeOrder);
+
+	/// Per-thread state for ranking a stretch of the v-sorted samples
+	struct RankChunk {
+		DifferenceCoverSample<TStr>* dc;
+		const String<TIndexOffU>* sPrime;
+		const String<TIndexOffU>* sPrimeOrder;
+		size_t begin;     // first sorted sample in the stretch
+		size_t end;       // one past the last
+		TIndexOffU base;  // rank of the first sample; set after pass 1
+		TIndexOffU names; // # rank increments in the stretch
+		int pass;         // 1 = local ranks, 2 = add base
+	};
+	static void rankWorker(void *vp);
 
 	bool built() const {
 		return length(_isaPrime) > 0;
@@ -610,6 +634,7 @@ private:
 
 	const TStr&      _text;     // text to sample
 	uint32_t         _v;        // periodicity of sample
+	int              _nthreads; // # threads for v-sorting and ranking
 	bool             _verbose;  //
 	bool             _sanity;   //
 	String<uint32_t> _ds;       // samples: idx -> d
@@ -772,13 +797,16 @@ void DifferenceCoverSample<TStr>::build() {
 	const TStr& t = this->text();
 	uint32_t v = this->v();
 	assert_gt(v, 2);
+	Timer buildTimer(cout, "  Building DifferenceCoverSample time: ", this->verbose());
 	// Build s'
 	String<TIndexOffU> sPrime;
-	VMSG_NL("  Building sPrime");
-	buildSPrime(sPrime);
+	{
+		Timer timer(cout, "  Building sPrime time: ", this->verbose());
+		VMSG_NL("  Building sPrime");
+		buildSPrime(sPrime);
+	}
 	assert_gt(length(sPrime), 0);
 	assert_leq(length(sPrime), length(t)+1); // +1 is because of the end-cap
-	TIndexOffU nextRank = 0;
 	{
 		VMSG_NL("  Building sPrimeOrder");
 		String<TIndexOffU> sPrimeOrder;
@@ -811,7 +839,8 @@ void DifferenceCoverSample<TStr>::build() {
 			// what the sort did.
 			mkeyQSortSuf2(t, sPrimeArr, slen, sPrimeOrderArr,
 			              ValueSize<TAlphabet>::VALUE,
-			              this->verbose(), this->sanityCheck(), v);
+			              this->verbose(), this->sanityCheck(), v,
+			              _nthreads);
 			// Make sure sPrime and sPrimeOrder are consistent with
 			// their respective backing-store arrays
 			assert_eq(sPrimeArr[0], sPrime[0]);
@@ -828,14 +857,7 @@ void DifferenceCoverSample<TStr>::build() {
 		{
 			Timer timer(cout, "  Ranking v-sort output time: ", this->verbose());
 			VMSG_NL("  Ranking v-sort output");
-			for(size_t i = 0; i < length(sPrime)-1; i++) {
-				// Place the appropriate ranking
-				_isaPrime[sPrimeOrder[i]] = nextRank;
-				// If sPrime[i] and sPrime[i+1] are identical up to v, then we
-				// should give the next suffix the same rank
-				if(!suffixSameUpTo(t, sPrime[i], sPrime[i+1], v)) nextRank++;
-			}
-			_isaPrime[sPrimeOrder[length(sPrime)-1]] = nextRank; // finish off
+			rankSPrime(sPrime, sPrimeOrder);
 		}
 		// sPrimeOrder is destroyed
 		// All the information we need is now in _isaPrime
@@ -878,6 +900,83 @@ void DifferenceCoverSample<TStr>::build() {
 	if(this->sanityCheck()) doBuiltSanityCheck();
 }
 
+/**
+ * Assign each sample in _isaPrime the rank implied by the v-sorted
+ * sPrime/sPrimeOrder arrays; samples identical up to v share a rank.
+ * With several threads, each ranks a stretch of the sorted samples
+ * starting from 0 and then shifts its ranks by the number of rank
+ * increments in the stretches before it.
+ */
+template <typename TStr>
+void DifferenceCoverSample<TStr>::rankSPrime(
+	const String<TIndexOffU>& sPrime,
+	const String<TIndexOffU>& sPrimeOrder)
+{
+	size_t n = length(sPrime);
+	assert_gt(n, 0);
+	size_t nchunks = min<size_t>(_nthreads, (n + 1023) / 1024);
+	vector<RankChunk> chunks(nchunks);
+	for(size_t i = 0; i < nchunks; i++) {
+		chunks[i].dc = this;
+		chunks[i].sPrime = &sPrime;
+		chunks[i].sPrimeOrder = &sPrimeOrder;
+		chunks[i].begin = n * i / nchunks;
+		chunks[i].end = n * (i+1) / nchunks;
+		chunks[i].base = 0;
+		chunks[i].names = 0;
+		chunks[i].pass = 1;
+	}
+	if(nchunks == 1) {
+		rankWorker((void*)&chunks[0]);
+		return;
+	}
+	for(int pass = 1; pass <= 2; pass++) {
+		vector<tthread::thread*> threads;
+		for(size_t i = 0; i < nchunks; i++) {
+			chunks[i].pass = pass;
+			threads.push_back(new tthread::thread(rankWorker, (void*)&chunks[i]));
+		}
+		for(size_t i = 0; i < nchunks; i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+		if(pass == 1) {
+			for(size_t i = 1; i < nchunks; i++) {
+				chunks[i].base = chunks[i-1].base + chunks[i-1].names;
+			}
+		}
+	}
+}
+
+/**
+ * Rank one stretch of v-sorted samples (pass 1), or add the stretch's
+ * base rank to the ranks assigned in pass 1 (pass 2).
+ */
+template <typename TStr>
+void DifferenceCoverSample<TStr>::rankWorker(void *vp) {
+	RankChunk& c = *(RankChunk*)vp;
+	DifferenceCoverSample<TStr>& dc = *c.dc;
+	const TStr& t = dc.text();
+	const String<TIndexOffU>& sPrime = *c.sPrime;
+	const String<TIndexOffU>& sPrimeOrder = *c.sPrimeOrder;
+	size_t n = length(sPrime);
+	if(c.pass == 2) {
+		for(size_t i = c.begin; i < c.end; i++) {
+			dc._isaPrime[sPrimeOrder[i]] += c.base;
+		}
+		return;
+	}
+	TIndexOffU nextRank = 0;
+	for(size_t i = c.begin; i < c.end; i++) {
+		// Place the appropriate ranking
+		dc._isaPrime[sPrimeOrder[i]] = nextRank;
+		// If sPrime[i] and sPrime[i+1] are identical up to v, then we
+		// should give the next suffix the same rank
+		if(i+1 < n && !suffixSameUpTo(t, sPrime[i], sPrime[i+1], dc.v())) nextRank++;
+	}
+	c.names = nextRank;
+}
+
 /**
  * Return true iff index i within the text is covered by the difference
  * cover sample.  Allow i to be off the end of the text; simplifies
@@ -21,6 +21,8 @@
 #endif
 #include "auto_array.h"
 #include "shmem.h"
+#include "mem_policy.h"
+#include "index_io.h"
 #include "alphabet.h"
 #include "assert_helpers.h"
 #include "bitpack.h"
@@ -38,11 +40,30 @@
 #include "refmap.h"
 #include "color_dec.h"
 #include "reference.h"
+#include "kmer_table.h"
+#include "hot_offs.h"
 
 #ifdef POPCNT_CAPABILITY 
     #include "processor_support.h" 
 #endif 
 
+// Vector backends for side counting are compiled with per-function
+// target attributes and selected at runtime, so they don't require
+// the whole binary to be built for AVX2/AVX-512
+#if defined(POPCNT_CAPABILITY) && defined(__GNUC__) && defined(__x86_64__)
+#define EBWT_SIMD_COUNT
+#include <immintrin.h>
+#endif
+
+/// Backends for counting characters within a side; see countUpToEx()
+enum {
+	EBWT_COUNT_GENERIC = 0, // bit-bashing population count
+	EBWT_COUNT_POPCNT,      // POPCNT instruction
+	EBWT_COUNT_SSE42,       // SSE4.2, 2 words per vector
+	EBWT_COUNT_AVX2,        // AVX2, 4 words per vector
+	EBWT_COUNT_AVX512       // AVX-512 VPOPCNTDQ, 8 words per vector
+};
+
 using namespace std;
 using namespace seqan;
 
@@ -84,9 +105,12 @@ if(this->verbose()) { \
  */
 enum EBWT_FLAGS {
 	EBWT_COLOR = 2,     // true -> Ebwt is colorspace
-	EBWT_ENTIRE_REV = 4 // true -> reverse Ebwt is the whole
-	                    // concatenated string reversed, rather than
-	                    // each stretch reversed
+	EBWT_ENTIRE_REV = 4, // true -> reverse Ebwt is the whole
+	                     // concatenated string reversed, rather than
+	                     // each stretch reversed
+	EBWT_INTERLEAVED = 8 // true -> every side is a forward side that
+	                     // stores all four occ[] counts for itself,
+	                     // so an LF step touches only one side
 };
 
 extern string gLastIOErrMsg;
@@ -127,22 +151,25 @@ public:
 	           int32_t isaRate,
 	           int32_t ftabChars,
 	           bool color,
-	           bool entireReverse)
+	           bool entireReverse,
+	           bool interleaved)
 	{
-		init(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, color, entireReverse);
+		init(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, color, entireReverse, interleaved);
 	}
 
 	EbwtParams(const EbwtParams& eh) {
 		init(eh._len, eh._lineRate, eh._linesPerSide, eh._offRate,
-		     eh._isaRate, eh._ftabChars, eh._color, eh._entireReverse);
+		     eh._isaRate, eh._ftabChars, eh._color, eh._entireReverse,
+		     eh._interleaved);
 	}
 
 	void init(TIndexOffU len, int32_t lineRate, int32_t linesPerSide,
 	          int32_t offRate, int32_t isaRate, int32_t ftabChars,
-	          bool color, bool entireReverse)
+	          bool color, bool entireReverse, bool interleaved)
 	{
 		_color = color;
 		_entireReverse = entireReverse;
+		_interleaved = interleaved;
 		_len = len;
 		_bwtLen = _len + 1;
 		_sz = (len+3)/4;
@@ -165,7 +192,11 @@ public:
 		_isaSz = _isaLen*OFF_SIZE;
 		_lineSz = 1 << _lineRate;
 		_sideSz = _lineSz * _linesPerSide;
-		_sideBwtSz = _sideSz - 2*OFF_SIZE;
+		// A side-pair side keeps two occ[] counts (A/C or G/T) at its
+		// end; an interleaved side keeps all four.  With 8-byte offsets
+		// the default side is 128 bytes, so an interleaved side spans
+		// two cache lines rather than one
+		_sideBwtSz = _sideSz - (_interleaved ? 4 : 2)*OFF_SIZE;
 		_sideBwtLen = _sideBwtSz*4;
 		_numSidePairs = (_bwtSz+(2*_sideBwtSz)-1)/(2*_sideBwtSz);
 		_numSides = _numSidePairs*2;
@@ -206,6 +237,7 @@ public:
 	TIndexOffU ebwtTotSz() const     { return _ebwtTotSz; }
 	bool color() const             { return _color; }
 	bool entireReverse() const     { return _entireReverse; }
+	bool interleaved() const       { return _interleaved; }
 
 	/**
 	 * Set a new suffix-array sampling rate, which involves updating
@@ -276,7 +308,8 @@ public:
 		    << "    numLines: "     << _numLines << endl
 		    << "    ebwtTotLen: "   << _ebwtTotLen << endl
 		    << "    ebwtTotSz: "    << _ebwtTotSz << endl
-		    << "    reverse: "      << _entireReverse << endl;
+		    << "    reverse: "      << _entireReverse << endl
+		    << "    interleaved: "  << _interleaved << endl;
 	}
 
 	TIndexOffU _len;
@@ -310,6 +343,7 @@ public:
 	TIndexOffU _ebwtTotSz;
 	bool     _color;
 	bool     _entireReverse;
+	bool     _interleaved;
 };
 
 /**
@@ -334,10 +368,49 @@ static inline int64_t fileSize(const char* name) {
 	return static_cast<int64_t>(f.tellg() - begin_pos);
 }
 
+/// Tag written ahead of the checksum that follows the reference names
+/// in the primary index file ("EBWTCKSM")
+static const uint64_t EBWT_CHECKSUM_TAG = 0x4d534b4354574245llu;
+
+/**
+ * Fold 'len' bytes starting at 'buf' into running checksum 'h' and
+ * return the result.  Mixes a word at a time, so it keeps up with the
+ * disk when run over a whole BWT.  Start from EBWT_CHECKSUM_TAG.
+ */
+static inline uint64_t ebwtChecksum(uint64_t h, const void *buf, size_t len) {
+	const uint8_t *p = (const uint8_t *)buf;
+	size_t i = 0;
+	for(; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15llu;
+		h ^= h >> 29;
+	}
+	for(; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3llu;
+	}
+	return h;
+}
+
 // Forward declarations for Ebwt class
 struct SideLocus;
 template<typename TStr> class EbwtSearchParams;
 
+/**
+ * A reference that was read and joined once so that the forward and
+ * mirror indexes can both be built from it without re-reading the
+ * input.  'text' is in the forward orientation unless 'sa' is set, in
+ * which case it's the text exactly as indexed and 'sa' produces its
+ * suffix array.
+ */
+template<typename TStr>
+struct JoinedRef {
+	JoinedRef() : sa(NULL) { }
+	TStr           text;  // joined reference, as read with REF_READ_FORWARD
+	vector<string> names; // reference names, as collected by Ebwt::joinRefs
+	InorderBlockwiseSA<TStr>* sa; // suffix array of 'text', or NULL to sort it
+};
+
 /**
  * Extended Burrows-Wheeler transform data.
  *
@@ -365,6 +438,7 @@ public:
 	    _zOff(OFF_MASK), \
 	    _zEbwtByteOff(OFF_MASK), \
 	    _zEbwtBpOff(-1), \
+	    _checksum(0), \
 	    _nPat(0), \
 	    _nFrag(0), \
 	    _plen(NULL), \
@@ -373,10 +447,15 @@ public:
 	    _ftab(NULL), \
 	    _eftab(NULL), \
 	    _offs(NULL), \
+	    _offBits(0), \
 	    _isa(NULL), \
 	    _ebwt(NULL), \
 	    _useMm(false), \
 	    useShmem_(false), \
+	    _hugePages(HUGEPAGES_NONE), \
+	    _ebwtMapLen(0), \
+	    _offsMapLen(0), \
+	    _ftabMapLen(0), \
 	    _refnames(), \
 	    rmap_(NULL), \
 	    mmFile1_(NULL), \
@@ -408,20 +487,34 @@ public:
 	     bool verbose = false,
 	     bool startVerbose = false,
 	     bool passMemExc = false,
-	     bool sanityCheck = false) :
+	     bool sanityCheck = false,
+	     int hugePages = HUGEPAGES_NONE) :
 	     Ebwt_INITS
 	     Ebwt_STAT_INITS
 	{
 		assert(!useMm || !useShmem);
+		assert(hugePages == HUGEPAGES_NONE || !useShmem);
 #ifdef POPCNT_CAPABILITY 
         ProcessorSupport ps; 
         _usePOPCNTinstruction = ps.POPCNTenabled(); 
+        _countBackend = _usePOPCNTinstruction ? EBWT_COUNT_POPCNT : EBWT_COUNT_GENERIC;
+#ifdef EBWT_SIMD_COUNT
+        if(ps.AVX512POPCNTenabled())  _countBackend = EBWT_COUNT_AVX512;
+        else if(ps.AVX2enabled())     _countBackend = EBWT_COUNT_AVX2;
+        else if(_usePOPCNTinstruction) _countBackend = EBWT_COUNT_SSE42;
+#endif
 #endif 
 		rmap_ = rmap;
 		_useMm = useMm;
 		useShmem_ = useShmem;
+		_hugePages = hugePages;
 		_in1Str = in + ".1." + gEbwt_ext;
 		_in2Str = in + ".2." + gEbwt_ext;
+		_in5Str = in + ".5." + gEbwt_ext;
+		_inOffs2Str = in + ".offs2." + gEbwt_ext;
+		_kmerChars = 0;
+		_offRate2 = -1;
+		_hotMinOcc = 0;
 		readIntoMemory(
 			color,         // expect colorspace reference?
 			__fw ? -1 : needEntireReverse, // need REF_READ_REVERSE
@@ -454,6 +547,10 @@ public:
 	     int32_t offRate,
 	     int32_t isaRate,
 	     int32_t ftabChars,
+	     bool interleaved,
+	     int32_t kmerChars,    // k for .5.ebwt k-mer table; 0 = none
+	     int32_t offRate2,     // hot-region SA sample rate; -1 = none
+	     uint32_t hotMinOcc,   // min k-mer occurrences for a hot region
 	     const string& file,   // base filename for EBWT files
 	     bool __fw,
 	     bool useBlockwise,
@@ -461,6 +558,7 @@ public:
 	     TIndexOffU bmaxSqrtMult,
 	     TIndexOffU bmaxDivN,
 	     int dcv,
+	     int nthreads,         // # threads for suffix sorting
 	     vector<FileBuf*>& is,
 	     vector<RefRecord>& szs,
 	     vector<uint32_t>& plens,
@@ -471,7 +569,8 @@ public:
 	     int32_t __overrideIsaRate = -1,
 	     bool verbose = false,
 	     bool passMemExc = false,
-	     bool sanityCheck = false) :
+	     bool sanityCheck = false,
+	     const JoinedRef<TStr>* joined = NULL) :
 	     Ebwt_INITS
 	     Ebwt_STAT_INITS,
 	     _eh(joinedLen(szs),
@@ -481,14 +580,29 @@ public:
 	         isaRate,
 	         ftabChars,
 	         color,
-	         refparams.reverse == REF_READ_REVERSE)
+	         refparams.reverse == REF_READ_REVERSE,
+	         interleaved)
 	{
 #ifdef POPCNT_CAPABILITY 
         ProcessorSupport ps; 
         _usePOPCNTinstruction = ps.POPCNTenabled(); 
+        _countBackend = _usePOPCNTinstruction ? EBWT_COUNT_POPCNT : EBWT_COUNT_GENERIC;
+#ifdef EBWT_SIMD_COUNT
+        if(ps.AVX512POPCNTenabled())  _countBackend = EBWT_COUNT_AVX512;
+        else if(ps.AVX2enabled())     _countBackend = EBWT_COUNT_AVX2;
+        else if(_usePOPCNTinstruction) _countBackend = EBWT_COUNT_SSE42;
+#endif
 #endif 
 		_in1Str = file + ".1." + gEbwt_ext;
 		_in2Str = file + ".2." + gEbwt_ext;
+		_in5Str = file + ".5." + gEbwt_ext;
+		_inOffs2Str = file + ".offs2." + gEbwt_ext;
+		_kmerChars = kmerChars;
+		_offRate2 = offRate2;
+		_hotMinOcc = hotMinOcc;
+		// Don't leave behind optional files from an earlier build
+		if(_kmerChars == 0) remove(_in5Str.c_str());
+		if(_offRate2 < 0)   remove(_inOffs2Str.c_str());
 		// Open output files
 		ofstream fout1(_in1Str.c_str(), ios::binary);
 		if(!fout1.good()) {
@@ -518,7 +632,9 @@ public:
 			bmaxSqrtMult,
 			bmaxDivN,
 			dcv,
-			seed);
+			nthreads,
+			seed,
+			joined);
 		// Close output files
 		fout1.flush();
 		int64_t tellpSz1 = (int64_t)fout1.tellp();
@@ -608,6 +724,12 @@ public:
 	 * depends on 'useBlockwise') for the resulting sequence.  The
 	 * suffix-array producer can then be used to obtain chunks of the
 	 * joined string's suffix array.
+	 *
+	 * If 'joined' is non-NULL, the reference was already joined and
+	 * the input streams aren't touched.  A forward index uses the
+	 * joined text in place; a mirror index reverses a copy of it.  If
+	 * it also has a suffix-array producer, the text is used in place
+	 * either way and no suffix sorting happens here.
 	 */
 	void initFromVector(
 		vector<FileBuf*>& is,
@@ -622,34 +744,51 @@ public:
 		TIndexOffU bmaxSqrtMult,
 		TIndexOffU bmaxDivN,
 		int dcv,
-		uint32_t seed)
+		int nthreads,
+		uint32_t seed,
+		const JoinedRef<TStr>* joined = NULL)
 	{
 		// Compose text strings into single string
 		VMSG_NL("Calculating joined length");
-		TStr s; // holds the entire joined reference after call to joinToDisk
+		TStr js; // holds the entire joined reference after call to joinToDisk
+		const bool shareFw = (joined != NULL &&
+		                      (joined->sa != NULL || refparams.reverse == REF_READ_FORWARD));
+		const TStr& s = shareFw ? joined->text : js;
 		TIndexOffU jlen;
 		jlen = joinedLen(szs);
 		assert_geq(jlen, sztot);
 		VMSG_NL("Writing header");
 		writeFromMemory(true, out1, out2);
 		try {
-			VMSG_NL("Reserving space for joined string");
-			seqan::reserve(s, jlen, Exact());
-			VMSG_NL("Joining reference sequences");
-			if(refparams.reverse == REF_READ_REVERSE) {
-				{
-					Timer timer(cout, "  Time to join reference sequences: ", _verbose);
-					joinToDisk(is, szs, plens, sztot, refparams, s, out1, out2, seed);
-				} {
-					Timer timer(cout, "  Time to reverse reference sequence: ", _verbose);
-					vector<RefRecord> tmp;
-					reverseInPlace(s);
-					reverseRefRecords(szs, tmp, false, false);
-					szsToDisk(tmp, out1, refparams.reverse);
+			if(joined != NULL) {
+				// Already joined; write what joinToDisk would have
+				assert_eq(jlen, length(joined->text));
+				lensToDisk(szs, plens, out1);
+				_refnames = joined->names;
+				if(!shareFw) {
+					VMSG_NL("Copying joined string");
+					Timer timer(cout, "  Time to copy joined string: ", _verbose);
+					seqan::reserve(js, jlen, Exact());
+					append(js, joined->text);
+					if(refparams.reverse == REF_READ_REVERSE_EACH) {
+						reverseEachRecord(js, szs);
+					}
 				}
 			} else {
+				VMSG_NL("Reserving space for joined string");
+				seqan::reserve(js, jlen, Exact());
+				VMSG_NL("Joining reference sequences");
 				Timer timer(cout, "  Time to join reference sequences: ", _verbose);
-				joinToDisk(is, szs, plens, sztot, refparams, s, out1, out2, seed);
+				joinToDisk(is, szs, plens, sztot, refparams, js, out1, out2, seed);
+			}
+			if(refparams.reverse == REF_READ_REVERSE) {
+				assert(!shareFw);
+				Timer timer(cout, "  Time to reverse reference sequence: ", _verbose);
+				vector<RefRecord> tmp;
+				reverseInPlace(js);
+				reverseRefRecords(szs, tmp, false, false);
+				szsToDisk(tmp, out1, refparams.reverse);
+			} else {
 				szsToDisk(szs, out1, refparams.reverse);
 			}
 			// Joined reference sequence now in 's'
@@ -684,103 +823,118 @@ public:
 		}
 		// Succesfully obtained joined reference string
 		assert_geq(length(s), jlen);
-		if(bmax != OFF_MASK) {
-			VMSG_NL("bmax according to bmax setting: " << bmax);
-		}
-		else if(bmaxSqrtMult != OFF_MASK) {
-			bmax *= bmaxSqrtMult;
-			VMSG_NL("bmax according to bmaxSqrtMult setting: " << bmax);
-		}
-		else if(bmaxDivN != OFF_MASK) {
-			bmax = max<TIndexOffU>(jlen / bmaxDivN, 1);
-			VMSG_NL("bmax according to bmaxDivN setting: " << bmax);
-		}
-		else {
-			bmax = (TIndexOffU)sqrt(length(s));
-			VMSG_NL("bmax defaulted to: " << bmax);
-		}
-		int iter = 0;
-		bool first = true;
-		// Look for bmax/dcv parameters that work.
-		while(true) {
-			if(!first && bmax < 40 && _passMemExc) {
-				cerr << "Could not find approrpiate bmax/dcv settings for building this index." << endl;
-				if(!isPacked()) {
-					// Throw an exception exception so that we can
-					// retry using a packed string representation
-					throw bad_alloc();
-				} else {
-					cerr << "Already tried a packed string representation." << endl;
-				}
-				cerr << "Please try indexing this reference on a computer with more memory." << endl;
-				if(sizeof(void*) == 4) {
-					cerr << "If this computer has more than 4 GB of memory, try using a 64-bit executable;" << endl
-						 << "this executable is 32-bit." << endl;
-				}
+		if(joined != NULL && joined->sa != NULL) {
+			// Suffix array is already being produced in order
+			assert(joined->sa->suffixItrIsReset());
+			assert_eq(joined->sa->size(), length(s)+1);
+			VMSG_NL("Converting suffix-array elements to index image");
+			buildToDisk(*joined->sa, s, out1, out2);
+			out1.flush(); out2.flush();
+			if(out1.fail() || out2.fail()) {
+				cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
 				throw 1;
 			}
-			if(dcv > 4096) dcv = 4096;
-			if((iter % 6) == 5 && dcv < 4096 && dcv != 0) {
-				dcv <<= 1; // double difference-cover period
-			} else {
-				bmax -= (bmax >> 2); // reduce by 25%
+		} else {
+			if(bmax != OFF_MASK) {
+				VMSG_NL("bmax according to bmax setting: " << bmax);
 			}
-			VMSG("Using parameters --bmax " << bmax);
-			if(dcv == 0) {
-				VMSG_NL(" and *no difference cover*");
-			} else {
-				VMSG_NL(" --dcv " << dcv);
+			else if(bmaxSqrtMult != OFF_MASK) {
+				bmax *= bmaxSqrtMult;
+				VMSG_NL("bmax according to bmaxSqrtMult setting: " << bmax);
 			}
-			iter++;
-			try {
-				{
-					VMSG_NL("  Doing ahead-of-time memory usage test");
-					// Make a quick-and-dirty attempt to force a bad_alloc iff
-					// we would have thrown one eventually as part of
-					// constructing the DifferenceCoverSample
-					dcv <<= 1;
-					TIndexOffU sz = (TIndexOffU)DifferenceCoverSample<TStr>::simulateAllocs(s, dcv >> 1);
-					AutoArray<uint8_t> tmp(sz);
-					dcv >>= 1;
-					// Likewise with the KarkkainenBlockwiseSA
-					sz = (TIndexOffU)KarkkainenBlockwiseSA<TStr>::simulateAllocs(s, bmax);
-					AutoArray<uint8_t> tmp2(sz);
-					// Now throw in the 'ftab' and 'isaSample' structures
-					// that we'll eventually allocate in buildToDisk
-					AutoArray<TIndexOffU> ftab(_eh._ftabLen * 2);
-					AutoArray<uint8_t> side(_eh._sideSz);
-					// Grab another 20 MB out of caution
-					AutoArray<uint32_t> extra(20*1024*1024);
-					// If we made it here without throwing bad_alloc, then we
-					// passed the memory-usage stress test
-					VMSG("  Passed!  Constructing with these parameters: --bmax " << bmax << " --dcv " << dcv);
-					if(isPacked()) {
-						VMSG(" --packed");
+			else if(bmaxDivN != OFF_MASK) {
+				bmax = max<TIndexOffU>(jlen / bmaxDivN, 1);
+				VMSG_NL("bmax according to bmaxDivN setting: " << bmax);
+			}
+			else {
+				bmax = (TIndexOffU)sqrt(length(s));
+				VMSG_NL("bmax defaulted to: " << bmax);
+			}
+			int iter = 0;
+			bool first = true;
+			// Look for bmax/dcv parameters that work.
+			while(true) {
+				if(!first && bmax < 40 && _passMemExc) {
+					cerr << "Could not find approrpiate bmax/dcv settings for building this index." << endl;
+					if(!isPacked()) {
+						// Throw an exception exception so that we can
+						// retry using a packed string representation
+						throw bad_alloc();
+					} else {
+						cerr << "Already tried a packed string representation." << endl;
+					}
+					cerr << "Please try indexing this reference on a computer with more memory." << endl;
+					if(sizeof(void*) == 4) {
+						cerr << "If this computer has more than 4 GB of memory, try using a 64-bit executable;" << endl
+							 << "this executable is 32-bit." << endl;
 					}
-					VMSG_NL("");
-				}
-				VMSG_NL("Constructing suffix-array element generator");
-				KarkkainenBlockwiseSA<TStr> bsa(s, bmax, dcv, seed, _sanity, _passMemExc, _verbose);
-				assert(bsa.suffixItrIsReset());
-				assert_eq(bsa.size(), length(s)+1);
-				VMSG_NL("Converting suffix-array elements to index image");
-				buildToDisk(bsa, s, out1, out2);
-				out1.flush(); out2.flush();
-				if(out1.fail() || out2.fail()) {
-					cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
 					throw 1;
 				}
-				break;
-			} catch(bad_alloc& e) {
-				if(_passMemExc) {
-					VMSG_NL("  Ran out of memory; automatically trying more memory-economical parameters.");
+				if(dcv > 4096) dcv = 4096;
+				if((iter % 6) == 5 && dcv < 4096 && dcv != 0) {
+					dcv <<= 1; // double difference-cover period
 				} else {
-					cerr << "Out of memory while constructing suffix array.  Please try using a smaller" << endl
-						 << "number of blocks by specifying a smaller --bmax or a larger --bmaxdivn" << endl;
-					throw 1;
+					bmax -= (bmax >> 2); // reduce by 25%
+				}
+				VMSG("Using parameters --bmax " << bmax);
+				if(dcv == 0) {
+					VMSG_NL(" and *no difference cover*");
+				} else {
+					VMSG_NL(" --dcv " << dcv);
+				}
+				iter++;
+				try {
+					// The test is only useful if a bad_alloc gets us another
+					// try with more economical parameters
+					if(_passMemExc) {
+						VMSG_NL("  Doing ahead-of-time memory usage test");
+						// Make a quick-and-dirty attempt to force a bad_alloc iff
+						// we would have thrown one eventually as part of
+						// constructing the DifferenceCoverSample
+						dcv <<= 1;
+						TIndexOffU sz = (TIndexOffU)DifferenceCoverSample<TStr>::simulateAllocs(s, dcv >> 1);
+						AutoArray<uint8_t> tmp(sz);
+						dcv >>= 1;
+						// Likewise with the KarkkainenBlockwiseSA
+						sz = (TIndexOffU)KarkkainenBlockwiseSA<TStr>::simulateAllocs(s, bmax, nthreads);
+						AutoArray<uint8_t> tmp2(sz);
+						// Now throw in the 'ftab' and 'isaSample' structures
+						// that we'll eventually allocate in buildToDisk
+						AutoArray<TIndexOffU> ftab(_eh._ftabLen * 2);
+						AutoArray<uint8_t> side(_eh._sideSz);
+						// Grab another 20 MB out of caution
+						AutoArray<uint32_t> extra(20*1024*1024);
+						// If we made it here without throwing bad_alloc, then we
+						// passed the memory-usage stress test
+						VMSG("  Passed!  Constructing with these parameters: --bmax " << bmax << " --dcv " << dcv);
+						if(isPacked()) {
+							VMSG(" --packed");
+						}
+						VMSG_NL("");
+					}
+					VMSG_NL("Constructing suffix-array element generator");
+					KarkkainenBlockwiseSA<TStr> bsa(s, bmax, nthreads, dcv, seed, _sanity, _passMemExc, _verbose);
+					assert(bsa.suffixItrIsReset());
+					assert_eq(bsa.size(), length(s)+1);
+					VMSG_NL("Converting suffix-array elements to index image");
+					buildToDisk(bsa, s, out1, out2);
+					out1.flush(); out2.flush();
+					if(out1.fail() || out2.fail()) {
+						cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
+						throw 1;
+					}
+					break;
+				} catch(bad_alloc& e) {
+					if(_passMemExc) {
+						VMSG_NL("  Ran out of memory; automatically trying more memory-economical parameters.");
+					} else {
+						cerr << "Out of memory while constructing suffix array.  Please try using a smaller" << endl
+							 << "number of blocks by specifying a smaller --bmax or a larger --bmaxdivn" << endl;
+						throw 1;
+					}
 				}
+				first = false;
 			}
-			first = false;
 		}
 		assert(repOk());
 		// Now write reference sequence names on the end
@@ -793,6 +947,9 @@ public:
 			out1 << this->_refnames[i] << endl;
 		}
 		out1 << '\0';
+		// Checksum after the names, where older versions stop reading
+		writeU<uint64_t>(out1, EBWT_CHECKSUM_TAG, this->toBe());
+		writeU<uint64_t>(out1, _checksum, this->toBe());
 		out1.flush(); out2.flush();
 		if(out1.fail() || out2.fail()) {
 			cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
@@ -821,10 +978,10 @@ public:
 		if(!_useMm) {
 			// Delete everything that was allocated in read(false, ...)
 			if(_fchr    != NULL) delete[] _fchr;    _fchr    = NULL;
-			if(_ftab    != NULL) delete[] _ftab;    _ftab    = NULL;
+			if(_ftab    != NULL) freeBig(_ftab, _ftabMapLen);
 			if(_eftab   != NULL) delete[] _eftab;   _eftab   = NULL;
 			if(_offs != NULL && !useShmem_) {
-				delete[] _offs; _offs = NULL;
+				freeBig(_offs, _offsMapLen);
 			} else if(_offs != NULL && useShmem_) {
 				FREE_SHARED(_offs);
 			}
@@ -832,7 +989,7 @@ public:
 			if(_plen    != NULL) delete[] _plen;    _plen    = NULL;
 			if(_rstarts != NULL) delete[] _rstarts; _rstarts = NULL;
 			if(_ebwt != NULL && !useShmem_) {
-				delete[] _ebwt; _ebwt = NULL;
+				freeBig(_ebwt, _ebwtMapLen);
 			} else if(_ebwt != NULL && useShmem_) {
 				FREE_SHARED(_ebwt);
 			}
@@ -860,7 +1017,19 @@ public:
 	TIndexOffU*   ftab() const         { return _ftab; }
 	TIndexOffU*   eftab() const        { return _eftab; }
 	TIndexOffU*   offs() const         { return _offs; }
-	uint32_t*   isa() const          { return _isa; } /* check */
+	int           offBits() const      { return _offBits; }
+
+	/**
+	 * Return the i'th entry of the suffix-array sample.
+	 */
+	inline TIndexOffU offAt(TIndexOffU i) const {
+#ifdef BOWTIE_PACKED_OFFS
+		if(_offBits > 0) return unpack_bits<TIndexOffU>(_offs, i, _offBits);
+#endif
+		return _offs[i];
+	}
+
+	TIndexOffU* isa() const          { return _isa; } /* check */
 	TIndexOffU*   plen() const         { return _plen; }
 	TIndexOffU*   rstarts() const      { return _rstarts; }
 	uint8_t*    ebwt() const         { return _ebwt; }
@@ -872,6 +1041,7 @@ public:
 	bool        fw() const           { return _fw; }
 #ifdef POPCNT_CAPABILITY 
     bool _usePOPCNTinstruction; 
+    int  _countBackend; // one of EBWT_COUNT_*
 #endif 
 
 	/// Return true iff the Ebwt is currently in memory
@@ -922,6 +1092,11 @@ public:
 			false,      // mmSweep
 			loadNames,  // loadNames
 			verbose);   // startVerbose
+		// Only an index with a k-mer table needs its fingerprint now
+		if(fileSize(_in5Str.c_str()) > 0) {
+			_kmers.readFromFile(_in5Str, _eh._len, fingerprint(), _useMm, verbose);
+		}
+		_hotOffs.readFromFile(_inOffs2Str, _eh._len, verbose);
 	}
 
 	/**
@@ -931,30 +1106,93 @@ public:
 		assert(isInMemory());
 		if(!_useMm) {
 			delete[] _fchr;
-			delete[] _ftab;
+			freeBig(_ftab, _ftabMapLen);
 			delete[] _eftab;
-			if(!useShmem_) delete[] _offs;
+			if(!useShmem_) freeBig(_offs, _offsMapLen);
 			delete[] _isa;
 			// Keep plen; it's small and the client may want to query it
 			// even when the others are evicted.
 			//delete[] _plen;
 			delete[] _rstarts;
-			if(!useShmem_) delete[] _ebwt;
+			if(!useShmem_) freeBig(_ebwt, _ebwtMapLen);
 		}
 		_fchr  = NULL;
 		_ftab  = NULL;
 		_eftab = NULL;
 		_offs  = NULL;
+		_offBits = 0;
 		_isa   = NULL;
 		// Keep plen; it's small and the client may want to query it
 		// even when the others are evicted.
 		//_plen  = NULL;
 		_rstarts = NULL;
 		_ebwt    = NULL;
+		_kmers.reset();
+		_hotOffs.reset();
 		_zEbwtByteOff = OFF_MASK;
 		_zEbwtBpOff = -1;
 	}
 
+	/**
+	 * Return a 64-bit fingerprint of the index contents, used to tie
+	 * files derived from this index (such as saved range caches and
+	 * the k-mer table) to it.  This is the checksum bowtie-build
+	 * stored after the reference names; for indexes built before it
+	 * did, it's computed once over the BWT in memory.
+	 */
+	uint64_t fingerprint() const {
+		if(_checksum == 0) {
+			assert(isInMemory());
+			_checksum = finishChecksum(
+				ebwtChecksum(EBWT_CHECKSUM_TAG, _ebwt, _eh._ebwtTotSz),
+				_zOff, _fchr);
+		}
+		return _checksum;
+	}
+
+	/**
+	 * Fold the shape parameters, zOff and fchr into checksum 'h' of
+	 * the BWT bytes.  Never returns 0, which means "unknown".
+	 */
+	uint64_t finishChecksum(uint64_t h, TIndexOffU zOff, const TIndexOffU *fchr) const {
+		uint64_t hdr[] = {
+			(uint64_t)_eh._len, (uint64_t)_eh._lineRate,
+			(uint64_t)_eh._linesPerSide, (uint64_t)_eh._ftabChars,
+			(uint64_t)_eh._color, (uint64_t)_eh._entireReverse,
+			(uint64_t)_eh._interleaved, (uint64_t)zOff,
+			(uint64_t)fchr[0], (uint64_t)fchr[1], (uint64_t)fchr[2],
+			(uint64_t)fchr[3], (uint64_t)fchr[4], (uint64_t)this->fw()
+		};
+		h = ebwtChecksum(h, hdr, sizeof(hdr));
+		return (h == 0) ? 1 : h;
+	}
+
+	/// Return k of the loaded k-mer table, or 0 if there is none
+	int kmerChars() const { return _kmers.k(); }
+
+	/**
+	 * Look up the range of the rightmost kmerChars() characters of
+	 * the first qlen characters of qry in the k-mer table, the same
+	 * characters the ftab would use.  Returns false, leaving top and
+	 * bot alone, if those characters include an N; otherwise sets
+	 * [top, bot) (possibly empty) and returns true.
+	 */
+	bool kmerRange(const String<Dna5>& qry, uint32_t qlen,
+	               TIndexOffU& top, TIndexOffU& bot) const
+	{
+		const int k = _kmers.k();
+		assert_gt(k, 0);
+		assert_geq(qlen, (uint32_t)k);
+		uint32_t code = 0;
+		for(uint32_t i = qlen - k; i < qlen; i++) {
+			int c = (int)qry[i];
+			if(c > 3) return false;
+			code = (code << 2) | (uint32_t)c;
+		}
+		if(!_kmers.lookup(code, top, bot)) top = bot = 0;
+		return true;
+	}
+
 	/**
 	 * Non-static facade for static function ftabHi.
 	 */
@@ -1038,7 +1276,7 @@ public:
 		assert_lt(_zEbwtByteOff, eh._sideBwtSz);
 		_zEbwtBpOff = sideCharOff & 3;
 		assert_lt(_zEbwtBpOff, 4);
-		if((sideNum & 1) == 0) {
+		if(!eh._interleaved && (sideNum & 1) == 0) {
 			// This is an even (backward) side
 			_zEbwtByteOff = eh._sideBwtSz - _zEbwtByteOff - 1;
 			_zEbwtBpOff = 3 - _zEbwtBpOff;
@@ -1106,7 +1344,7 @@ public:
 		if(_offs == NULL) {
 			out << "NULL" << endl;
 		} else {
-			out << "non-NULL, [0] = " << _offs[0] << endl;
+			out << "non-NULL, [0] = " << offAt(0) << endl;
 		}
 	}
 
@@ -1114,6 +1352,8 @@ public:
 	static TStr join(vector<TStr>& l, uint32_t seed);
 	static TStr join(vector<FileBuf*>& l, vector<RefRecord>& szs, TIndexOffU sztot, const RefReadInParams& refparams, uint32_t seed);
 	void joinToDisk(vector<FileBuf*>& l, vector<RefRecord>& szs, vector<uint32_t>& plens, TIndexOffU sztot, const RefReadInParams& refparams, TStr& ret, ostream& out1, ostream& out2, uint32_t seed = 0);
+	void lensToDisk(const vector<RefRecord>& szs, const vector<uint32_t>& plens, ostream& out1);
+	static void joinRefs(vector<FileBuf*>& l, const vector<RefRecord>& szs, const vector<uint32_t>& plens, const RefReadInParams& refparams, TStr& ret, vector<string>& names);
 	void buildToDisk(InorderBlockwiseSA<TStr>& sa, const TStr& s, ostream& out1, ostream& out2);
 
 	// I/O
@@ -1132,6 +1372,7 @@ public:
 	// Searching and reporting
 	void joinedToTextOff(TIndexOffU qlen, TIndexOffU off, TIndexOffU& tidx, TIndexOffU& textoff, TIndexOffU& tlen) const;
 	inline bool report(const String<Dna5>& query, String<char>* quals, String<char>* name, bool color, char primer, char trimc, bool colExEnds, int snpPhred, const BitPairReference* ref, const std::vector<TIndexOffU>& mmui32, const std::vector<uint8_t>& refcs, size_t numMms, TIndexOffU off, TIndexOffU top, TIndexOffU bot, uint32_t qlen, int stratum, uint16_t cost, uint32_t patid, uint32_t seed, const EbwtSearchParams<TStr>& params) const;
+	inline TIndexOffU chaseRow(TIndexOffU i, SideLocus *l = NULL) const;
 	inline bool reportChaseOne(const String<Dna5>& query, String<char>* quals, String<char>* name, bool color, char primer, char trimc, bool colExEnds, int snpPhred, const BitPairReference* ref, const std::vector<TIndexOffU>& mmui32, const std::vector<uint8_t>& refcs, size_t numMms, TIndexOffU i, TIndexOffU top, TIndexOffU bot, uint32_t qlen, int stratum, uint16_t cost, uint32_t patid, uint32_t seed, const EbwtSearchParams<TStr>& params, SideLocus *l = NULL) const;
 	inline bool reportReconstruct(const String<Dna5>& query, String<char>* quals, String<char>* name, String<Dna5>& lbuf, String<Dna5>& rbuf, const TIndexOffU *mmui32, const char* refcs, size_t numMms, TIndexOffU i, TIndexOffU top, TIndexOffU bot, uint32_t qlen, int stratum, const EbwtSearchParams<TStr>& params, SideLocus *l = NULL) const;
 	inline int rowL(const SideLocus& l) const;
@@ -1147,6 +1388,7 @@ public:
 	inline TIndexOffU mapLF(const SideLocus& l, int c ASSERT_ONLY(, bool overrideSanity = false)) const;
 	inline TIndexOffU mapLF1(TIndexOffU row, const SideLocus& l, int c ASSERT_ONLY(, bool overrideSanity = false)) const;
 	inline int mapLF1(TIndexOffU& row, const SideLocus& l ASSERT_ONLY(, bool overrideSanity = false)) const;
+	inline void mapLFBatch(size_t n, TIndexOffU *tops, TIndexOffU *bots, const int *cs, SideLocus *ltops, SideLocus *lbots) const;
 	/// Check that in-memory Ebwt is internally consistent with respect
 	/// to given EbwtParams; assert if not
 	bool inMemoryRepOk(const EbwtParams& eh) const {
@@ -1192,9 +1434,14 @@ public:
 	FILE      *_in2;    // input fd for secondary index file
 	string     _in1Str; // filename for primary index file
 	string     _in2Str; // filename for secondary index file
+	string     _in5Str; // filename for k-mer table file
+	string     _inOffs2Str; // filename for hot-region SA sample file
 	TIndexOffU   _zOff;
 	TIndexOffU   _zEbwtByteOff;
 	TIndexOff        _zEbwtBpOff;
+	// Checksum over the whole BWT and the shape of the index; written
+	// after the reference names.  0 = not known yet
+	mutable uint64_t _checksum;
 	TIndexOffU   _nPat;  /// number of reference texts
 	TIndexOffU   _nFrag; /// number of fragments
 	TIndexOffU*  _plen;
@@ -1206,16 +1453,32 @@ public:
 	TIndexOffU*  _fchr;
 	TIndexOffU*  _ftab;
 	TIndexOffU*  _eftab; // "extended" entries for _ftab
+	// Optional table mapping longer k-mers straight to BWT ranges;
+	// stored in the .5.ebwt file
+	KmerTable    _kmers;
+	int32_t      _kmerChars; // k of the table to build; 0 = none
+	// Optional denser SA sample covering repetitive stretches of rows;
+	// stored in the .offs2.ebwt file
+	HotOffs      _hotOffs;
+	int32_t      _offRate2;  // rate of the sample to build; -1 = none
+	uint32_t     _hotMinOcc; // k-mer occurrences that make a row hot
 	// _offs may be extremely large.  E.g. for DNA w/ offRate=4 (one
 	// offset every 16 rows), the total size of _offs is the same as
-	// the total size of the input sequence
+	// the total size of the input sequence.  With BOWTIE_PACKED_OFFS,
+	// an _offs read into our own or shared memory holds each offset in
+	// just _offBits bits; offAt() reads it either way
 	TIndexOffU*  _offs;
+	int          _offBits; // width of a packed offset; 0 = not packed
 	TIndexOffU*  _isa;
 	// _ebwt is the Extended Burrows-Wheeler Transform itself, and thus
 	// is at least as large as the input sequence.
 	uint8_t*   _ebwt;
 	bool       _useMm;        /// use memory-mapped files to hold the index
 	bool       useShmem_;     /// use shared memory to hold large parts of the index
+	int        _hugePages;    /// HUGEPAGES_* backing for ebwt[], offs[] and ftab[]
+	size_t     _ebwtMapLen;   /// bytes mapped by allocHugeMem() for _ebwt; 0 = new[]
+	size_t     _offsMapLen;   /// same for _offs
+	size_t     _ftabMapLen;   /// same for _ftab
 	vector<string> _refnames; /// names of the reference sequences
 	const ReferenceMap* rmap_; /// mapping into another reference coordinate space
 	char *mmFile1_;
@@ -1248,6 +1511,28 @@ private:
 			this->log().flush();
 		}
 	}
+
+	/// Allocate one of the big arrays, on huge pages if _hugePages
+	/// asks for them and the kernel obliges, otherwise with new[].
+	/// Sets 'mapLen' to what freeBig() needs to release it.
+	template<typename T>
+	T* allocBig(size_t n, size_t& mapLen, const char *name, bool verbose) {
+		mapLen = 0;
+		if(_hugePages != HUGEPAGES_NONE) {
+			T* p = (T*)allocHugeMem(n * sizeof(T), _hugePages, mapLen, name, verbose);
+			if(p != NULL) return p;
+		}
+		return new T[n];
+	}
+
+	/// Free an array allocated with allocBig()
+	template<typename T>
+	void freeBig(T*& p, size_t& mapLen) {
+		if(mapLen > 0) freeHugeMem(p, mapLen);
+		else           delete[] p;
+		p = NULL;
+		mapLen = 0;
+	}
 };
 
 /// Specialization for packed Ebwts - return true
@@ -1606,8 +1891,15 @@ struct SideLocus {
 		const uint32_t sideSz     = ep._sideSz;
 		// Side length is hard-coded for now; this allows the compiler
 		// to do clever things to accelerate / and %.
-		_sideNum                  = row / (56*OFF_SIZE);
-		_charOff                  = row % (56*OFF_SIZE);
+		if(ep._interleaved) {
+			assert_eq(48*OFF_SIZE, ep._sideBwtLen);
+			_sideNum              = row / (48*OFF_SIZE);
+			_charOff              = row % (48*OFF_SIZE);
+		} else {
+			assert_eq(56*OFF_SIZE, ep._sideBwtLen);
+			_sideNum              = row / (56*OFF_SIZE);
+			_charOff              = row % (56*OFF_SIZE);
+		}
 		_sideByteOff              = _sideNum * sideSz;
 		assert_leq(row, ep._len);
 		assert_leq(_sideByteOff + sideSz, ep._ebwtTotSz);
@@ -1617,7 +1909,8 @@ struct SideLocus {
 		                   PREFETCH_LOCALITY);
 #endif
 		// prefetch this side too
-		_fw = (_sideNum & 1) != 0; // odd-numbered sides are forward
+		// odd-numbered sides are forward; interleaved sides always are
+		_fw = ep._interleaved || (_sideNum & 1) != 0;
 		_by = _charOff >> 2; // byte within side
 		assert_lt(_by, (int)ep._sideBwtSz);
 		_bp = _charOff & 3;  // bit-pair within byte
@@ -1720,9 +2013,18 @@ void Ebwt<TStr>::sanityCheckUpToSide(TIndexOff upToSide) const {
 	ASSERT_ONLY(TIndexOffU occ_save[] = {0, 0});
 	TIndexOffU cur = 0; // byte pointer
 	const EbwtParams& eh = this->_eh;
-	bool fw = false;
+	bool fw = eh._interleaved;
 	while(cur < (TIndexOffU)(upToSide * eh._sideSz)) {
 		assert_leq(cur + eh._sideSz, eh._ebwtTotLen);
+		if(eh._interleaved) {
+			// Check the four counts at the end of the side against
+			// the chars counted in all previous sides
+			ASSERT_ONLY(TIndexOffU *u32ebwt = reinterpret_cast<TIndexOffU*>(&this->_ebwt[cur + eh._sideBwtSz]));
+			assert(u32ebwt[0] == occ[0] || u32ebwt[0] == occ[0]-1); // one 'a' is a skipped '$'
+			assert_eq(u32ebwt[1], occ[1]);
+			assert_eq(u32ebwt[2], occ[2]);
+			assert_eq(u32ebwt[3], occ[3]);
+		}
 		for(uint32_t i = 0; i < eh._sideBwtSz; i++) {
 			uint8_t by = this->_ebwt[cur + (fw ? i : eh._sideBwtSz-i-1)];
 			for(int j = 0; j < 4; j++) {
@@ -1734,7 +2036,9 @@ void Ebwt<TStr>::sanityCheckUpToSide(TIndexOff upToSide) const {
 			assert_eq(0, (occ[0] + occ[1] + occ[2] + occ[3]) % 4);
 		}
 		assert_eq(0, (occ[0] + occ[1] + occ[2] + occ[3]) % eh._sideBwtLen);
-		if(fw) {
+		if(eh._interleaved) {
+			// Every side is a forward side
+		} else if(fw) {
 			// Finished forward bucket; check saved [G] and [T]
 			// against the two uint32_ts encoded here
 			ASSERT_ONLY(TIndexOffU *u32ebwt = reinterpret_cast<TIndexOffU*>(&this->_ebwt[cur + eh._sideBwtSz]));
@@ -1786,9 +2090,9 @@ void Ebwt<TStr>::sanityCheckAll(int reverse) const {
 	memset(seen, 0, OFF_SIZE * seenLen);
 	TIndexOffU offsLen = eh._offsLen;
 	for(TIndexOffU i = 0; i < offsLen; i++) {
-		assert_lt(this->_offs[i], eh._bwtLen);
-		TIndexOff w = this->_offs[i] >> 5;
-		TIndexOff r = this->_offs[i] & 31;
+		assert_lt(this->offAt(i), eh._bwtLen);
+		TIndexOff w = this->offAt(i) >> 5;
+		TIndexOff r = this->offAt(i) & 31;
 		assert_eq(0, (seen[w] >> r) & 1); // shouldn't have been seen before
 		seen[w] |= (1 << r);
 	}
@@ -2021,6 +2325,150 @@ inline static void countInU64Ex(uint64_t dw, TIndexOffU* arrs) {
         arrs[3] += (uint32_t) tmp;
 }
 
+#ifdef EBWT_SIMD_COUNT
+/**
+ * Add the number of occurrences of each of the four characters among
+ * the first (by*4 + bp) bit pairs of the side at p to arrs; i.e. the
+ * same thing countUpToEx computes, but for all whole and partial words
+ * at once.  Same bit-bashing as countInU64Ex, four words per vector,
+ * with the population count done per nibble by table lookup (vpshufb)
+ * and summed with vpsadbw.  Words past the final partial word are
+ * never loaded.
+ */
+__attribute__((target("avx2")))
+static inline void countUpToEx_avx2(const uint8_t* p, int by, int bp, TIndexOffU* arrs) {
+	const int full = by >> 3;                    // # whole words
+	const int r = ((by & 7) << 2) + bp;          // # bit pairs in partial word
+	const int nwords = full + (r > 0 ? 1 : 0);
+	const __m256i part = _mm256_set1_epi64x(r > 0 ? (long long)((1llu << (r << 1)) - 1) : 0ll);
+	const __m256i m55  = _mm256_set1_epi64x(0x5555555555555555ll);
+	const __m256i m0f  = _mm256_set1_epi8(0x0f);
+	const __m256i lut  = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+	                                      0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+	const __m256i lane = _mm256_setr_epi64x(0, 1, 2, 3);
+	const __m256i zero = _mm256_setzero_si256();
+	// Per-lane counts for characters 0-3 go in bits 0-15, 16-31,
+	// 32-47 and 48-63 respectively, so that only one horizontal sum
+	// is needed at the end
+	__m256i acc = zero;
+	for(int i = 0; i < nwords; i += 4) {
+		// Load only the lanes that hold one of the nwords words
+		__m256i ld = _mm256_cmpgt_epi64(_mm256_set1_epi64x(nwords - i), lane);
+		__m256i v = _mm256_maskload_epi64((const long long*)(p + (i << 3)), ld);
+		// Bits that count: all of a whole word, the low 2*r bits of
+		// the partial word, none of the unloaded lanes (which read as
+		// 0, i.e. as As)
+		__m256i m = _mm256_or_si256(
+			_mm256_cmpgt_epi64(_mm256_set1_epi64x(full - i), lane),
+			_mm256_and_si256(_mm256_cmpeq_epi64(_mm256_set1_epi64x(full - i), lane), part));
+		for(int c = 0; c < 4; c++) {
+			__m256i x0 = _mm256_xor_si256(v, _mm256_set1_epi64x((long long)c_table[c]));
+			__m256i x3 = _mm256_and_si256(x0, _mm256_and_si256(_mm256_srli_epi64(x0, 1), m55));
+			x3 = _mm256_and_si256(x3, m);
+			__m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x3, m0f));
+			__m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x3, 4), m0f));
+			__m256i cnt = _mm256_sad_epu8(_mm256_add_epi8(lo, hi), zero);
+			acc = _mm256_add_epi64(acc, _mm256_slli_epi64(cnt, c << 4));
+		}
+	}
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc),
+	                          _mm256_extracti128_si256(acc, 1));
+	uint64_t tot = (uint64_t)(_mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1));
+	arrs[0] += (TIndexOffU)( tot        & 0xffff);
+	arrs[1] += (TIndexOffU)((tot >> 16) & 0xffff);
+	arrs[2] += (TIndexOffU)((tot >> 32) & 0xffff);
+	arrs[3] += (TIndexOffU)( tot >> 48);
+}
+
+/**
+ * SSE4.2 version of countUpToEx_avx2 for processors without AVX2: two
+ * words per vector, with the nibble lookup done by pshufb.  Words are
+ * loaded one at a time, so none past the final partial word is read.
+ */
+__attribute__((target("sse4.2")))
+static inline void countUpToEx_sse42(const uint8_t* p, int by, int bp, TIndexOffU* arrs) {
+	const int full = by >> 3;                    // # whole words
+	const int r = ((by & 7) << 2) + bp;          // # bit pairs in partial word
+	const int nwords = full + (r > 0 ? 1 : 0);
+	const uint64_t part = r > 0 ? ((1llu << (r << 1)) - 1) : 0;
+	const __m128i m55  = _mm_set1_epi64x(0x5555555555555555ll);
+	const __m128i m0f  = _mm_set1_epi8(0x0f);
+	const __m128i lut  = _mm_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+	const __m128i zero = _mm_setzero_si128();
+	// Counts for characters 0-3 packed 16 bits apart, as in
+	// countUpToEx_avx2
+	__m128i acc = zero;
+	for(int i = 0; i < nwords; i += 2) {
+		// Word i and word i+1, if there is one, and the bits of each
+		// that count
+		uint64_t w0 = *(const uint64_t*)(p + (i << 3));
+		uint64_t m0 = (i < full) ? ~0llu : part;
+		uint64_t w1 = 0, m1 = 0;
+		if(i + 1 < nwords) {
+			w1 = *(const uint64_t*)(p + ((i + 1) << 3));
+			m1 = (i + 1 < full) ? ~0llu : part;
+		}
+		__m128i v = _mm_set_epi64x((long long)w1, (long long)w0);
+		__m128i m = _mm_set_epi64x((long long)m1, (long long)m0);
+		for(int c = 0; c < 4; c++) {
+			__m128i x0 = _mm_xor_si128(v, _mm_set1_epi64x((long long)c_table[c]));
+			__m128i x3 = _mm_and_si128(x0, _mm_and_si128(_mm_srli_epi64(x0, 1), m55));
+			x3 = _mm_and_si128(x3, m);
+			__m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(x3, m0f));
+			__m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(x3, 4), m0f));
+			__m128i cnt = _mm_sad_epu8(_mm_add_epi8(lo, hi), zero);
+			acc = _mm_add_epi64(acc, _mm_slli_epi64(cnt, c << 4));
+		}
+	}
+	uint64_t tot = (uint64_t)(_mm_cvtsi128_si64(acc) + _mm_extract_epi64(acc, 1));
+	arrs[0] += (TIndexOffU)( tot        & 0xffff);
+	arrs[1] += (TIndexOffU)((tot >> 16) & 0xffff);
+	arrs[2] += (TIndexOffU)((tot >> 32) & 0xffff);
+	arrs[3] += (TIndexOffU)( tot >> 48);
+}
+
+/**
+ * AVX-512 VPOPCNTDQ version of countUpToEx_avx2: a whole 64-byte side
+ * per masked load, one vpopcntq per character.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static inline void countUpToEx_avx512(const uint8_t* p, int by, int bp, TIndexOffU* arrs) {
+	const int full = by >> 3;                    // # whole words
+	const int r = ((by & 7) << 2) + bp;          // # bit pairs in partial word
+	const int nwords = full + (r > 0 ? 1 : 0);
+	const long long part = r > 0 ? (long long)((1llu << (r << 1)) - 1) : 0ll;
+	const __m512i m55 = _mm512_set1_epi64(0x5555555555555555ll);
+	// Counts for characters 0-3 packed 16 bits apart, as in
+	// countUpToEx_avx2
+	__m512i acc = _mm512_setzero_si512();
+	for(int i = 0; i < nwords; i += 8) {
+		const int n = min(nwords - i, 8);
+		const int f = min(full - i, 8);
+		const __mmask8 ld = (__mmask8)((1u << n) - 1);
+		__m512i v = _mm512_maskz_loadu_epi64(ld, p + (i << 3));
+		// All bits of whole words; low 2*r bits of the partial word
+		__m512i m = _mm512_maskz_set1_epi64((__mmask8)((1u << f) - 1), -1ll);
+		if(f < n) m = _mm512_mask_set1_epi64(m, (__mmask8)(1u << f), part);
+		for(int c = 0; c < 4; c++) {
+			__m512i x0 = _mm512_xor_si512(v, _mm512_set1_epi64((long long)c_table[c]));
+			// The zero-masking shifts, unlike the plain ones, don't
+			// start from an undefined vector
+			__m512i x3 = _mm512_and_si512(x0, _mm512_and_si512(_mm512_maskz_srli_epi64(0xff, x0, 1), m55));
+			x3 = _mm512_and_si512(x3, m);
+			acc = _mm512_add_epi64(acc, _mm512_maskz_slli_epi64(0xff, _mm512_popcnt_epi64(x3), c << 4));
+		}
+	}
+	uint64_t lanes[8];
+	_mm512_storeu_si512((void*)lanes, acc);
+	uint64_t tot = 0;
+	for(int i = 0; i < 8; i++) tot += lanes[i];
+	arrs[0] += (TIndexOffU)( tot        & 0xffff);
+	arrs[1] += (TIndexOffU)((tot >> 16) & 0xffff);
+	arrs[2] += (TIndexOffU)((tot >> 32) & 0xffff);
+	arrs[3] += (TIndexOffU)( tot >> 48);
+}
+#endif
+
 /**
  * Counts the number of occurrences of character 'c' in the given Ebwt
  * side up to (but not including) the given byte/bitpair (by/bp).
@@ -2105,10 +2553,23 @@ inline void Ebwt<TStr>::countUpToEx(const SideLocus& l, TIndexOffU* arrs) const
 	// performance.  If you comment out this whole loop (which won't
 	// affect correctness - it will just cause the following loop to
 	// take up the slack) then runtime does not change noticeably.
-	// Someday the countInU64() and pop() functions should be
-	// vectorized/SSE-ized in case that helps.
+	// On CPUs with SSE4.2, AVX2 or AVX-512 VPOPCNTDQ, the whole count
+	// is done by the vector backends instead.
 	const uint8_t *side = l.side(this->_ebwt);
 
+#ifdef EBWT_SIMD_COUNT
+    if (_countBackend >= EBWT_COUNT_SSE42) {
+        // Whole words and the trailing partial word together
+        if(_countBackend == EBWT_COUNT_AVX512) {
+            countUpToEx_avx512(side, l._by, l._bp, arrs);
+        } else if(_countBackend == EBWT_COUNT_AVX2) {
+            countUpToEx_avx2(side, l._by, l._bp, arrs);
+        } else {
+            countUpToEx_sse42(side, l._by, l._bp, arrs);
+        }
+        return;
+    }
+#endif
 #ifdef POPCNT_CAPABILITY
     if (_usePOPCNTinstruction) {
         for(; i+7 < l._by; i += 8) {
@@ -2191,7 +2652,12 @@ inline TIndexOffU Ebwt<TStr>::countFwSide(const SideLocus& l, int c) const { /*
 	}
 	TIndexOffU ret;
 	// Now factor in the occ[] count at the side break
-	if(c < 2) {
+	if(this->_eh._interleaved) {
+		// All four counts live at the end of this same side
+		const TIndexOffU *occ = reinterpret_cast<const TIndexOffU*>(side + this->_eh._sideBwtSz);
+		assert_leq(occ[c], this->_eh._len);
+		ret = occ[c] + cCnt + this->_fchr[c];
+	} else if(c < 2) {
 		const TIndexOffU *ac = reinterpret_cast<const TIndexOffU*>(side - 2*OFF_SIZE);
 		assert_leq(ac[0], this->_eh._numSides * this->_eh._sideBwtLen); // b/c it's used as padding
 		assert_leq(ac[1], this->_eh._len);
@@ -2246,6 +2712,21 @@ inline void Ebwt<TStr>::countFwSideEx(const SideLocus& l, TIndexOffU* arrs) cons
 		}
 	}
 	// Now factor in the occ[] count at the side break
+	if(this->_eh._interleaved) {
+		// All four counts live at the end of this same side
+		const TIndexOffU *occ = reinterpret_cast<const TIndexOffU*>(side + this->_eh._sideBwtSz);
+		arrs[0] += (occ[0] + this->_fchr[0]);
+		arrs[1] += (occ[1] + this->_fchr[1]);
+		arrs[2] += (occ[2] + this->_fchr[2]);
+		arrs[3] += (occ[3] + this->_fchr[3]);
+#ifndef NDEBUG
+		assert_leq(arrs[0], this->_fchr[1]); // can't have jumpded into next char's section
+		assert_leq(arrs[1], this->_fchr[2]); // can't have jumpded into next char's section
+		assert_leq(arrs[2], this->_fchr[3]); // can't have jumpded into next char's section
+		assert_leq(arrs[3], this->_fchr[4]); // can't have jumpded into next char's section
+#endif
+		return;
+	}
 	const TIndexOffU *ac = reinterpret_cast<const TIndexOffU*>(side - 2*OFF_SIZE);
 	const TIndexOffU *gt = reinterpret_cast<const TIndexOffU*>(side + this->_eh._sideSz - 2*OFF_SIZE);
 #ifndef NDEBUG
@@ -2275,6 +2756,7 @@ inline void Ebwt<TStr>::countFwSideEx(const SideLocus& l, TIndexOffU* arrs) cons
  */
 template<typename TStr>
 inline TIndexOffU Ebwt<TStr>::countBwSide(const SideLocus& l, int c) const {
+	assert(!this->_eh._interleaved);
 	assert_lt(c, 4);
 	assert_geq(c, 0);
 	assert_lt(l._by, (int)this->_eh._sideBwtSz);
@@ -2324,6 +2806,7 @@ inline TIndexOffU Ebwt<TStr>::countBwSide(const SideLocus& l, int c) const {
  */
 template<typename TStr>
 inline void Ebwt<TStr>::countBwSideEx(const SideLocus& l, TIndexOffU* arrs) const {
+	assert(!this->_eh._interleaved);
 	assert_lt(l._by, (int)this->_eh._sideBwtSz);
 	assert_geq(l._by, 0);
 	assert_lt(l._bp, 4);
@@ -2567,6 +3050,48 @@ inline int Ebwt<TStr>::mapLF1(TIndexOffU& row, const SideLocus& l
 	return c;
 }
 
+/**
+ * Given n independent ranges (tops[i], bots[i]) and a character cs[i]
+ * for each, replace each range with the range obtained by LF-mapping
+ * its top and bot on cs[i].  Ranges that are already empty are left
+ * alone.  All n side loci are computed (and their sides prefetched)
+ * before any of them is resolved, so that the cache misses for the
+ * whole batch are outstanding at once instead of one at a time.
+ * ltops and lbots are caller-supplied scratch arrays of length n.
+ */
+template<typename TStr>
+inline void Ebwt<TStr>::mapLFBatch(size_t n,
+                                   TIndexOffU *tops,
+                                   TIndexOffU *bots,
+                                   const int *cs,
+                                   SideLocus *ltops,
+                                   SideLocus *lbots) const
+{
+	// Pass 1: compute side loci; this issues the prefetches
+	for(size_t i = 0; i < n; i++) {
+		if(bots[i] <= tops[i]) continue;
+		SideLocus::initFromTopBot(tops[i], bots[i], this->_eh, this->_ebwt, ltops[i], lbots[i]);
+#ifndef NO_PREFETCH
+		// The occ[] counts for a forward side of a non-interleaved
+		// index are split with the preceding backward side; fetch the
+		// tail of that side too
+		if(ltops[i]._fw && !this->_eh._interleaved) {
+			__builtin_prefetch((const void *)(ltops[i].side(this->_ebwt) - 1), 0, PREFETCH_LOCALITY);
+		}
+		if(lbots[i]._sideByteOff != ltops[i]._sideByteOff && lbots[i]._fw && !this->_eh._interleaved) {
+			__builtin_prefetch((const void *)(lbots[i].side(this->_ebwt) - 1), 0, PREFETCH_LOCALITY);
+		}
+#endif
+	}
+	// Pass 2: resolve
+	for(size_t i = 0; i < n; i++) {
+		if(bots[i] <= tops[i]) continue;
+		assert_range(0, 3, cs[i]);
+		tops[i] = mapLF(ltops[i], cs[i]);
+		bots[i] = mapLF(lbots[i], cs[i]);
+	}
+}
+
 /**
  * Take an offset into the joined text and translate it into the
  * reference of the index it falls on, the offset into the reference,
@@ -2706,44 +3231,21 @@ inline bool Ebwt<TStr>::report(const String<Dna5>& query,
 #include "row_chaser.h"
 
 /**
- * Report a result.  Involves walking backwards along the original
- * string by way of the LF-mapping until we reach a marked SA row or
- * the row corresponding to the 0th suffix.  A marked row's offset
- * into the original string can be read directly from the this->_offs[]
- * array.
+ * Return the offset into the joined reference of the suffix in row i.
+ * Involves walking backwards along the original string by way of the
+ * LF-mapping until we reach a marked SA row or the row corresponding
+ * to the 0th suffix.  A marked row's offset into the original string
+ * can be read directly from the this->_offs[] array.  'l', if given,
+ * is a pre-calculated (and prefetched) locus for row i.
  */
 template<typename TStr>
-inline bool Ebwt<TStr>::reportChaseOne(const String<Dna5>& query,
-                                       String<char>* quals,
-                                       String<char>* name,
-                                       bool color,
-                                       char primer,
-                                       char trimc,
-                                       bool colExEnds,
-                                       int snpPhred,
-                                       const BitPairReference* ref,
-                                       const std::vector<TIndexOffU>& mmui32,
-                                       const std::vector<uint8_t>& refcs,
-                                       size_t numMms,
-                                       TIndexOffU i,
-                                       TIndexOffU top,
-                                       TIndexOffU bot,
-                                       uint32_t qlen,
-                                       int stratum,
-                                       uint16_t cost,
-                                       uint32_t patid,
-                                       uint32_t seed,
-                                       const EbwtSearchParams<TStr>& params,
-                                       SideLocus *l) const
-{
-	VMSG_NL("In reportChaseOne");
+inline TIndexOffU Ebwt<TStr>::chaseRow(TIndexOffU i, SideLocus *l) const {
 	TIndexOffU off;
 	uint32_t jumps = 0;
-	ASSERT_ONLY(uint32_t origi = i);
+	ASSERT_ONLY(TIndexOffU origi = i);
 	SideLocus myl;
 	const TIndexOffU offMask = this->_eh._offMask;
 	const uint32_t offRate = this->_eh._offRate;
-	const TIndexOffU* offs = this->_offs;
 	// If the caller didn't give us a pre-calculated (and prefetched)
 	// locus, then we have to do that now
 	if(l == NULL) {
@@ -2753,7 +3255,8 @@ inline bool Ebwt<TStr>::reportChaseOne(const String<Dna5>& query,
 	assert(l != NULL);
 	assert(l->valid());
 	// Walk along until we reach the next marked row to the left
-	while(((i & offMask) != i) && i != _zOff) {
+	TIndexOffU hotOff = OFF_MASK;
+	while(((i & offMask) != i) && i != _zOff && !_hotOffs.lookup(i, hotOff)) {
 		// Not a marked row; walk left one more char
 		TIndexOffU newi = mapLF(*l); // calc next row
 		assert_neq(newi, i);
@@ -2767,20 +3270,55 @@ inline bool Ebwt<TStr>::reportChaseOne(const String<Dna5>& query,
 		// lexicographically smallest suffix, which is implicitly
 		// marked 0
 		off = jumps;
-		VMSG_NL("reportChaseOne found zoff off=" << off << " (jumps=" << jumps << ")");
+		VMSG_NL("chaseRow found zoff off=" << off << " (jumps=" << jumps << ")");
+	} else if(hotOff != OFF_MASK) {
+		// Row marked by the second-level sample
+		off = hotOff + jumps;
+		VMSG_NL("chaseRow found hot off=" << off << " (jumps=" << jumps << ")");
 	} else {
 		// Normal marked row, calculate offset of row i
-		off = offs[i >> offRate] + jumps;
-		VMSG_NL("reportChaseOne found off=" << off << " (jumps=" << jumps << ")");
+		off = offAt(i >> offRate) + jumps;
+		VMSG_NL("chaseRow found off=" << off << " (jumps=" << jumps << ")");
 	}
 #ifndef NDEBUG
 	{
-		uint32_t rcoff = RowChaser<TStr>::toFlatRefOff(this, qlen, origi);
+		TIndexOffU rcoff = RowChaser<TStr>::toFlatRefOff(this, 1, origi);
 		assert_eq(rcoff, off);
 	}
 #endif
+	return off;
+}
+
+/**
+ * Report a result, resolving the offset of row i with chaseRow().
+ */
+template<typename TStr>
+inline bool Ebwt<TStr>::reportChaseOne(const String<Dna5>& query,
+                                       String<char>* quals,
+                                       String<char>* name,
+                                       bool color,
+                                       char primer,
+                                       char trimc,
+                                       bool colExEnds,
+                                       int snpPhred,
+                                       const BitPairReference* ref,
+                                       const std::vector<TIndexOffU>& mmui32,
+                                       const std::vector<uint8_t>& refcs,
+                                       size_t numMms,
+                                       TIndexOffU i,
+                                       TIndexOffU top,
+                                       TIndexOffU bot,
+                                       uint32_t qlen,
+                                       int stratum,
+                                       uint16_t cost,
+                                       uint32_t patid,
+                                       uint32_t seed,
+                                       const EbwtSearchParams<TStr>& params,
+                                       SideLocus *l) const
+{
+	VMSG_NL("In reportChaseOne");
 	return report(query, quals, name, color, primer, trimc, colExEnds,
-	              snpPhred, ref, mmui32, refcs, numMms, off, top, bot,
+	              snpPhred, ref, mmui32, refcs, numMms, chaseRow(i, l), top, bot,
 	              qlen, stratum, cost, patid, seed, params);
 }
 
@@ -2815,7 +3353,6 @@ inline bool Ebwt<TStr>::reportReconstruct(const String<Dna5>& query,
 	SideLocus myl;
 	const TIndexOffU offMask = this->_eh._offMask;
 	const TIndexOffU offRate = this->_eh._offRate;
-	const TIndexOffU* offs = this->_offs;
 	const TIndexOffU* isa = this->_isa;
 	assert(isa != NULL);
 	if(l == NULL) {
@@ -2849,7 +3386,7 @@ inline bool Ebwt<TStr>::reportReconstruct(const String<Dna5>& query,
 		VMSG_NL("reportChaseOne found zoff off=" << off << " (jumps=" << jumps << ")");
 	} else {
 		// Normal marked row, calculate offset of row i
-		off = offs[i >> offRate] + jumps;
+		off = offAt(i >> offRate) + jumps;
 		VMSG_NL("reportChaseOne found off=" << off << " (jumps=" << jumps << ")");
 	}
 	// 'off' now holds the text offset of the first (leftmost) position
@@ -3103,13 +3640,15 @@ void Ebwt<TStr>::readIntoMemory(
 					cerr << "Error: Could not memory-map the index file " << names[i] << endl;
 					throw 1;
 				}
+				if(_hugePages != HUGEPAGES_NONE) {
+					// Only takes effect where the filesystem supports
+					// huge pages in its page cache
+					adviseHugeMem(mmFile[i], sbuf.st_size);
+				}
 				if(mmSweep) {
-					int sum = 0;
-					for(off_t j = 0; j < sbuf.st_size; j += 1024) {
-						sum += (int) mmFile[i][j];
-					}
+					int sum = (int)parallelSweep(mmFile[i], sbuf.st_size, names[i], _verbose || startVerbose);
 					if(startVerbose) {
-						cerr << "  Swept the memory-mapped ebwt index file 1; checksum: " << sum << ": ";
+						cerr << "  Swept the memory-mapped ebwt index file " << (i+1) << "; checksum: " << sum << ": ";
 						logTime(cerr);
 					}
 				}
@@ -3205,17 +3744,18 @@ void Ebwt<TStr>::readIntoMemory(
 			throw 1;
 		}
 	} else entireRev = true;
+	bool interleaved = (flags < 0 && (((-flags) & EBWT_INTERLEAVED) != 0));
 	bytesRead += 4;
 
 	// Create a new EbwtParams from the entries read from primary stream
 	EbwtParams *eh;
 	bool deleteEh = false;
 	if(params != NULL) {
-		params->init(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, color, entireRev);
+		params->init(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, color, entireRev, interleaved);
 		if(_verbose || startVerbose) params->print(cerr);
 		eh = params;
 	} else {
-		eh = new EbwtParams(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, color, entireRev);
+		eh = new EbwtParams(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, color, entireRev, interleaved);
 		deleteEh = true;
 	}
 
@@ -3224,6 +3764,7 @@ void Ebwt<TStr>::readIntoMemory(
 	uint64_t offsSz = eh->_offsSz;
 	TIndexOffU offRateDiff = 0;
 	TIndexOffU offsLenSampled = offsLen;
+	TIndexOffU offsWords = offsLen;
 	if(_overrideOffRate > offRate) {
 		offRateDiff = _overrideOffRate - offRate;
 	}
@@ -3359,7 +3900,7 @@ void Ebwt<TStr>::readIntoMemory(
 			}
 		} else {
 			try {
-				this->_ebwt = new uint8_t[eh->_ebwtTotLen];
+				this->_ebwt = allocBig<uint8_t>(eh->_ebwtTotLen, _ebwtMapLen, "ebwt[]", _verbose || startVerbose);
 			} catch(bad_alloc& e) {
 				cerr << "Out of memory allocating the ebwt[] array for the Bowtie index.  Please try" << endl
 				     << "again on a computer with more memory." << endl;
@@ -3368,29 +3909,27 @@ void Ebwt<TStr>::readIntoMemory(
 		}
 		if(shmemLeader) {
 			// Read ebwt from primary stream
-			uint64_t bytesLeft = eh->_ebwtTotLen;
-			char *pebwt = (char*)this->ebwt();
-
-			while (bytesLeft>0){
-				size_t r = MM_READ(_in1, (void *)pebwt, bytesLeft);
-				if(MM_IS_IO_ERR(_in1,r,bytesLeft)) {
-					cerr << "Error reading ebwt array: returned " << r << ", length was " << (eh->_ebwtTotLen) << endl
-					     << "Your index files may be corrupt; please try re-building or re-downloading." << endl
-					     << "A complete index consists of 6 files: XYZ.1.ebwt, XYZ.2.ebwt, XYZ.3.ebwt," << endl
-					     << "XYZ.4.ebwt, XYZ.rev.1.ebwt, and XYZ.rev.2.ebwt.  The XYZ.1.ebwt and " << endl
-					     << "XYZ.rev.1.ebwt files should have the same size, as should the XYZ.2.ebwt and" << endl
-					     << "XYZ.rev.2.ebwt files." << endl;
-					throw 1;
-				}
-				pebwt += r;
-				bytesLeft -= r;
+			if(!parallelRead(_in1, _in1Str.c_str(), this->_ebwt, eh->_ebwtTotLen,
+			                 "ebwt[]", _verbose || startVerbose))
+			{
+				cerr << "Error reading ebwt array of length " << (eh->_ebwtTotLen) << endl
+				     << "Your index files may be corrupt; please try re-building or re-downloading." << endl
+				     << "A complete index consists of 6 files: XYZ.1.ebwt, XYZ.2.ebwt, XYZ.3.ebwt," << endl
+				     << "XYZ.4.ebwt, XYZ.rev.1.ebwt, and XYZ.rev.2.ebwt.  The XYZ.1.ebwt and " << endl
+				     << "XYZ.rev.1.ebwt files should have the same size, as should the XYZ.2.ebwt and" << endl
+				     << "XYZ.rev.2.ebwt files." << endl;
+				throw 1;
 			}
 			if(switchEndian) {
 				uint8_t *side = this->_ebwt;
 				for(size_t i = 0; i < eh->_numSides; i++) {
-					TIndexOffU *cums = reinterpret_cast<TIndexOffU*>(side + eh->_sideSz - 2*OFF_SIZE);
+					TIndexOffU *cums = reinterpret_cast<TIndexOffU*>(side + eh->_sideBwtSz);
 					cums[0] = endianSwapU(cums[0]);
 					cums[1] = endianSwapU(cums[1]);
+					if(eh->_interleaved) {
+						cums[2] = endianSwapU(cums[2]);
+						cums[3] = endianSwapU(cums[3]);
+					}
 					side += this->_eh._sideSz;
 				}
 			}
@@ -3437,14 +3976,15 @@ void Ebwt<TStr>::readIntoMemory(
 			fseeko(_in1, eh->_ftabLen*OFF_SIZE, SEEK_CUR);
 #endif
 		} else {
-			this->_ftab = new TIndexOffU[eh->_ftabLen];
+			this->_ftab = allocBig<TIndexOffU>(eh->_ftabLen, _ftabMapLen, "ftab[]", _verbose || startVerbose);
 			if(switchEndian) {
 				for(TIndexOffU i = 0; i < eh->_ftabLen; i++)
 					this->_ftab[i] = readU<TIndexOffU>(_in1, switchEndian);
 			} else {
-				size_t r = MM_READ(_in1, (void *)this->_ftab, eh->_ftabLen*OFF_SIZE);
-				if(r != (size_t)(eh->_ftabLen*OFF_SIZE)) {
-					cerr << "Error reading _ftab[] array: " << r << ", " << (eh->_ftabLen*OFF_SIZE) << endl;
+				if(!parallelRead(_in1, _in1Str.c_str(), this->_ftab, eh->_ftabLen*OFF_SIZE,
+				                 "ftab[]", _verbose || startVerbose))
+				{
+					cerr << "Error reading _ftab[] array: " << (eh->_ftabLen*OFF_SIZE) << endl;
 					throw 1;
 				}
 			}
@@ -3486,15 +4026,20 @@ void Ebwt<TStr>::readIntoMemory(
 		throw 1;
 	}
 
-	// Read reference sequence names from primary index file (or not,
-	// if --refidx is specified)
-	if(loadNames) {
+	// Read reference sequence names from primary index file (or just
+	// skip them, if --refidx is specified)
+	{
+		bool namesEnded = false;
 		while(true) {
 			char c = '\0';
 			if(MM_READ(_in1, (void *)(&c), (size_t)1) != (size_t)1) break;
 			bytesRead++;
-			if(c == '\0') break;
-			else if(c == '\n') {
+			if(c == '\0') {
+				namesEnded = true;
+				break;
+			}
+			if(!loadNames) continue;
+			if(c == '\n') {
 				this->_refnames.push_back("");
 			} else {
 				if(this->_refnames.size() == 0) {
@@ -3503,6 +4048,15 @@ void Ebwt<TStr>::readIntoMemory(
 				this->_refnames.back().push_back(c);
 			}
 		}
+		// Checksum, if the index was built with one
+		uint64_t cktag[2];
+		if(namesEnded && fread(cktag, 1, sizeof(cktag), _in1) == sizeof(cktag)) {
+			if(switchEndian) {
+				cktag[0] = endianSwapU64(cktag[0]);
+				cktag[1] = endianSwapU64(cktag[1]);
+			}
+			if(cktag[0] == EBWT_CHECKSUM_TAG) _checksum = cktag[1];
+		}
 	}
 
 	bytesRead = 4; // reset for secondary index file (already read 1-sentinel)
@@ -3512,11 +4066,28 @@ void Ebwt<TStr>::readIntoMemory(
 		cerr << "Reading offs (" << offsLenSampled << " 32-bit words): ";
 		logTime(cerr);
 	}
+	// offs[] words to allocate; fewer than offsLenSampled if packed
+	offsWords = offsLenSampled;
+	this->_offBits = 0;
+#ifdef BOWTIE_PACKED_OFFS
+	if(!_useMm) {
+		// Offsets range over [0, len]
+		int bits = 1;
+		while(bits < (int)(OFF_SIZE*8) && (len >> bits) != 0) bits++;
+		if(bits < (int)(OFF_SIZE*8)) {
+			this->_offBits = bits;
+			offsWords = (TIndexOffU)packed_words<TIndexOffU>(offsLenSampled, bits);
+			if(_verbose || startVerbose) {
+				cerr << "  packing offs into " << bits << "-bit entries (" << offsWords << " words)" << endl;
+			}
+		}
+	}
+#endif
 	if(!_useMm) {
 		if(!useShmem_) {
 			// Allocate offs_
 			try {
-				this->_offs = new TIndexOffU[offsLenSampled];
+				this->_offs = allocBig<TIndexOffU>(offsWords, _offsMapLen, "offs[]", _verbose || startVerbose);
 			} catch(bad_alloc& e) {
 				cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
 					 << "Please try again on a computer with more memory." << endl;
@@ -3524,7 +4095,7 @@ void Ebwt<TStr>::readIntoMemory(
 			}
 		} else {
 			shmemLeader = ALLOC_SHARED_U(
-				(_in2Str + "[offs]"), offsLenSampled*OFF_SIZE, &this->_offs,
+				(_in2Str + "[offs]"), offsWords*OFF_SIZE, &this->_offs,
 				"offs", (_verbose || startVerbose));
 		}
 	}
@@ -3532,7 +4103,7 @@ void Ebwt<TStr>::readIntoMemory(
 	if(_overrideOffRate < 32) {
 		if(shmemLeader) {
 			// Allocate offs (big allocation)
-			if(switchEndian || offRateDiff > 0) {
+			if(switchEndian || offRateDiff > 0 || this->_offBits > 0) {
 				assert(!_useMm);
 				const TIndexOffU blockMaxSz = (2 * 1024 * 1024); // 2 MB block size
 				const TIndexOffU blockMaxSzU = (blockMaxSz >> (OFF_SIZE/4 +1)); // # U32s per block
@@ -3552,9 +4123,14 @@ void Ebwt<TStr>::readIntoMemory(
 					TIndexOffU idx = i >> offRateDiff;
 					for(TIndexOffU j = 0; j < block; j += (1 << offRateDiff)) {
 						assert_lt(idx, offsLenSampled);
-						this->_offs[idx] = ((TIndexOffU*)buf)[j];
+						TIndexOffU off = ((TIndexOffU*)buf)[j];
 						if(switchEndian) {
-							this->_offs[idx] = endianSwapU(this->_offs[idx]);
+							off = endianSwapU(off);
+						}
+						if(this->_offBits > 0) {
+							pack_bits<TIndexOffU>(this->_offs, idx, this->_offBits, off);
+						} else {
+							this->_offs[idx] = off;
 						}
 						idx++;
 					}
@@ -3570,22 +4146,13 @@ void Ebwt<TStr>::readIntoMemory(
 					fseeko(_in2, offsSz, SEEK_CUR);
 #endif
 				} else {
-					// If any of the high two bits are set
-					// Workaround for small-index mode where MM_READ may
-					// not be able to handle read amounts greater than 2^32
-					// bytes.
-					uint64_t bytesLeft = offsSz;
-					char *offs = (char *)this->offs();
-
-					while(bytesLeft > 0) {
-						size_t r = MM_READ(_in2, (void*)offs, bytesLeft);
-						if(MM_IS_IO_ERR(_in2,r,bytesLeft)) {
-							cerr << "Error reading block of _offs[] array: "
-							     << r << ", " << bytesLeft << gLastIOErrMsg << endl;
-							throw 1;
-						}
-						offs += r;
-						bytesLeft -= r;
+					// parallelRead() reads in pieces, so offs[] may
+					// exceed 2^32 bytes even in small-index mode
+					if(!parallelRead(_in2, _in2Str.c_str(), this->_offs, offsSz,
+					                 "offs[]", _verbose || startVerbose))
+					{
+						cerr << "Error reading _offs[] array: " << offsSz << endl;
+						throw 1;
 					}
 				}
 			}
@@ -3593,17 +4160,17 @@ void Ebwt<TStr>::readIntoMemory(
 			{
 				ASSERT_ONLY(Bitset offsSeen(len+1));
 				for(TIndexOffU i = 0; i < offsLenSampled; i++) {
-					assert(!offsSeen.test(this->_offs[i]));
-					ASSERT_ONLY(offsSeen.set(this->_offs[i]));
-					assert_leq(this->_offs[i], len);
+					assert(!offsSeen.test(this->offAt(i)));
+					ASSERT_ONLY(offsSeen.set(this->offAt(i)));
+					assert_leq(this->offAt(i), len);
 				}
 			}
 
-			if(useShmem_) NOTIFY_SHARED(this->_offs, offsLenSampled*OFF_SIZE);
+			if(useShmem_) NOTIFY_SHARED(this->_offs, offsWords*OFF_SIZE);
 		} else {
 			// Not the shmem leader
 			fseeko(_in2, offsLenSampled*OFF_SIZE, SEEK_CUR);
-			if(useShmem_) WAIT_SHARED(this->_offs, offsLenSampled*OFF_SIZE);
+			if(useShmem_) WAIT_SHARED(this->_offs, offsWords*OFF_SIZE);
 		}
 	}
 
@@ -3646,9 +4213,10 @@ void Ebwt<TStr>::readIntoMemory(
 			fseeko(_in2, (isaLen << 2), SEEK_CUR);
 #endif
 		} else {
-			size_t r = MM_READ(_in2, (void *)this->_isa, isaLen*OFF_SIZE);
-			if(r != (size_t)(isaLen*OFF_SIZE)) {
-				cerr << "Error reading _isa[] array: " << r << ", " << (isaLen*OFF_SIZE) << endl;
+			if(!parallelRead(_in2, _in2Str.c_str(), this->_isa, isaLen*OFF_SIZE,
+			                 "isa[]", _verbose || startVerbose))
+			{
+				cerr << "Error reading _isa[] array: " << (isaLen*OFF_SIZE) << endl;
 				throw 1;
 			}
 		}
@@ -3707,13 +4275,15 @@ readEbwtRefnames(FILE* fin, vector<string>& refnames) {
 	int32_t flags = readI<int32_t>(fin, switchEndian);
 	bool color = false;
 	bool entireReverse = false;
+	bool interleaved = false;
 	if(flags < 0) {
 		color = (((-flags) & EBWT_COLOR) != 0);
 		entireReverse = (((-flags) & EBWT_ENTIRE_REV) != 0);
+		interleaved = (((-flags) & EBWT_INTERLEAVED) != 0);
 	}
 
 	// Create a new EbwtParams from the entries read from primary stream
-	EbwtParams eh(len, lineRate, linesPerSide, offRate, -1, ftabChars, color, entireReverse);
+	EbwtParams eh(len, lineRate, linesPerSide, offRate, -1, ftabChars, color, entireReverse, interleaved);
 
 	TIndexOffU nPat = readI<TIndexOffU>(fin, switchEndian); // nPat
 	fseeko(fin, nPat*OFF_SIZE, SEEK_CUR);
@@ -3868,6 +4438,7 @@ void Ebwt<TStr>::writeFromMemory(bool justHeader,
 	int32_t flags = 1;
 	if(eh._color) flags |= EBWT_COLOR;
 	if(eh._entireReverse) flags |= EBWT_ENTIRE_REV;
+	if(eh._interleaved) flags |= EBWT_INTERLEAVED;
 	writeI<int32_t>(out1, -flags, be); // BTL: chunkRate is now deprecated
 
 	if(!justHeader) {
@@ -3892,7 +4463,7 @@ void Ebwt<TStr>::writeFromMemory(bool justHeader,
 		writeU<TIndexOffU>(out1, this->zOff(), be);
 		TIndexOffU offsLen = eh._offsLen;
 		for(TIndexOffU i = 0; i < offsLen; i++)
-			writeU<TIndexOffU>(out2, this->_offs[i], be);
+			writeU<TIndexOffU>(out2, this->offAt(i), be);
 		uint32_t isaLen = eh._isaLen;
 		for(TIndexOffU i = 0; i < isaLen; i++)
 			writeU<TIndexOffU>(out2, this->_isa[i], be);
@@ -3966,7 +4537,7 @@ void Ebwt<TStr>::writeFromMemory(bool justHeader,
 		for(TIndexOffU i = 0; i < eh._eftabLen; i++)
 			assert_eq(this->eftab()[i], copy.eftab()[i]);
 		for(TIndexOffU i = 0; i < eh._offsLen; i++)
-			assert_eq(this->_offs[i], copy.offs()[i]);
+			assert_eq(this->offAt(i), copy.offAt(i));
 		for(TIndexOffU i = 0; i < eh._isaLen; i++)
 			assert_eq(this->_isa[i], copy.isa()[i]);
 		for(TIndexOffU i = 0; i < eh._ebwtTotLen; i++)
@@ -4080,10 +4651,25 @@ void Ebwt<TStr>::joinToDisk(
 {
 	RandomSource rand; // reproducible given same seed
 	rand.init(seed);
-	RefReadInParams rpcp = refparams;
 	assert_gt(szs.size(), 0);
 	assert_gt(l.size(), 0);
 	assert_gt(sztot, 0);
+	lensToDisk(szs, plens, out1);
+	joinRefs(l, szs, plens, refparams, ret, _refnames);
+}
+
+/**
+ * Count the sequences and fragments in szs and write their number and
+ * the sequence lengths to 'out1'.  This is the part of joinToDisk that
+ * doesn't need the reference itself.
+ */
+template<typename TStr>
+void Ebwt<TStr>::lensToDisk(
+	const vector<RefRecord>& szs,
+	const vector<uint32_t>& plens,
+	ostream& out1)
+{
+	assert_gt(szs.size(), 0);
 	// Not every fragment represents a distinct sequence - many
 	// fragments may correspond to a single sequence.  Count the
 	// number of sequences here by counting the number of "first"
@@ -4124,6 +4710,25 @@ void Ebwt<TStr>::joinToDisk(
 	}
 	// Write the number of fragments
 	writeU<TIndexOffU>(out1, this->_nFrag, this->toBe());
+}
+
+/**
+ * Read the reference sequences from the input streams, appending each
+ * unambiguous stretch to 'ret' and each sequence name to 'names'.
+ * Sequences without a name are named after their index.  Rewinds each
+ * input stream before returning.
+ */
+template<typename TStr>
+void Ebwt<TStr>::joinRefs(
+	vector<FileBuf*>& l,
+	const vector<RefRecord>& szs,
+	const vector<uint32_t>& plens,
+	const RefReadInParams& refparams,
+	TStr& ret,
+	vector<string>& names)
+{
+	RefReadInParams rpcp = refparams;
+	assert_gt(l.size(), 0);
 	TIndexOffU seqsRead = 0;
 	ASSERT_ONLY(TIndexOffU szsi = 0);
 	ASSERT_ONLY(TIndexOffU entsWritten = 0);
@@ -4137,25 +4742,25 @@ void Ebwt<TStr>::joinToDisk(
 		while(!l[i]->eof()) {
 			string name;
 			// Push a new name onto our vector
-			_refnames.push_back("");
+			names.push_back("");
 			//uint32_t oldRetLen = length(ret);
-			RefRecord rec = fastaRefReadAppend(*l[i], first, ret, rpcp, &_refnames.back());
+			RefRecord rec = fastaRefReadAppend(*l[i], first, ret, rpcp, &names.back());
 #ifndef ACCOUNT_FOR_ALL_GAP_REFS
 			if(rec.first && rec.len == 0) rec.first = false;
 #endif
 			first = false;
 			if(rec.first) {
-				if(_refnames.back().length() == 0) {
+				if(names.back().length() == 0) {
 					// If name was empty, replace with an index
 					ostringstream stm;
-					stm << (_refnames.size()-1);
-					_refnames.back() = stm.str();
+					stm << (names.size()-1);
+					names.back() = stm.str();
 				}
 			} else {
 				// This record didn't actually start a new sequence so
 				// no need to add a name
-				//assert_eq(0, _refnames.back().length());
-				_refnames.pop_back();
+				//assert_eq(0, names.back().length());
+				names.pop_back();
 			}
 			assert_lt(szsi, szs.size());
 			assert(szs[szsi].first == 0 || szs[szsi].first == 1);
@@ -4169,11 +4774,11 @@ void Ebwt<TStr>::joinToDisk(
 #ifdef ACCOUNT_FOR_ALL_GAP_REFS
 			if(rec.len == 0) continue;
 			if(rec.first && rec.len > 0) seqsRead++;
-			assert_leq(rec.len, this->_plen[seqsRead-1]);
+			assert_leq(rec.len, plens[seqsRead-1]);
 #else
 			if(rec.first) seqsRead++;
 			if(rec.len == 0) continue;
-			assert_leq(rec.len, this->_plen[seqsRead-1]);
+			assert_leq(rec.len, plens[seqsRead-1]);
 #endif
 			// Reset the patoff if this is the first fragment
 			if(rec.first) patoff = 0;
@@ -4198,7 +4803,13 @@ void Ebwt<TStr>::joinToDisk(
 		assert(!l[i]->eof());
 		#endif
 	}
-	assert_eq(entsWritten, this->_nFrag);
+#ifndef NDEBUG
+	TIndexOffU nFrag = 0;
+	for(size_t i = 0; i < szs.size(); i++) {
+		if(szs[i].len > 0) nFrag++;
+	}
+	assert_eq(entsWritten, nFrag);
+#endif
 }
 
 
@@ -4253,12 +4864,34 @@ void Ebwt<TStr>::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 	TIndexOffU occ[4] = {0, 0, 0, 0};
 	// Save 'G' and 'T' occurrences between backward and forward buckets
 	TIndexOffU occSave[2] = {0, 0};
+	// Save all four occurrences as of the start of the current side;
+	// used only for the interleaved layout
+	TIndexOffU occSide[4] = {0, 0, 0, 0};
 
 	// Record rows that should "absorb" adjacent rows in the ftab.
 	// The absorbed rows represent suffixes shorter than the ftabChars
 	// cutoff.
 	uint8_t absorbCnt = 0;
 	uint8_t *absorbFtab;
+
+	// Ranges for the optional k-mer table.  Suffixes sharing a k-mer
+	// prefix occupy consecutive rows, so each range is closed when the
+	// prefix changes or a suffix shorter than k intervenes.
+	// k-mer ranges for the .5.ebwt table, spilled to disk as they close
+	KmerTableBuilder *kmerb = NULL;
+	uint32_t kmerCode = 0;
+	TIndexOffU kmerTop = 0;
+	bool kmerOpen = false;
+	if(_kmerChars > 0) {
+		kmerb = new KmerTableBuilder(_kmerChars, _in5Str);
+	}
+
+	// Optional second-level SA sample over repetitive rows
+	HotOffsBuilder *hotb = NULL;
+	if(_offRate2 >= 0) {
+		assert_lt(_offRate2, eh._offRate);
+		hotb = new HotOffsBuilder(eh._offRate, _offRate2, _hotMinOcc, len);
+	}
 	try {
 		VMSG_NL("Allocating ftab, absorbFtab");
 		ftab = new TIndexOffU[ftabLen];
@@ -4319,13 +4952,14 @@ void Ebwt<TStr>::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 	// Points to a byte offset from 'side' within ebwt[] where next
 	// char should be written
 #ifdef SIXTY4_FORMAT
-	TIndexOff sideCur = (eh._sideBwtSz >> 3) - 1;
+	TIndexOff sideCur = eh._interleaved ? 0 : (eh._sideBwtSz >> 3) - 1;
 #else
-	TIndexOff sideCur = eh._sideBwtSz - 1;
+	TIndexOff sideCur = eh._interleaved ? 0 : eh._sideBwtSz - 1;
 #endif
 
-	// Whether we're assembling a forward or a reverse bucket
-	bool fw = false;
+	// Whether we're assembling a forward or a reverse bucket; in the
+	// interleaved layout, every bucket is a forward bucket
+	bool fw = eh._interleaved;
 
 	// Did we just finish writing a forward bucket?  (Must be true when
 	// we exit the loop.)
@@ -4342,6 +4976,7 @@ void Ebwt<TStr>::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 	// Iterate over packed bwt bytes
 	VMSG_NL("Entering Ebwt loop");
 	ASSERT_ONLY(TIndexOffU beforeEbwtOff = (uint32_t)out1.tellp());
+	uint64_t checksum = EBWT_CHECKSUM_TAG; // over the sides as written
 	while(side < ebwtTotSz) {
 		ASSERT_ONLY(wroteFwBucket = false);
 		// Sanity-check our cursor into the side buffer
@@ -4419,6 +5054,38 @@ void Ebwt<TStr>::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 					assert_lt(absorbCnt, 255);
 					absorbCnt++;
 				}
+				// Update k-mer table
+				if(kmerb != NULL) {
+					if((len-saElt) >= (TIndexOffU)_kmerChars) {
+						uint32_t code = 0;
+						for(int i = 0; i < _kmerChars; i++) {
+							code = (code << 2) | (unsigned char)(Dna)(s[saElt+i]);
+						}
+						if(!kmerOpen || code != kmerCode) {
+							if(kmerOpen) {
+								assert_gt(code, kmerCode);
+								kmerb->add(kmerCode, kmerTop, si);
+							}
+							kmerCode = code;
+							kmerTop = si;
+							kmerOpen = true;
+						}
+					} else if(kmerOpen) {
+						kmerb->add(kmerCode, kmerTop, si);
+						kmerOpen = false;
+					}
+				}
+				// Update second-level SA sample
+				if(hotb != NULL) {
+					bool hasKmer = (len-saElt) >= (TIndexOffU)HOT_OFFS_KMER;
+					uint64_t code = 0;
+					if(hasKmer) {
+						for(int i = 0; i < HOT_OFFS_KMER; i++) {
+							code = (code << 2) | (unsigned char)(Dna)(s[saElt+i]);
+						}
+					}
+					hotb->add(si, saElt, hasKmer, code);
+				}
 				// Suffix array offset boundary? - update offset array
 				if((si & eh._offMask) == si) {
 					assert_lt((si >> eh._offRate), eh._offsLen);
@@ -4479,13 +5146,30 @@ void Ebwt<TStr>::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 		{
 			// Forward side boundary
 			assert_eq(0, si % eh._sideBwtLen);
+			assert(fw);
+			ASSERT_ONLY(wroteFwBucket = true);
+			if(eh._interleaved) {
+				// Write all four counts as of the start of this side,
+				// then start the next (also forward) side
+				sideCur = 0;
+				TIndexOffU *u32side = reinterpret_cast<TIndexOffU*>(ebwtSide);
+				side += sideSz;
+				assert_leq(side, eh._ebwtTotSz);
+				for(int i = 0; i < 4; i++) {
+					u32side[(sideSz / OFF_SIZE) - 4 + i] = endianizeU<TIndexOffU>(occSide[i], this->toBe());
+					occSide[i] = occ[i];
+				}
+				// Write forward side to primary file
+				out1.write((const char *)ebwtSide, sideSz);
+				checksum = ebwtChecksum(checksum, ebwtSide, sideSz);
+				continue;
+			}
 #ifdef SIXTY4_FORMAT
 			sideCur = (eh._sideBwtSz >> 3) - 1;
 #else
 			sideCur = eh._sideBwtSz - 1;
 #endif
-			assert(fw); fw = false;
-			ASSERT_ONLY(wroteFwBucket = true);
+			fw = false;
 			// Write 'G' and 'T'
 			assert_leq(occSave[0], occ[2]);
 			assert_leq(occSave[1], occ[3]);
@@ -4501,6 +5185,7 @@ void Ebwt<TStr>::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 #endif
 			// Write forward side to primary file
 			out1.write((const char *)ebwtSide, sideSz);
+			checksum = ebwtChecksum(checksum, ebwtSide, sideSz);
 		} else if (sideCur == -1) {
 			// Backward side boundary
 			assert_eq(0, si % eh._sideBwtLen);
@@ -4521,10 +5206,22 @@ void Ebwt<TStr>::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 			occSave[1] = occ[3]; // save 'T' count
 			// Write backward side to primary file
 			out1.write((const char *)ebwtSide, sideSz);
+			checksum = ebwtChecksum(checksum, ebwtSide, sideSz);
 		}
 	}
 	VMSG_NL("Exited Ebwt loop");
 	assert(ftab != NULL);
+	if(kmerOpen) {
+		kmerb->add(kmerCode, kmerTop, len+1);
+	}
+	if(hotb != NULL) {
+		HotOffs ho;
+		hotb->finish(ho);
+		delete hotb;
+		VMSG_NL("Writing " << ho.numHot() << " of " << ho.numBlocks()
+		        << " SA blocks to " << _inOffs2Str);
+		ho.writeToFile(_inOffs2Str, this->toBe());
+	}
 	assert_neq(zOff, OFF_MASK);
 	if(absorbCnt > 0) {
 		// Absorb any trailing, as-yet-unabsorbed short suffixes into
@@ -4564,6 +5261,18 @@ void Ebwt<TStr>::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 	for(int i = 0; i < 5; i++) {
 		writeU<TIndexOffU>(out1, fchr[i], this->toBe());
 	}
+	_checksum = finishChecksum(checksum, zOff, fchr);
+
+	//
+	// Write the k-mer table, tagged with the checksum
+	//
+	if(kmerb != NULL) {
+		VMSG_NL("Writing " << kmerb->size() << " " << _kmerChars << "-mer ranges to " << _in5Str);
+		KmerTable kt;
+		kmerb->finish(kt, len, _checksum);
+		delete kmerb;
+		kt.writeToFile(_in5Str, this->toBe());
+	}
 
 	//
 	// Finish building ftab and build eftab
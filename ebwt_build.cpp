@@ -16,6 +16,9 @@
 #include "ref_read.h"
 #include "filebuf.h"
 #include "reference.h"
+#include "threading.h"
+#include "merged_sa.h"
+#include "external_sa.h"
 
 /**
  * \file Driver for the bowtie-build indexing tool.
@@ -28,17 +31,29 @@ static int format;
 static TIndexOffU bmax;
 static TIndexOffU bmaxMultSqrt;
 static uint32_t bmaxDivN;
+static bool bmaxGiven;
 static int dcv;
 static int noDc;
 static int entireSA;
 static int seed;
 static int showVersion;
 static bool doubleEbwt;
+static int nthreads;
+static uint64_t memBudget;
+static bool concurrent;
+static bool external;
+static int mirrorThreads;
+static string appendBase;
 //   Ebwt parameters
 static int32_t lineRate;
 static int32_t linesPerSide;
 static int32_t offRate;
+static bool offRateGiven;
 static int32_t ftabChars;
+static bool interleaved;
+static int32_t kmerChars;
+static int32_t offRate2;
+static uint32_t hotMinOcc;
 static int  bigEndian;
 static bool nsToAs;
 static bool autoMem;
@@ -57,17 +72,29 @@ static void resetOptions() {
 	bmax         = OFF_MASK; // max blockwise SA bucket size
 	bmaxMultSqrt = OFF_MASK; // same, as multplier of sqrt(n)
 	bmaxDivN     = 4;          // same, as divisor of n
+	bmaxGiven    = false; // user gave --bmax, --bmaxmultsqrt or --bmaxdivn
 	dcv          = 1024;  // bwise SA difference-cover sample sz
 	noDc         = 0;     // disable difference-cover sample
 	entireSA     = 0;     // 1 = disable blockwise SA
 	seed         = 0;     // srandom seed
 	showVersion  = 0;     // just print version and quit?
 	doubleEbwt   = true;  // build forward and reverse Ebwts
+	nthreads     = 1;     // # threads sorting suffix-array blocks
+	memBudget    = 0;     // bytes to fit index construction into; 0 = none
+	concurrent   = false; // build forward and mirror indexes at once
+	external     = false; // sort runs of suffixes on disk and merge them
+	mirrorThreads = 0;    // threads for the mirror index; 0 = half
+	appendBase.clear();   // index whose sequences follow the new ones
 	//   Ebwt parameters
 	lineRate     = Ebwt<String<Dna> >::default_lineRate;  // a "line" is 64 bytes
 	linesPerSide = 1;  // 1 64-byte line on a side
 	offRate      = 5;  // sample 1 out of 32 SA elts
+	offRateGiven = false; // user gave -o/--offrate
 	ftabChars    = 10; // 10 chars in initial lookup table
+	interleaved  = false; // keep occ[] counts split across side pairs
+	kmerChars    = 0;  // no .5.ebwt k-mer table
+	offRate2     = -1; // no .offs2.ebwt hot-region SA sample
+	hotMinOcc    = 8;  // 20-mers occurring 8+ times are hot
 	bigEndian    = 0;  // little endian
 	nsToAs       = false; // convert reference Ns to As prior to indexing
 	autoMem      = true;  // automatically adjust memory usage parameters
@@ -90,7 +117,17 @@ enum {
 	ARG_NTOA,
 	ARG_USAGE,
 	ARG_NEW_REVERSE,
-	ARG_WRAPPER
+	ARG_WRAPPER,
+	ARG_INTERLEAVED,
+	ARG_KMER,
+	ARG_OFFRATE2,
+	ARG_HOT_OCC,
+	ARG_THREADS,
+	ARG_MEM_BUDGET,
+	ARG_CONCURRENT,
+	ARG_MIRROR_THREADS,
+	ARG_APPEND,
+	ARG_EXTERNAL
 };
 
 /**
@@ -122,13 +159,24 @@ static void printUsage(ostream& out) {
 	    //<< "    -B                      build both letter- and colorspace indexes" << endl
 	    << "    --bmax <int>            max bucket sz for blockwise suffix-array builder" << endl
 	    //<< "    --bmaxmultsqrt <int>    max bucket sz as multiple of sqrt(ref len)" << endl
-	    << "    --bmaxdivn <int>        max bucket sz as divisor of ref len (default: 4)" << endl
+	    << "    --bmaxdivn <int>        max bucket sz as divisor of ref len (default: 4 * threads)" << endl
 	    << "    --dcv <int>             diff-cover period for blockwise (default: 1024)" << endl
 	    << "    --nodc                  disable diff-cover (algorithm becomes quadratic)" << endl
+	    << "    --threads <int>         # of threads sorting suffix-array blocks (default: 1)" << endl
+	    << "    --mem-budget <int>      choose -p/--bmax/--dcv to build in <int> bytes (K/M/G ok)" << endl
+	    << "    --concurrent            read ref once, build fw and mirror indexes at same time" << endl
+	    << "    --mirror-threads <int>  # of --threads given to mirror index (default: half)" << endl
+	    << "    --append <ebwt_base>    index <reference_in> followed by refs of existing index" << endl
+	    << "    --external              spill sorted runs to disk and merge them" << endl
 	    << "    -r/--noref              don't build .3/.4.ebwt (packed reference) portion" << endl
 	    << "    -3/--justref            just build .3/.4.ebwt (packed reference) portion" << endl
 	    << "    -o/--offrate <int>      SA is sampled every 2^offRate BWT chars (default: 5)" << endl
+	    << "                            (default: 6 with --offrate2)" << endl
 	    << "    -t/--ftabchars <int>    # of chars consumed in initial lookup (default: 10)" << endl
+	    << "    --interleaved           store all occ[] counts in each side (1 line/LF step w/ -s)" << endl
+	    << "    --kmer <int>            also build .5.ebwt k-mer table of given length (<= 16)" << endl
+	    << "    --offrate2 <int>        also sample repetitive SA rows every 2^<int> rows" << endl
+	    << "    --hot-occ <int>         20-mers occurring <int>+ times are repetitive (default: 8)" << endl
 	    << "    --ntoa                  convert Ns in reference to As" << endl
 	    //<< "    --big --little          endianness (default: little, this host: "
 	    //<< (currentlyBigEndian()? "big":"little") << ")" << endl
@@ -179,6 +227,16 @@ static struct option long_options[] = {
 	{(char*)"usage",        no_argument,       0,            ARG_USAGE},
 	{(char*)"wrapper",      required_argument, 0,            ARG_WRAPPER},
 	{(char*)"new-reverse",  no_argument,       0,            ARG_NEW_REVERSE},
+	{(char*)"interleaved",  no_argument,       0,            ARG_INTERLEAVED},
+	{(char*)"kmer",         required_argument, 0,            ARG_KMER},
+	{(char*)"offrate2",     required_argument, 0,            ARG_OFFRATE2},
+	{(char*)"hot-occ",      required_argument, 0,            ARG_HOT_OCC},
+	{(char*)"threads",      required_argument, 0,            ARG_THREADS},
+	{(char*)"mem-budget",   required_argument, 0,            ARG_MEM_BUDGET},
+	{(char*)"concurrent",   no_argument,       0,            ARG_CONCURRENT},
+	{(char*)"mirror-threads", required_argument, 0,          ARG_MIRROR_THREADS},
+	{(char*)"append",       required_argument, 0,            ARG_APPEND},
+	{(char*)"external",     no_argument,       0,            ARG_EXTERNAL},
 	{(char*)0, 0, 0, 0} // terminator
 };
 
@@ -205,6 +263,29 @@ static int parseNumber(T lower, const char *errmsg) {
 	return -1;
 }
 
+/**
+ * Parse a byte count out of optarg, optionally suffixed with K, M or G
+ * (powers of 1024).  If it is malformed or less than 1, then output the
+ * given error message and exit with an error and a usage message.
+ */
+static uint64_t parseMemSize(const char *errmsg) {
+	char *endPtr = NULL;
+	uint64_t t = (uint64_t)strtoull(optarg, &endPtr, 10);
+	if(endPtr != optarg && t >= 1) {
+		switch(*endPtr) {
+			case 'g': case 'G': t <<= 10; /* fall through */
+			case 'm': case 'M': t <<= 10; /* fall through */
+			case 'k': case 'K': t <<= 10; endPtr++; break;
+			default: break;
+		}
+		if(*endPtr == '\0') return t;
+	}
+	cerr << errmsg << endl;
+	printUsage(cerr);
+	throw 1;
+	return 0;
+}
+
 /**
  * Read command-line arguments
  */
@@ -229,6 +310,7 @@ static void parseOptions(int argc, const char **argv) {
 				break;
 			case 'o':
 				offRate = parseNumber<int>(0, "-o/--offRate arg must be at least 0");
+				offRateGiven = true;
 				break;
 			case '3':
 				justRef = true;
@@ -249,16 +331,19 @@ static void parseOptions(int argc, const char **argv) {
 				bmax = parseNumber<TIndexOffU>(1, "--bmax arg must be at least 1");
 				bmaxMultSqrt = OFF_MASK; // don't use multSqrt
 				bmaxDivN = 0xffffffff;     // don't use multSqrt
+				bmaxGiven   = true;
 				break;
 			case ARG_BMAX_MULT:
 				bmaxMultSqrt = parseNumber<TIndexOffU>(1, "--bmaxmultsqrt arg must be at least 1");
 				bmax = OFF_MASK;     // don't use bmax
 				bmaxDivN = 0xffffffff; // don't use multSqrt
+				bmaxGiven   = true;
 				break;
 			case ARG_BMAX_DIV:
 				bmaxDivN = parseNumber<uint32_t>(1, "--bmaxdivn arg must be at least 1");
 				bmax = OFF_MASK;         // don't use bmax
 				bmaxMultSqrt = OFF_MASK; // don't use multSqrt
+				bmaxGiven   = true;
 				break;
 			case ARG_DCV:
 				dcv = parseNumber<int>(3, "--dcv arg must be at least 3");
@@ -268,6 +353,28 @@ static void parseOptions(int argc, const char **argv) {
 				break;
 			case ARG_NTOA: nsToAs = true; break;
 			case ARG_NEW_REVERSE: reverseType = REF_READ_REVERSE; break;
+			case ARG_INTERLEAVED: interleaved = true; break;
+			case ARG_KMER:
+				kmerChars = parseNumber<int>(0, "--kmer arg must be at least 0");
+				break;
+			case ARG_OFFRATE2:
+				offRate2 = parseNumber<int>(0, "--offrate2 arg must be at least 0");
+				break;
+			case ARG_HOT_OCC:
+				hotMinOcc = parseNumber<uint32_t>(2, "--hot-occ arg must be at least 2");
+				break;
+			case ARG_THREADS:
+				nthreads = parseNumber<int>(1, "--threads arg must be at least 1");
+				break;
+			case ARG_CONCURRENT: concurrent = true; break;
+			case ARG_MIRROR_THREADS:
+				mirrorThreads = parseNumber<int>(1, "--mirror-threads arg must be at least 1");
+				break;
+			case ARG_APPEND: appendBase = optarg; break;
+			case ARG_EXTERNAL: external = true; break;
+			case ARG_MEM_BUDGET:
+				memBudget = parseMemSize("--mem-budget arg must be a positive number of bytes, optionally suffixed with K, M or G");
+				break;
 			case 'a': autoMem = false; break;
 			case 'q': verbose = false; break;
 			case 's': sanityCheck = true; break;
@@ -283,6 +390,58 @@ static void parseOptions(int argc, const char **argv) {
 				throw 1;
 		}
 	} while(next_option != -1);
+	if(kmerChars != 0 && (kmerChars <= ftabChars || kmerChars > 16)) {
+		cerr << "--kmer arg must be greater than -t/--ftabchars (" << ftabChars
+		     << ") and at most 16" << endl;
+		printUsage(cerr);
+		throw 1;
+	}
+	if(!bmaxGiven) {
+		// Keep the default memory footprint: with N threads, N blocks
+		// are sorted at once, so make each one N times smaller
+		bmaxDivN *= nthreads;
+	}
+	if(!appendBase.empty()) {
+		if(color) {
+			cerr << "--append can't be used with -C/--color" << endl;
+			printUsage(cerr);
+			throw 1;
+		}
+		if(reverseType == REF_READ_REVERSE) {
+			cerr << "--append can't be used with --new-reverse" << endl;
+			printUsage(cerr);
+			throw 1;
+		}
+		if(concurrent) {
+			cerr << "Warning: --concurrent is ignored with --append" << endl;
+			concurrent = false;
+		}
+		if(external) {
+			cerr << "Warning: --external is ignored with --append" << endl;
+			external = false;
+		}
+	}
+	if(external) {
+		if(reverseType == REF_READ_REVERSE) {
+			cerr << "--external can't be used with --new-reverse" << endl;
+			printUsage(cerr);
+			throw 1;
+		}
+		if(concurrent) {
+			cerr << "Warning: --concurrent is ignored with --external" << endl;
+			concurrent = false;
+		}
+	}
+	if(offRate2 >= 0 && !offRateGiven) {
+		// The .offs2.ebwt sample is itself a good fraction of the size
+		// of the base sample, so thin the base sample to compensate
+		offRate++;
+	}
+	if(offRate2 >= offRate) {
+		cerr << "--offrate2 arg must be less than -o/--offrate (" << offRate << ")" << endl;
+		printUsage(cerr);
+		throw 1;
+	}
 	if(bmax < 40) {
 		cerr << "Warning: specified bmax is very small (" << bmax << ").  This can lead to" << endl
 		     << "extremely slow performance and memory exhaustion.  Perhaps you meant to specify" << endl
@@ -290,6 +449,541 @@ static void parseOptions(int argc, const char **argv) {
 	}
 }
 
+/**
+ * Estimate the peak number of bytes resident while building one Ebwt
+ * over a joined text of length n in nrecs reference records with the
+ * given string representation,
+ * difference-cover period v (0 = none) and block size b.  The text
+ * stays resident throughout; the DifferenceCoverSample peaks while
+ * ranking its sample and then shrinks to one offset per sample, which
+ * is then joined by the blocks being sorted and the sample suffixes,
+ * or with --external, by the runs being sorted and then the merge
+ * buffers.  The BWT, SA sample and ftab are streamed to the .1/.2
+ * files as blocks come out in order, so they don't scale with n.
+ */
+static uint64_t estimateBuildBytes(uint64_t n, uint64_t nrecs, int nthr, bool pack, uint32_t v, uint64_t b) {
+	const uint64_t O = OFF_SIZE;
+	const uint64_t T = (uint64_t)nthr;
+	uint64_t fixed = pack ? ((n + 3) >> 2) : n;
+	fixed += (1llu << (ftabChars << 1)) * (O + 1); // ftab, absorbFtab
+	if(kmerChars > 0) {
+		// k-mer ranges are spilled to disk; only the table is resident
+		uint64_t ents = min<uint64_t>(n, 1llu << (kmerChars << 1));
+		fixed += KmerTable::capacityFor(ents) * sizeof(KmerTable::Entry);
+	}
+	if(offRate2 >= 0) {
+		// At worst every row is in a hot region
+		fixed += ((n >> offRate2) + 1) * O;
+	}
+	if(external) {
+		// The one side being assembled, each record's size and name,
+		// and stdio buffers for the spill file and the outputs
+		fixed += (1llu << lineRate) * linesPerSide;
+		fixed += nrecs * (sizeof(RefRecord) + sizeof(string) + 64);
+		fixed += 64 * 1024;
+	} else {
+		fixed += 16 * 1024 * 1024; // side buffers, size records, names
+	}
+	uint64_t dcPeak = 0, dcRes = 0;
+	if(v > 0) {
+		uint64_t sPrimeSz = (n / v) * length(getDiffCover<uint32_t>(v));
+		dcPeak = sPrimeSz * O * 3; // sPrime, sPrimeOrder, isaPrime
+		dcRes  = sPrimeSz * O;     // isaPrime
+	}
+	b = max<uint64_t>(b, 1);
+	uint64_t blocks;
+	if(external) {
+		// One run and its bucket-sort scratch per thread; then the
+		// merge buffers (at least 1024 offsets per run), the block
+		// being merged into and each run's cursors
+		uint64_t runs = n / b + 1;
+		uint64_t sorting = (b + min<uint64_t>(b, 4 * 1024 * 1024) * 4) * O * T;
+		uint64_t merging = (max<uint64_t>(b, runs * 1024) + b) * O + runs * (O + 24);
+		blocks = max(sorting, merging);
+	} else {
+		blocks = b * O * (T > 1 ? T + 1 : 1);
+		blocks += min<uint64_t>(b, 4 * 1024 * 1024) * 4 * O * T; // bucket-sort scratch
+		blocks += (n / b + 1) * O * 2; // sample suffixes, while splitting
+	}
+	return fixed + max(dcPeak, dcRes + blocks);
+}
+
+/**
+ * Choose a string representation, block size and difference-cover
+ * period such that building one Ebwt over a joined text of length n
+ * in nrecs records with nthr threads fits in budget bytes.  Prefer
+ * unpacked strings as long as that
+ * doesn't take more than 256 blocks (with --external, where blocks
+ * don't each cost a pass over the text, as long as the runs outweigh
+ * their merge buffers), then the smallest difference-cover
+ * period, then the largest block size up to the default.  If the user
+ * set the block size, only the representation and period are chosen.
+ * Returns false iff no setting fits, in which case need is set to the
+ * smallest budget that would.
+ */
+static bool planMemBudget(uint64_t n, uint64_t nrecs, int nthr, uint64_t budget, bool& pack, TIndexOffU& b, int& v, uint64_t& need) {
+	uint64_t bdef;
+	if(bmax != OFF_MASK) {
+		bdef = bmax;
+	} else if(bmaxDivN != 0xffffffff) {
+		bdef = n / bmaxDivN;
+	} else {
+		bdef = (uint64_t)sqrt((double)n) * (bmaxMultSqrt != OFF_MASK ? bmaxMultSqrt : 1);
+	}
+	bdef = max<uint64_t>(bdef, 1);
+	int v0 = noDc ? 0 : min(dcv, 4096);
+	for(int p = (packed ? 1 : 0); p < 2; p++) {
+		uint64_t bmin;
+		if(bmaxGiven) {
+			bmin = bdef;
+		} else if(external) {
+			// Runs shorter than this only add merge buffers
+			bmin = min<uint64_t>(max<uint64_t>((uint64_t)sqrt(1024.0 * n), 40), bdef);
+		} else {
+			bmin = max<uint64_t>(p == 0 ? n / 256 : 0, 40);
+		}
+		if(bmin > bdef) continue;
+		for(int dv = v0; ; dv <<= 1) {
+			if(estimateBuildBytes(n, nrecs, nthr, p == 1, dv, bmin) <= budget) {
+				// Largest block size in [bmin, bdef] that fits
+				uint64_t lo = bmin, hi = bdef;
+				while(lo < hi) {
+					uint64_t mid = lo + ((hi - lo + 1) >> 1);
+					if(estimateBuildBytes(n, nrecs, nthr, p == 1, dv, mid) <= budget) {
+						lo = mid;
+					} else {
+						hi = mid - 1;
+					}
+				}
+				pack = (p == 1);
+				b = (TIndexOffU)lo;
+				v = dv;
+				return true;
+			}
+			if(dv == 0 || dv >= 4096) break;
+		}
+	}
+	// Nothing fits; report what the most economical settings need
+	int vmax = noDc ? 0 : 4096;
+	need = estimateBuildBytes(n, nrecs, nthr, true, vmax, bdef);
+	if(!bmaxGiven) {
+		for(uint64_t bb = 40; bb < bdef; bb <<= 1) {
+			need = min(need, estimateBuildBytes(n, nrecs, nthr, true, vmax, bb));
+		}
+	}
+	return false;
+}
+
+/// EbwtBuild::err value for a build that ran out of memory
+static const int BUILD_BAD_ALLOC = -1;
+
+/**
+ * Everything needed to build one index (forward or mirror) once the
+ * reference sizes are known, and the result.  See buildEbwt().
+ */
+template<typename TStr>
+struct EbwtBuild {
+	EbwtBuild(const string& o, bool r, const RefReadInParams& rp, int t, bool v,
+	          vector<FileBuf*>& i, vector<RefRecord>& z, vector<uint32_t>& p,
+	          size_t st, const JoinedRef<TStr>* j) :
+		outfile(o), reverse(r), refparams(rp), nthreads(t), verbose(v),
+		bmax(OFF_MASK), bmaxMultSqrt(OFF_MASK), bmaxDivN(0xffffffff), dcv(0),
+		passMemExc(false), is(i), szs(z), plens(p), sztot(st), joined(j),
+		ebwt(NULL), err(0) { }
+
+	string outfile;              // basename for .?.ebwt files
+	bool reverse;                // build the mirror index?
+	RefReadInParams refparams;   // reference read-in parameters
+	int nthreads;                // # threads for suffix sorting
+	bool verbose;                // be talkative
+	TIndexOffU bmax;             // block size
+	TIndexOffU bmaxMultSqrt;     // block size as multiplier of sqrt(len)
+	uint32_t bmaxDivN;           // block size as divisor of len
+	int dcv;                     // difference-cover period
+	bool passMemExc;             // pass bad_alloc up for another try
+	vector<FileBuf*>& is;        // input streams
+	vector<RefRecord>& szs;      // reference sizes
+	vector<uint32_t>& plens;     // not-all-gap reference sequence lengths
+	size_t sztot;                // total unambiguous ref chars
+	const JoinedRef<TStr>* joined; // reference already joined, or NULL
+	Ebwt<TStr>* ebwt;            // the result
+	int err;                     // 0, or what buildEbwt() threw
+};
+
+/**
+ * Set the block size and difference-cover period for build b, fitting
+ * them to 'budget' bytes if it's non-zero.  Throws bad_alloc if that
+ * takes packed strings and we don't have them yet.
+ */
+template<typename TStr>
+static void planBuild(EbwtBuild<TStr>& b, size_t jlen, uint64_t budget) {
+	b.bmax = bmax;
+	b.bmaxMultSqrt = bmaxMultSqrt;
+	b.bmaxDivN = bmaxDivN;
+	b.dcv = noDc ? 0 : dcv;
+	b.passMemExc = autoMem && budget == 0;
+	if(budget == 0) return;
+	bool pack = packed;
+	TIndexOffU pbmax = 0;
+	int pdcv = 0;
+	uint64_t need = 0;
+	// A k-mer table that doesn't fit gets a shorter k, down to one
+	// more than ftabChars, and is then left out
+	int k0 = kmerChars;
+	while(!planMemBudget(jlen, b.szs.size(), b.nthreads, budget, pack, pbmax, pdcv, need)) {
+		if(kmerChars > ftabChars + 1) {
+			kmerChars--;
+			continue;
+		} else if(kmerChars > 0) {
+			kmerChars = 0;
+			continue;
+		}
+		cerr << "Error: building this index needs an estimated " << ((need + (1 << 20) - 1) >> 20)
+		     << " MB, more than the " << (budget >> 20) << " MB --mem-budget allows." << endl;
+		throw 1;
+	}
+	if(kmerChars != k0) {
+		if(kmerChars == 0) {
+			cerr << "Warning: leaving out the --kmer table to fit --mem-budget" << endl;
+		} else {
+			cerr << "Warning: lowering --kmer from " << k0 << " to " << kmerChars
+			     << " to fit --mem-budget" << endl;
+		}
+	}
+	if(pack && !packed) {
+		cerr << "Unpacked strings don't fit in --mem-budget." << endl;
+		// Caught in bowtie_build(), which retries with packed strings
+		throw bad_alloc();
+	}
+	if(!bmaxGiven) {
+		b.bmax = pbmax;
+		b.bmaxMultSqrt = OFF_MASK;
+		b.bmaxDivN = 0xffffffff;
+	}
+	b.dcv = pdcv;
+	if(verbose) {
+		cout << "Memory budget: " << (budget >> 20) << " MB for " << jlen << " chars; using"
+		     << (packed ? " --packed" : "") << " --bmax " << pbmax
+		     << " --dcv " << pdcv << " (~"
+		     << (estimateBuildBytes(jlen, b.szs.size(), b.nthreads, packed, pdcv, pbmax) >> 20) << " MB)" << endl;
+	}
+}
+
+/**
+ * Construct the Ebwt for build b, writing it to disk.
+ */
+template<typename TStr>
+static void buildEbwt(EbwtBuild<TStr>& b) {
+	b.ebwt = new Ebwt<TStr>(
+		b.refparams.color ? 1 : 0,
+		lineRate,
+		linesPerSide,
+		offRate,      // suffix-array sampling rate
+		-1,           // ISA sampling rate
+		ftabChars,    // number of chars in initial arrow-pair calc
+		interleaved,  // store all four occ[] counts in every side
+		kmerChars,    // k for .5.ebwt k-mer table; 0 = none
+		offRate2,     // hot-region SA sample rate; -1 = none
+		hotMinOcc,    // min 20-mer occurrences for a hot region
+		b.outfile,    // basename for .?.ebwt files
+		!b.reverse,   // fw
+		!entireSA,    // useBlockwise
+		b.bmax,       // block size for blockwise SA builder
+		b.bmaxMultSqrt, // block size as multiplier of sqrt(len)
+		b.bmaxDivN,   // block size as divisor of len
+		b.dcv,        // difference-cover period
+		b.nthreads,   // # threads for suffix sorting
+		b.is,         // list of input streams
+		b.szs,        // list of reference sizes
+		b.plens,      // list of not-all-gap reference sequence lengths
+		(TIndexOffU)b.sztot, // total size of all unambiguous ref chars
+		b.refparams,  // reference read-in parameters
+		seed,         // pseudo-random number generator seed
+		-1,           // override offRate
+		-1,           // override isaRate
+		b.verbose,    // be talkative
+		b.passMemExc, // pass exceptions up to the toplevel so that we can adjust memory settings automatically
+		sanityCheck,  // verify results and internal consistency
+		b.joined);    // reference already joined, or NULL
+	// Note that the Ebwt is *not* resident in memory at this time.  To
+	// load it into memory, call ebwt.loadIntoMemory()
+	if(b.verbose) {
+		// Print Ebwt's vital stats
+		b.ebwt->eh().print(cout);
+	}
+}
+
+/**
+ * Thread body for building one index while the other is built on the
+ * calling thread.  Exceptions can't cross threads, so they're recorded
+ * in b.err instead.
+ */
+template<typename TStr>
+static void buildEbwtWorker(void *vp) {
+	EbwtBuild<TStr>& b = *(EbwtBuild<TStr>*)vp;
+	try {
+		buildEbwt(b);
+	} catch(bad_alloc& e) {
+		b.err = BUILD_BAD_ALLOC;
+	} catch(int e) {
+		b.err = (e != 0 ? e : 1);
+	} catch(std::exception& e) {
+		b.err = 1;
+	}
+}
+
+/**
+ * If sanity checking is enabled, check that the text restored from
+ * build b's index is the reference.
+ */
+template<typename TStr>
+static void checkEbwt(EbwtBuild<TStr>& b) {
+	if(!sanityCheck) return;
+	Ebwt<TStr>& ebwt = *b.ebwt;
+	const RefReadInParams& refparams = b.refparams;
+	// Try restoring the original string (if there were
+	// multiple texts, what we'll get back is the joined,
+	// padded string, not a list)
+	ebwt.loadIntoMemory(
+		refparams.color ? 1 : 0,
+		-1,
+		false,
+		false);
+	TStr s2; ebwt.restore(s2);
+	ebwt.evictFromMemory();
+	if(b.joined != NULL && b.joined->sa != NULL) {
+		// Text was assembled from more than the input streams
+		assert_eq(length(b.joined->text), length(s2));
+		assert_eq(b.joined->text, s2);
+	} else {
+		TStr joinedss = Ebwt<TStr>::join(
+			b.is,        // list of input streams
+			b.szs,       // list of reference sizes
+			(TIndexOffU)b.sztot, // total size of all unambiguous ref chars
+			refparams,   // reference read-in parameters
+			seed);       // pseudo-random number generator seed
+		for(size_t i = 0; i < b.is.size(); i++) b.is[i]->reset();
+		if(refparams.reverse == REF_READ_REVERSE) {
+			reverseInPlace(joinedss);
+		}
+		assert_eq(length(joinedss), length(s2));
+		assert_eq(joinedss, s2);
+	}
+	if(b.verbose) {
+		if(length(s2) < 1000) {
+			cout << "Passed restore check: " << s2 << endl;
+		} else {
+			cout << "Passed restore check: (" << length(s2) << " chars)" << endl;
+		}
+	}
+}
+
+/**
+ * Read the reference records of the --append index from its .3.ebwt
+ * file, and the lengths of its sequences from its header.
+ */
+template<typename TStr>
+static void readAppendRecords(vector<RefRecord>& szs, vector<uint32_t>& plens) {
+	try {
+		if(readEbwtColor(appendBase)) {
+			cerr << "Error: --append index " << appendBase << " is a colorspace index" << endl;
+			throw 1;
+		}
+		if(readEntireReverse(appendBase + ".rev")) {
+			cerr << "Error: --append index " << appendBase << " was built with --new-reverse" << endl;
+			throw 1;
+		}
+	} catch(EbwtFileOpenException& e) {
+		cerr << "Error: could not open the .1." << gEbwt_ext << " files of --append index "
+		     << appendBase << endl;
+		throw 1;
+	}
+	string file3 = appendBase + ".3." + gEbwt_ext;
+	FILE *f3 = fopen(file3.c_str(), "rb");
+	if(f3 == NULL) {
+		cerr << "Error: could not open " << file3 << "; --append needs the reference portion" << endl
+		     << "of the index it extends (don't build that index with -r/--noref)." << endl;
+		throw 1;
+	}
+	bool swap = false;
+	uint32_t one = readU<int32_t>(f3, swap);
+	if(one != 1) {
+		assert_eq(0x1000000, one);
+		swap = true; // have to endian swap U32s
+	}
+	TIndexOffU sz = readU<TIndexOffU>(f3, swap);
+	for(TIndexOffU i = 0; i < sz; i++) {
+		szs.push_back(RefRecord(f3, swap));
+	}
+	fclose(f3);
+	Ebwt<TStr> old(appendBase, 0, -1, true);
+	for(TIndexOffU i = 0; i < old.nPat(); i++) {
+		plens.push_back((uint32_t)old.plen()[i]);
+	}
+}
+
+/**
+ * Stream the first 'len' characters of the --append index's joined
+ * reference from its .4.ebwt file (four to a byte, low bits first),
+ * appending them to 'text' and/or writing them to 'bpout'.
+ */
+template<typename TStr>
+static void readAppendText(size_t len, TStr* text, BitpairOutFileBuf* bpout) {
+	string file4 = appendBase + ".4." + gEbwt_ext;
+	FILE *f4 = fopen(file4.c_str(), "rb");
+	if(f4 == NULL) {
+		cerr << "Error: could not open " << file4 << "; --append needs the reference portion" << endl
+		     << "of the index it extends (don't build that index with -r/--noref)." << endl;
+		throw 1;
+	}
+	uint8_t buf[64 * 1024];
+	size_t done = 0;
+	while(done < len) {
+		size_t nbytes = min<size_t>(sizeof(buf), (len - done + 3) >> 2);
+		if(fread(buf, 1, nbytes, f4) != nbytes) {
+			cerr << "Error: " << file4 << " is shorter than its .3." << gEbwt_ext << " file says" << endl;
+			throw 1;
+		}
+		for(size_t i = 0; i < nbytes; i++) {
+			for(int j = 0; j < 8 && done < len; j += 2, done++) {
+				int c = (buf[i] >> j) & 3;
+				if(text != NULL) appendValue(*text, (Dna)c);
+				if(bpout != NULL) bpout->write(c);
+			}
+		}
+	}
+	fclose(f4);
+}
+
+/**
+ * Build b's index over the new sequences followed by those of the
+ * --append index.  The first 'nszs' of b.szs are the new sequences'
+ * records.  Rather than sorting all suffixes again, the new ones are
+ * merged into the suffix order of the existing forward or mirror
+ * index; see MergedBlockwiseSA.
+ */
+template<typename TStr>
+static void appendEbwt(EbwtBuild<TStr>& b, size_t nszs, size_t jlen) {
+	JoinedRef<TStr> joined;
+	TIndexOffU newLen = 0;
+	{
+		if(b.verbose) cout << "Joining new reference sequences and those of " << appendBase << endl;
+		Timer timer(cout, "  Time to join reference sequences: ", b.verbose);
+		vector<RefRecord> newSzs(b.szs.begin(), b.szs.begin() + nszs);
+		RefReadInParams refparams = b.refparams;
+		refparams.reverse = REF_READ_FORWARD;
+		try {
+			reserve(joined.text, jlen, Exact());
+			Ebwt<TStr>::joinRefs(b.is, newSzs, b.plens, refparams, joined.text, joined.names);
+			newLen = (TIndexOffU)length(joined.text);
+			readAppendText(jlen - newLen, &joined.text, NULL);
+		} catch(bad_alloc& e) {
+			cerr << "Could not allocate space for a joined string of " << jlen << " elements." << endl;
+			throw e;
+		}
+		vector<string> onames;
+		readEbwtRefnames(appendBase, onames);
+		joined.names.insert(joined.names.end(), onames.begin(), onames.end());
+		if(b.reverse) {
+			reverseEachRecord(joined.text, b.szs);
+		}
+	}
+	Ebwt<TStr> old(
+		appendBase + (b.reverse ? ".rev" : ""),
+		0,            // not colorspace
+		-1,           // don't care about entire reverse
+		!b.reverse,   // index is for the forward direction?
+		-1,           // offrate (-1 = index default)
+		-1,           // isarate (-1 = index default)
+		false,        // use memory-mapped IO
+		false,        // use shared memory
+		false,        // sweep memory-mapped memory
+		false,        // load names?
+		NULL,         // no reference map
+		false,        // be talkative?
+		false);       // be talkative at startup?
+	{
+		if(b.verbose) cout << "Loading index " << appendBase << (b.reverse ? ".rev" : "") << endl;
+		Timer timer(cout, "  Time loading index to append to: ", b.verbose);
+		old.loadIntoMemory(0, -1, false, false);
+	}
+	// Each block covers this many rows of the old index, plus the new
+	// suffixes that fall between them.  Blocks are sized as they would
+	// be for a fresh build; with more than one, the old index is walked
+	// once and the offsets spilled to disk (see MergedBlockwiseSA)
+	const EbwtParams& oeh = old.eh();
+	TIndexOffU obmax;
+	if(bmax != OFF_MASK) {
+		obmax = bmax;
+	} else if(bmaxMultSqrt != OFF_MASK) {
+		obmax = bmaxMultSqrt * (TIndexOffU)sqrt((double)oeh._bwtLen);
+	} else {
+		obmax = max<TIndexOffU>(oeh._bwtLen / bmaxDivN, 1);
+	}
+	if(memBudget > 0 && !bmaxGiven) {
+		uint64_t resident = (packed ? (jlen + 3) / 4 : jlen) + oeh._ebwtTotSz + oeh._offsSz +
+		                    3 * (uint64_t)OFF_SIZE * newLen;
+		if(resident + 1024 * OFF_SIZE > memBudget) {
+			cerr << "Error: appending to this index needs an estimated "
+			     << ((resident + (1 << 20) - 1) >> 20) << " MB, more than the "
+			     << (memBudget >> 20) << " MB --mem-budget allows." << endl;
+			throw 1;
+		}
+		// A block, plus spill buffers of about the same size
+		obmax = (TIndexOffU)min<uint64_t>(obmax, (memBudget - resident) / (2 * OFF_SIZE));
+	}
+	obmax = max<TIndexOffU>(min<TIndexOffU>(obmax, oeh._bwtLen), 1);
+	MergedBlockwiseSA<TStr> sa(joined.text, newLen, old, obmax, b.nthreads,
+	                           b.outfile + ".sa.tmp", sanityCheck, b.verbose);
+	joined.sa = &sa;
+	b.joined = &joined;
+	buildEbwt(b);
+	old.evictFromMemory();
+	checkEbwt(b);
+	delete b.ebwt;
+}
+
+/**
+ * Build b's index with the suffixes sorted in runs that are spilled to
+ * disk and merged; see ExternalBlockwiseSA.  Runs are the size that
+ * blocks would otherwise be.
+ */
+template<typename TStr>
+static void externalEbwt(EbwtBuild<TStr>& b, size_t jlen) {
+	JoinedRef<TStr> joined;
+	{
+		if(b.verbose) cout << "Joining reference sequences" << endl;
+		Timer timer(cout, "  Time to join reference sequences: ", b.verbose);
+		RefReadInParams refparams = b.refparams;
+		refparams.reverse = REF_READ_FORWARD;
+		try {
+			reserve(joined.text, jlen, Exact());
+			Ebwt<TStr>::joinRefs(b.is, b.szs, b.plens, refparams, joined.text, joined.names);
+		} catch(bad_alloc& e) {
+			cerr << "Could not allocate space for a joined string of " << jlen << " elements." << endl;
+			throw e;
+		}
+		if(b.reverse) {
+			reverseEachRecord(joined.text, b.szs);
+		}
+	}
+	TIndexOffU ebmax;
+	if(b.bmax != OFF_MASK) {
+		ebmax = b.bmax;
+	} else if(b.bmaxMultSqrt != OFF_MASK) {
+		ebmax = b.bmaxMultSqrt * (TIndexOffU)sqrt((double)jlen);
+	} else {
+		ebmax = max<TIndexOffU>((TIndexOffU)(jlen / b.bmaxDivN), 1);
+	}
+	ExternalBlockwiseSA<TStr> sa(joined.text, ebmax, b.nthreads, b.dcv,
+	                             b.outfile + ".sa.tmp", sanityCheck, b.verbose);
+	joined.sa = &sa;
+	b.joined = &joined;
+	buildEbwt(b);
+	checkEbwt(b);
+	delete b.ebwt;
+}
+
 /**
  * Drive the Ebwt construction process and optionally sanity-check the
  * result.
@@ -340,6 +1034,15 @@ static void driver(const string& infile,
 	vector<RefRecord> szs;
 	vector<uint32_t> plens;
 	std::pair<size_t, size_t> sztot;
+	// Records and sequence lengths of the --append index, whose
+	// sequences follow the new ones
+	vector<RefRecord> oszs;
+	vector<uint32_t> oplens;
+	size_t olen = 0;
+	if(!appendBase.empty()) {
+		readAppendRecords<TStr>(oszs, oplens);
+		for(size_t i = 0; i < oszs.size(); i++) olen += oszs[i].len;
+	}
 	{
 		if(verbose) cout << "Reading reference sizes" << endl;
 		Timer _t(cout, "  Time reading reference sizes: ", verbose);
@@ -383,8 +1086,10 @@ static void driver(const string& infile,
 			} else {
 				TIndexOff numSeqs = 0;
 				sztot = fastaRefReadSizes(is, szs, plens, refparams, &bpout, numSeqs);
-				writeU<TIndexOffU>(fout3, (TIndexOffU)szs.size(), bigEndian); // write # records
+				if(!appendBase.empty()) readAppendText<TStr>(olen, NULL, &bpout);
+				writeU<TIndexOffU>(fout3, (TIndexOffU)(szs.size() + oszs.size()), bigEndian); // write # records
 				for(size_t i = 0; i < szs.size(); i++) szs[i].write(fout3, bigEndian);
+				for(size_t i = 0; i < oszs.size(); i++) oszs[i].write(fout3, bigEndian);
 			}
 			if(sztot.first == 0) {
 				cerr << "Error: No unambiguous stretches of characters in the input.  Aborting..." << endl;
@@ -395,7 +1100,7 @@ static void driver(const string& infile,
 			bpout.close();
 			fout3.close();
 #ifndef NDEBUG
-			if(sanityCheck) {
+			if(sanityCheck && appendBase.empty()) {
 				BitPairReference bpr(
 					outfile, // ebwt basename
 					color,   // expect color?
@@ -430,73 +1135,83 @@ static void driver(const string& infile,
 #endif
 		}
 	}
+	size_t nszs = szs.size();
+	szs.insert(szs.end(), oszs.begin(), oszs.end());
+	plens.insert(plens.end(), oplens.begin(), oplens.end());
+	sztot.first += olen;
 	if(justRef) return;
 	assert_gt(sztot.first, 0);
 	assert_gt(sztot.second, 0);
 	assert_gt(szs.size(), 0);
-	// Construct Ebwt from input strings and parameters
-	Ebwt<TStr> ebwt(refparams.color ? 1 : 0,
-	                lineRate,
-	                linesPerSide,
-	                offRate,      // suffix-array sampling rate
-	                -1,           // ISA sampling rate
-	                ftabChars,    // number of chars in initial arrow-pair calc
-	                outfile,      // basename for .?.ebwt files
-	                !reverse,     // fw
-	                !entireSA,    // useBlockwise
-	                bmax,         // block size for blockwise SA builder
-	                bmaxMultSqrt, // block size as multiplier of sqrt(len)
-	                bmaxDivN,     // block size as divisor of len
-	                noDc? 0 : dcv,// difference-cover period
-	                is,           // list of input streams
-	                szs,          // list of reference sizes
-	                plens,        // list of not-all-gap reference sequence lengths
-	                (TIndexOffU)sztot.first,  // total size of all unambiguous ref chars
-	                refparams,    // reference read-in parameters
-	                seed,         // pseudo-random number generator seed
-	                -1,           // override offRate
-	                -1,           // override isaRate
-	                verbose,      // be talkative
-	                autoMem,      // pass exceptions up to the toplevel so that we can adjust memory settings automatically
-	                sanityCheck); // verify results and internal consistency
-	// Note that the Ebwt is *not* resident in memory at this time.  To
-	// load it into memory, call ebwt.loadIntoMemory()
-	if(verbose) {
-		// Print Ebwt's vital stats
-		ebwt.eh().print(cout);
-	}
-	if(sanityCheck) {
-		// Try restoring the original string (if there were
-		// multiple texts, what we'll get back is the joined,
-		// padded string, not a list)
-		ebwt.loadIntoMemory(
-			refparams.color ? 1 : 0,
-			-1,
-			false,
-			false);
-		TStr s2; ebwt.restore(s2);
-		ebwt.evictFromMemory();
-		{
-			TStr joinedss = Ebwt<TStr>::join(
-				is,          // list of input streams
-				szs,         // list of reference sizes
-				(TIndexOffU)sztot.first, // total size of all unambiguous ref chars
-				refparams,   // reference read-in parameters
-				seed);       // pseudo-random number generator seed
-			if(refparams.reverse == REF_READ_REVERSE) {
-				reverseInPlace(joinedss);
-			}
-			assert_eq(length(joinedss), length(s2));
-			assert_eq(joinedss, s2);
+	size_t jlen = 0;
+	for(size_t i = 0; i < szs.size(); i++) jlen += szs[i].len;
+	if(!appendBase.empty()) {
+		EbwtBuild<TStr> b(outfile, reverse, refparams, nthreads, verbose,
+		                  is, szs, plens, sztot.first, NULL);
+		appendEbwt(b, nszs, jlen);
+		return;
+	}
+	if(reverse || !concurrent || !doubleEbwt) {
+		EbwtBuild<TStr> b(outfile, reverse, refparams, nthreads, verbose,
+		                  is, szs, plens, sztot.first, NULL);
+		planBuild(b, jlen, memBudget);
+		if(external) {
+			externalEbwt(b, jlen);
+			return;
 		}
-		if(verbose) {
-			if(length(s2) < 1000) {
-				cout << "Passed restore check: " << s2 << endl;
-			} else {
-				cout << "Passed restore check: (" << length(s2) << " chars)" << endl;
-			}
+		buildEbwt(b);
+		checkEbwt(b);
+		delete b.ebwt;
+		return;
+	}
+	// Read the reference once and build the forward and mirror indexes
+	// from it at the same time, splitting the threads between them
+	int mthreads = (mirrorThreads > 0) ? mirrorThreads : max(nthreads >> 1, 1);
+	int fthreads = max(nthreads - mthreads, 1);
+	RefReadInParams mrefparams(color, reverseType, nsToAs, bisulfite);
+	JoinedRef<TStr> joined;
+	EbwtBuild<TStr> fw(outfile, false, refparams, fthreads, verbose,
+	                   is, szs, plens, sztot.first, &joined);
+	EbwtBuild<TStr> mir(outfile + ".rev", true, mrefparams, mthreads, false,
+	                    is, szs, plens, sztot.first, &joined);
+	// Both builds are resident at once, so each gets half the budget
+	planBuild(fw, jlen, memBudget / 2);
+	planBuild(mir, jlen, memBudget / 2);
+	{
+		if(verbose) cout << "Joining reference sequences" << endl;
+		Timer timer(cout, "  Time to join reference sequences: ", verbose);
+		try {
+			reserve(joined.text, jlen, Exact());
+			Ebwt<TStr>::joinRefs(is, szs, plens, refparams, joined.text, joined.names);
+		} catch(bad_alloc& e) {
+			cerr << "Could not allocate space for a joined string of " << jlen << " elements." << endl;
+			throw e;
 		}
 	}
+	if(verbose) {
+		cout << "Building forward index with " << fthreads << " thread(s) and mirror index with "
+		     << mthreads << " thread(s) concurrently; only the forward build is logged" << endl;
+	}
+	tthread::thread *mt = new tthread::thread(buildEbwtWorker<TStr>, (void*)&mir);
+	buildEbwtWorker<TStr>((void*)&fw);
+	mt->join();
+	delete mt;
+	if(fw.err == BUILD_BAD_ALLOC || mir.err == BUILD_BAD_ALLOC) {
+		delete fw.ebwt; delete mir.ebwt;
+		throw bad_alloc();
+	}
+	if(fw.err != 0 || mir.err != 0) {
+		delete fw.ebwt; delete mir.ebwt;
+		throw (fw.err != 0 ? fw.err : mir.err);
+	}
+	if(verbose) {
+		cout << "Mirror index:" << endl;
+		mir.ebwt->eh().print(cout);
+	}
+	checkEbwt(fw);
+	checkEbwt(mir);
+	delete fw.ebwt;
+	delete mir.ebwt;
 }
 
 static const char *argv0 = NULL;
@@ -554,6 +1269,12 @@ int bowtie_build(int argc, const char **argv) {
 		}
 		outfile = argv[optind++];
 
+		if(!appendBase.empty() && appendBase == outfile) {
+			cerr << "--append index must be different from the output index" << endl;
+			printUsage(cerr);
+			return 1;
+		}
+
 		tokenize(infile, ",", infiles);
 		if(infiles.size() < 1) {
 			cerr << "Tokenized input file list was empty!" << endl;
@@ -569,8 +1290,29 @@ int bowtie_build(int argc, const char **argv) {
 				 << "  Lines per side: " << linesPerSide << " (side is " << ((1<<lineRate)*linesPerSide) << " bytes)" << endl
 				 << "  Offset rate: " << offRate << " (one in " << (1<<offRate) << ")" << endl
 				 << "  FTable chars: " << ftabChars << endl
+				 << "  Side layout: " << (interleaved? "interleaved" : "side pairs") << endl
+				 << "  K-mer table chars: " << kmerChars << endl
+				 << "  Hot-region offset rate: " << offRate2 << endl
+				 << "  Hot-region min occurrences: " << hotMinOcc << endl
 				 << "  Strings: " << (packed? "packed" : "unpacked") << endl
+				 << "  Threads: " << nthreads << endl
 				 ;
+			if(concurrent) {
+				cout << "  Forward and mirror indexes: concurrent" << endl;
+			} else {
+				cout << "  Forward and mirror indexes: one after the other" << endl;
+			}
+			cout << "  Suffix sorting: " << (external ? "external (runs merged from disk)" : "in memory") << endl;
+			if(appendBase.empty()) {
+				cout << "  Append to index: none" << endl;
+			} else {
+				cout << "  Append to index: \"" << appendBase << ".*." + gEbwt_ext + "\"" << endl;
+			}
+			if(memBudget == 0) {
+				cout << "  Memory budget: none" << endl;
+			} else {
+				cout << "  Memory budget: " << memBudget << " bytes" << endl;
+			}
 			if(bmax == OFF_MASK) {
 				cout << "  Max bucket size: default" << endl;
 			} else {
@@ -605,12 +1347,14 @@ int bowtie_build(int argc, const char **argv) {
 		// Seed random number generator
 		srand(seed);
 		{
-			Timer timer(cout, "Total time for call to driver() for forward index: ", verbose);
+			Timer timer(cout, concurrent ?
+				"Total time for call to driver() for forward and mirror indexes: " :
+				"Total time for call to driver() for forward index: ", verbose);
 			if(!packed) {
 				try {
 					driver<String<Dna, Alloc<> > >(infile, infiles, outfile);
 				} catch(bad_alloc& e) {
-					if(autoMem) {
+					if(autoMem || memBudget > 0) {
 						cerr << "Switching to a packed string representation." << endl;
 						packed = true;
 					} else {
@@ -622,14 +1366,14 @@ int bowtie_build(int argc, const char **argv) {
 				driver<String<Dna, Packed<Alloc<> > > >(infile, infiles, outfile);
 			}
 		}
-		if(doubleEbwt) {
+		if(doubleEbwt && !concurrent) {
 			srand(seed);
 			Timer timer(cout, "Total time for backward call to driver() for mirror index: ", verbose);
 			if(!packed) {
 				try {
 					driver<String<Dna, Alloc<> > >(infile, infiles, outfile + ".rev", true);
 				} catch(bad_alloc& e) {
-					if(autoMem) {
+					if(autoMem || memBudget > 0) {
 						cerr << "Switching to a packed string representation." << endl;
 						packed = true;
 					} else {
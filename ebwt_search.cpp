@@ -8,10 +8,15 @@
 #include <seqan/find.h>
 #include <getopt.h>
 #include <vector>
+#include <map>
+#include <limits.h>
 #include "alphabet.h"
 #include "assert_helpers.h"
 #include "endian_swap.h"
 #include "ebwt.h"
+#include "mem_policy.h"
+#include "index_io.h"
+#include "server.h"
 #include "formats.h"
 #include "sequence_io.h"
 #include "tokenize.h"
@@ -24,6 +29,7 @@
 #include "annot.h"
 #include "aligner.h"
 #include "aligner_0mm.h"
+#include "ebwt_search_batch.h"
 #include "aligner_1mm.h"
 #include "aligner_23mm.h"
 #include "aligner_seed_mm.h"
@@ -81,6 +87,7 @@ static string dumpMaxBase;    // basename of same-format files to dump reads wit
 static uint32_t khits;  // number of hits per read; >1 is much slower
 static uint32_t mhits;  // don't report any hits if there are > mhits
 static bool better;     // true -> guarantee alignments from best possible stratum
+static bool best;       // true -> --best; hits must be best across all indexes
 static bool strata;     // true -> don't stop at stratum boundaries
 static bool refOut;     // if true, alignments go to per-ref files
 static int partitionSz; // output a partitioning key in first field
@@ -89,8 +96,13 @@ static bool fileParallel; // separate threads read separate input files in paral
 static bool useShmem;     // use shared memory to hold the index
 static bool useMm;        // use memory-mapped files to hold the index
 static bool mmSweep;      // sweep through memory-mapped files immediately after mapping
+static int hugePages;     // HUGEPAGES_* backing for the big index arrays
+static int numaMode;      // NUMA_* placement of the index across NUMA nodes
+static int loadThreads;   // # threads reading the index; 0 -> same as -p
+static int gzThreads;     // # threads inflating read files; 0 -> -p, at most 4
 static bool stateful;     // use stateful aligners
 static uint32_t prefetchWidth; // number of reads to process in parallel w/ --stateful
+static uint32_t exactBatch;    // number of reads to match in lock-step in exact mode
 static uint32_t minInsert;     // minimum insert size (Maq = 0, SOAP = 400)
 static uint32_t maxInsert;     // maximum insert size (Maq = 250, SOAP = 600)
 static bool mate1fw;           // -1 mate aligns in fw orientation on fw strand
@@ -100,7 +112,10 @@ static uint32_t mixedThresh;   // threshold for when to switch to paired-end mix
 static uint32_t mixedAttemptLim; // number of attempts to make in "mixed mode" before giving up on orientation
 static bool dontReconcileMates;  // suppress pairwise all-versus-all way of resolving mates
 static uint32_t cacheLimit;      // ranges w/ size > limit will be cached
-static uint32_t cacheSize;       // # words per range cache
+static size_t cacheSize;         // # bytes per range cache
+static string cacheFile;         // file to pre-populate range caches from and save them to
+static RangeCache* rangeCacheFw; // range cache shared by all threads, forward index
+static RangeCache* rangeCacheBw; // range cache shared by all threads, mirror index
 static int offBase;              // offsets are 0-based by default, but configurable
 static bool tryHard;             // set very high maxBts, mixedAttemptLim
 static uint32_t skipReads;       // # reads/read pairs to skip
@@ -193,6 +208,7 @@ static void resetOptions() {
 	khits					= 1;     // number of hits per read; >1 is much slower
 	mhits					= 0xffffffff; // don't report any hits if there are > mhits
 	better					= false; // true -> guarantee alignments from best possible stratum
+	best					= false; // true -> --best; hits must be best across all indexes
 	strata					= false; // true -> don't stop at stratum boundaries
 	refOut					= false; // if true, alignments go to per-ref files
 	partitionSz				= 0;     // output a partitioning key in first field
@@ -201,8 +217,14 @@ static void resetOptions() {
 	useShmem				= false; // use shared memory to hold the index
 	useMm					= false; // use memory-mapped files to hold the index
 	mmSweep					= false; // sweep through memory-mapped files immediately after mapping
+	hugePages				= HUGEPAGES_NONE; // ordinary pages for the index
+	numaMode				= NUMA_NONE; // leave NUMA placement to the kernel
+	loadThreads				= 0;     // read the index with -p threads
+	gzThreads				= 0;     // inflate reads with -p (at most 4) threads
+	gLoadDirect				= false; // read the index through the page cache
 	stateful				= false; // use stateful aligners
 	prefetchWidth			= 1;     // number of reads to process in parallel w/ --stateful
+	exactBatch				= 32;    // number of reads to match in lock-step in exact mode
 	minInsert				= 0;     // minimum insert size (Maq = 0, SOAP = 400)
 	maxInsert				= 250;   // maximum insert size (Maq = 250, SOAP = 600)
 	mate1fw					= true;  // -1 mate aligns in fw orientation on fw strand
@@ -212,7 +234,8 @@ static void resetOptions() {
 	mixedAttemptLim			= 100;   // number of attempts to make in "mixed mode" before giving up on orientation
 	dontReconcileMates		= true;  // suppress pairwise all-versus-all way of resolving mates
 	cacheLimit				= 5;     // ranges w/ size > limit will be cached
-	cacheSize				= 0;     // # words per range cache
+	cacheSize				= 0;     // # bytes per range cache
+	cacheFile.clear();               // don't save range caches between runs
 	offBase					= 0;     // offsets are 0-based by default, but configurable
 	tryHard					= false; // set very high maxBts, mixedAttemptLim
 	skipReads				= 0;     // # reads/read pairs to skip
@@ -295,8 +318,14 @@ enum {
 	ARG_SHMEM,
 	ARG_MM,
 	ARG_MMSWEEP,
+	ARG_HUGEPAGES,
+	ARG_NUMA,
+	ARG_LOAD_THREADS,
+	ARG_GZ_THREADS,
+	ARG_LOAD_DIRECT,
 	ARG_STATEFUL,
 	ARG_PREFETCH_WIDTH,
+	ARG_EXACT_BATCH,
 	ARG_FF,
 	ARG_FR,
 	ARG_RF,
@@ -304,6 +333,7 @@ enum {
 	ARG_NO_RECONCILE,
 	ARG_CACHE_LIM,
 	ARG_CACHE_SZ,
+	ARG_CACHE_FILE,
 	ARG_NO_FW,
 	ARG_NO_RC,
 	ARG_SKIP,
@@ -399,6 +429,7 @@ static struct option long_options[] = {
 	{(char*)"partition",    required_argument, 0,            ARG_PARTITION},
 	{(char*)"stateful",     no_argument,       0,            ARG_STATEFUL},
 	{(char*)"prewidth",     required_argument, 0,            ARG_PREFETCH_WIDTH},
+	{(char*)"exbatch",      required_argument, 0,            ARG_EXACT_BATCH},
 	{(char*)"ff",           no_argument,       0,            ARG_FF},
 	{(char*)"fr",           no_argument,       0,            ARG_FR},
 	{(char*)"rf",           no_argument,       0,            ARG_RF},
@@ -407,6 +438,7 @@ static struct option long_options[] = {
 	{(char*)"noreconcile",  no_argument,       0,            ARG_NO_RECONCILE},
 	{(char*)"cachelim",     required_argument, 0,            ARG_CACHE_LIM},
 	{(char*)"cachesz",      required_argument, 0,            ARG_CACHE_SZ},
+	{(char*)"cachefile",    required_argument, 0,            ARG_CACHE_FILE},
 	{(char*)"nofw",         no_argument,       0,            ARG_NO_FW},
 	{(char*)"norc",         no_argument,       0,            ARG_NO_RC},
 	{(char*)"offbase",      required_argument, 0,            'B'},
@@ -425,6 +457,11 @@ static struct option long_options[] = {
 	{(char*)"mm",           no_argument,       0,            ARG_MM},
 	{(char*)"shmem",        no_argument,       0,            ARG_SHMEM},
 	{(char*)"mmsweep",      no_argument,       0,            ARG_MMSWEEP},
+	{(char*)"hugepages",    required_argument, 0,            ARG_HUGEPAGES},
+	{(char*)"numa",         required_argument, 0,            ARG_NUMA},
+	{(char*)"load-threads", required_argument, 0,            ARG_LOAD_THREADS},
+	{(char*)"load-direct",  no_argument,       0,            ARG_LOAD_DIRECT},
+	{(char*)"gz-threads",   required_argument, 0,            ARG_GZ_THREADS},
 	{(char*)"recal",        no_argument,       0,            ARG_RECAL},
 	{(char*)"pev2",         no_argument,       0,            ARG_PEV2},
 	{(char*)"refmap",       required_argument, 0,            ARG_REFMAP},
@@ -472,6 +509,8 @@ static void printUsage(ostream& out) {
 	out << "Usage: " << endl
         << tool_name << " [options]* <ebwt> {-1 <m1> -2 <m2> | --12 <r> | <s>} [<hit>]" << endl
         << endl
+	    << "  <ebwt>  Index filename prefix (minus trailing .X.ebwt), or a comma-separated" << endl
+	    << "          list of them to search all at once" << endl
 	    << "  <m1>    Comma-separated list of files containing upstream mates (or the" << endl
 	    << "          sequences themselves, if -c is set) paired with mates in <m2>" << endl
 	    << "  <m2>    Comma-separated list of files containing downstream mates (or the" << endl
@@ -550,12 +589,21 @@ static void printUsage(ostream& out) {
 	    << "Performance:" << endl
 	    << "  -o/--offrate <int> override offrate of index; must be >= index's offrate" << endl
 	    << "  -p/--threads <int> number of alignment threads to launch (default: 1)" << endl
+	    << "  --exbatch <int>    # reads per thread matched in lock-step in -v 0 mode (32)" << endl
 #ifdef BOWTIE_MM
 	    << "  --mm               use memory-mapped I/O for index; many 'bowtie's can share" << endl
 #endif
 #ifdef BOWTIE_SHARED_MEM
 	    << "  --shmem            use shared mem for index; many 'bowtie's can share" << endl
 #endif
+#ifdef BOWTIE_MEM_POLICY
+	    << "  --hugepages <pg>   back index with huge pages: thp, 2m or 1g" << endl
+	    << "  --numa <mode>      spread index over NUMA nodes: interleave or replicate" << endl
+#endif
+	    << "  --load-threads <int> # threads reading index files (default: -p)" << endl
+	    << "  --load-direct      read index files with O_DIRECT, bypassing page cache" << endl
+	    << "  --gz-threads <int> # threads inflating BGZF/indexed .gz reads (default: -p, max 4)" << endl
+	    << "  --cachefile <path> save/reload range caches in <path>, <path>.rev" << endl
 	    << "Other:" << endl
 	    << "  --seed <int>       seed for random number generator" << endl
 	    << "  --verbose          verbose output (for debugging)" << endl
@@ -719,6 +767,40 @@ static void parseOptions(int argc, const char **argv) {
 #endif
 			}
 			case ARG_MMSWEEP: mmSweep = true; break;
+			case ARG_LOAD_THREADS:
+				loadThreads = parseInt(1, "--load-threads arg must be at least 1");
+				break;
+			case ARG_LOAD_DIRECT: gLoadDirect = true; break;
+			case ARG_GZ_THREADS:
+				gzThreads = parseInt(1, "--gz-threads arg must be at least 1");
+				break;
+			case ARG_HUGEPAGES:
+			case ARG_NUMA: {
+#ifdef BOWTIE_MEM_POLICY
+				string arg = optarg;
+				if(next_option == ARG_NUMA) {
+					if     (arg == "interleave") numaMode = NUMA_INTERLEAVE;
+					else if(arg == "replicate")  numaMode = NUMA_REPLICATE;
+					else {
+						cerr << "--numa arg must be interleave or replicate" << endl;
+						throw 1;
+					}
+				} else {
+					if     (arg == "thp")               hugePages = HUGEPAGES_THP;
+					else if(arg == "2m" || arg == "2M") hugePages = HUGEPAGES_2M;
+					else if(arg == "1g" || arg == "1G") hugePages = HUGEPAGES_1G;
+					else {
+						cerr << "--hugepages arg must be thp, 2m or 1g" << endl;
+						throw 1;
+					}
+				}
+				break;
+#else
+				cerr << "Huge pages and NUMA placement are disabled because bowtie was not compiled" << endl
+				     << "with BOWTIE_MEM_POLICY defined.  They are only supported under Linux." << endl;
+				throw 1;
+#endif
+			}
 			case ARG_HADOOPOUT: hadoopOut = true; break;
 			case ARG_AL: dumpAlBase = optarg; break;
 			case ARG_UN: dumpUnalBase = optarg; break;
@@ -754,6 +836,9 @@ static void parseOptions(int argc, const char **argv) {
 			case ARG_PREFETCH_WIDTH:
 				prefetchWidth = parseInt(1, "--prewidth must be at least 1");
 				break;
+			case ARG_EXACT_BATCH:
+				exactBatch = parseInt(1, "--exbatch must be at least 1");
+				break;
 			case 'B':
 				offBase = parseInt(-999999, "-B/--offbase cannot be a large negative number");
 				break;
@@ -793,9 +878,12 @@ static void parseOptions(int argc, const char **argv) {
 				cacheLimit = (uint32_t)parseInt(1, "--cachelim arg must be at least 1");
 				break;
 			case ARG_CACHE_SZ:
-				cacheSize = (uint32_t)parseInt(1, "--cachesz arg must be at least 1");
+				cacheSize = (size_t)parseInt(1, "--cachesz arg must be at least 1");
 				cacheSize *= (1024 * 1024); // convert from MB to B
 				break;
+			case ARG_CACHE_FILE:
+				cacheFile = optarg;
+				break;
 			case ARG_NO_RECONCILE:
 				dontReconcileMates = true;
 				break;
@@ -825,7 +913,7 @@ static void parseOptions(int argc, const char **argv) {
 			case ARG_CHUNKSZ: chunkSz = parseInt(1, "--chunksz arg must be at least 1"); break;
 			case ARG_CHUNKVERBOSE: chunkVerbose = true; break;
 			case ARG_BETTER: stateful = true; better = true; break;
-			case ARG_BEST: stateful = true; useV1 = false; break;
+			case ARG_BEST: stateful = true; useV1 = false; best = true; break;
 			case ARG_STRATA: strata = true; break;
 			case ARG_VERBOSE: verbose = true; break;
 			case ARG_STARTVERBOSE: startVerbose = true; break;
@@ -978,6 +1066,22 @@ static void parseOptions(int argc, const char **argv) {
 		cerr << "Warning: --shmem overrides --mm..." << endl;
 		useMm = false;
 	}
+	gLoadThreads = (loadThreads > 0) ? loadThreads : nthreads;
+	gInflateThreads = (gzThreads > 0) ? gzThreads : min(nthreads, 4);
+	if(hugePages != HUGEPAGES_NONE && useShmem) {
+		cerr << "Error: --hugepages cannot be combined with --shmem" << endl;
+		throw 1;
+	}
+	if(numaMode != NUMA_NONE && (useMm || useShmem)) {
+		cerr << "Error: --numa cannot be combined with --mm or --shmem" << endl;
+		throw 1;
+	}
+	if(numaMode != NUMA_NONE && numaNodes() < 2) {
+		if(!quiet) {
+			cerr << "Warning: only one NUMA node is online; ignoring --numa" << endl;
+		}
+		numaMode = NUMA_NONE;
+	}
 	if(snpPhred <= 10 && color && !quiet) {
 		cerr << "Warning: the colorspace SNP penalty (--snpphred) is very low: " << snpPhred << endl;
 	}
@@ -1024,15 +1128,15 @@ static const char *argv0 = NULL;
 	assert(!empty(p->bufa().patFw)); \
 	String<Dna5>& patFw  = p->bufa().patFw;  \
 	patFw.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<Dna5>& patRc  = p->bufa().patRc;  \
+	String<Dna5>& patRc  = p->bufa().getPatRc();  \
 	patRc.data_begin += 0; /* suppress "unused" compiler warning */ \
 	String<char>& qual = p->bufa().qual; \
 	qual.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<char>& qualRev = p->bufa().qualRev; \
+	String<char>& qualRev = p->bufa().getQualRev(); \
 	qualRev.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<Dna5>& patFwRev  = p->bufa().patFwRev;  \
+	String<Dna5>& patFwRev  = p->bufa().getPatFwRev();  \
 	patFwRev.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<Dna5>& patRcRev  = p->bufa().patRcRev;  \
+	String<Dna5>& patRcRev  = p->bufa().getPatRcRev();  \
 	patRcRev.data_begin += 0; /* suppress "unused" compiler warning */ \
 	String<char>& name   = p->bufa().name;   \
 	name.data_begin += 0; /* suppress "unused" compiler warning */ \
@@ -1055,9 +1159,9 @@ static const char *argv0 = NULL;
 	patFw.data_begin += 0; /* suppress "unused" compiler warning */ \
 	String<char>& qual = p->bufa().qual; \
 	qual.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<Dna5>& patFwRev  = p->bufa().patFwRev;  \
+	String<Dna5>& patFwRev  = p->bufa().getPatFwRev();  \
 	patFwRev.data_begin += 0; /* suppress "unused" compiler warning */ \
-	String<char>& qualRev = p->bufa().qualRev; \
+	String<char>& qualRev = p->bufa().getQualRev(); \
 	qualRev.data_begin += 0; /* suppress "unused" compiler warning */ \
 	String<char>& name   = p->bufa().name;   \
 	name.data_begin += 0; /* suppress "unused" compiler warning */ \
@@ -1127,6 +1231,342 @@ createSinkFactory(HitSink& _sink) {
 	return sink;
 }
 
+/// Indexes and references loaded once by a --server process, which
+/// the jobs it forks share copy-on-write; keyed by residentKey()
+static map<string, Ebwt<String<Dna> >*> residentEbwts;
+static map<string, BitPairReference*>   residentRefs;
+
+/**
+ * Key for the index or reference at 'base' as the current options
+ * would load it.  The directory is resolved so that jobs started from
+ * other directories find the server's copy; jobs whose options load
+ * the files differently don't share it.
+ */
+static string residentKey(const string& base) {
+	string canon = base;
+#ifdef BOWTIE_SERVER
+	size_t slash = base.rfind('/');
+	string dir = (slash == string::npos) ? "." : base.substr(0, max<size_t>(slash, 1));
+	char buf[PATH_MAX];
+	if(realpath(dir.c_str(), buf) != NULL) {
+		canon = buf;
+		if(canon[canon.length()-1] != '/') canon += '/';
+		canon += (slash == string::npos) ? base : base.substr(slash + 1);
+	}
+#endif
+	ostringstream os;
+	os << canon << '\t' << color << ' ' << offRate << ' ' << isaRate << ' '
+	   << useMm << ' ' << useShmem << ' ' << hugePages << ' ' << noRefNames;
+	return os.str();
+}
+
+/**
+ * Return the index at 'base', initialized but not necessarily loaded:
+ * the resident copy if there is a suitable one, else a new Ebwt.
+ * Release it with closeEbwt().
+ */
+static Ebwt<String<Dna> >* openEbwt(const string& base,
+                                    bool fw,
+                                    ReferenceMap* rmap)
+{
+	if(rmap == NULL && !residentEbwts.empty()) {
+		map<string, Ebwt<String<Dna> >*>::iterator it = residentEbwts.find(residentKey(base));
+		if(it != residentEbwts.end()) return it->second;
+	}
+	return new Ebwt<String<Dna> >(
+		base,
+		color,   // index is colorspace
+		-1,      // don't care about entireReverse
+		fw,      // forward or mirror index
+		offRate, // overriding
+		isaRate, // overriding
+		useMm,   // whether to use memory-mapped files
+		useShmem, // whether to use shared memory
+		mmSweep, // sweep memory-mapped files
+		!noRefNames, // load names?
+		rmap,    // reference map, or NULL if none is needed
+		verbose, // whether to be talkative
+		startVerbose, // talkative during initialization
+		false /*passMemExc*/,
+		sanityCheck,
+		hugePages); // page size for the big arrays
+}
+
+static bool isResident(const Ebwt<String<Dna> >* ebwt) {
+	map<string, Ebwt<String<Dna> >*>::const_iterator it;
+	for(it = residentEbwts.begin(); it != residentEbwts.end(); ++it) {
+		if(it->second == ebwt) return true;
+	}
+	return false;
+}
+
+/**
+ * Evict an index from memory unless it's resident.
+ */
+static void evictEbwt(Ebwt<String<Dna> >& ebwt) {
+	if(ebwt.isInMemory() && !isResident(&ebwt)) {
+		ebwt.evictFromMemory();
+	}
+}
+
+static void closeEbwt(Ebwt<String<Dna> >* ebwt) {
+	if(ebwt != NULL && !isResident(ebwt)) delete ebwt;
+}
+
+/**
+ * Return the reference for the index at 'base': the resident copy if
+ * there is one, else a newly loaded one.  Release it with
+ * closeReference().
+ */
+static BitPairReference* openReference(const string& base,
+                                       vector<String<Dna5> >& os)
+{
+	if(!residentRefs.empty()) {
+		map<string, BitPairReference*>::iterator it = residentRefs.find(residentKey(base));
+		if(it != residentRefs.end()) return it->second;
+	}
+	BitPairReference *refs = new BitPairReference(base, color, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
+	if(!refs->loaded()) throw 1;
+	return refs;
+}
+
+static void closeReference(BitPairReference* refs) {
+	if(refs == NULL) return;
+	map<string, BitPairReference*>::const_iterator it;
+	for(it = residentRefs.begin(); it != residentRefs.end(); ++it) {
+		if(it->second == refs) return;
+	}
+	delete refs;
+}
+
+/**
+ * One of the indexes searched, when <ebwt> is a comma-separated list
+ * of them.  Hits in it have 'refBase' added to their reference ids, so
+ * that the references of all the indexes are numbered consecutively.
+ */
+struct SearchShard {
+	string              base;    // adjusted index basename
+	Ebwt<String<Dna> >* ebwtFw;  // forward index
+	Ebwt<String<Dna> >* ebwtBw;  // mirror index, or NULL if not needed
+	BitPairReference*   refs;    // reference, or NULL if not needed
+	TIndexOffU          refBase; // # references in the indexes before it
+	// With --numa replicate, copies of ebwtFw/ebwtBw in the memory of
+	// NUMA nodes 1 and up; node 0 uses the originals
+	vector<Ebwt<String<Dna> >*> replicasFw;
+	vector<Ebwt<String<Dna> >*> replicasBw;
+};
+static vector<SearchShard> searchShards; // first is adjustedEbwtFileBase
+
+/**
+ * Load the second and later indexes into memory, along with their
+ * references if the first index needed its reference ('refs').  The
+ * caller loads the first index.
+ */
+static void replicateSearchShards();
+
+/**
+ * Load the second and later indexes into memory, along with their
+ * references if the first index needed its reference ('refs').  The
+ * caller loads the first index.  With --numa replicate, also load the
+ * copies for the other NUMA nodes.
+ */
+static void loadSearchShards(BitPairReference* refs,
+                             vector<String<Dna5> >& os)
+{
+	searchShards[0].refs = refs;
+	if(searchShards.size() > 1) {
+		Timer _t(cerr, "Time loading additional indexes: ", timing);
+		for(size_t i = 1; i < searchShards.size(); i++) {
+			SearchShard& sh = searchShards[i];
+			if(!sh.ebwtFw->isInMemory()) {
+				sh.ebwtFw->loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
+			}
+			if(sh.ebwtBw != NULL && !sh.ebwtBw->isInMemory()) {
+				sh.ebwtBw->loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
+			}
+			if(refs != NULL) {
+				sh.refs = openReference(sh.base, os);
+			}
+		}
+	}
+	if(numaMode == NUMA_REPLICATE) {
+		replicateSearchShards();
+	}
+	if(numaMode != NUMA_NONE) {
+		// The driver set a policy for loading the indexes; memory the
+		// search threads touch from here on should be local to them
+		numaSetPolicy(NUMA_NONE, 0);
+	}
+}
+
+/**
+ * Load another copy of the in-memory index 'orig' of the given shard,
+ * placed according to the calling thread's memory policy.
+ */
+static Ebwt<String<Dna> >* loadReplica(const SearchShard& sh,
+                                       const Ebwt<String<Dna> >& orig)
+{
+	Ebwt<String<Dna> >* ebwt = new Ebwt<String<Dna> >(
+		orig.fw() ? sh.base : (sh.base + ".rev"),
+		color,   // index is colorspace
+		-1,      // don't care about entireReverse
+		orig.fw(),
+		offRate,
+		isaRate,
+		false,   // --numa excludes --mm
+		false,   // and --shmem
+		false,   // mmSweep
+		!noRefNames,
+		orig.rmap(),
+		verbose,
+		startVerbose,
+		false,   // passMemExc
+		sanityCheck,
+		hugePages);
+	ebwt->loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
+	return ebwt;
+}
+
+/**
+ * Load a copy of each in-memory index into the memory of each NUMA
+ * node but the first, which holds the originals.
+ */
+static void replicateSearchShards() {
+	Timer _t(cerr, "Time replicating indexes across NUMA nodes: ", timing);
+	for(int node = 1; node < numaNodes(); node++) {
+		if(!numaSetPolicy(NUMA_REPLICATE, node) && !quiet) {
+			cerr << "Warning: could not place index copy in the memory of NUMA node " << node << endl;
+		}
+		for(size_t i = 0; i < searchShards.size(); i++) {
+			SearchShard& sh = searchShards[i];
+			if(sh.ebwtFw->isInMemory()) {
+				sh.replicasFw.push_back(loadReplica(sh, *sh.ebwtFw));
+			}
+			if(sh.ebwtBw != NULL && sh.ebwtBw->isInMemory()) {
+				sh.replicasBw.push_back(loadReplica(sh, *sh.ebwtBw));
+			}
+		}
+	}
+}
+
+/**
+ * Free the references loaded by loadSearchShards() and any copies of
+ * the indexes made for other NUMA nodes.
+ */
+static void unloadSearchShards() {
+	searchShards[0].refs = NULL;
+	for(size_t i = 1; i < searchShards.size(); i++) {
+		closeReference(searchShards[i].refs);
+		searchShards[i].refs = NULL;
+	}
+	for(size_t i = 0; i < searchShards.size(); i++) {
+		SearchShard& sh = searchShards[i];
+		for(size_t j = 0; j < sh.replicasFw.size(); j++) delete sh.replicasFw[j];
+		for(size_t j = 0; j < sh.replicasBw.size(); j++) delete sh.replicasBw[j];
+		sh.replicasFw.clear();
+		sh.replicasBw.clear();
+	}
+}
+
+/**
+ * With --numa replicate, pin search thread 'tid' (numbered from 1) to
+ * a NUMA node, dealing threads out to nodes in turn, and return that
+ * node.  Otherwise return node 0.
+ */
+static int searchThreadNode(int tid) {
+	if(numaMode != NUMA_REPLICATE) return 0;
+	int node = (tid - 1) % numaNodes();
+	if(!numaPinThread(node) && verbose) {
+		cerr << "Could not pin search thread " << tid << " to NUMA node " << node << endl;
+	}
+	return node;
+}
+
+/**
+ * Return the copy of in-memory index 'ebwt' that lives on NUMA node
+ * 'node'.
+ */
+static Ebwt<String<Dna> >* localEbwt(Ebwt<String<Dna> >* ebwt, int node) {
+	if(node == 0 || ebwt == NULL) return ebwt;
+	for(size_t i = 0; i < searchShards.size(); i++) {
+		const SearchShard& sh = searchShards[i];
+		if(ebwt == sh.ebwtFw && (size_t)node <= sh.replicasFw.size()) {
+			return sh.replicasFw[node-1];
+		}
+		if(ebwt == sh.ebwtBw && (size_t)node <= sh.replicasBw.size()) {
+			return sh.replicasBw[node-1];
+		}
+	}
+	return ebwt;
+}
+
+/**
+ * Append the names of an index's 'nPat' references to 'all', which
+ * holds those of the indexes before it.  References without a name
+ * get their number, as in the output.
+ */
+static void appendShardRefnames(const vector<string>& names,
+                                size_t nPat,
+                                vector<string>& all)
+{
+	for(size_t i = 0; i < nPat; i++) {
+		if(i < names.size()) {
+			all.push_back(names[i]);
+		} else {
+			ostringstream ss;
+			ss << all.size();
+			all.push_back(ss.str());
+		}
+	}
+}
+
+/**
+ * Create the range caches shared by all search threads, if the user
+ * gave --cachesz or --cachefile.  The stateful aligners and the
+ * backtracking aligners both consult them.  With --cachefile,
+ * pre-populate them from the entries saved by an earlier run against
+ * the same index.  The indexes must already be in memory.
+ */
+static void createRangeCaches(Ebwt<String<Dna> >* ebwtFw,
+                              Ebwt<String<Dna> >* ebwtBw)
+{
+	rangeCacheFw = rangeCacheBw = NULL;
+	// Cached ranges belong to one index
+	if(searchShards.size() > 1) return;
+	if(cacheSize == 0 && !cacheFile.empty()) {
+		cacheSize = 64 * 1024 * 1024; // default size when saving caches
+	}
+	if(cacheSize == 0) return;
+	Timer _t(cerr, "Time loading range caches: ", timing && !cacheFile.empty());
+	rangeCacheFw = new RangeCache(cacheSize, ebwtFw);
+	if(!cacheFile.empty()) {
+		rangeCacheFw->load(cacheFile, ebwtFw->fingerprint(), verbose || startVerbose);
+	}
+	if(ebwtBw != NULL) {
+		rangeCacheBw = new RangeCache(cacheSize, ebwtBw);
+		if(!cacheFile.empty()) {
+			rangeCacheBw->load(cacheFile + ".rev", ebwtBw->fingerprint(), verbose || startVerbose);
+		}
+	}
+}
+
+/**
+ * Free the shared range caches once all search threads have joined,
+ * first saving them if the user gave --cachefile.
+ */
+static void destroyRangeCaches() {
+	if(!cacheFile.empty()) {
+		if(rangeCacheFw != NULL) {
+			rangeCacheFw->save(cacheFile, rangeCacheFw->ebwt()->fingerprint());
+		}
+		if(rangeCacheBw != NULL) {
+			rangeCacheBw->save(cacheFile + ".rev", rangeCacheBw->ebwt()->fingerprint());
+		}
+	}
+	delete rangeCacheFw; rangeCacheFw = NULL;
+	delete rangeCacheBw; rangeCacheBw = NULL;
+}
+
 /**
  * Search through a single (forward) Ebwt index for exact end-to-end
  * hits.  Assumes that index is already loaded into memory.
@@ -1138,9 +1578,10 @@ static vector<String<Dna5> >* exactSearch_os;
 static BitPairReference*      exactSearch_refs;
 static void exactSearchWorker(void *vp) {
 	int tid = *((int*)vp);
+	int node = searchThreadNode(tid);
 	PairedPatternSource& _patsrc = *exactSearch_patsrc;
 	HitSink& _sink               = *exactSearch_sink;
-	Ebwt<String<Dna> >& ebwt     = *exactSearch_ebwt;
+	Ebwt<String<Dna> >& ebwt     = *localEbwt(exactSearch_ebwt, node);
 	vector<String<Dna5> >& os    = *exactSearch_os;
 	const BitPairReference* refs =  exactSearch_refs;
 
@@ -1167,6 +1608,7 @@ static void exactSearchWorker(void *vp) {
 	        verbose,        // verbose
 	        &os,
 	        false);         // considerQuals
+	bt.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	bool skipped = false;
 	while(true) {
 		FINISH_READ(patsrc);
@@ -1177,72 +1619,171 @@ static void exactSearchWorker(void *vp) {
 	WORKER_EXIT();
 }
 
+/**
+ * Like exactSearchWorker, but pulls exactBatch reads at a time and
+ * finds the exact-match ranges for all of them (both orientations) in
+ * lock-step with BatchExactSearch before reporting them in order.
+ */
+static void exactSearchWorkerBatch(void *vp) {
+	int tid = *((int*)vp);
+	int node = searchThreadNode(tid);
+	PairedPatternSource& _patsrc = *exactSearch_patsrc;
+	HitSink& _sink               = *exactSearch_sink;
+	Ebwt<String<Dna> >& ebwt     = *localEbwt(exactSearch_ebwt, node);
+	vector<String<Dna5> >& os    = *exactSearch_os;
+	const BitPairReference* refs =  exactSearch_refs;
+
+	// Per-thread initialization
+	PatternSourcePerThreadFactory *patsrcFact = createPatsrcFactory(_patsrc, tid);
+	vector<PatternSourcePerThread*>* patsrc = patsrcFact->create(exactBatch);
+	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
+	HitSinkPerThread* sink = sinkFact->create();
+	EbwtSearchParams<String<Dna> > params(
+	        *sink,      // HitSink
+	        os,         // reference sequences
+	        true,       // read is forward
+	        true);       // index is forward
+	GreedyDFSRangeSource bt(
+	        &ebwt, params,
+	        refs,           // reference sequence (for colorspace)
+	        0xffffffff,     // qualThresh
+	        0xffffffff,     // max backtracks (no max)
+	        0,              // reportPartials (don't)
+	        true,           // reportExacts
+	        rangeMode,      // reportRanges
+	        NULL,           // seedlings
+	        NULL,           // mutations
+	        verbose,        // verbose
+	        &os,
+	        false);         // considerQuals
+	bt.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
+	assert(ebwt.fw());
+	// Slot 2*i is read i's forward orientation, 2*i+1 its reverse
+	// complement
+	BatchExactSearch batch(ebwt, 2 * exactBatch);
+	// The sources share one stream of reads, so filling the block
+	// from them in turn keeps the reads (and the output) in input
+	// order
+	vector<PatternSourcePerThread*> live(*patsrc);
+	vector<PatternSourcePerThread*> reads;
+	while(!live.empty()) {
+		reads.clear();
+		batch.clear();
+		size_t nlive = 0;
+		for(size_t i = 0; i < live.size(); i++) {
+			PatternSourcePerThread* p = live[i];
+			p->nextReadPair();
+			if(p->empty() || p->patid() >= qUpto) {
+				p->bufa().clearAll();
+				continue;
+			}
+			live[nlive++] = p;
+			assert(!empty(p->bufa().patFw));
+			reads.push_back(p);
+			batch.add(nofw ? NULL : &p->bufa().patFw);
+			batch.add(norc ? NULL : &p->bufa().getPatRc());
+		}
+		live.resize(nlive);
+		batch.run();
+		for(uint32_t i = 0; i < reads.size(); i++) {
+			PatternSourcePerThread* p = reads[i];
+			uint32_t plen = (uint32_t)length(p->bufa().patFw);
+			params.setPatId(p->patid());
+			bool hit = false;
+			if(batch.found(2*i)) {
+				// Match against forward strand
+				params.setFw(true);
+				bt.setQuery(p->bufa());
+				bt.setOffs(0, 0, plen, plen, plen, plen);
+				// If we matched on the forward strand, ignore the
+				// reverse-complement strand
+				hit = bt.reportExact(batch.top(2*i), batch.bot(2*i));
+			}
+			if(!hit && batch.found(2*i+1)) {
+				// Process reverse-complement read
+				params.setFw(false);
+				bt.setQuery(p->bufa());
+				bt.setOffs(0, 0, plen, plen, plen, plen);
+				bt.reportExact(batch.top(2*i+1), batch.bot(2*i+1));
+			}
+			sink->finishRead(*p, true, true);
+		}
+	}
+	WORKER_EXIT();
+}
+
 /**
  * A statefulness-aware worker driver.  Uses UnpairedExactAlignerV1.
  */
 static void exactSearchWorkerStateful(void *vp) {
 	int tid = *((int*)vp);
+	int node = searchThreadNode(tid);
 	PairedPatternSource& _patsrc = *exactSearch_patsrc;
 	HitSink& _sink               = *exactSearch_sink;
-	Ebwt<String<Dna> >& ebwt     = *exactSearch_ebwt;
 	vector<String<Dna5> >& os    = *exactSearch_os;
-	BitPairReference* refs       =  exactSearch_refs;
 
 	// Global initialization
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
 
 	ChunkPool *pool = new ChunkPool(chunkSz * 1024, chunkPoolMegabytes * 1024 * 1024, chunkVerbose);
-	UnpairedExactAlignerV1Factory alSEfact(
-			ebwt,
-			NULL,
-			!nofw,
-			!norc,
-			_sink,
-			*sinkFact,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
-			cacheLimit,
-			pool,
-			refs,
-			os,
-			!noMaqRound,
-			!better,
-			strandFix,
-			rangeMode,
-			verbose,
-			quiet,
-			seed);
-	PairedExactAlignerV1Factory alPEfact(
-			ebwt,
-			NULL,
-			color,
-			!nofw,
-			!norc,
-			useV1,
-			_sink,
-			*sinkFact,
-			mate1fw,
-			mate2fw,
-			minInsert,
-			maxInsert,
-			dontReconcileMates,
-			mhits,       // for symCeiling
-			mixedThresh,
-			mixedAttemptLim,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
-			cacheLimit,
-			pool,
-			refs, os,
-			reportSe,
-			!noMaqRound,
-			strandFix,
-			!better,
-			rangeMode,
-			verbose,
-			quiet,
-			seed);
+	// Without --best/--better, later indexes needn't be searched once
+	// earlier ones have yielded -k hits
+	ShardedAlignerFactory alSEfact(*sinkFact, searchShards.size(), !best && !better);
+	ShardedAlignerFactory alPEfact(*sinkFact, searchShards.size(), !best && !better);
+	for(size_t i = 0; i < searchShards.size(); i++) {
+		const SearchShard& sh = searchShards[i];
+		alSEfact.addShard(new UnpairedExactAlignerV1Factory(
+				*localEbwt(sh.ebwtFw, node),
+				NULL,
+				!nofw,
+				!norc,
+				_sink,
+				alSEfact.shardSinks(sh.refBase),
+				rangeCacheFw,
+				rangeCacheBw,
+				cacheLimit,
+				pool,
+				sh.refs,
+				os,
+				!noMaqRound,
+				!better,
+				strandFix,
+				rangeMode,
+				verbose,
+				quiet,
+				seed));
+		alPEfact.addShard(new PairedExactAlignerV1Factory(
+				*localEbwt(sh.ebwtFw, node),
+				NULL,
+				color,
+				!nofw,
+				!norc,
+				useV1,
+				_sink,
+				alPEfact.shardSinks(sh.refBase),
+				mate1fw,
+				mate2fw,
+				minInsert,
+				maxInsert,
+				dontReconcileMates,
+				mhits,       // for symCeiling
+				mixedThresh,
+				mixedAttemptLim,
+				rangeCacheFw,
+				rangeCacheBw,
+				cacheLimit,
+				pool,
+				sh.refs, os,
+				reportSe,
+				!noMaqRound,
+				strandFix,
+				!better,
+				rangeMode,
+				verbose,
+				quiet,
+				seed));
+	}
 	{
 		MixedMultiAligner multi(
 				prefetchWidth,
@@ -1265,13 +1806,13 @@ static void exactSearchWorkerStateful(void *vp) {
 	bt.setQuery(&p->bufa().patFw, &p->bufa().qual, &p->bufa().name); \
 	params.setFw(true);
 #define SET_A_RC(bt, p, params) \
-	bt.setQuery(&p->bufa().patRc, &p->bufa().qualRev, &p->bufa().name); \
+	bt.setQuery(&p->bufa().getPatRc(), &p->bufa().getQualRev(), &p->bufa().name); \
 	params.setFw(false);
 #define SET_B_FW(bt, p, params) \
 	bt.setQuery(&p->bufb().patFw, &p->bufb().qual, &p->bufb().name); \
 	params.setFw(true);
 #define SET_B_RC(bt, p, params) \
-	bt.setQuery(&p->bufb().patRc, &p->bufb().qualRev, &p->bufb().name); \
+	bt.setQuery(&p->bufb().getPatRc(), &p->bufb().getQualRev(), &p->bufb().name); \
 	params.setFw(false);
 
 /**
@@ -1288,8 +1829,7 @@ static void exactSearch(PairedPatternSource& _patsrc,
 	exactSearch_ebwt   = &ebwt;
 	exactSearch_os     = &os;
 
-	assert(!ebwt.isInMemory());
-	{
+	if(!ebwt.isInMemory()) {
 		// Load the rest of (vast majority of) the backward Ebwt into
 		// memory
 		Timer _t(cerr, "Time loading forward index: ", timing);
@@ -1300,14 +1840,16 @@ static void exactSearch(PairedPatternSource& _patsrc,
 	bool pair = mates1.size() > 0 || mates12.size() > 0;
 	if(color || (pair && mixedThresh < 0xffffffff)) {
 		Timer _t(cerr, "Time loading reference: ", timing);
-		refs = new BitPairReference(adjustedEbwtFileBase, color, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
-		if(!refs->loaded()) throw 1;
+		refs = openReference(adjustedEbwtFileBase, os);
 	}
 	exactSearch_refs   = refs;
+	loadSearchShards(refs, os);
 
 	AutoArray<tthread::thread*> threads(nthreads);
 	AutoArray<int> tids(nthreads);
 
+	// Create range cache, which is shared among all aligners
+	createRangeCaches(&ebwt, NULL);
 	CHUD_START();
 	{
 		Timer _t(cerr, "Time for 0-mismatch search: ", timing);
@@ -1316,6 +1858,8 @@ static void exactSearch(PairedPatternSource& _patsrc,
 			tids[i] = i+1;
 			if(stateful) {
                                 threads[i] = new tthread::thread(exactSearchWorkerStateful, (void*)&tids[i]);
+			} else if(exactBatch > 1) {
+                                threads[i] = new tthread::thread(exactSearchWorkerBatch, (void*)&tids[i]);
 			} else {
                                 threads[i] = new tthread::thread(exactSearchWorker, (void*)&tids[i]);
 			}
@@ -1325,7 +1869,9 @@ static void exactSearch(PairedPatternSource& _patsrc,
                     threads[i]->join();
 
 	}
-	if(refs != NULL) delete refs;
+	destroyRangeCaches();
+	unloadSearchShards();
+	closeReference(refs);
 }
 
 /**
@@ -1351,68 +1897,71 @@ static BitPairReference*              mismatchSearch_refs;
  */
 static void mismatchSearchWorkerFullStateful(void *vp) {
 	int tid = *((int*)vp);
+	int node = searchThreadNode(tid);
 	PairedPatternSource&   _patsrc = *mismatchSearch_patsrc;
 	HitSink&               _sink   = *mismatchSearch_sink;
-	Ebwt<String<Dna> >&    ebwtFw  = *mismatchSearch_ebwtFw;
-	Ebwt<String<Dna> >&    ebwtBw  = *mismatchSearch_ebwtBw;
 	vector<String<Dna5> >& os      = *mismatchSearch_os;
-	BitPairReference*      refs    =  mismatchSearch_refs;
 
 	// Global initialization
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
 	ChunkPool *pool = new ChunkPool(chunkSz * 1024, chunkPoolMegabytes * 1024 * 1024, chunkVerbose);
 
-	Unpaired1mmAlignerV1Factory alSEfact(
-			ebwtFw,
-			&ebwtBw,
-			!nofw,
-			!norc,
-			_sink,
-			*sinkFact,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
-			cacheLimit,
-			pool,
-			refs,
-			os,
-			!noMaqRound,
-			!better,
-			strandFix,
-			rangeMode,
-			verbose,
-			quiet,
-			seed);
-	Paired1mmAlignerV1Factory alPEfact(
-			ebwtFw,
-			&ebwtBw,
-			color,
-			!nofw,
-			!norc,
-			useV1,
-			_sink,
-			*sinkFact,
-			mate1fw,
-			mate2fw,
-			minInsert,
-			maxInsert,
-			dontReconcileMates,
-			mhits,     // for symCeiling
-			mixedThresh,
-			mixedAttemptLim,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
-			cacheLimit,
-			pool,
-			refs, os,
-			reportSe,
-			!noMaqRound,
-			!better,
-			strandFix,
-			rangeMode,
-			verbose,
-			quiet,
-			seed);
+	ShardedAlignerFactory alSEfact(*sinkFact, searchShards.size(), !best && !better);
+	ShardedAlignerFactory alPEfact(*sinkFact, searchShards.size(), !best && !better);
+	for(size_t i = 0; i < searchShards.size(); i++) {
+		const SearchShard& sh = searchShards[i];
+		alSEfact.addShard(new Unpaired1mmAlignerV1Factory(
+				*localEbwt(sh.ebwtFw, node),
+				localEbwt(sh.ebwtBw, node),
+				!nofw,
+				!norc,
+				_sink,
+				alSEfact.shardSinks(sh.refBase),
+				rangeCacheFw,
+				rangeCacheBw,
+				cacheLimit,
+				pool,
+				sh.refs,
+				os,
+				!noMaqRound,
+				!better,
+				strandFix,
+				rangeMode,
+				verbose,
+				quiet,
+				seed));
+		alPEfact.addShard(new Paired1mmAlignerV1Factory(
+				*localEbwt(sh.ebwtFw, node),
+				localEbwt(sh.ebwtBw, node),
+				color,
+				!nofw,
+				!norc,
+				useV1,
+				_sink,
+				alPEfact.shardSinks(sh.refBase),
+				mate1fw,
+				mate2fw,
+				minInsert,
+				maxInsert,
+				dontReconcileMates,
+				mhits,     // for symCeiling
+				mixedThresh,
+				mixedAttemptLim,
+				rangeCacheFw,
+				rangeCacheBw,
+				cacheLimit,
+				pool,
+				sh.refs, os,
+				reportSe,
+				!noMaqRound,
+				!better,
+				strandFix,
+				rangeMode,
+				verbose,
+				quiet,
+				seed));
+	}
 	{
 		MixedMultiAligner multi(
 				prefetchWidth,
@@ -1435,8 +1984,9 @@ static void mismatchSearchWorkerFull(void *vp){
 	int tid = *((int*)vp);
 	PairedPatternSource&   _patsrc   = *mismatchSearch_patsrc;
 	HitSink&               _sink     = *mismatchSearch_sink;
-	Ebwt<String<Dna> >&    ebwtFw    = *mismatchSearch_ebwtFw;
-	Ebwt<String<Dna> >&    ebwtBw    = *mismatchSearch_ebwtBw;
+	int node = searchThreadNode(tid);
+	Ebwt<String<Dna> >&    ebwtFw    = *localEbwt(mismatchSearch_ebwtFw, node);
+	Ebwt<String<Dna> >&    ebwtBw    = *localEbwt(mismatchSearch_ebwtBw, node);
 	vector<String<Dna5> >& os        = *mismatchSearch_os;
 	const BitPairReference* refs     =  mismatchSearch_refs;
 
@@ -1463,6 +2013,7 @@ static void mismatchSearchWorkerFull(void *vp){
 	        verbose,        // verbose
 	        &os,
 	        false);         // considerQuals
+	bt.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	bool skipped = false;
 	while(true) {
 		FINISH_READ(patsrc);
@@ -1498,31 +2049,30 @@ static void mismatchSearchFull(PairedPatternSource& _patsrc,
 	mismatchSearch_hitMask      = NULL;
 	mismatchSearch_os           = &os;
 
-	assert(!ebwtFw.isInMemory());
-	assert(!ebwtBw.isInMemory());
-	{
+	if(!ebwtFw.isInMemory()) {
 		// Load the other half of the index into memory
 		Timer _t(cerr, "Time loading forward index: ", timing);
 		ebwtFw.loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
 	}
-	{
+	if(!ebwtBw.isInMemory()) {
 		// Load the other half of the index into memory
 		Timer _t(cerr, "Time loading mirror index: ", timing);
 		ebwtBw.loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
 	}
-	// Create range caches, which are shared among all aligners
 	BitPairReference *refs = NULL;
 	bool pair = mates1.size() > 0 || mates12.size() > 0;
 	if(color || (pair && mixedThresh < 0xffffffff)) {
 		Timer _t(cerr, "Time loading reference: ", timing);
-		refs = new BitPairReference(adjustedEbwtFileBase, color, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
-		if(!refs->loaded()) throw 1;
+		refs = openReference(adjustedEbwtFileBase, os);
 	}
 	mismatchSearch_refs = refs;
+	loadSearchShards(refs, os);
 
 	AutoArray<tthread::thread*> threads(nthreads);
 	AutoArray<int> tids(nthreads);
 
+	// Create range caches, which are shared among all aligners
+	createRangeCaches(&ebwtFw, &ebwtBw);
     CHUD_START();
     {
 		Timer _t(cerr, "Time for 1-mismatch full-index search: ", timing);
@@ -1539,33 +2089,9 @@ static void mismatchSearchFull(PairedPatternSource& _patsrc,
                     threads[i]->join();
 
     }
-	if(refs != NULL) delete refs;
-}
-
-#define SWITCH_TO_FW_INDEX() { \
-	/* Evict the mirror index from memory if necessary */ \
-	if(ebwtBw.isInMemory()) ebwtBw.evictFromMemory(); \
-	assert(!ebwtBw.isInMemory()); \
-	/* Load the forward index into memory if necessary */ \
-	if(!ebwtFw.isInMemory()) { \
-		Timer _t(cerr, "Time loading forward index: ", timing); \
-		ebwtFw.loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose); \
-	} \
-	assert(ebwtFw.isInMemory()); \
-	_patsrc.reset(); /* rewind pattern source to first pattern */ \
-}
-
-#define SWITCH_TO_BW_INDEX() { \
-	/* Evict the forward index from memory if necessary */ \
-	if(ebwtFw.isInMemory()) ebwtFw.evictFromMemory(); \
-	assert(!ebwtFw.isInMemory()); \
-	/* Load the forward index into memory if necessary */ \
-	if(!ebwtBw.isInMemory()) { \
-		Timer _t(cerr, "Time loading mirror index: ", timing); \
-		ebwtBw.loadIntoMemory(color ? 1 : 0, !noRefNames, startVerbose); \
-	} \
-	assert(ebwtBw.isInMemory()); \
-	_patsrc.reset(); /* rewind pattern source to first pattern */ \
+	destroyRangeCaches();
+	unloadSearchShards();
+	closeReference(refs);
 }
 
 #define ASSERT_NO_HITS_FW(ebwtfw) \
@@ -1646,12 +2172,10 @@ static BitPairReference*              twoOrThreeMismatchSearch_refs;
  */
 static void twoOrThreeMismatchSearchWorkerStateful(void *vp) {
 	int tid = *((int*)vp);
+	int node = searchThreadNode(tid);
 	PairedPatternSource&   _patsrc = *twoOrThreeMismatchSearch_patsrc;
 	HitSink&               _sink   = *twoOrThreeMismatchSearch_sink;
-	Ebwt<String<Dna> >&    ebwtFw  = *twoOrThreeMismatchSearch_ebwtFw;
-	Ebwt<String<Dna> >&    ebwtBw  = *twoOrThreeMismatchSearch_ebwtBw;
 	vector<String<Dna5> >& os      = *twoOrThreeMismatchSearch_os;
-	BitPairReference*      refs    =  twoOrThreeMismatchSearch_refs;
 	static bool            two     =  twoOrThreeMismatchSearch_two;
 
 	// Global initialization
@@ -1659,58 +2183,63 @@ static void twoOrThreeMismatchSearchWorkerStateful(void *vp) {
 	HitSinkPerThreadFactory* sinkFact = createSinkFactory(_sink);
 
 	ChunkPool *pool = new ChunkPool(chunkSz * 1024, chunkPoolMegabytes * 1024 * 1024, chunkVerbose);
-	Unpaired23mmAlignerV1Factory alSEfact(
-			ebwtFw,
-			&ebwtBw,
-			two,
-			!nofw,
-			!norc,
-			_sink,
-			*sinkFact,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
-			cacheLimit,
-			pool,
-			refs,
-			os,
-			!noMaqRound,
-			!better,
-			strandFix,
-			rangeMode,
-			verbose,
-			quiet,
-			seed);
-	Paired23mmAlignerV1Factory alPEfact(
-			ebwtFw,
-			&ebwtBw,
-			color,
-			!nofw,
-			!norc,
-			useV1,
-			two,
-			_sink,
-			*sinkFact,
-			mate1fw,
-			mate2fw,
-			minInsert,
-			maxInsert,
-			dontReconcileMates,
-			mhits,       // for symCeiling
-			mixedThresh,
-			mixedAttemptLim,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
-			cacheLimit,
-			pool,
-			refs, os,
-			reportSe,
-			!noMaqRound,
-			!better,
-			strandFix,
-			rangeMode,
-			verbose,
-			quiet,
-			seed);
+	ShardedAlignerFactory alSEfact(*sinkFact, searchShards.size(), !best && !better);
+	ShardedAlignerFactory alPEfact(*sinkFact, searchShards.size(), !best && !better);
+	for(size_t i = 0; i < searchShards.size(); i++) {
+		const SearchShard& sh = searchShards[i];
+		alSEfact.addShard(new Unpaired23mmAlignerV1Factory(
+				*localEbwt(sh.ebwtFw, node),
+				localEbwt(sh.ebwtBw, node),
+				two,
+				!nofw,
+				!norc,
+				_sink,
+				alSEfact.shardSinks(sh.refBase),
+				rangeCacheFw,
+				rangeCacheBw,
+				cacheLimit,
+				pool,
+				sh.refs,
+				os,
+				!noMaqRound,
+				!better,
+				strandFix,
+				rangeMode,
+				verbose,
+				quiet,
+				seed));
+		alPEfact.addShard(new Paired23mmAlignerV1Factory(
+				*localEbwt(sh.ebwtFw, node),
+				localEbwt(sh.ebwtBw, node),
+				color,
+				!nofw,
+				!norc,
+				useV1,
+				two,
+				_sink,
+				alPEfact.shardSinks(sh.refBase),
+				mate1fw,
+				mate2fw,
+				minInsert,
+				maxInsert,
+				dontReconcileMates,
+				mhits,       // for symCeiling
+				mixedThresh,
+				mixedAttemptLim,
+				rangeCacheFw,
+				rangeCacheBw,
+				cacheLimit,
+				pool,
+				sh.refs, os,
+				reportSe,
+				!noMaqRound,
+				!better,
+				strandFix,
+				rangeMode,
+				verbose,
+				quiet,
+				seed));
+	}
 	{
 		MixedMultiAligner multi(
 				prefetchWidth,
@@ -1731,8 +2260,9 @@ static void twoOrThreeMismatchSearchWorkerStateful(void *vp) {
 
 static void twoOrThreeMismatchSearchWorkerFull(void *vp) {
 	TWOTHREE_WORKER_SETUP();
-	Ebwt<String<Dna> >& ebwtFw = *twoOrThreeMismatchSearch_ebwtFw;
-	Ebwt<String<Dna> >& ebwtBw = *twoOrThreeMismatchSearch_ebwtBw;
+	int node = searchThreadNode(tid);
+	Ebwt<String<Dna> >& ebwtFw = *localEbwt(twoOrThreeMismatchSearch_ebwtFw, node);
+	Ebwt<String<Dna> >& ebwtBw = *localEbwt(twoOrThreeMismatchSearch_ebwtBw, node);
 	const BitPairReference* refs = twoOrThreeMismatchSearch_refs;
 	GreedyDFSRangeSource btr1(
 	        &ebwtFw, params,
@@ -1748,6 +2278,7 @@ static void twoOrThreeMismatchSearchWorkerFull(void *vp) {
 	        verbose,        // verbose
 	        &os,
 	        false);         // considerQuals
+	btr1.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	GreedyDFSRangeSource bt2(
 	        &ebwtBw, params,
 	        refs,           // reference sequence (for colorspace)
@@ -1762,6 +2293,7 @@ static void twoOrThreeMismatchSearchWorkerFull(void *vp) {
 	        verbose,        // verbose
 	        &os,
 	        false);         // considerQuals
+	bt2.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	GreedyDFSRangeSource bt3(
 	        &ebwtFw, params,
 	        refs,           // reference sequence (for colorspace)
@@ -1776,6 +2308,7 @@ static void twoOrThreeMismatchSearchWorkerFull(void *vp) {
 	        verbose,        // verbose
 	        &os,
 	        false);         // considerQuals
+	bt3.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	GreedyDFSRangeSource bthh3(
 	        &ebwtFw, params,
 	        refs,           // reference sequence (for colorspace)
@@ -1791,6 +2324,7 @@ static void twoOrThreeMismatchSearchWorkerFull(void *vp) {
 	        &os,
 	        false,          // considerQuals
 	        true);          // halfAndHalf
+	bthh3.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	bool skipped = false;
 	while(true) { // Read read-in loop
 		FINISH_READ(patsrc);
@@ -1821,25 +2355,21 @@ static void twoOrThreeMismatchSearchFull(
 		bool two = true)                /// true -> 2, false -> 3
 {
 	// Global initialization
-	assert(!ebwtFw.isInMemory());
-	assert(!ebwtBw.isInMemory());
-	{
+	if(!ebwtFw.isInMemory()) {
 		// Load the other half of the index into memory
 		Timer _t(cerr, "Time loading forward index: ", timing);
 		ebwtFw.loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
 	}
-	{
+	if(!ebwtBw.isInMemory()) {
 		// Load the other half of the index into memory
 		Timer _t(cerr, "Time loading mirror index: ", timing);
 		ebwtBw.loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
 	}
-	// Create range caches, which are shared among all aligners
 	BitPairReference *refs = NULL;
 	bool pair = mates1.size() > 0 || mates12.size() > 0;
 	if(color || (pair && mixedThresh < 0xffffffff)) {
 		Timer _t(cerr, "Time loading reference: ", timing);
-		refs = new BitPairReference(adjustedEbwtFileBase, color, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
-		if(!refs->loaded()) throw 1;
+		refs = openReference(adjustedEbwtFileBase, os);
 	}
 	twoOrThreeMismatchSearch_refs     = refs;
 	twoOrThreeMismatchSearch_patsrc   = &_patsrc;
@@ -1850,10 +2380,13 @@ static void twoOrThreeMismatchSearchFull(
 	twoOrThreeMismatchSearch_doneMask = NULL;
 	twoOrThreeMismatchSearch_hitMask  = NULL;
 	twoOrThreeMismatchSearch_two      = two;
+	loadSearchShards(refs, os);
 
 	AutoArray<tthread::thread*> threads(nthreads);
 	AutoArray<int> tids(nthreads);
 
+	// Create range caches, which are shared among all aligners
+	createRangeCaches(&ebwtFw, &ebwtBw);
         CHUD_START();
     {
 		Timer _t(cerr, "End-to-end 2/3-mismatch full-index search: ", timing);
@@ -1868,7 +2401,9 @@ static void twoOrThreeMismatchSearchFull(
 		for(int i = 0; i < nthreads; i++) 
                     threads[i]->join();
     }
-	if(refs != NULL) delete refs;
+	destroyRangeCaches();
+	unloadSearchShards();
+	closeReference(refs);
 	return;
 }
 
@@ -1903,8 +2438,9 @@ static BitPairReference*        seededQualSearch_refs;
 
 static void seededQualSearchWorkerFull(void *vp) {
 	SEEDEDQUAL_WORKER_SETUP();
-	Ebwt<String<Dna> >& ebwtFw = *seededQualSearch_ebwtFw;
-	Ebwt<String<Dna> >& ebwtBw = *seededQualSearch_ebwtBw;
+	int node = searchThreadNode(tid);
+	Ebwt<String<Dna> >& ebwtFw = *localEbwt(seededQualSearch_ebwtFw, node);
+	Ebwt<String<Dna> >& ebwtBw = *localEbwt(seededQualSearch_ebwtBw, node);
 	PartialAlignmentManager * pamRc = NULL;
 	PartialAlignmentManager * pamFw = NULL;
 	if(seedMms > 0) {
@@ -1928,6 +2464,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        verbose,               // verbose
 	        &os,
 	        false);                // considerQuals
+	btf1.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	GreedyDFSRangeSource bt1(
 	        &ebwtFw, params,
 	        refs,           // reference sequence (for colorspace)
@@ -1942,6 +2479,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        &os,                   // reference sequences
 	        true,                  // considerQuals
 	        false, !noMaqRound);
+	bt1.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	// GreedyDFSRangeSource to search for hits for cases 1F, 2F, 3F
 	GreedyDFSRangeSource btf2(
 	        &ebwtBw, params,
@@ -1957,6 +2495,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        &os,                   // reference sequences
 	        true,                  // considerQuals
 	        false, !noMaqRound);
+	btf2.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	// GreedyDFSRangeSource to search for partial alignments for case 4R
 	GreedyDFSRangeSource btr2(
 	        &ebwtBw, params,
@@ -1972,6 +2511,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        &os,                   // reference sequences
 	        true,                  // considerQuals
 	        false, !noMaqRound);
+	btr2.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	// GreedyDFSRangeSource to search for seedlings for case 4F
 	GreedyDFSRangeSource btf3(
 	        &ebwtFw, params,
@@ -1987,6 +2527,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        &os,                   // reference sequences
 	        true,                  // considerQuals
 	        false, !noMaqRound);
+	btf3.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	// GreedyDFSRangeSource to search for hits for case 4R by extending
 	// the partial alignments found in Phase 2
 	GreedyDFSRangeSource btr3(
@@ -2003,6 +2544,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        &os,     // reference sequences
 	        true,    // considerQuals
 	        false, !noMaqRound);
+	btr3.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	// The half-and-half GreedyDFSRangeSource
 	GreedyDFSRangeSource btr23(
 	        &ebwtFw, params,
@@ -2019,6 +2561,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        true,    // considerQuals
 	        true,    // halfAndHalf
 	        !noMaqRound);
+	btr23.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	// GreedyDFSRangeSource to search for hits for case 4F by extending
 	// the partial alignments found in Phase 3
 	GreedyDFSRangeSource btf4(
@@ -2035,6 +2578,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        &os,     // reference sequences
 	        true,    // considerQuals
 	        false, !noMaqRound);
+	btf4.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	// Half-and-half GreedyDFSRangeSource for forward read
 	GreedyDFSRangeSource btf24(
 	        &ebwtBw, params,
@@ -2051,6 +2595,7 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        true,    // considerQuals
 	        true,    // halfAndHalf
 	        !noMaqRound);
+	btf24.setCaches(rangeCacheFw, rangeCacheBw, cacheLimit);
 	String<QueryMutation> muts;
 	bool skipped = false;
 	while(true) {
@@ -2080,13 +2625,11 @@ static void seededQualSearchWorkerFull(void *vp) {
 
 static void seededQualSearchWorkerFullStateful(void *vp) {
 	int tid = *((int*)vp);
+	int node = searchThreadNode(tid);
 	PairedPatternSource&     _patsrc    = *seededQualSearch_patsrc;
 	HitSink&                 _sink      = *seededQualSearch_sink;
-	Ebwt<String<Dna> >&      ebwtFw     = *seededQualSearch_ebwtFw;
-	Ebwt<String<Dna> >&      ebwtBw     = *seededQualSearch_ebwtBw;
 	vector<String<Dna5> >&   os         = *seededQualSearch_os;
 	int                      qualCutoff = seededQualSearch_qualCutoff;
-	BitPairReference*        refs       = seededQualSearch_refs;
 
 	// Global initialization
 	PatternSourcePerThreadFactory* patsrcFact = createPatsrcFactory(_patsrc, tid);
@@ -2097,66 +2640,71 @@ static void seededQualSearchWorkerFullStateful(void *vp) {
 	if(stats) {
 		metrics = new AlignerMetrics();
 	}
-	UnpairedSeedAlignerFactory alSEfact(
-			ebwtFw,
-			&ebwtBw,
-			!nofw,
-			!norc,
-			seedMms,
-			seedLen,
-			qualCutoff,
-			maxBts,
-			_sink,
-			*sinkFact,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
-			cacheLimit,
-			pool,
-			refs,
-			os,
-			!noMaqRound,
-			!better,
-			strandFix,
-			rangeMode,
-			verbose,
-			quiet,
-			seed,
-			metrics);
-	PairedSeedAlignerFactory alPEfact(
-			ebwtFw,
-			&ebwtBw,
-			color,
-			useV1,
-			!nofw,
-			!norc,
-			seedMms,
-			seedLen,
-			qualCutoff,
-			maxBts,
-			_sink,
-			*sinkFact,
-			mate1fw,
-			mate2fw,
-			minInsert,
-			maxInsert,
-			dontReconcileMates,
-			mhits,       // for symCeiling
-			mixedThresh,
-			mixedAttemptLim,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
-			cacheLimit,
-			pool,
-			refs,
-			os,
-			reportSe,
-			!noMaqRound,
-			!better,
-			strandFix,
-			rangeMode,
-			verbose,
-			quiet,
-			seed);
+	ShardedAlignerFactory alSEfact(*sinkFact, searchShards.size(), !best && !better);
+	ShardedAlignerFactory alPEfact(*sinkFact, searchShards.size(), !best && !better);
+	for(size_t i = 0; i < searchShards.size(); i++) {
+		const SearchShard& sh = searchShards[i];
+		alSEfact.addShard(new UnpairedSeedAlignerFactory(
+				*localEbwt(sh.ebwtFw, node),
+				localEbwt(sh.ebwtBw, node),
+				!nofw,
+				!norc,
+				seedMms,
+				seedLen,
+				qualCutoff,
+				maxBts,
+				_sink,
+				alSEfact.shardSinks(sh.refBase),
+				rangeCacheFw,
+				rangeCacheBw,
+				cacheLimit,
+				pool,
+				sh.refs,
+				os,
+				!noMaqRound,
+				!better,
+				strandFix,
+				rangeMode,
+				verbose,
+				quiet,
+				seed,
+				metrics));
+		alPEfact.addShard(new PairedSeedAlignerFactory(
+				*localEbwt(sh.ebwtFw, node),
+				localEbwt(sh.ebwtBw, node),
+				color,
+				useV1,
+				!nofw,
+				!norc,
+				seedMms,
+				seedLen,
+				qualCutoff,
+				maxBts,
+				_sink,
+				alPEfact.shardSinks(sh.refBase),
+				mate1fw,
+				mate2fw,
+				minInsert,
+				maxInsert,
+				dontReconcileMates,
+				mhits,       // for symCeiling
+				mixedThresh,
+				mixedAttemptLim,
+				rangeCacheFw,
+				rangeCacheBw,
+				cacheLimit,
+				pool,
+				sh.refs,
+				os,
+				reportSe,
+				!noMaqRound,
+				!better,
+				strandFix,
+				rangeMode,
+				verbose,
+				quiet,
+				seed));
+	}
 	{
 		MixedMultiAligner multi(
 				prefetchWidth,
@@ -2183,8 +2731,8 @@ static void seededQualSearchWorkerFullStateful(void *vp) {
  * Search for a good alignments for each read using criteria that
  * correspond somewhat faithfully to Maq's.  Search is aided by a pair
  * of Ebwt indexes, one for the original references, and one for the
- * transpose of the references.  Neither index should be loaded upon
- * entry to this function.
+ * transpose of the references.  Either index may already be loaded
+ * upon entry to this function.
  *
  * Like Maq, we treat the first 24 base pairs of the read (those
  * closest to the 5' end) differently from the remainder of the read.
@@ -2219,26 +2767,31 @@ static void seededQualCutoffSearchFull(
 	seededQualSearch_pamRc    = NULL;
 	seededQualSearch_qualCutoff = qualCutoff;
 
-	// Create range caches, which are shared among all aligners
 	BitPairReference *refs = NULL;
 	bool pair = mates1.size() > 0 || mates12.size() > 0;
 	if(color || (pair && mixedThresh < 0xffffffff)) {
 		Timer _t(cerr, "Time loading reference: ", timing);
-		refs = new BitPairReference(adjustedEbwtFileBase, color, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
-		if(!refs->loaded()) throw 1;
+		refs = openReference(adjustedEbwtFileBase, os);
 	}
 	seededQualSearch_refs = refs;
 
 	AutoArray<tthread::thread*> threads(nthreads);
 	AutoArray<int> tids(nthreads);
 
-	SWITCH_TO_FW_INDEX();
-	assert(!ebwtBw.isInMemory());
-	{
+	// All phases run back to back for each read, so both indexes stay
+	// resident for the whole search and the input is parsed once
+	if(!ebwtFw.isInMemory()) {
+		Timer _t(cerr, "Time loading forward index: ", timing);
+		ebwtFw.loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
+	}
+	if(!ebwtBw.isInMemory()) {
 		// Load the other half of the index into memory
 		Timer _t(cerr, "Time loading mirror index: ", timing);
 		ebwtBw.loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
 	}
+	loadSearchShards(refs, os);
+	// Create range caches, which are shared among all aligners
+	createRangeCaches(&ebwtFw, &ebwtBw);
 	CHUD_START();
 	{
 		// Phase 1: Consider cases 1R and 2R
@@ -2256,10 +2809,10 @@ static void seededQualCutoffSearchFull(
                     threads[i]->join();
 
 	}
-	if(refs != NULL) {
-		delete refs;
-	}
-	ebwtBw.evictFromMemory();
+	destroyRangeCaches();
+	unloadSearchShards();
+	closeReference(refs);
+	evictEbwt(ebwtBw);
 }
 
 /**
@@ -2361,8 +2914,30 @@ static void driver(const char * type,
 			readSequenceString(origString, os);
 		}
 	}
+	// Several indexes may be given, separated by commas
+	vector<string> ebwtFileBases;
+	tokenize(ebwtFileBase, ",", ebwtFileBases);
+	if(ebwtFileBases.empty()) {
+		cerr << "Tokenized index list was empty!" << endl;
+		throw 1;
+	}
+	if(ebwtFileBases.size() > 1) {
+		if(!os.empty()) {
+			cerr << "Error: --orig cannot be used when searching more than one index" << endl;
+			throw 1;
+		}
+		if(refMapFile != NULL) {
+			cerr << "Error: --refmap cannot be used when searching more than one index" << endl;
+			throw 1;
+		}
+		if((cacheSize > 0 || !cacheFile.empty()) && !quiet) {
+			cerr << "Warning: range caches are not used when searching more than one index" << endl;
+		}
+		// The stateful aligners know how to hand hits on to be merged
+		stateful = true;
+	}
 	// Adjust
-	adjustedEbwtFileBase = adjustEbwtBase(argv0, ebwtFileBase, verbose);
+	adjustedEbwtFileBase = adjustEbwtBase(argv0, ebwtFileBases[0], verbose);
 
 	vector<PatternSource*> patsrcs_a;
 	vector<PatternSource*> patsrcs_b;
@@ -2512,43 +3087,53 @@ static void driver(const char * type,
 	if(verbose || startVerbose) {
 		cerr << "About to initialize fw Ebwt: "; logTime(cerr, true);
 	}
-	Ebwt<TStr> ebwt(adjustedEbwtFileBase,
-	                color,  // index is colorspace
-	                -1,     // don't care about entireReverse
-	                true,     // index is for the forward direction
-	                /* overriding: */ offRate,
-	                /* overriding: */ isaRate,
-	                useMm,    // whether to use memory-mapped files
-	                useShmem, // whether to use shared memory
-	                mmSweep,  // sweep memory-mapped files
-	                !noRefNames, // load names?
-	                rmap,     // reference map, or NULL if none is needed
-	                verbose, // whether to be talkative
-	                startVerbose, // talkative during initialization
-	                false /*passMemExc*/,
-	                sanityCheck);
+	Ebwt<TStr>& ebwt = *openEbwt(adjustedEbwtFileBase, true, rmap);
 	Ebwt<TStr>* ebwtBw = NULL;
 	// We need the mirror index if mismatches are allowed
 	if(mismatches > 0 || maqLike) {
 		if(verbose || startVerbose) {
 			cerr << "About to initialize rev Ebwt: "; logTime(cerr, true);
 		}
-		ebwtBw = new Ebwt<TStr>(
-			adjustedEbwtFileBase + ".rev",
-			color,  // index is colorspace
-			-1,     // don't care about entireReverse
-			false, // index is for the reverse direction
-			/* overriding: */ offRate,
-			/* overriding: */ isaRate,
-			useMm,    // whether to use memory-mapped files
-			useShmem, // whether to use shared memory
-			mmSweep,  // sweep memory-mapped files
-			!noRefNames, // load names?
-			rmap,     // reference map, or NULL if none is needed
-			verbose,  // whether to be talkative
-			startVerbose, // talkative during initialization
-			false /*passMemExc*/,
-			sanityCheck);
+		ebwtBw = openEbwt(adjustedEbwtFileBase + ".rev", false, rmap);
+	}
+	// Set up the other indexes; hits in each are numbered after the
+	// references of the indexes before it
+	searchShards.clear();
+	{
+		SearchShard sh = { adjustedEbwtFileBase, &ebwt, ebwtBw, NULL, 0 };
+		searchShards.push_back(sh);
+	}
+	for(size_t i = 1; i < ebwtFileBases.size(); i++) {
+		const SearchShard& prev = searchShards.back();
+		SearchShard sh = { adjustEbwtBase(argv0, ebwtFileBases[i], verbose),
+		                   NULL, NULL, NULL,
+		                   prev.refBase + prev.ebwtFw->nPat() };
+		if(verbose || startVerbose) {
+			cerr << "About to initialize Ebwts for " << sh.base << ": "; logTime(cerr, true);
+		}
+		sh.ebwtFw = openEbwt(sh.base, true, NULL);
+		if(ebwtBw != NULL) {
+			sh.ebwtBw = openEbwt(sh.base + ".rev", false, NULL);
+		}
+		searchShards.push_back(sh);
+	}
+	// Reference names and lengths, numbered across all indexes
+	TIndexOffU nPat = ebwt.nPat();
+	const TIndexOffU* plen = ebwt.plen();
+	vector<string> shardRefnames;
+	vector<TIndexOffU> shardPlen;
+	if(searchShards.size() > 1) {
+		for(size_t i = 0; i < searchShards.size(); i++) {
+			const Ebwt<TStr>& e = *searchShards[i].ebwtFw;
+			vector<string> names;
+			if(!noRefNames) {
+				readEbwtRefnames(searchShards[i].base, names);
+			}
+			appendShardRefnames(names, e.nPat(), shardRefnames);
+			shardPlen.insert(shardPlen.end(), e.plen(), e.plen() + e.nPat());
+		}
+		nPat = (TIndexOffU)shardPlen.size();
+		plen = &shardPlen[0];
 	}
 	if(!os.empty()) {
 		for(size_t i = 0; i < os.size(); i++) {
@@ -2577,8 +3162,8 @@ static void driver(const char * type,
 			assert_eq(length(os[i]), ebwt.plen()[i] + (color ? 1 : 0));
 		}
 		ebwt.loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
+		// Leave it loaded; the search needs it next
 		ebwt.checkOrigs(os, color, false);
-		ebwt.evictFromMemory();
 	}
 	{
 		Timer _t(cerr, "Time searching: ", timing);
@@ -2594,12 +3179,13 @@ static void driver(const char * type,
 			table = new RecalTable(recalMaxCycle, recalMaxQual, recalQualShift);
 		}
 		vector<string>* refnames = &ebwt.refnames();
+		if(searchShards.size() > 1) refnames = &shardRefnames;
 		if(noRefNames) refnames = NULL;
 		switch(outType) {
 			case OUTPUT_FULL:
 				if(refOut) {
 					sink = new VerboseHitSink(
-							ebwt.nPat(), offBase,
+							nPat, offBase,
 							colorSeq, colorQual, printCost,
 							suppressOuts, rmap, amap,
 							fullRef, PASS_DUMP_FILES,
@@ -2628,12 +3214,16 @@ static void driver(const char * type,
 					if(!samNoHead) {
 						vector<string> refnames;
 						if(!samNoSQ) {
-							readEbwtRefnames(adjustedEbwtFileBase, refnames);
+							if(searchShards.size() > 1) {
+								refnames = shardRefnames;
+							} else {
+								readEbwtRefnames(adjustedEbwtFileBase, refnames);
+							}
 						}
 						sam->appendHeaders(
-								sam->out(0), ebwt.nPat(),
+								sam->out(0), nPat,
 								refnames, color, samNoSQ, rmap,
-								ebwt.plen(), fullRef,
+								plen, fullRef,
 								samNoQnameTrunc,
 								argstr.c_str(),
 								rgs.empty() ? NULL : rgs.c_str());
@@ -2644,7 +3234,7 @@ static void driver(const char * type,
 			case OUTPUT_CONCISE:
 				if(refOut) {
 					sink = new ConciseHitSink(
-							ebwt.nPat(), offBase,
+							nPat, offBase,
 							PASS_DUMP_FILES,
 							format == TAB_MATE,  sampleMax,
 							table, refnames, reportOpps);
@@ -2666,6 +3256,14 @@ static void driver(const char * type,
 		if(verbose || startVerbose) {
 			cerr << "Dispatching to search driver: "; logTime(cerr, true);
 		}
+		if(numaMode != NUMA_NONE) {
+			// Place the indexes the search driver loads: spread over
+			// all nodes, or on node 0 with copies for the others made
+			// by loadSearchShards(), which then restores the default
+			if(!numaSetPolicy(numaMode, 0) && !quiet) {
+				cerr << "Warning: could not set the NUMA memory policy for the index" << endl;
+			}
+		}
 		if(maqLike) {
 			seededQualCutoffSearchFull(seedLen,
 									   qualThresh,
@@ -2693,15 +3291,18 @@ static void driver(const char * type,
 			exactSearch(*patsrc, *sink, ebwt, os);
 		}
 		// Evict any loaded indexes from memory
-		if(ebwt.isInMemory()) {
-			ebwt.evictFromMemory();
-		}
-		if(ebwtBw != NULL) {
-			delete ebwtBw;
+		evictEbwt(ebwt);
+		closeEbwt(ebwtBw);
+		for(size_t i = 1; i < searchShards.size(); i++) {
+			closeEbwt(searchShards[i].ebwtFw);
+			closeEbwt(searchShards[i].ebwtBw);
 		}
+		searchShards.clear();
 		if(!quiet) {
 			sink->finish(hadoopOut); // end the hits section of the hit file
 		}
+		// Stops patsrc's input thread before its sources go away
+		delete patsrc;
 		for(size_t i = 0; i < patsrcs_a.size(); i++) {
 			assert(patsrcs_a[i] != NULL);
 			delete patsrcs_a[i];
@@ -2716,12 +3317,14 @@ static void driver(const char * type,
 				delete patsrcs_ab[i];
 			}
 		}
-		delete patsrc;
 		delete sink;
 		delete amap;
-		delete rmap;
 		if(fout != NULL) delete fout;
 	}
+	// The sink referred to the index's reference names, and the index
+	// to the reference map
+	closeEbwt(&ebwt);
+	delete rmap;
 }
 
 // C++ name mangling is disabled for the bowtie() function to make it
@@ -2872,4 +3475,46 @@ int bowtie(int argc, const char **argv) {
 		return e;
 	}
 } // bowtie()
+
+/**
+ * Parse argc/argv style options followed by a comma-separated list of
+ * indexes, and load those indexes, their mirror indexes and their
+ * references to stay resident for the jobs of a --server process.
+ */
+int bowtiePreload(int argc, const char **argv) {
+	try {
+		opterr = optind = 1;
+		resetOptions();
+		parseOptions(argc, argv);
+		argv0 = argv[0];
+		if(optind >= argc) {
+			cerr << "No index specified for --server!" << endl;
+			printUsage(cerr);
+			return 1;
+		}
+		if(optind + 1 < argc) {
+			cerr << "Extra parameter(s) specified after the --server index: \"" << argv[optind+1] << "\"" << endl;
+			return 1;
+		}
+		vector<string> bases;
+		tokenize(argv[optind], ",", bases);
+		Timer _t(cerr, "Time loading resident indexes: ", timing);
+		for(size_t i = 0; i < bases.size(); i++) {
+			string base = adjustEbwtBase(argv0, bases[i], verbose);
+			Ebwt<String<Dna> >* fw = openEbwt(base, true, NULL);
+			fw->loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
+			residentEbwts[residentKey(base)] = fw;
+			Ebwt<String<Dna> >* bw = openEbwt(base + ".rev", false, NULL);
+			bw->loadIntoMemory(color ? 1 : 0, -1, !noRefNames, startVerbose);
+			residentEbwts[residentKey(base + ".rev")] = bw;
+			vector<String<Dna5> > os;
+			residentRefs[residentKey(base)] = openReference(base, os);
+		}
+		return 0;
+	} catch(exception& e) {
+		return 1;
+	} catch(int e) {
+		return (e != 0) ? e : 1;
+	}
+}
 } // extern "C"
@@ -8,6 +8,7 @@
 #include "ebwt_search_util.h"
 #include "range.h"
 #include "range_source.h"
+#include "range_cache.h"
 #include "aligner_metrics.h"
 #include "search_globals.h"
 
@@ -76,7 +77,10 @@ public:
 		_preLtop(),
 		_preLbot(),
 		_verbose(verbose),
-		_ihits(0llu)
+		_ihits(0llu),
+		_cacheFw(NULL),
+		_cacheBw(NULL),
+		_cacheThresh(0)
 	{ }
 
 	~GreedyDFSRangeSource() {
@@ -92,11 +96,11 @@ public:
 		const bool fw = _params.fw();
 		const bool ebwtFw = _ebwt->fw();
 		if(ebwtFw) {
-			_qry  = fw ? &r.patFw : &r.patRc;
-			_qual = fw ? &r.qual  : &r.qualRev;
+			_qry  = fw ? &r.patFw : &r.getPatRc();
+			_qual = fw ? &r.qual  : &r.getQualRev();
 		} else {
-			_qry  = fw ? &r.patFwRev : &r.patRcRev;
-			_qual = fw ? &r.qualRev  : &r.qual;
+			_qry  = fw ? &r.getPatFwRev() : &r.getPatRcRev();
+			_qual = fw ? &r.getQualRev()  : &r.qual;
 		}
 		_name = &r.name;
 		// Reset _qlen
@@ -208,6 +212,17 @@ public:
 		_ebwt = ebwt;
 	}
 
+	/**
+	 * Resolve the rows of ranges wider than 'thresh' through the given
+	 * range caches, shared with the other search threads, for the
+	 * forward and mirror index respectively.  Either may be NULL.
+	 */
+	void setCaches(RangeCache* cacheFw, RangeCache* cacheBw, uint32_t thresh) {
+		_cacheFw = cacheFw;
+		_cacheBw = cacheBw;
+		_cacheThresh = thresh;
+	}
+
 	/**
 	 * Return the current range
 	 */
@@ -255,10 +270,29 @@ public:
 		// m = depth beyond which ftab must not extend or else we might
 		// miss some legitimate paths
 		uint32_t m = min<uint32_t>(_unrevOff, (uint32_t)_qlen);
-		if(nsInFtab == 0 && m >= (uint32_t)ftabChars) {
+		int kmerChars = ebwt.kmerChars();
+		TIndexOffU top = 0, bot = 0;
+		if(kmerChars > 0 && m >= (uint32_t)kmerChars &&
+		   (_qlen > (TIndexOffU)kmerChars || _reportPartials == 0) &&
+		   ebwt.kmerRange(*_qry, (uint32_t)_qlen, top, bot))
+		{
+			// The k-mer table covers more of the unrevisitable
+			// portion than the ftab does; jump straight past it
+			if(bot <= top) {
+				ret = false;
+			} else if(_qlen == (TIndexOffU)kmerChars) {
+				ret = reportAlignment(0, top, bot, ham);
+			} else {
+				ret = backtrack(kmerChars, // depth
+				                top,       // top
+				                bot,       // bot
+				                ham,
+				                nsInFtab > 0);
+			}
+		} else if(nsInFtab == 0 && m >= (uint32_t)ftabChars) {
 			uint32_t ftabOff = calcFtabOff();
-			TIndexOffU top = ebwt.ftabHi(ftabOff);
-			TIndexOffU bot = ebwt.ftabLo(ftabOff+1);
+			top = ebwt.ftabHi(ftabOff);
+			bot = ebwt.ftabLo(ftabOff+1);
 			if(_qlen == (TIndexOffU)ftabChars && bot > top) {
 				// We have a match!
 				if(_reportPartials > 0) {
@@ -300,6 +334,20 @@ public:
 		return ret;
 	}
 
+	/**
+	 * Report an end-to-end exact match for the current query whose
+	 * range [top, bot) was already found by the caller (e.g. by
+	 * BatchExactSearch), skipping the search itself.  Return true iff
+	 * the HitSink has indicated that we're done with this read.
+	 */
+	bool reportExact(TIndexOffU top, TIndexOffU bot, uint32_t ham = 0) {
+		assert_gt(bot, top);
+		assert_eq(0, _reportPartials);
+		bool ret = reportAlignment(0, top, bot, ham);
+		if(finalize()) ret = true;
+		return ret;
+	}
+
 	/**
 	 * If there are any buffered results that have yet to be committed,
 	 * commit them.  This happens when looking for partial alignments.
@@ -1538,22 +1586,44 @@ protected:
 		}
 		assert(!_reportRanges);
 		TIndexOffU spread = bot - top;
+		// Rows of a wide range are resolved through the shared range
+		// cache, if there is one, so that no thread chases them twice
+		RangeCache *cache = _ebwt->fw() ? _cacheFw : _cacheBw;
+		RangeCacheEntry ent;
+		if(cache != NULL && spread > _cacheThresh) {
+			cache->lookup(top, bot, ent);
+		}
 		// Pick a random spot in the range to begin report
 		TIndexOffU r = top + (_rand.nextU<TIndexOffU>() % spread);
 		for(TIndexOffU i = 0; i < spread; i++) {
 			TIndexOffU ri = r + i;
 			if(ri >= bot) ri -= spread;
-			// reportChaseOne takes the _mms[] list in terms of
-			// their indices into the query string; not in terms
-			// of their offset from the 3' or 5' end.
+			// report() and reportChaseOne() take the _mms[] list in
+			// terms of their indices into the query string; not in
+			// terms of their offset from the 3' or 5' end.
 			assert_geq(cost, (uint32_t)(stratum << 14));
-			if(_ebwt->reportChaseOne((*_qry), _qual, _name,
-			                         _color, _primer, _trimc, colorExEnds,
-			                         snpPhred, _refs, _mms, _refcs,
-			                         stackDepth, ri, top, bot,
-			                         (uint32_t)_qlen, stratum, cost, _patid,
-			                         _seed, _params))
-			{
+			bool ret;
+			if(ent.valid()) {
+				TIndexOffU off = ent.get(ri - top);
+				if(off == RANGE_NOT_SET) {
+					off = _ebwt->chaseRow(ri);
+					ent.install(ri - top, off);
+				}
+				ret = _ebwt->report((*_qry), _qual, _name,
+				                    _color, _primer, _trimc, colorExEnds,
+				                    snpPhred, _refs, _mms, _refcs,
+				                    stackDepth, off, top, bot,
+				                    (uint32_t)_qlen, stratum, cost, _patid,
+				                    _seed, _params);
+			} else {
+				ret = _ebwt->reportChaseOne((*_qry), _qual, _name,
+				                            _color, _primer, _trimc, colorExEnds,
+				                            snpPhred, _refs, _mms, _refcs,
+				                            stackDepth, ri, top, bot,
+				                            (uint32_t)_qlen, stratum, cost, _patid,
+				                            _seed, _params);
+			}
+			if(ret) {
 				// Return value of true means that we can stop
 				return true;
 			}
@@ -1774,6 +1844,11 @@ protected:
 	/// Be talkative
 	bool                _verbose;
 	uint64_t            _ihits;
+	/// Shared caches of resolved rows for the forward and mirror
+	/// index, and the range width above which they're consulted
+	RangeCache*         _cacheFw;
+	RangeCache*         _cacheBw;
+	uint32_t            _cacheThresh;
 	// Holding area for partial alignments
 	vector<PartialAlignment> _partialsBuf;
 	// Current range to expose to consumers
@@ -1845,15 +1920,15 @@ public:
 	virtual void setQuery(ReadBuf& r, Range *seedRange) {
 		const bool ebwtFw = ebwt_->fw();
 		if(ebwtFw) {
-			qry_  = fw_ ? &r.patFw : &r.patRc;
-			qual_ = fw_ ? &r.qual  : &r.qualRev;
-			altQry_  = (String<Dna5>*)(fw_ ? r.altPatFw : r.altPatRc);
-			altQual_ = (String<char>*)(fw_ ? r.altQual  : r.altQualRev);
+			qry_  = fw_ ? &r.patFw : &r.getPatRc();
+			qual_ = fw_ ? &r.qual  : &r.getQualRev();
+			altQry_  = (String<Dna5>*)(fw_ ? r.altPatFw : r.getAltPatRc());
+			altQual_ = (String<char>*)(fw_ ? r.altQual  : r.getAltQualRev());
 		} else {
-			qry_  = fw_ ? &r.patFwRev : &r.patRcRev;
-			qual_ = fw_ ? &r.qualRev  : &r.qual;
-			altQry_  = (String<Dna5>*)(fw_ ? r.altPatFwRev : r.altPatRcRev);
-			altQual_ = (String<char>*)(fw_ ? r.altQualRev  : r.altQual);
+			qry_  = fw_ ? &r.getPatFwRev() : &r.getPatRcRev();
+			qual_ = fw_ ? &r.getQualRev()  : &r.qual;
+			altQry_  = (String<Dna5>*)(fw_ ? r.getAltPatFwRev() : r.getAltPatRcRev());
+			altQual_ = (String<char>*)(fw_ ? r.getAltQualRev()  : r.altQual);
 		}
 		alts_ = r.alts;
 		name_ = &r.name;
@@ -1992,14 +2067,27 @@ public:
 		bool ftabSkipsToEnd = (qlen_ == (uint32_t)ftabChars);
 		bool skipInvalidExact = (!reportExacts_ && ftabSkipsToEnd);
 
+		// Prefer the k-mer table, if there is one, when it doesn't jump
+		// past the unrevisitable region or straight to an exact
+		// alignment we couldn't use
+		int jumpChars = ftabChars;
+		TIndexOffU top = 0, bot = 0;
+		int kmerChars = ebwt.kmerChars();
+		bool useKmer = kmerChars > 0 && m >= (uint32_t)kmerChars &&
+		               (reportExacts_ || qlen_ != (uint32_t)kmerChars) &&
+		               ebwt.kmerRange(*qry_, (uint32_t)qlen_, top, bot);
+		if(useKmer) jumpChars = kmerChars;
+
 		// If it's OK to use the ftab...
-		if(nsInFtab == 0 && m >= (uint32_t)ftabChars && !skipInvalidExact) {
-			// Use the ftab to jump 'ftabChars' chars into the read
-			// from the right
-			uint32_t ftabOff = calcFtabOff();
-			TIndexOffU top = ebwt.ftabHi(ftabOff);
-			TIndexOffU bot = ebwt.ftabLo(ftabOff+1);
-			if(qlen_ == (uint32_t)ftabChars && bot > top) {
+		if(useKmer || (nsInFtab == 0 && m >= (uint32_t)ftabChars && !skipInvalidExact)) {
+			// Use the ftab (or k-mer table) to jump 'jumpChars' chars
+			// into the read from the right
+			if(!useKmer) {
+				uint32_t ftabOff = calcFtabOff();
+				top = ebwt.ftabHi(ftabOff);
+				bot = ebwt.ftabLo(ftabOff+1);
+			}
+			if(qlen_ == (uint32_t)jumpChars && bot > top) {
 				// We found a range with 0 mismatches immediately.  Set
 				// fields to indicate we found a range.
 				assert(reportExacts_);
@@ -2031,7 +2119,7 @@ public:
 				if(!b->init(
 				        pm.rpool, pm.epool, pm.bpool.lastId(), (uint32_t)qlen_,
 				        offRev0_, offRev1_, offRev2_, offRev3_,
-				        0, ftabChars, icost, iham, top, bot,
+				        0, jumpChars, icost, iham, top, bot,
 				        ebwt._eh, ebwt._ebwt))
 				{
 					// Negative result from b->init() indicates we ran
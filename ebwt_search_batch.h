@@ -0,0 +1,170 @@
+/*
+ * ebwt_search_batch.h
+ *
+ * Lock-step exact matching of a block of queries against an Ebwt.
+ */
+
+#ifndef EBWT_SEARCH_BATCH_H_
+#define EBWT_SEARCH_BATCH_H_
+
+#include <vector>
+#include <seqan/sequence.h>
+#include "ebwt.h"
+
+/**
+ * Finds the BWT range of exact end-to-end matches for a block of
+ * queries.  Rather than walking one query all the way to its 5' end
+ * before starting on the next, all queries are advanced by one
+ * character per round using Ebwt::mapLFBatch, so that the side
+ * fetches for the whole block overlap.  Each query is jump-started
+ * with the k-mer table, if one is loaded, or the ftab when it is long
+ * enough.
+ *
+ * Usage: clear(), add() up to the desired number of queries, run(),
+ * then inspect found()/top()/bot() for each slot in the order added.
+ */
+class BatchExactSearch {
+
+	typedef seqan::String<seqan::Dna> TStr;
+
+public:
+	BatchExactSearch(const Ebwt<TStr>& ebwt, size_t width) :
+		ebwt_(ebwt)
+	{
+		qrys_.reserve(width);
+		cur_.reserve(width);
+		tops_.reserve(width);
+		bots_.reserve(width);
+		act_.reserve(width);
+		atops_.resize(width);
+		abots_.resize(width);
+		acs_.resize(width);
+		ltops_.resize(width);
+		lbots_.resize(width);
+	}
+
+	/**
+	 * Forget all queries.
+	 */
+	void clear() {
+		qrys_.clear();
+		cur_.clear();
+		tops_.clear();
+		bots_.clear();
+	}
+
+	/**
+	 * Add a query to the block.  A NULL query occupies a slot but is
+	 * never found.
+	 */
+	void add(const String<Dna5>* qry) {
+		qrys_.push_back(qry);
+		cur_.push_back(0);
+		tops_.push_back(0);
+		bots_.push_back(0);
+	}
+
+	/**
+	 * Find exact-match ranges for all queries added since the last
+	 * clear().
+	 */
+	void run() {
+		const size_t n = qrys_.size();
+		if(atops_.size() < n) {
+			atops_.resize(n); abots_.resize(n); acs_.resize(n);
+			ltops_.resize(n); lbots_.resize(n);
+		}
+		act_.clear();
+		for(size_t i = 0; i < n; i++) {
+			if(start(i)) act_.push_back(i);
+		}
+		while(!act_.empty()) {
+			// Gather the next character of every live query
+			const size_t nact = act_.size();
+			for(size_t j = 0; j < nact; j++) {
+				size_t i = act_[j];
+				atops_[j] = tops_[i];
+				abots_[j] = bots_[i];
+				acs_[j] = (int)(*qrys_[i])[--cur_[i]];
+			}
+			ebwt_.mapLFBatch(nact, &atops_[0], &abots_[0], &acs_[0], &ltops_[0], &lbots_[0]);
+			// Scatter results; retire queries that emptied or finished
+			size_t k = 0;
+			for(size_t j = 0; j < nact; j++) {
+				size_t i = act_[j];
+				tops_[i] = atops_[j];
+				bots_[i] = abots_[j];
+				if(bots_[i] > tops_[i] && cur_[i] > 0) act_[k++] = i;
+			}
+			act_.resize(k);
+		}
+	}
+
+	/// Return true iff query i matched end-to-end
+	bool found(size_t i) const { return bots_[i] > tops_[i]; }
+
+	/// Return top of the range for query i
+	TIndexOffU top(size_t i) const { return tops_[i]; }
+
+	/// Return bot of the range for query i
+	TIndexOffU bot(size_t i) const { return bots_[i]; }
+
+	/// Return the number of queries in the block
+	size_t size() const { return qrys_.size(); }
+
+private:
+
+	/**
+	 * Set up the initial range for query i using the k-mer table or
+	 * the ftab (or fchr for queries shorter than both).  Return true
+	 * iff the query still has characters left to match against a
+	 * non-empty range.
+	 */
+	bool start(size_t i) {
+		const String<Dna5>* qry = qrys_[i];
+		if(qry == NULL) return false;
+		const uint32_t qlen = (uint32_t)seqan::length(*qry);
+		if(qlen == 0) return false;
+		// Ns can't be matched exactly
+		for(uint32_t j = 0; j < qlen; j++) {
+			if((int)(*qry)[j] == 4) return false;
+		}
+		const uint32_t ftabChars = (uint32_t)ebwt_._eh._ftabChars;
+		const uint32_t kmerChars = (uint32_t)ebwt_.kmerChars();
+		if(kmerChars > ftabChars && qlen >= kmerChars) {
+			// No Ns, so the lookup can't fail
+			bool ok = ebwt_.kmerRange(*qry, qlen, tops_[i], bots_[i]);
+			assert(ok); (void)ok;
+			cur_[i] = qlen - kmerChars;
+		} else if(qlen >= ftabChars) {
+			uint32_t ftabOff = 0;
+			for(uint32_t j = qlen - ftabChars; j < qlen; j++) {
+				ftabOff = (ftabOff << 2) | (uint32_t)(*qry)[j];
+			}
+			assert_lt(ftabOff, ebwt_._eh._ftabLen-1);
+			tops_[i] = ebwt_.ftabHi(ftabOff);
+			bots_[i] = ebwt_.ftabLo(ftabOff+1);
+			cur_[i] = qlen - ftabChars;
+		} else {
+			int c = (int)(*qry)[qlen-1];
+			tops_[i] = ebwt_.fchr()[c];
+			bots_[i] = ebwt_.fchr()[c+1];
+			cur_[i] = qlen - 1;
+		}
+		return bots_[i] > tops_[i] && cur_[i] > 0;
+	}
+
+	const Ebwt<TStr>&                 ebwt_;
+	std::vector<const String<Dna5>*>  qrys_;  // queries
+	std::vector<uint32_t>             cur_;   // # chars left to match
+	std::vector<TIndexOffU>           tops_;  // current tops
+	std::vector<TIndexOffU>           bots_;  // current bots
+	std::vector<size_t>               act_;   // slots still being extended
+	std::vector<TIndexOffU>           atops_; // per-round scratch
+	std::vector<TIndexOffU>           abots_;
+	std::vector<int>                  acs_;
+	std::vector<SideLocus>            ltops_;
+	std::vector<SideLocus>            lbots_;
+};
+
+#endif /*EBWT_SEARCH_BATCH_H_*/
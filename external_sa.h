@@ -0,0 +1,353 @@
+#ifndef EXTERNAL_SA_H_
+#define EXTERNAL_SA_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <seqan/sequence.h>
+#include "assert_helpers.h"
+#include "blockwise_sa.h"
+#include "diff_sample.h"
+#include "multikey_qsort.h"
+#include "spill_file.h"
+#include "threading.h"
+#include "timer.h"
+
+using namespace std;
+using namespace seqan;
+
+/**
+ * Build the SA by sorting runs of suffixes and merging them, for texts
+ * too long for KarkkainenBlockwiseSA to build in few enough blocks.
+ *
+ * Run r holds the suffixes starting at text offsets [r*R, (r+1)*R),
+ * where R is the bucket size.  Runs are sorted concurrently, each with
+ * multikey quicksort and the difference cover as tie-breaker, and
+ * spilled in turn to a temporary file, where run r occupies elements
+ * [r*R, (r+1)*R).  Blocks are then doled out by a k-way merge of the
+ * runs, reading each through a small buffer.  Comparing two suffixes
+ * from different runs takes at most v characters before the
+ * difference cover breaks the tie.  So sorting costs one pass over
+ * each run plus a merge, rather than a pass over the text per block.
+ */
+template<typename TStr>
+class ExternalBlockwiseSA : public InorderBlockwiseSA<TStr> {
+public:
+	typedef DifferenceCoverSample<TStr> TDC;
+
+	ExternalBlockwiseSA(const TStr& __text,
+	                    TIndexOffU __bucketSz,
+	                    int __nthreads,
+	                    uint32_t __dcV,
+	                    const string& __spillFn,
+	                    bool __sanityCheck = false,
+	                    bool __verbose = false,
+	                    ostream& __logger = cout) :
+	InorderBlockwiseSA<TStr>(__text, __bucketSz, __sanityCheck, false, __verbose, __logger),
+	_len((TIndexOffU)length(__text)), _dcV(__dcV), _dc(NULL),
+	_nthreads(max<int>(__nthreads, 1)), _spillFn(__spillFn),
+	_nruns(0), _bufLen(0), _nextRun(0), _done(false), _first(true),
+	_failed(false)
+	{
+		build();
+		reset();
+	}
+
+	~ExternalBlockwiseSA() {
+		delete _dc;
+		_dc = NULL;
+	}
+
+protected:
+
+	/**
+	 * Restart the merge from the first suffix of every run.
+	 */
+	virtual void reset() {
+		_heap.clear();
+		for(TIndexOffU r = 0; r < _nruns; r++) {
+			_runCur[r] = runBegin(r);
+			fillBuf(r);
+			_heap.push_back(r);
+		}
+		make_heap(_heap.begin(), _heap.end(), HeadGt(this));
+		_done = false;
+		_first = true;
+	}
+
+	/// Return true iff we're about to dole out the first block
+	virtual bool isReset() {
+		return _first;
+	}
+
+	/// Return true iff more blocks are available
+	virtual bool hasMoreBlocks() const {
+		return !_done;
+	}
+
+	virtual void nextBlock();
+
+private:
+
+	/// Orders runs by their current suffixes, greatest first, so that
+	/// the standard heap functions keep the least on top
+	struct HeadGt {
+		HeadGt(const ExternalBlockwiseSA<TStr>* e) : esa(e) { }
+		bool operator()(TIndexOffU a, TIndexOffU b) const {
+			return esa->sufLt(esa->head(b), esa->head(a));
+		}
+		const ExternalBlockwiseSA<TStr>* esa;
+	};
+
+	/// Words of merge buffer per run; together about one bucket, but
+	/// enough for each refill to be a sizable read
+	size_t bufLenFor() const {
+		return max<size_t>(this->bucketSz() / max<TIndexOffU>(_nruns, 1), 1024);
+	}
+
+	/// First element of run r in the spill file
+	uint64_t runBegin(TIndexOffU r) const {
+		return (uint64_t)r * this->bucketSz();
+	}
+
+	/// One past the last element of run r in the spill file
+	uint64_t runEnd(TIndexOffU r) const {
+		return min<uint64_t>(runBegin(r) + this->bucketSz(), _len);
+	}
+
+	/// Current suffix of run r
+	TIndexOffU head(TIndexOffU r) const {
+		return _buf[r * _bufLen + _bufPos[r]];
+	}
+
+	void build();
+	void sortRuns();
+	static void runWorker(void *vp);
+	void sortRun(String<TIndexOffU>& run, String<TIndexOffU>& scratch);
+	void fillBuf(TIndexOffU r);
+	inline bool sufLt(TIndexOffU i, TIndexOffU j) const;
+
+	const TIndexOffU   _len;       /// length of the text
+	const uint32_t     _dcV;       /// difference-cover periodicity
+	TDC*               _dc;        /// queryable difference-cover data
+	const int          _nthreads;  /// # run-sorting threads
+	const string       _spillFn;   /// name for the spill file
+	OffSpillFile       _spill;     /// sorted runs
+	TIndexOffU         _nruns;     /// # runs
+	size_t             _bufLen;    /// words of merge buffer per run
+	String<TIndexOffU> _buf;       /// merge buffers, _bufLen per run
+	vector<size_t>     _bufPos;    /// next suffix in each run's buffer
+	vector<size_t>     _bufEnd;    /// suffixes in each run's buffer
+	vector<uint64_t>   _runCur;    /// next spilled suffix of each run
+	vector<TIndexOffU> _heap;      /// runs with suffixes left
+	TIndexOffU         _nextRun;   /// next run to sort
+	bool               _done;      /// all blocks doled out
+	bool               _first;     /// no block doled out yet
+	bool               _failed;    /// a run-sorting thread gave up
+	tthread::mutex     _mutex;     /// protects _nextRun, _failed, _spill
+};
+
+/**
+ * Calculate the difference-cover sample, then sort and spill the runs.
+ */
+template<typename TStr>
+void ExternalBlockwiseSA<TStr>::build() {
+	if(_dcV != 0) {
+		_dc = new TDC(this->text(), _dcV, _nthreads, this->verbose(), this->sanityCheck());
+		_dc->build();
+	}
+	_nruns = (TIndexOffU)(((uint64_t)_len + this->bucketSz() - 1) / this->bucketSz());
+	_spill.open(_spillFn);
+	if(_nruns > 0) sortRuns();
+	_bufLen = bufLenFor();
+	resize(_buf, _nruns * _bufLen, Exact());
+	_bufPos.resize(_nruns);
+	_bufEnd.resize(_nruns);
+	_runCur.resize(_nruns);
+}
+
+/**
+ * Sort each run and spill it, with _nthreads threads claiming runs in
+ * turn.
+ */
+template<typename TStr>
+void ExternalBlockwiseSA<TStr>::sortRuns() {
+	Timer timer(cout, "  Sorting and spilling runs time: ", this->verbose());
+	VMSG_NL("Sorting " << _nruns << " runs of up to " << this->bucketSz()
+	        << " suffixes and spilling them to " << _spillFn);
+	_nextRun = 0;
+	_failed = false;
+	int nworkers = (int)min<TIndexOffU>((TIndexOffU)_nthreads, _nruns);
+	if(nworkers == 1) {
+		runWorker((void*)this);
+	} else {
+		vector<tthread::thread*> threads;
+		for(int i = 0; i < nworkers; i++) {
+			threads.push_back(new tthread::thread(runWorker, (void*)this));
+		}
+		for(int i = 0; i < nworkers; i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+	}
+	if(_failed) throw 1;
+}
+
+template<typename TStr>
+void ExternalBlockwiseSA<TStr>::runWorker(void *vp) {
+	ExternalBlockwiseSA<TStr>* esa = (ExternalBlockwiseSA<TStr>*)vp;
+	// Run and bucket-sort scratch space, reused for every run this
+	// thread sorts
+	String<TIndexOffU> run, scratch;
+	while(true) {
+		TIndexOffU r;
+		{
+			tthread::lock_guard<tthread::mutex> guard(esa->_mutex);
+			if(esa->_failed || esa->_nextRun >= esa->_nruns) return;
+			r = esa->_nextRun++;
+		}
+		try {
+			clear(run);
+			reserve(run, esa->bucketSz(), Exact());
+			for(uint64_t i = esa->runBegin(r); i < esa->runEnd(r); i++) {
+				appendValue(run, (TIndexOffU)i);
+			}
+			esa->sortRun(run, scratch);
+			tthread::lock_guard<tthread::mutex> guard(esa->_mutex);
+			esa->_spill.write(esa->runBegin(r), begin(run), length(run));
+		} catch(bad_alloc& e) {
+			cerr << "Could not allocate a run of " << esa->bucketSz() << " suffixes" << endl
+			     << "Please try using a smaller --bmax or a larger --bmaxdivn" << endl;
+			tthread::lock_guard<tthread::mutex> guard(esa->_mutex);
+			esa->_failed = true;
+			return;
+		} catch(...) {
+			// The spill file reported the problem; stop the others too
+			tthread::lock_guard<tthread::mutex> guard(esa->_mutex);
+			esa->_failed = true;
+			return;
+		}
+	}
+}
+
+/**
+ * Qsort the suffixes in 'run'.
+ */
+template<typename TStr>
+void ExternalBlockwiseSA<TStr>::sortRun(String<TIndexOffU>& run, String<TIndexOffU>& scratch) {
+	typedef typename Value<TStr>::Type TAlphabet;
+	const TStr& t = this->text();
+	TIndexOffU *s = begin(run);
+	TIndexOffU slen = (TIndexOffU)length(run);
+	if(_dc != NULL) {
+		resize(scratch, mkeyQSortSufDcU8Scratch(slen), Exact());
+		// Extract the 'host' array because it's faster to work with
+		// than the String<> container
+		uint8_t *host = (uint8_t*)t.data_begin;
+		mkeyQSortSufDcU8(t, host, _len, s, slen, *_dc,
+		                 ValueSize<TAlphabet>::VALUE, begin(scratch),
+		                 false, this->sanityCheck());
+	} else {
+		mkeyQSortSuf(t, s, slen, ValueSize<TAlphabet>::VALUE,
+		             false, this->sanityCheck());
+	}
+}
+
+/**
+ * Qsort the suffixes in 'run'.  This specialization for packed strings
+ * operates on the string itself since it has no one-char-per-elt host
+ * array.
+ */
+template<>
+inline void ExternalBlockwiseSA<String<Dna, Packed<> > >::sortRun(String<TIndexOffU>& run, String<TIndexOffU>& scratch) {
+	const String<Dna, Packed<> >& t = this->text();
+	TIndexOffU *s = begin(run);
+	TIndexOffU slen = (TIndexOffU)length(run);
+	if(_dc != NULL) {
+		resize(scratch, mkeyQSortSufDcU8Scratch(slen), Exact());
+		mkeyQSortSufDcU8(t, t, _len, s, slen, *_dc,
+		                 ValueSize<Dna>::VALUE, begin(scratch),
+		                 false, this->sanityCheck());
+	} else {
+		mkeyQSortSuf(t, s, slen, ValueSize<Dna>::VALUE,
+		             false, this->sanityCheck());
+	}
+}
+
+/**
+ * Refill run r's merge buffer from the spill file.
+ */
+template<typename TStr>
+void ExternalBlockwiseSA<TStr>::fillBuf(TIndexOffU r) {
+	size_t n = (size_t)min<uint64_t>(runEnd(r) - _runCur[r], _bufLen);
+	assert_gt(n, 0);
+	_spill.read(_runCur[r], begin(_buf) + r * _bufLen, n);
+	_runCur[r] += n;
+	_bufPos[r] = 0;
+	_bufEnd[r] = n;
+}
+
+/**
+ * Return true iff the suffix at i is less than the one at j.  The
+ * empty suffix is greater than all others, as in the blockwise sort.
+ */
+template<typename TStr>
+inline bool ExternalBlockwiseSA<TStr>::sufLt(TIndexOffU i, TIndexOffU j) const {
+	const TStr& t = this->text();
+	assert_neq(i, j);
+	// Characters to compare before the difference cover can break the
+	// tie; tieBreakOff() returns 0xffffffff if the first ones differ
+	TIndexOffU d = (_dc != NULL) ? (TIndexOffU)_dc->tieBreakOff(i, j) : OFF_MASK;
+	for(TIndexOffU k = 0; k < d; k++) {
+		if(i + k == _len) return false;
+		if(j + k == _len) return true;
+		int ci = (int)(Dna)t[i + k];
+		int cj = (int)(Dna)t[j + k];
+		if(ci != cj) return ci < cj;
+	}
+	if(i + d == _len) return false;
+	if(j + d == _len) return true;
+	assert(_dc != NULL);
+	return _dc->breakTie(i + d, j + d) < 0;
+}
+
+/**
+ * Merge the next bucketSz suffixes out of the runs.  The empty suffix
+ * goes at the end of the last block.
+ */
+template<typename TStr>
+void ExternalBlockwiseSA<TStr>::nextBlock() {
+	assert(hasMoreBlocks());
+	_first = false;
+	clear(this->_itrBucket);
+	reserve(this->_itrBucket, this->bucketSz() + 1, Exact());
+	HeadGt gt(this);
+	while(length(this->_itrBucket) < this->bucketSz() && !_heap.empty()) {
+		pop_heap(_heap.begin(), _heap.end(), gt);
+		TIndexOffU r = _heap.back();
+		appendValue(this->_itrBucket, head(r));
+		if(++_bufPos[r] == _bufEnd[r]) {
+			if(_runCur[r] == runEnd(r)) {
+				_heap.pop_back(); // run exhausted
+				continue;
+			}
+			fillBuf(r);
+		}
+		push_heap(_heap.begin(), _heap.end(), gt);
+	}
+	if(_heap.empty()) {
+		appendValue(this->_itrBucket, _len);
+		_done = true;
+	}
+	VMSG_NL("Merged block of " << length(this->_itrBucket) << " suffixes");
+	if(this->sanityCheck()) {
+		for(size_t i = 1; i < length(this->_itrBucket); i++) {
+			if(this->_itrBucket[i] == _len) break;
+			assert(sufLt(this->_itrBucket[i-1], this->_itrBucket[i]));
+		}
+	}
+}
+
+#endif /*EXTERNAL_SA_H_*/
@@ -14,6 +14,7 @@
 #include <stdint.h>
 #include <stdexcept>
 #include "assert_helpers.h"
+#include "bgzf.h"
 
 #include <zlib.h>
 #include <bzlib.h>
@@ -58,8 +59,14 @@ public:
 		_bz2in = bz2in;
 		assert(_bz2in!=NULL);
 	}
+
+	FileBuf(BgzfReader* bgzfin) {
+		init ();
+		_bgzfin = bgzfin;
+		assert(_bgzfin!=NULL);
+	}
 	bool isOpen() {
-		return _in != NULL || _inf != NULL || _ins != NULL || _gzin!=NULL || _bz2in!=NULL;
+		return _in != NULL || _inf != NULL || _ins != NULL || _gzin!=NULL || _bz2in!=NULL || _bgzfin!=NULL || inMemory();
 	}
 
 	/**
@@ -74,6 +81,9 @@ public:
 			gzclose(*_gzin);
 		} else if (_bz2in!=NULL) {
 			BZ2_bzclose(_bz2in);
+		} else if (_bgzfin!=NULL) {
+			delete _bgzfin;
+			_bgzfin = NULL;
 		} else {
 			// can't close _ins
 		}
@@ -83,7 +93,7 @@ public:
 	 * Get the next character of input and advance.
 	 */
 	int get() {
-		assert(_in != NULL || _inf != NULL || _ins != NULL || _gzin!=NULL || _bz2in!=NULL);
+		assert(isOpen());
 		int c = peek();
 		if(c != -1) {
 			_cur++;
@@ -108,6 +118,8 @@ public:
 		_ins = NULL;
 		_gzin = NULL;
 		_bz2in = NULL;
+		_bgzfin = NULL;
+		_bufp = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
@@ -122,6 +134,8 @@ public:
 		_ins = NULL;
 		_gzin = NULL;
 		_bz2in = NULL;
+		_bgzfin = NULL;
+		_bufp = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
@@ -136,6 +150,8 @@ public:
 		_ins = __ins;
 		_gzin = NULL;
 		_bz2in = NULL;
+		_bgzfin = NULL;
+		_bufp = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
@@ -147,6 +163,8 @@ public:
 		_ins = NULL;
 		_gzin = __gzin;
 		_bz2in = NULL;
+		_bgzfin = NULL;
+		_bufp = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
@@ -158,11 +176,102 @@ public:
 		_ins = NULL;
 		_gzin = NULL;
 		_bz2in = __bz2zin;
+		_bgzfin = NULL;
+		_bufp = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
 	}
 	
+	void newFile(BgzfReader* __bgzfin) {
+		_in = NULL;
+		_inf = NULL;
+		_ins = NULL;
+		_gzin = NULL;
+		_bz2in = NULL;
+		_bgzfin = __bgzfin;
+		_bufp = _buf;
+		_cur = BUF_SZ;
+		_buf_sz = BUF_SZ;
+		_done = false;
+	}
+
+	/**
+	 * Read the 'len' characters at 's' instead of a file.  They aren't
+	 * copied; the caller keeps them unchanged until it's done reading.
+	 */
+	void newBuf(const char *s, size_t len) {
+		_in = NULL;
+		_inf = NULL;
+		_ins = NULL;
+		_gzin = NULL;
+		_bz2in = NULL;
+		_bgzfin = NULL;
+		_bufp = (const uint8_t*)s;
+		_cur = 0;
+		_buf_sz = len;
+		_done = true;
+		_lastn_cur = 0;
+	}
+
+	/**
+	 * Return true iff we're reading characters that are all in memory
+	 * (see newBuf()), so that cursor() and skip() may be used.
+	 */
+	bool inMemory() const {
+		return _bufp != _buf;
+	}
+
+	/**
+	 * Pointer to the next character; only if inMemory().
+	 */
+	const char *cursor() const {
+		assert(inMemory());
+		return (const char*)_bufp + _cur;
+	}
+
+	/**
+	 * Pointer just past the last character; only if inMemory().
+	 */
+	const char *bufEnd() const {
+		assert(inMemory());
+		return (const char*)_bufp + _buf_sz;
+	}
+
+	/**
+	 * Advance past the next 'n' characters without adding them to the
+	 * last-N-chars buffer; only if inMemory().
+	 */
+	void skip(size_t n) {
+		assert(inMemory());
+		assert_leq(_cur + n, _buf_sz);
+		_cur += n;
+	}
+
+	/**
+	 * Pass over the rest of the current line, including its newline,
+	 * appending it to 'dst' unless that's NULL, and set 'len' to its
+	 * length.  Return its first character, or -1 if the input is
+	 * exhausted.  Scans the buffer a chunk at a time and doesn't add
+	 * to the last-N-chars buffer.
+	 */
+	int getLine(std::string *dst, size_t& len) {
+		len = 0;
+		int first = peek();
+		if(first < 0) return -1;
+		while(_cur < _buf_sz || peek() >= 0) {
+			const uint8_t *s = _bufp + _cur;
+			size_t avail = _buf_sz - _cur;
+			const uint8_t *nl = (const uint8_t*)memchr(s, '\n', avail);
+			size_t n = (nl == NULL) ? avail : (size_t)(nl - s) + 1;
+			if(dst != NULL) dst->append((const char*)s, n);
+			_cur += n;
+			len += n;
+			if(nl != NULL) break;
+		}
+		return first;
+	}
+
 	/**
 	 * Restore state as though we just started reading the input
 	 * stream.
@@ -181,7 +290,10 @@ public:
 		} else if (_bz2in != NULL){
 			/* seems that this function is never called. so I'll be sloppy here */
 			fprintf (stderr, "cannot reset bzip2 file in %s, %d of %s\n", __func__, __LINE__, __FILE__);
+		} else if (_bgzfin != NULL){
+			_bgzfin->rewind();
 		}
+		_bufp = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
@@ -193,7 +305,7 @@ public:
 	 * Occasionally we'll need to read in a new buffer's worth of data.
 	 */
 	int peek() {
-		assert(_in != NULL || _inf != NULL || _ins != NULL || _gzin != NULL || _bz2in!=NULL);
+		assert(isOpen());
 		assert_leq(_cur, _buf_sz);
 		if(_cur == _buf_sz) {
 			if(_done) {
@@ -216,6 +328,8 @@ public:
 				} else if (_bz2in != NULL) {
 					int bzError;
 					_buf_sz = BZ2_bzRead(&bzError, _bz2in, _buf, BUF_SZ);
+				} else if (_bgzfin != NULL) {
+					_buf_sz = _bgzfin->read(_buf, BUF_SZ);
 				} else {
 					
 				}
@@ -231,7 +345,7 @@ public:
 				}
 			}
 		}
-		return (int)_buf[_cur];
+		return (int)_bufp[_cur];
 	}
 
 	/**
@@ -377,6 +491,8 @@ private:
 		_ins = NULL;
 		_gzin = NULL;
 		_bz2in = NULL;
+		_bgzfin = NULL;
+		_bufp = _buf;
 		_cur = _buf_sz = BUF_SZ;
 		_done = false;
 		_lastn_cur = 0;
@@ -389,10 +505,12 @@ private:
 	std::istream  *_ins;
 	gzFile *_gzin;
 	BZFILE *_bz2in;
+	BgzfReader *_bgzfin;
 	size_t    _cur;
 	size_t    _buf_sz;
 	bool      _done;
 	uint8_t   _buf[BUF_SZ]; // (large) input buffer
+	const uint8_t *_bufp;   // _buf, or the caller's characters after newBuf()
 	size_t    _lastn_cur;
 	char      _lastn_buf[LASTN_BUF_SZ]; // buffer of the last N chars dispensed
 
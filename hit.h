@@ -2,6 +2,8 @@
 #define HIT_H_
 
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <stdint.h>
 #include <iostream>
 #include <sstream>
@@ -964,15 +966,22 @@ protected:
  */
 class HitSinkPerThread {
 public:
-	HitSinkPerThread(HitSink& sink, uint32_t max, uint32_t n) :
+	HitSinkPerThread(HitSink& sink, uint32_t max, uint32_t n, uint32_t mult = 1) :
 		_sink(sink),
 		_bestRemainingStratum(0),
 		_numValidHits(0llu),
 		_hits(),
 		_bufferedHits(),
+		_merge(NULL),
+		_refBase(0),
+		_shardHits(),
+		_shardOms(),
+		_shardHitsSeen(0),
+		_shardMaxedStratum(-1),
 		hitsForThisRead_(),
 		_max(max),
-		_n(n)
+		_n(n),
+		_mult(mult)
 	{
 		_sink.addWrapper();
 		assert_gt(_n, 0);
@@ -985,6 +994,12 @@ public:
 
 	/// Finalize current read
 	virtual uint32_t finishRead(PatternSourcePerThread& p, bool report, bool dump) {
+		if(_merge != NULL) {
+			return finishShard(report);
+		}
+		if(!_shardHits.empty() || _shardMaxedStratum >= 0) {
+			mergeShards();
+		}
 		uint32_t ret = finishReadImpl();
 		_bestRemainingStratum = 0;
 		if(!report) {
@@ -1026,6 +1041,66 @@ public:
 
 	virtual uint32_t finishReadImpl() = 0;
 
+	/**
+	 * Make this the sink for one index of a multi-index search.  It
+	 * then hands each read's hits to 'merge', with 'refBase' added to
+	 * their reference ids, instead of reporting them.
+	 */
+	void setShard(HitSinkPerThread* merge, TIndexOffU refBase) {
+		assert(merge != NULL);
+		_merge = merge;
+		_refBase = refBase;
+	}
+
+	/**
+	 * Set aside hits found for the current read in one index of a
+	 * multi-index search.  'n' is the number of valid hits found
+	 * there, which exceeds hits.size() if that index alone went over
+	 * the -m ceiling.
+	 */
+	void addShardHits(const vector<Hit>& hits, uint32_t n, TIndexOffU refBase) {
+		int bestStratum = 0;
+		// Each alignment's oms counts the other rows of its range in
+		// this index; the same alignment's range in the other indexes
+		// holds the rest, so sum them, once per index
+		map<string, uint32_t> seen;
+		assert_eq(0, hits.size() % _mult);
+		for(size_t i = 0; i < hits.size(); i += _mult) {
+			string key = omsKey(hits, i);
+			if(seen.find(key) == seen.end()) {
+				seen[key] = hits[i].oms + 1;
+			}
+		}
+		for(map<string, uint32_t>::iterator it = seen.begin(); it != seen.end(); ++it) {
+			_shardOms[it->first] += it->second;
+		}
+		for(size_t i = 0; i < hits.size(); i++) {
+			_shardHits.push_back(hits[i]);
+			Hit& h = _shardHits.back();
+			h.h.first += refBase;
+			if(_mult > 1) h.mh.first += refBase;
+			if(i == 0 || h.stratum < bestStratum) bestStratum = h.stratum;
+		}
+		_shardHitsSeen += n;
+		if(n > _max && (_shardMaxedStratum < 0 || bestStratum < _shardMaxedStratum)) {
+			_shardMaxedStratum = bestStratum;
+		}
+	}
+
+	/**
+	 * Return true iff the hits set aside so far settle what gets
+	 * reported for the current read, so the remaining indexes needn't
+	 * be searched: strata don't matter and there are already more hits
+	 * than -m allows, or 'anyHits' is set and we already have the -k
+	 * hits we need.
+	 */
+	bool shardsDone(bool anyHits) {
+		if(spanStrata() && (_shardMaxedStratum >= 0 || _shardHitsSeen > _max)) {
+			return true;
+		}
+		return anyHits && _shardHitsSeen >= _n && (_max == 0xffffffff || _max < _n);
+	}
+
 	/**
 	 * Implementation for hit reporting; update per-thread _hits and
 	 * _numReportableHits variables and call the master HitSink to do the actual
@@ -1134,6 +1209,98 @@ public:
 	}
 
 protected:
+
+	/**
+	 * Finish the current read in one index of a multi-index search by
+	 * handing its hits to the merging sink.  Returns what finishRead()
+	 * would have returned had this been the only index.
+	 */
+	uint32_t finishShard(bool report) {
+		uint32_t ret = finishReadImpl();
+		_bestRemainingStratum = 0;
+		if(!report) {
+			_bufferedHits.clear();
+			return 0;
+		}
+		_merge->addShardHits(_bufferedHits, ret, _refBase);
+		_bufferedHits.clear();
+		return (ret > _max) ? 0 : min<uint32_t>(ret, _n);
+	}
+
+	/**
+	 * Report the hits set aside from all the indexes of a multi-index
+	 * search as though they'd come from one index: best stratum and
+	 * cost first, stopping where this sink would have stopped the
+	 * search.  Hits come in groups of _mult, e.g. the two mates of a
+	 * paired alignment; as within one index, strata only separate
+	 * unpaired alignments.
+	 */
+	void mergeShards() {
+		assert(_bufferedHits.empty());
+		assert_eq(0, _shardHits.size() % _mult);
+		// Order groups by (stratum, cost), ties by index order
+		vector<pair<pair<int, uint32_t>, size_t> > order;
+		for(size_t i = 0; i < _shardHits.size(); i += _mult) {
+			int stratum = 0;
+			uint32_t cost = 0;
+			for(size_t j = i; j < i + _mult; j++) {
+				stratum = max<int>(stratum, _shardHits[j].stratum);
+				cost += _shardHits[j].cost;
+			}
+			order.push_back(make_pair(make_pair(stratum, cost), i));
+		}
+		sort(order.begin(), order.end());
+		const bool strata = !spanStrata() && _mult == 1;
+		bool done = false;
+		for(size_t i = 0; i < order.size() && !done; i++) {
+			int stratum = order[i].first.first;
+			if(strata && i > 0 && stratum != order[i-1].first.first &&
+			   finishedWithStratum(order[i-1].first.first))
+			{
+				break;
+			}
+			// Count the other alignments across all the indexes, as
+			// the range in one index spanning them all would have
+			uint32_t oms = _shardOms[omsKey(_shardHits, order[i].second)] - 1;
+			for(size_t j = order[i].second; j < order[i].second + _mult && !done; j++) {
+				_shardHits[j].oms = oms;
+				done = reportHit(_shardHits[j], _shardHits[j].stratum);
+			}
+		}
+		// An index that went over -m on its own puts the read over
+		// -m too, unless we're reporting a better stratum than its
+		if(_shardMaxedStratum >= 0 && hitsForThisRead_ <= _max &&
+		   (!strata || order.empty() || _shardMaxedStratum <= order[0].first.first))
+		{
+			hitsForThisRead_ = _max + 1;
+		}
+		_shardHits.clear();
+		_shardOms.clear();
+		_shardHitsSeen = 0;
+		_shardMaxedStratum = -1;
+	}
+
+	/**
+	 * Return a key identifying the alignment whose _mult hits start at
+	 * hits[i] up to where in the reference it lies: its strands and
+	 * mismatches.  The alignments that share a key in one index are
+	 * the rows of one BW range.
+	 */
+	string omsKey(const vector<Hit>& hits, size_t i) const {
+		string key;
+		for(size_t j = i; j < i + _mult; j++) {
+			const Hit& h = hits[j];
+			key.push_back(h.fw ? '+' : '-');
+			key.push_back((char)h.mate);
+			// In colorspace the range is one of colors; decoded bases
+			// can differ between its rows
+			const vector<char>& rc = h.color ? h.crefcs : h.refcs;
+			key.append(rc.begin(), rc.end());
+			key.push_back('|');
+		}
+		return key;
+	}
+
 	HitSink&    _sink; /// Ultimate destination of reported hits
 	/// Least # mismatches in alignments that will be reported in the
 	/// future.  Updated by the search routine.
@@ -1144,12 +1311,21 @@ protected:
 	vector<Hit> _hits; /// Repository for retained hits
 	/// Buffered hits, to be reported and flushed at end of read-phase
 	vector<Hit> _bufferedHits;
+	/// Sink merging hits across indexes, if this is the sink for one
+	/// index of a multi-index search
+	HitSinkPerThread* _merge;
+	TIndexOffU  _refBase;       /// # references in indexes before this one
+	vector<Hit> _shardHits;     /// hits set aside from indexes searched
+	map<string, uint32_t> _shardOms; /// alignments per omsKey() in those indexes
+	uint32_t    _shardHitsSeen; /// # valid hits found in those indexes
+	int         _shardMaxedStratum; /// best stratum of an index over -m; -1 if none
 
 	// Following variables are declared in the parent but maintained in
 	// the concrete subcalsses
 	uint32_t hitsForThisRead_; /// # hits for this read so far
 	uint32_t _max; /// don't report any hits if there were > _max
 	uint32_t _n;   /// report at most _n hits
+	uint32_t _mult; /// # hits per alignment (2 for paired-end)
 };
 
 /**
@@ -1169,6 +1345,55 @@ public:
 	}
 };
 
+/**
+ * Factory for the HitSinkPerThreads of one index in a multi-index
+ * search.  The k-th sink it creates for an aligner hands its hits to
+ * the k-th merging sink in the list given to setMerges(); the first
+ * index's factory fills the list, creating each merging sink from the
+ * wrapped factory the same way as the sink that feeds it.
+ */
+class ShardHitSinkPerThreadFactory : public HitSinkPerThreadFactory {
+public:
+	ShardHitSinkPerThreadFactory(
+			const HitSinkPerThreadFactory& fact,
+			TIndexOffU refBase) :
+			fact_(fact),
+			refBase_(refBase),
+			merges_(NULL),
+			next_(0)
+	{ }
+
+	/// Point the sinks created from now on at the merging sinks in
+	/// 'merges', starting with the first
+	void setMerges(vector<HitSinkPerThread*>* merges) {
+		merges_ = merges;
+		next_ = 0;
+	}
+
+	virtual HitSinkPerThread* create() const {
+		assert(merges_ != NULL);
+		if(next_ == merges_->size()) merges_->push_back(fact_.create());
+		return shard(fact_.create());
+	}
+	virtual HitSinkPerThread* createMult(uint32_t m) const {
+		assert(merges_ != NULL);
+		if(next_ == merges_->size()) merges_->push_back(fact_.createMult(m));
+		return shard(fact_.createMult(m));
+	}
+
+private:
+	HitSinkPerThread* shard(HitSinkPerThread* sink) const {
+		assert_lt(next_, merges_->size());
+		sink->setShard((*merges_)[next_++], refBase_);
+		return sink;
+	}
+
+	const HitSinkPerThreadFactory& fact_;
+	TIndexOffU refBase_; /// # references in indexes before this one
+	vector<HitSinkPerThread*>* merges_;
+	mutable size_t next_; /// merging sink for the next sink created
+};
+
 /**
  * Report first N good alignments encountered; trust search routine
  * to try alignments in something approximating a best-first order.
@@ -1180,8 +1405,9 @@ public:
 	NGoodHitSinkPerThread(
 			HitSink& sink,
 			uint32_t n,
-			uint32_t max) :
-				HitSinkPerThread(sink, max, n)
+			uint32_t max,
+			uint32_t mult = 1) :
+				HitSinkPerThread(sink, max, n, mult)
 	{ }
 
 	virtual bool spanStrata() {
@@ -1253,7 +1479,7 @@ public:
 	virtual HitSinkPerThread* createMult(uint32_t m) const {
 		uint32_t max = max_ * (max_ == 0xffffffff ? 1 : m);
 		uint32_t n = n_ * (n_ == 0xffffffff ? 1 : m);
-		return new NGoodHitSinkPerThread(sink_, n, max);
+		return new NGoodHitSinkPerThread(sink_, n, max, m);
 	}
 
 private:
@@ -1275,8 +1501,8 @@ public:
 			uint32_t n,
 			uint32_t max,
 			uint32_t mult) :
-				HitSinkPerThread(sink, max, n),
-				bestStratum_(999), mult_(mult)
+				HitSinkPerThread(sink, max, n, mult),
+				bestStratum_(999)
 	{ }
 
 	/**
@@ -1332,7 +1558,7 @@ public:
 		for(size_t i = 0; i < sz; i++) {
 			// Set 'oms' according to the number of other alignments
 			// at this stratum
-			_bufferedHits[i].oms = ((uint32_t)sz / mult_) - 1;
+			_bufferedHits[i].oms = ((uint32_t)sz / _mult) - 1;
 		}
 		return ret;
 	}
@@ -1360,7 +1586,6 @@ public:
 private:
 
 	int bestStratum_; /// best stratum observed so far
-	uint32_t mult_; /// number of batched-up alignments
 };
 
 /**
@@ -1404,8 +1629,9 @@ class AllHitSinkPerThread : public HitSinkPerThread {
 public:
 	AllHitSinkPerThread(
 			HitSink& sink,
-	        uint32_t max) :
-		    HitSinkPerThread(sink, max, 0xffffffff) { }
+	        uint32_t max,
+	        uint32_t mult = 1) :
+		    HitSinkPerThread(sink, max, 0xffffffff, mult) { }
 
 	virtual bool spanStrata() {
 		return true; // we span strata
@@ -1465,7 +1691,7 @@ public:
 	}
 	virtual HitSinkPerThread* createMult(uint32_t m) const {
 		uint32_t max = max_ * (max_ == 0xffffffff ? 1 : m);
-		return new AllHitSinkPerThread(sink_, max);
+		return new AllHitSinkPerThread(sink_, max, m);
 	}
 
 private:
@@ -0,0 +1,312 @@
+/*
+ * hot_offs.h
+ *
+ * Optional second-level suffix-array sample, stored in the .offs2.ebwt
+ * file, that samples "hot" (repetitive) stretches of BWT rows more
+ * densely than the regular offRate sample in _offs.
+ */
+
+#ifndef HOT_OFFS_H_
+#define HOT_OFFS_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include "assert_helpers.h"
+#include "btypes.h"
+#include "endian_swap.h"
+#include "word_io.h"
+
+/// Length of the k-mers whose occurrence counts decide which rows are
+/// hot; long enough that a frequent one indicates a genuine repeat
+static const int HOT_OFFS_KMER = 20;
+
+/**
+ * Rows are grouped into blocks of 2^offRate rows, the same blocks the
+ * primary sample marks the first row of.  A bit vector records which
+ * blocks are hot; every hot block stores the SA offsets of the rows
+ * whose index within the block is a multiple of 2^offRate2.  Hot blocks
+ * are found by rank over the bit vector, so the structure costs
+ * 1 bit per block plus the dense samples themselves.
+ *
+ * File layout (all fields in the index's endianness):
+ *   uint32_t   1 (endianness hint)
+ *   int32_t    offRate (block size is 2^offRate rows)
+ *   int32_t    offRate2 (dense sampling rate within a hot block)
+ *   TIndexOffU length of the indexed text, to detect a stale sample
+ *   TIndexOffU number of hot blocks
+ *   ceil(# blocks / 64) x uint64_t hot-block bits
+ *   # hot blocks x 2^(offRate-offRate2) x TIndexOffU offsets
+ */
+class HotOffs {
+
+public:
+
+	HotOffs() :
+		offRate_(0), offRate2_(0), len_(0), per_(0), nhot_(0),
+		blockMask_(0), mask2_(0) { }
+
+	/// Return true iff there is a sample to consult
+	bool loaded() const { return !bits_.empty(); }
+
+	/// Return the number of hot blocks
+	TIndexOffU numHot() const { return nhot_; }
+
+	/// Return the number of blocks
+	TIndexOffU numBlocks() const { return (TIndexOffU)((len_ + 1 + blockMask_) >> offRate_); }
+
+	/**
+	 * If the given row is sampled, set off to its offset and return
+	 * true.  Otherwise return false.
+	 */
+	bool lookup(TIndexOffU row, TIndexOffU& off) const {
+		if(bits_.empty() || (row & mask2_) != row) return false;
+		TIndexOffU b = row >> offRate_;
+		uint64_t w = bits_[b >> 6];
+		uint64_t bit = (uint64_t)1 << (b & 63);
+		if((w & bit) == 0) return false;
+		TIndexOffU r = cum_[b >> 6] + (TIndexOffU)__builtin_popcountll(w & (bit - 1));
+		off = offs_[(size_t)r * per_ + ((row & blockMask_) >> offRate2_)];
+		assert_neq(OFF_MASK, off);
+		return true;
+	}
+
+	/**
+	 * Install the given hot-block bits and dense samples.
+	 */
+	void init(int offRate, int offRate2, TIndexOffU len,
+	          std::vector<uint64_t>& bits, std::vector<TIndexOffU>& offs)
+	{
+		assert_lt(offRate2, offRate);
+		offRate_ = offRate;
+		offRate2_ = offRate2;
+		len_ = len;
+		per_ = (TIndexOffU)1 << (offRate - offRate2);
+		blockMask_ = ((TIndexOffU)1 << offRate) - 1;
+		mask2_ = ~(((TIndexOffU)1 << offRate2) - 1);
+		bits_.swap(bits);
+		offs_.swap(offs);
+		assert_eq(0, offs_.size() % per_);
+		nhot_ = (TIndexOffU)(offs_.size() / per_);
+		cum_.resize(bits_.size());
+		TIndexOffU c = 0;
+		for(size_t i = 0; i < bits_.size(); i++) {
+			cum_[i] = c;
+			c += (TIndexOffU)__builtin_popcountll(bits_[i]);
+		}
+		assert_eq(c, nhot_);
+	}
+
+	/**
+	 * Write the sample to the given file.
+	 */
+	void writeToFile(const std::string& fn, bool be) const {
+		std::ofstream out(fn.c_str(), std::ios::binary);
+		if(!out.good()) {
+			std::cerr << "Could not open SA sample file for writing: \"" << fn << "\"" << std::endl;
+			throw 1;
+		}
+		writeU<uint32_t>(out, 1, be);
+		writeI<int32_t>(out, offRate_, be);
+		writeI<int32_t>(out, offRate2_, be);
+		writeU<TIndexOffU>(out, len_, be);
+		writeU<TIndexOffU>(out, nhot_, be);
+		for(size_t i = 0; i < bits_.size(); i++) {
+			writeU<uint64_t>(out, bits_[i], be);
+		}
+		for(size_t i = 0; i < offs_.size(); i++) {
+			writeU<TIndexOffU>(out, offs_[i], be);
+		}
+		out.close();
+		if(out.fail()) {
+			std::cerr << "Error writing SA sample file \"" << fn << "\"; please check whether the disk is full." << std::endl;
+			throw 1;
+		}
+	}
+
+	/**
+	 * Load the sample from the given file if it exists.  Return false
+	 * (leaving the sample unloaded) if there is no such file or if it
+	 * doesn't belong to an index over a text of length len.
+	 */
+	bool readFromFile(const std::string& fn, TIndexOffU len, bool verbose) {
+		reset();
+		std::ifstream in(fn.c_str(), std::ios::binary);
+		if(!in.good()) return false;
+		uint32_t one = readU<uint32_t>(in, false);
+		bool swap = false;
+		if(one != 1) {
+			if(endianSwapU32(one) != 1) {
+				std::cerr << "Warning: ignoring SA sample \"" << fn << "\" with bad endianness hint" << std::endl;
+				return false;
+			}
+			swap = true;
+		}
+		int32_t offRate  = readI<int32_t>(in, swap);
+		int32_t offRate2 = readI<int32_t>(in, swap);
+		TIndexOffU tlen  = readU<TIndexOffU>(in, swap);
+		TIndexOffU nhot  = readU<TIndexOffU>(in, swap);
+		if(!in.good() || tlen != len || offRate2 < 0 || offRate2 >= offRate ||
+		   offRate >= (int32_t)(8 * sizeof(TIndexOffU)))
+		{
+			std::cerr << "Warning: ignoring SA sample \"" << fn << "\"; it does not match the index" << std::endl;
+			return false;
+		}
+		TIndexOffU nblocks = (TIndexOffU)(((uint64_t)len + 1 + ((1llu << offRate) - 1)) >> offRate);
+		std::vector<uint64_t> bits((nblocks + 63) >> 6);
+		for(size_t i = 0; i < bits.size(); i++) {
+			bits[i] = readU<uint64_t>(in, swap);
+		}
+		std::vector<TIndexOffU> offs((size_t)nhot << (offRate - offRate2));
+		if(!swap) {
+			if(!offs.empty()) in.read((char*)&offs[0], offs.size() * sizeof(TIndexOffU));
+		} else {
+			for(size_t i = 0; i < offs.size() && in.good(); i++) {
+				offs[i] = readU<TIndexOffU>(in, true);
+			}
+		}
+		if(!in.good()) {
+			std::cerr << "Warning: ignoring truncated SA sample \"" << fn << "\"" << std::endl;
+			return false;
+		}
+		if(verbose) {
+			std::cerr << "Reading SA sample \"" << fn << "\" (" << nhot << " of "
+			          << nblocks << " blocks sampled at offRate " << offRate2 << ")" << std::endl;
+		}
+		init(offRate, offRate2, len, bits, offs);
+		return true;
+	}
+
+	/**
+	 * Free the sample.
+	 */
+	void reset() {
+		std::vector<uint64_t>().swap(bits_);
+		std::vector<TIndexOffU>().swap(cum_);
+		std::vector<TIndexOffU>().swap(offs_);
+		offRate_ = offRate2_ = 0;
+		len_ = per_ = nhot_ = blockMask_ = mask2_ = 0;
+	}
+
+private:
+	int                     offRate_;   // block size is 2^offRate_ rows
+	int                     offRate2_;  // sampling rate within hot blocks
+	TIndexOffU              len_;
+	TIndexOffU              per_;       // samples per hot block
+	TIndexOffU              nhot_;
+	TIndexOffU              blockMask_;
+	TIndexOffU              mask2_;
+	std::vector<uint64_t>   bits_;      // 1 bit per block; set = hot
+	std::vector<TIndexOffU> cum_;       // # hot blocks before each word of bits_
+	std::vector<TIndexOffU> offs_;      // dense samples for hot blocks
+};
+
+/**
+ * Builds a HotOffs during the SA walk in Ebwt::buildToDisk().  A block
+ * is hot if it overlaps a run of at least minOcc rows whose suffixes
+ * share the same k-character prefix, i.e. if it covers a k-mer that
+ * occurs at least minOcc times in the text.  Those are the rows that
+ * -k/-a alignments in repeats resolve most often, and the rows visited
+ * while walking left from them are mostly in the same repeats.
+ *
+ * Rows must be added in order.  Samples are buffered only until it is
+ * known whether their block is hot, i.e. until the run(s) overlapping
+ * the block have closed.
+ */
+class HotOffsBuilder {
+
+public:
+
+	HotOffsBuilder(int offRate, int offRate2, uint32_t minOcc, TIndexOffU len) :
+		offRate_(offRate), offRate2_(offRate2), minOcc_(minOcc), len_(len),
+		per_((TIndexOffU)1 << (offRate - offRate2)),
+		mask2_(((TIndexOffU)1 << offRate2) - 1),
+		pendBlk_(0), runOpen_(false), runStart_(0), runCode_(0)
+	{
+		assert_lt(offRate2, offRate);
+		TIndexOffU nblocks = (TIndexOffU)(((uint64_t)len + 1 + ((1llu << offRate) - 1)) >> offRate);
+		bits_.resize((nblocks + 63) >> 6, 0);
+	}
+
+	/**
+	 * Add the next row, whose suffix starts at text offset saElt.  If
+	 * the suffix is at least k characters long, hasKmer is true and
+	 * code identifies its k-character prefix.
+	 */
+	void add(TIndexOffU row, TIndexOffU saElt, bool hasKmer, uint64_t code) {
+		if(!hasKmer || !runOpen_ || code != runCode_) {
+			closeRun(row);
+			if(hasKmer) {
+				runOpen_ = true;
+				runStart_ = row;
+				runCode_ = code;
+			}
+		}
+		if((row & mask2_) == 0) {
+			assert_eq(pend_.size(), ((row >> offRate2_) - ((TIndexOffU)pendBlk_ << (offRate_ - offRate2_))));
+			pend_.push_back(saElt);
+		}
+	}
+
+	/**
+	 * Close the last run, flush the remaining samples and install the
+	 * result in ho.
+	 */
+	void finish(HotOffs& ho) {
+		TIndexOffU end = len_ + 1;
+		closeRun(end);
+		while(pend_.size() % per_ != 0) pend_.push_back(OFF_MASK);
+		flush((TIndexOffU)bits_.size() << 6);
+		ho.init(offRate_, offRate2_, len_, bits_, out_);
+	}
+
+private:
+
+	/**
+	 * Close the current run at row end (exclusive), marking the blocks
+	 * it overlaps as hot if it's long enough, then retire the blocks
+	 * that no later run can overlap.
+	 */
+	void closeRun(TIndexOffU end) {
+		if(runOpen_ && end - runStart_ >= minOcc_) {
+			for(TIndexOffU b = runStart_ >> offRate_; b <= ((end - 1) >> offRate_); b++) {
+				bits_[b >> 6] |= ((uint64_t)1 << (b & 63));
+			}
+		}
+		runOpen_ = false;
+		flush(end >> offRate_);
+	}
+
+	/**
+	 * Move the samples of all pending blocks before block 'upto' to
+	 * the output if they are hot, discarding them otherwise.
+	 */
+	void flush(TIndexOffU upto) {
+		while(pendBlk_ < upto && pend_.size() >= per_) {
+			if((bits_[pendBlk_ >> 6] >> (pendBlk_ & 63)) & 1) {
+				out_.insert(out_.end(), pend_.begin(), pend_.begin() + per_);
+			}
+			pend_.erase(pend_.begin(), pend_.begin() + per_);
+			pendBlk_++;
+		}
+	}
+
+	int                     offRate_;
+	int                     offRate2_;
+	uint32_t                minOcc_;
+	TIndexOffU              len_;
+	TIndexOffU              per_;
+	TIndexOffU              mask2_;
+	TIndexOffU              pendBlk_;  // first block with buffered samples
+	std::deque<TIndexOffU>  pend_;     // buffered samples, from pendBlk_ on
+	bool                    runOpen_;
+	TIndexOffU              runStart_;
+	uint64_t                runCode_;
+	std::vector<uint64_t>   bits_;
+	std::vector<TIndexOffU> out_;
+};
+
+#endif /*HOT_OFFS_H_*/
@@ -0,0 +1,267 @@
+/*
+ * index_io.cpp
+ *
+ * Reads the large index arrays with several threads, each issuing
+ * large positioned reads (pread) on its own stretch of the file, and
+ * pre-faults memory-mapped index files from several threads.  Both
+ * need POSIX I/O, so without BOWTIE_MM everything is done serially.
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "index_io.h"
+#include "threading.h"
+
+#ifdef BOWTIE_MM
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+using namespace std;
+
+int  gLoadThreads = 1;
+bool gLoadDirect  = false;
+
+#ifdef BOWTIE_MM
+
+/// Bytes requested per read() call
+static const uint64_t LOAD_BLOCK = 8 * 1024 * 1024;
+/// Don't give a thread less than this much of an array
+static const uint64_t LOAD_MIN_CHUNK = 4 * 1024 * 1024;
+/// Alignment O_DIRECT demands of offsets, lengths and buffers
+static const uint64_t DIRECT_ALIGN = 4096;
+
+/// One thread's stretch of an array being read
+struct LoadChunk {
+	int       fd;       // descriptor for buffered reads
+	int       directFd; // descriptor opened with O_DIRECT, or -1
+	char     *dst;      // where the stretch goes
+	uint64_t  off;      // file offset of the stretch
+	uint64_t  len;      // length of the stretch
+	bool      ok;       // false if a read failed
+};
+
+/**
+ * Read 'len' bytes at offset 'off' of 'fd' into 'dst' with plain
+ * positioned reads.
+ */
+static bool preadFully(int fd, char *dst, uint64_t off, uint64_t len) {
+	while(len > 0) {
+		ssize_t r = pread(fd, dst, (size_t)min(len, LOAD_BLOCK), (off_t)off);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return false;
+		dst += r; off += r; len -= r;
+	}
+	return true;
+}
+
+/**
+ * Read one stretch, through an aligned bounce buffer if O_DIRECT is in
+ * use (the stretch itself is rarely aligned in the file).  Falls back
+ * to buffered reads if the filesystem refuses O_DIRECT.
+ */
+static void loadChunkWorker(void *vp) {
+	LoadChunk& c = *(LoadChunk*)vp;
+	c.ok = true;
+	char *dst = c.dst;
+	uint64_t off = c.off;
+	uint64_t end = c.off + c.len;
+	if(c.directFd >= 0) {
+		void *bounce = NULL;
+		if(posix_memalign(&bounce, DIRECT_ALIGN, LOAD_BLOCK) != 0) bounce = NULL;
+		while(bounce != NULL && off < end) {
+			uint64_t aoff = off & ~(DIRECT_ALIGN - 1);
+			ssize_t r = pread(c.directFd, bounce, LOAD_BLOCK, (off_t)aoff);
+			if(r < 0 && errno == EINTR) continue;
+			if(r <= (ssize_t)(off - aoff)) break; // refused; finish buffered
+			uint64_t n = min<uint64_t>(aoff + r, end) - off;
+			memcpy(dst, (char*)bounce + (off - aoff), (size_t)n);
+			dst += n; off += n;
+		}
+		free(bounce);
+	}
+	if(off < end) {
+		c.ok = preadFully(c.fd, dst, off, end - off);
+	}
+}
+
+static double wallSecs() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Print the throughput of a load step.
+ */
+static void reportThroughput(const char *what,
+                             const char *memName,
+                             uint64_t len,
+                             int nthreads,
+                             double secs)
+{
+	double mb = len / (1024.0 * 1024.0);
+	cerr << "  " << what << " " << len << " bytes of " << memName
+	     << " with " << nthreads << " thread(s) in " << secs << " s";
+	if(secs > 0) cerr << " (" << (mb / secs) << " MB/s)";
+	cerr << endl;
+}
+
+#endif
+
+/**
+ * Read 'len' bytes from the current position of 'f' (opened on file
+ * 'fname') into 'dst', leaving 'f' positioned just after them.  With
+ * gLoadThreads > 1 the bytes are split into stretches read at once by
+ * that many threads, so the pages of 'dst' are also faulted in
+ * parallel; with gLoadDirect they bypass the page cache.  Returns
+ * false if the file was short or a read failed.
+ */
+bool parallelRead(FILE *f,
+                  const char *fname,
+                  void *dst,
+                  uint64_t len,
+                  const char *memName,
+                  bool verbose)
+{
+	if(len == 0) return true;
+#ifdef BOWTIE_MM
+	double start = wallSecs();
+	int nthreads = (int)max<uint64_t>(1, min<uint64_t>(gLoadThreads, len / LOAD_MIN_CHUNK));
+	if(nthreads > 1 || gLoadDirect) {
+		off_t pos = ftello(f);
+		if(pos < 0) return false;
+		int directFd = -1;
+		if(gLoadDirect) {
+#ifdef O_DIRECT
+			directFd = open(fname, O_RDONLY | O_DIRECT);
+#endif
+			if(directFd < 0 && verbose) {
+				cerr << "  Could not open " << fname << " with O_DIRECT; reading through the page cache" << endl;
+			}
+		}
+		// Split at multiples of 2 MB so that no two threads fault in
+		// the same huge page
+		const uint64_t align = 2 * 1024 * 1024;
+		uint64_t per = ((len / nthreads) + align - 1) & ~(align - 1);
+		vector<LoadChunk> chunks;
+		for(uint64_t o = 0; o < len; o += per) {
+			LoadChunk c;
+			c.fd = fileno(f);
+			c.directFd = directFd;
+			c.dst = (char*)dst + o;
+			c.off = (uint64_t)pos + o;
+			c.len = min(per, len - o);
+			c.ok = false;
+			chunks.push_back(c);
+		}
+		if(chunks.size() == 1) {
+			loadChunkWorker((void*)&chunks[0]);
+		} else {
+			vector<tthread::thread*> threads;
+			for(size_t i = 0; i < chunks.size(); i++) {
+				threads.push_back(new tthread::thread(loadChunkWorker, (void*)&chunks[i]));
+			}
+			for(size_t i = 0; i < threads.size(); i++) {
+				threads[i]->join();
+				delete threads[i];
+			}
+		}
+		if(directFd >= 0) close(directFd);
+		for(size_t i = 0; i < chunks.size(); i++) {
+			if(!chunks[i].ok) return false;
+		}
+		if(fseeko(f, pos + (off_t)len, SEEK_SET) != 0) return false;
+		if(verbose) {
+			reportThroughput("Read", memName, len, (int)chunks.size(), wallSecs() - start);
+		}
+		return true;
+	}
+#endif
+	// Serial: a series of large freads
+	char *p = (char*)dst;
+	uint64_t left = len;
+	while(left > 0) {
+		size_t r = fread(p, 1, (size_t)left, f);
+		if(r == 0) return false;
+		p += r;
+		left -= r;
+	}
+#ifdef BOWTIE_MM
+	if(verbose) {
+		reportThroughput("Read", memName, len, 1, wallSecs() - start);
+	}
+#endif
+	return true;
+}
+
+#ifdef BOWTIE_MM
+/// One thread's stretch of a region being swept
+struct SweepChunk {
+	const char *mem;
+	uint64_t    len;
+	int64_t     sum;
+};
+
+static void sweepChunkWorker(void *vp) {
+	SweepChunk& c = *(SweepChunk*)vp;
+	int64_t sum = 0;
+	for(uint64_t i = 0; i < c.len; i += 1024) {
+		sum += c.mem[i];
+	}
+	c.sum = sum;
+}
+#endif
+
+/**
+ * Touch every page of [mem, mem+len), typically a memory-mapped index
+ * file, so that it's faulted in now rather than during the search.
+ * Uses gLoadThreads threads.  Returns a checksum of the bytes touched
+ * so the compiler can't drop the loop.
+ */
+int64_t parallelSweep(const void *mem,
+                      uint64_t len,
+                      const char *memName,
+                      bool verbose)
+{
+	const char *p = (const char*)mem;
+#ifdef BOWTIE_MM
+	double start = wallSecs();
+	int nthreads = (int)max<uint64_t>(1, min<uint64_t>(gLoadThreads, len / LOAD_MIN_CHUNK));
+	// Multiples of 1 KB keep the touched bytes the same as a serial
+	// sweep
+	uint64_t per = ((len / nthreads) + 1023) & ~(uint64_t)1023;
+	vector<SweepChunk> chunks;
+	for(uint64_t o = 0; o < len; o += per) {
+		SweepChunk c = { p + o, min(per, len - o), 0 };
+		chunks.push_back(c);
+	}
+	if(chunks.size() <= 1) {
+		for(size_t i = 0; i < chunks.size(); i++) sweepChunkWorker((void*)&chunks[i]);
+	} else {
+		vector<tthread::thread*> threads;
+		for(size_t i = 0; i < chunks.size(); i++) {
+			threads.push_back(new tthread::thread(sweepChunkWorker, (void*)&chunks[i]));
+		}
+		for(size_t i = 0; i < threads.size(); i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+	}
+	int64_t sum = 0;
+	for(size_t i = 0; i < chunks.size(); i++) sum += chunks[i].sum;
+	if(verbose) {
+		reportThroughput("Swept", memName, len, (int)chunks.size(), wallSecs() - start);
+	}
+	return sum;
+#else
+	int64_t sum = 0;
+	for(uint64_t i = 0; i < len; i += 1024) sum += p[i];
+	return sum;
+#endif
+}
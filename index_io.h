@@ -0,0 +1,28 @@
+/*
+ * index_io.h
+ *
+ * Multithreaded reading and pre-faulting of the large index arrays.
+ */
+
+#ifndef INDEX_IO_H_
+#define INDEX_IO_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+extern int  gLoadThreads; /// # threads reading/faulting index files; 1 = serial
+extern bool gLoadDirect;  /// bypass the page cache (O_DIRECT) when reading
+
+extern bool parallelRead(FILE *f,
+                         const char *fname,
+                         void *dst,
+                         uint64_t len,
+                         const char *memName,
+                         bool verbose);
+
+extern int64_t parallelSweep(const void *mem,
+                             uint64_t len,
+                             const char *memName,
+                             bool verbose);
+
+#endif /* INDEX_IO_H_ */
@@ -0,0 +1,365 @@
+/*
+ * kmer_table.h
+ *
+ * Optional secondary lookup table, stored in the .5.ebwt file, that
+ * maps every k-mer occurring in the indexed text (for k larger than
+ * the ftab's ftabChars) directly to its BWT range.
+ */
+
+#ifndef KMER_TABLE_H_
+#define KMER_TABLE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef BOWTIE_MM
+#include <sys/mman.h>
+#endif
+#include "assert_helpers.h"
+#include "btypes.h"
+#include "endian_swap.h"
+#include "word_io.h"
+
+/**
+ * Open-addressing (linear probing) hash table from k-mer code to
+ * [top, bot).  A k-mer's code packs its characters 2 bits each, the
+ * leftmost character in the most significant position, exactly as
+ * for ftab offsets; k is therefore at most 16.  K-mers that don't
+ * occur in the text have no entry, so a failed lookup means the range
+ * is empty.  The table is at most 3/4 full, so a lookup usually
+ * touches a single cache line.
+ *
+ * File layout (all fields in the index's endianness):
+ *   uint32_t   1 (endianness hint)
+ *   int32_t    k
+ *   TIndexOffU length of the indexed text
+ *   uint64_t   fingerprint of the index (Ebwt::fingerprint()), to
+ *              detect a table left over from a different index
+ *   TIndexOffU capacity (# slots; a power of 2)
+ *   capacity x Entry
+ */
+class KmerTable {
+
+public:
+
+	/// One slot; an empty slot has top == bot
+	struct Entry {
+		TIndexOffU top;
+		TIndexOffU bot;
+		uint32_t   code;
+		uint32_t   pad;
+	};
+
+	KmerTable() :
+		k_(0), len_(0), fp_(0), cap_(0), mask_(0), ents_(NULL),
+		mmBuf_(NULL), mmSz_(0) { }
+
+	~KmerTable() { reset(); }
+
+	/// Return k, or 0 if the table is not loaded
+	int k() const { return k_; }
+
+	/// Return true iff there is a table to consult
+	bool loaded() const { return ents_ != NULL; }
+
+	/// Return the number of slots
+	TIndexOffU capacity() const { return cap_; }
+
+	/**
+	 * Return the number of slots a table holding n k-mers has: the
+	 * smallest power of 2 that keeps it at most 3/4 full.
+	 */
+	static uint64_t capacityFor(uint64_t n) {
+		uint64_t cap = 1;
+		while(cap < n + n / 3) cap <<= 1;
+		return cap;
+	}
+
+	/**
+	 * Allocate an empty table with room for n k-mers, for an index
+	 * over a text of length len with fingerprint fp.
+	 */
+	void init(int k, TIndexOffU len, uint64_t fp, TIndexOffU n) {
+		assert_gt(k, 0);
+		assert_leq(k, 16);
+		reset();
+		k_ = k;
+		len_ = len;
+		fp_ = fp;
+		cap_ = (TIndexOffU)capacityFor(n);
+		mask_ = cap_ - 1;
+		ents_ = new Entry[cap_];
+		memset(ents_, 0, cap_ * sizeof(Entry));
+	}
+
+	/**
+	 * Add a (code, top, bot) triple.  Codes must be distinct, and no
+	 * more than init()'s n may be added.
+	 */
+	void insert(const Entry& e) {
+		assert(loaded());
+		assert_gt(e.bot, e.top);
+		TIndexOffU j = slot(e.code);
+		while(ents_[j].bot > ents_[j].top) {
+			assert_neq(e.code, ents_[j].code);
+			j = (j + 1) & mask_;
+		}
+		ents_[j] = e;
+	}
+
+	/**
+	 * Look up the range for the given k-mer code.  Return true and set
+	 * top and bot if it occurs, otherwise return false.
+	 */
+	bool lookup(uint32_t code, TIndexOffU& top, TIndexOffU& bot) const {
+		assert(loaded());
+		TIndexOffU j = slot(code);
+		while(ents_[j].bot > ents_[j].top) {
+			if(ents_[j].code == code) {
+				top = ents_[j].top;
+				bot = ents_[j].bot;
+				return true;
+			}
+			j = (j + 1) & mask_;
+		}
+		return false;
+	}
+
+	/**
+	 * Write the table to the given file.
+	 */
+	void writeToFile(const std::string& fn, bool be) const {
+		assert(loaded());
+		std::ofstream out(fn.c_str(), std::ios::binary);
+		if(!out.good()) {
+			std::cerr << "Could not open k-mer table file for writing: \"" << fn << "\"" << std::endl;
+			throw 1;
+		}
+		writeU<uint32_t>(out, 1, be);
+		writeI<int32_t>(out, k_, be);
+		writeU<TIndexOffU>(out, len_, be);
+		writeU<uint64_t>(out, fp_, be);
+		writeU<TIndexOffU>(out, cap_, be);
+		for(TIndexOffU i = 0; i < cap_; i++) {
+			writeU<TIndexOffU>(out, ents_[i].top, be);
+			writeU<TIndexOffU>(out, ents_[i].bot, be);
+			writeU<uint32_t>(out, ents_[i].code, be);
+			writeU<uint32_t>(out, 0, be);
+		}
+		out.close();
+		if(out.fail()) {
+			std::cerr << "Error writing k-mer table file \"" << fn << "\"; please check whether the disk is full." << std::endl;
+			throw 1;
+		}
+	}
+
+	/**
+	 * Load the table from the given file if it exists.  If useMm is
+	 * true and the file is in the native endianness, memory-map it
+	 * rather than reading it.  Return false (leaving the table
+	 * unloaded) if there is no such file or if it doesn't belong to
+	 * the index over a text of length len with fingerprint fp.
+	 */
+	bool readFromFile(const std::string& fn, TIndexOffU len, uint64_t fp, bool useMm, bool verbose) {
+		reset();
+		std::ifstream in(fn.c_str(), std::ios::binary);
+		if(!in.good()) return false;
+		uint32_t one = readU<uint32_t>(in, false);
+		bool swap = false;
+		if(one != 1) {
+			if(endianSwapU32(one) != 1) {
+				std::cerr << "Warning: ignoring k-mer table \"" << fn << "\" with bad endianness hint" << std::endl;
+				return false;
+			}
+			swap = true;
+		}
+		int32_t k = readI<int32_t>(in, swap);
+		TIndexOffU tlen = readU<TIndexOffU>(in, swap);
+		uint64_t   tfp  = readU<uint64_t>(in, swap);
+		TIndexOffU cap  = readU<TIndexOffU>(in, swap);
+		if(!in.good() || k <= 0 || k > 16 || tlen != len || tfp != fp ||
+		   cap == 0 || (cap & (cap - 1)) != 0)
+		{
+			std::cerr << "Warning: ignoring k-mer table \"" << fn << "\"; it does not match the index" << std::endl;
+			return false;
+		}
+		const size_t hdrSz = 16 + 2 * sizeof(TIndexOffU);
+		if(verbose) {
+			std::cerr << "Reading k-mer table \"" << fn << "\" (k=" << k << ", " << cap << " slots)" << std::endl;
+		}
+#ifdef BOWTIE_MM
+		if(useMm && !swap) {
+			in.close();
+			int fd = open(fn.c_str(), O_RDONLY);
+			struct stat sbuf;
+			if(fd < 0 || fstat(fd, &sbuf) < 0 ||
+			   (size_t)sbuf.st_size < hdrSz + cap * sizeof(Entry))
+			{
+				if(fd >= 0) close(fd);
+				std::cerr << "Warning: ignoring truncated k-mer table \"" << fn << "\"" << std::endl;
+				return false;
+			}
+			void *buf = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if(buf == MAP_FAILED) {
+				perror("mmap");
+				std::cerr << "Warning: could not memory-map k-mer table \"" << fn << "\"" << std::endl;
+				return false;
+			}
+			mmBuf_ = buf;
+			mmSz_ = sbuf.st_size;
+			ents_ = (Entry*)((char*)buf + hdrSz);
+			k_ = k; len_ = tlen; fp_ = tfp; cap_ = cap; mask_ = cap - 1;
+			return true;
+		}
+#else
+		(void)useMm;
+#endif
+		Entry *ents = new Entry[cap];
+		if(!swap) {
+			in.read((char*)ents, cap * sizeof(Entry));
+		} else {
+			for(TIndexOffU i = 0; i < cap && in.good(); i++) {
+				ents[i].top  = readU<TIndexOffU>(in, true);
+				ents[i].bot  = readU<TIndexOffU>(in, true);
+				ents[i].code = readU<uint32_t>(in, true);
+				ents[i].pad  = readU<uint32_t>(in, true);
+			}
+		}
+		if(!in.good()) {
+			delete[] ents;
+			std::cerr << "Warning: ignoring truncated k-mer table \"" << fn << "\"" << std::endl;
+			return false;
+		}
+		ents_ = ents;
+		k_ = k; len_ = tlen; fp_ = tfp; cap_ = cap; mask_ = cap - 1;
+		return true;
+	}
+
+	/**
+	 * Free the table.
+	 */
+	void reset() {
+		if(mmBuf_ != NULL) {
+#ifdef BOWTIE_MM
+			munmap(mmBuf_, mmSz_);
+#endif
+		} else if(ents_ != NULL) {
+			delete[] ents_;
+		}
+		ents_ = NULL;
+		mmBuf_ = NULL;
+		mmSz_ = 0;
+		k_ = 0; len_ = 0; fp_ = 0; cap_ = 0; mask_ = 0;
+	}
+
+private:
+
+	/// Home slot for the given code (Fibonacci hashing)
+	TIndexOffU slot(uint32_t code) const {
+		return (TIndexOffU)(((uint64_t)code * 0x9E3779B97F4A7C15llu) >> 32) & mask_;
+	}
+
+	int         k_;
+	TIndexOffU  len_;
+	uint64_t    fp_;
+	TIndexOffU  cap_;
+	TIndexOffU  mask_;
+	Entry      *ents_;
+	void       *mmBuf_; // non-NULL iff ents_ points into a mapped file
+	size_t      mmSz_;
+};
+
+/**
+ * Collects the entries of a KmerTable as bowtie-build's BWT loop
+ * closes each k-mer range.  How many distinct k-mers there are isn't
+ * known until the loop ends, so rather than hold them in memory
+ * alongside the table, they're spilled to a temporary file next to
+ * the table's and read back once the table can be sized.
+ */
+class KmerTableBuilder {
+
+public:
+
+	KmerTableBuilder(int k, const std::string& fn) :
+		k_(k), tmpFn_(fn + ".tmp"), n_(0), nbuf_(0)
+	{
+		out_.open(tmpFn_.c_str(), std::ios::binary);
+		if(!out_.good()) {
+			std::cerr << "Could not open temporary k-mer table file for writing: \"" << tmpFn_ << "\"" << std::endl;
+			throw 1;
+		}
+	}
+
+	~KmerTableBuilder() {
+		if(out_.is_open()) out_.close();
+		remove(tmpFn_.c_str());
+	}
+
+	/// Add the range [top, bot) of the k-mer with the given code
+	void add(uint32_t code, TIndexOffU top, TIndexOffU bot) {
+		assert_gt(bot, top);
+		KmerTable::Entry& e = buf_[nbuf_++];
+		e.top = top;
+		e.bot = bot;
+		e.code = code;
+		e.pad = 0;
+		n_++;
+		if(nbuf_ == BUF_ENTS) flush();
+	}
+
+	/// Return the number of k-mers added so far
+	TIndexOffU size() const { return n_; }
+
+	/**
+	 * Fill kt, sized for the k-mers added, for the index over a text
+	 * of length len with fingerprint fp.
+	 */
+	void finish(KmerTable& kt, TIndexOffU len, uint64_t fp) {
+		flush();
+		out_.close();
+		if(out_.fail()) {
+			std::cerr << "Error writing temporary k-mer table file \"" << tmpFn_ << "\"; please check whether the disk is full." << std::endl;
+			throw 1;
+		}
+		kt.init(k_, len, fp, n_);
+		std::ifstream in(tmpFn_.c_str(), std::ios::binary);
+		for(TIndexOffU done = 0; done < n_; ) {
+			size_t nread = (size_t)std::min<TIndexOffU>(n_ - done, (TIndexOffU)BUF_ENTS);
+			in.read((char*)buf_, nread * sizeof(KmerTable::Entry));
+			if(!in.good()) {
+				std::cerr << "Error reading temporary k-mer table file \"" << tmpFn_ << "\"" << std::endl;
+				throw 1;
+			}
+			for(size_t i = 0; i < nread; i++) kt.insert(buf_[i]);
+			done += (TIndexOffU)nread;
+		}
+		in.close();
+		remove(tmpFn_.c_str());
+	}
+
+private:
+
+	void flush() {
+		out_.write((const char*)buf_, nbuf_ * sizeof(KmerTable::Entry));
+		nbuf_ = 0;
+	}
+
+	static const size_t BUF_ENTS = 4096;
+
+	int              k_;
+	std::string      tmpFn_;
+	std::ofstream    out_;
+	TIndexOffU       n_;    // entries added
+	size_t           nbuf_; // entries in buf_ not yet written
+	KmerTable::Entry buf_[BUF_ENTS];
+};
+
+#endif /*KMER_TABLE_H_*/
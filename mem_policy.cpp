@@ -0,0 +1,227 @@
+/*
+ * mem_policy.cpp
+ *
+ * Huge-page allocation and NUMA placement for the large index arrays.
+ * Only Linux offers these; elsewhere the functions report failure and
+ * callers fall back to ordinary allocation.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include "mem_policy.h"
+
+#ifdef BOWTIE_MEM_POLICY
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#endif
+
+using namespace std;
+
+#ifdef BOWTIE_MEM_POLICY
+
+/// Size of a transparent huge page on the platforms we care about
+static const size_t THP_SIZE = 2 * 1024 * 1024;
+
+/**
+ * Parse a Linux list of ids such as "0-3,8,10-11" into 'ids'.
+ */
+static void parseIdList(const string& s, vector<int>& ids) {
+	istringstream in(s);
+	string tok;
+	while(getline(in, tok, ',')) {
+		if(tok.empty()) continue;
+		size_t dash = tok.find('-');
+		int lo = atoi(tok.c_str());
+		int hi = (dash == string::npos) ? lo : atoi(tok.c_str() + dash + 1);
+		for(int i = lo; i <= hi; i++) ids.push_back(i);
+	}
+}
+
+/**
+ * Read the first line of a sysfs file as an id list.
+ */
+static bool readIdList(const string& fname, vector<int>& ids) {
+	ifstream in(fname.c_str());
+	string line;
+	if(!in.good() || !getline(in, line)) return false;
+	parseIdList(line, ids);
+	return !ids.empty();
+}
+
+/**
+ * Return the ids of the online NUMA nodes, or just node 0 if the
+ * kernel doesn't say.
+ */
+static const vector<int>& onlineNodes() {
+	static vector<int> nodes;
+	if(nodes.empty()) {
+		if(!readIdList("/sys/devices/system/node/online", nodes)) {
+			nodes.clear();
+			nodes.push_back(0);
+		}
+	}
+	return nodes;
+}
+
+#endif
+
+/**
+ * Map an anonymous region of at least 'len' bytes backed by the given
+ * kind of huge pages and return it, setting 'mapLen' to the length to
+ * pass to freeHugeMem().  If the hugetlb pool can't supply 2 MB or
+ * 1 GB pages, falls back to transparent huge pages.  Returns NULL (and
+ * leaves 'mapLen' at 0) if nothing could be mapped; the caller should
+ * then allocate the array normally.
+ */
+void *allocHugeMem(size_t len,
+                   int hugePages,
+                   size_t& mapLen,
+                   const char *memName,
+                   bool verbose)
+{
+	mapLen = 0;
+#ifdef BOWTIE_MEM_POLICY
+	if(len == 0 || hugePages == HUGEPAGES_NONE) return NULL;
+#ifdef MAP_HUGETLB
+	if(hugePages == HUGEPAGES_2M || hugePages == HUGEPAGES_1G) {
+		int shift = (hugePages == HUGEPAGES_1G) ? 30 : 21;
+		size_t pg = (size_t)1 << shift;
+		size_t sz = (len + pg - 1) & ~(pg - 1);
+		void *p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT),
+		               -1, 0);
+		if(p != MAP_FAILED) {
+			if(verbose) {
+				cerr << "  Mapped " << (sz >> shift) << " reserved huge page(s) for " << memName << endl;
+			}
+			mapLen = sz;
+			return p;
+		}
+		static bool warned = false;
+		if(!warned || verbose) {
+			cerr << "Warning: could not map " << (sz >> shift) << " reserved "
+			     << (hugePages == HUGEPAGES_1G ? "1 GB" : "2 MB") << " page(s) for " << memName
+			     << "; using transparent huge pages instead" << endl;
+			warned = true;
+		}
+	}
+#endif
+	// Over-allocate by one huge page so the array can start on a huge
+	// page boundary, then trim the ends
+	size_t sz = (len + THP_SIZE - 1) & ~(THP_SIZE - 1);
+	char *p = (char*)mmap(NULL, sz + THP_SIZE, PROT_READ | PROT_WRITE,
+	                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == (char*)MAP_FAILED) return NULL;
+	char *aligned = (char*)(((uintptr_t)p + THP_SIZE - 1) & ~(uintptr_t)(THP_SIZE - 1));
+	if(aligned > p) munmap(p, aligned - p);
+	if(p + THP_SIZE > aligned) munmap(aligned + sz, (p + THP_SIZE) - aligned);
+	adviseHugeMem(aligned, sz);
+	if(verbose) {
+		cerr << "  Mapped " << sz << " bytes of transparent huge pages for " << memName << endl;
+	}
+	mapLen = sz;
+	return aligned;
+#else
+	return NULL;
+#endif
+}
+
+/**
+ * Unmap a region returned by allocHugeMem().
+ */
+void freeHugeMem(void *mem, size_t mapLen) {
+#ifdef BOWTIE_MEM_POLICY
+	if(mem != NULL && mapLen > 0) munmap(mem, mapLen);
+#endif
+}
+
+/**
+ * Ask the kernel to back the given region with transparent huge pages
+ * where it can.  'mem' needn't be aligned; only the whole huge pages
+ * inside the region are affected.
+ */
+void adviseHugeMem(void *mem, size_t len) {
+#if defined(BOWTIE_MEM_POLICY) && defined(MADV_HUGEPAGE)
+	uintptr_t lo = ((uintptr_t)mem + THP_SIZE - 1) & ~(uintptr_t)(THP_SIZE - 1);
+	uintptr_t hi = ((uintptr_t)mem + len) & ~(uintptr_t)(THP_SIZE - 1);
+	if(hi > lo) madvise((void*)lo, hi - lo, MADV_HUGEPAGE);
+#endif
+}
+
+/**
+ * Return the number of online NUMA nodes (1 if unknown).
+ */
+int numaNodes() {
+#ifdef BOWTIE_MEM_POLICY
+	return (int)onlineNodes().size();
+#else
+	return 1;
+#endif
+}
+
+/**
+ * Set the memory policy that pages first touched by the calling thread
+ * will follow: NUMA_NONE restores the default (local node),
+ * NUMA_INTERLEAVE spreads pages over all nodes, and NUMA_REPLICATE
+ * prefers node number 'node' (0 through numaNodes()-1).  Returns false
+ * if the kernel refused.
+ */
+bool numaSetPolicy(int numa, int node) {
+#ifdef BOWTIE_MEM_POLICY
+	const vector<int>& nodes = onlineNodes();
+	const int maxNode = 1024;
+	unsigned long mask[maxNode / (8 * sizeof(unsigned long))] = { 0 };
+	const int bits = 8 * sizeof(unsigned long);
+	int mode = MPOL_DEFAULT;
+	if(numa == NUMA_INTERLEAVE) {
+		mode = MPOL_INTERLEAVE;
+		for(size_t i = 0; i < nodes.size(); i++) {
+			if(nodes[i] < maxNode) mask[nodes[i] / bits] |= 1ul << (nodes[i] % bits);
+		}
+	} else if(numa == NUMA_REPLICATE) {
+		if(node < 0 || node >= (int)nodes.size() || nodes[node] >= maxNode) return false;
+		mode = MPOL_PREFERRED;
+		mask[nodes[node] / bits] |= 1ul << (nodes[node] % bits);
+	}
+	if(mode == MPOL_DEFAULT) {
+		return syscall(SYS_set_mempolicy, mode, NULL, 0) == 0;
+	}
+	return syscall(SYS_set_mempolicy, mode, mask, maxNode + 1) == 0;
+#else
+	return numa == NUMA_NONE;
+#endif
+}
+
+/**
+ * Restrict the calling thread to the CPUs of node number 'node' (0
+ * through numaNodes()-1).  Returns false if that wasn't possible.
+ */
+bool numaPinThread(int node) {
+#ifdef BOWTIE_MEM_POLICY
+	const vector<int>& nodes = onlineNodes();
+	if(node < 0 || node >= (int)nodes.size()) return false;
+	ostringstream fname;
+	fname << "/sys/devices/system/node/node" << nodes[node] << "/cpulist";
+	vector<int> cpus;
+	if(!readIdList(fname.str(), cpus)) return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(size_t i = 0; i < cpus.size(); i++) {
+		if(cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+	}
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
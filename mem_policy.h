@@ -0,0 +1,43 @@
+/*
+ * mem_policy.h
+ *
+ * Page-size and NUMA placement policies for the large index arrays.
+ */
+
+#ifndef MEM_POLICY_H_
+#define MEM_POLICY_H_
+
+#include <stddef.h>
+
+/// Kinds of pages that may back the ebwt[], offs[] and ftab[] arrays
+enum {
+	HUGEPAGES_NONE = 0, /// ordinary pages allocated with new[]
+	HUGEPAGES_THP,      /// transparent huge pages (madvise(MADV_HUGEPAGE))
+	HUGEPAGES_2M,       /// 2 MB pages reserved in the hugetlb pool
+	HUGEPAGES_1G        /// 1 GB pages reserved in the hugetlb pool
+};
+
+/// Placements of the index across NUMA nodes
+enum {
+	NUMA_NONE = 0,   /// kernel default (first touch)
+	NUMA_INTERLEAVE, /// one copy, pages spread round-robin over all nodes
+	NUMA_REPLICATE   /// one copy per node; threads pinned to their node
+};
+
+extern void *allocHugeMem(size_t len,
+                          int hugePages,
+                          size_t& mapLen,
+                          const char *memName,
+                          bool verbose);
+
+extern void freeHugeMem(void *mem, size_t mapLen);
+
+extern void adviseHugeMem(void *mem, size_t len);
+
+extern int numaNodes();
+
+extern bool numaSetPolicy(int numa, int node);
+
+extern bool numaPinThread(int node);
+
+#endif /* MEM_POLICY_H_ */
@@ -0,0 +1,370 @@
+#ifndef MERGED_SA_H_
+#define MERGED_SA_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <seqan/sequence.h>
+#include <seqan/index.h>
+#include "assert_helpers.h"
+#include "blockwise_sa.h"
+#include "ebwt.h"
+#include "spill_file.h"
+#include "threading.h"
+#include "timer.h"
+
+using namespace std;
+using namespace seqan;
+
+/**
+ * Produce the suffix array of a text N.O, where O is the text already
+ * indexed by the Ebwt 'old' and N is a (typically much shorter) text
+ * of new sequences, without sorting O's suffixes again.
+ *
+ * O's suffixes keep the order they have in 'old'.  Each suffix of N.O
+ * starting in N is placed among them by backward search: the suffix
+ * starting at |N| is O itself, in row zOff of 'old', and the suffix
+ * starting at x lands where an LF step from the suffix at x+1 on
+ * character N[x] lands.  Suffixes of N that land between the same two
+ * rows of 'old' are ordered by Larsson-Sadakane on the string of
+ * (landing row, character) pairs, which orders them exactly as their
+ * N.O suffixes are ordered.
+ *
+ * Blocks cover a range of rows of 'old'.  The text offsets for those
+ * rows are recovered by walking 'old' backward from its last row to
+ * row zOff, splitting the walk between threads at SA samples.  With
+ * more than one block, a single walk spills (row, offset) pairs to a
+ * temporary file, grouped by block, and each block reads its own back.
+ */
+template<typename TStr>
+class MergedBlockwiseSA : public InorderBlockwiseSA<TStr> {
+public:
+	MergedBlockwiseSA(const TStr& __text,
+	                  TIndexOffU __newLen,
+	                  const Ebwt<TStr>& __old,
+	                  TIndexOffU __bucketSz,
+	                  int __nthreads,
+	                  const string& __spillFn,
+	                  bool __sanityCheck = false,
+	                  bool __verbose = false,
+	                  ostream& __logger = cout) :
+	InorderBlockwiseSA<TStr>(__text, __bucketSz, __sanityCheck, false, __verbose, __logger),
+	_old(__old), _newLen(__newLen), _oldLen(__old.eh()._len),
+	_nthreads(max<int>(__nthreads, 1)), _spillFn(__spillFn),
+	_nblocks((TIndexOffU)(((uint64_t)_oldLen + __bucketSz) / __bucketSz)),
+	_cur(0), _curNew(0)
+	{
+		assert(_old.isInMemory());
+		assert_eq(_newLen + _oldLen, length(__text));
+		assert_gt(__bucketSz, 0);
+		rankNew();
+		pickWalkStarts();
+	}
+
+protected:
+	virtual void reset() {
+		_cur = 0;
+		_curNew = 0;
+	}
+
+	virtual bool isReset() {
+		return _cur == 0 && _curNew == 0;
+	}
+
+	virtual bool hasMoreBlocks() const {
+		return _cur <= _oldLen;
+	}
+
+	virtual void nextBlock();
+
+private:
+
+	/// One stretch of the backward walk over 'old'.  Starting from
+	/// the row holding text offset 'pos', walk down to offset 'stop'
+	/// and record the offsets of rows in [lo, hi) in 'sa', or if 'sa'
+	/// is NULL, spill the offsets of all rows.
+	struct WalkChunk {
+		MergedBlockwiseSA<TStr>* msa;
+		TIndexOffU row;  // row of 'old' holding offset 'pos'
+		TIndexOffU pos;  // first (highest) text offset walked
+		TIndexOffU stop; // last (lowest) text offset walked
+		TIndexOffU lo;   // first row to record
+		TIndexOffU hi;   // one past the last row to record
+		TIndexOffU *sa;  // destination; sa[0] holds row lo
+		size_t bufPairs; // pairs to collect per block before spilling
+		vector<vector<TIndexOffU> > bufs; // unspilled pairs, per block
+	};
+	static void walkWorker(void *vp);
+
+	void rankNew();
+	void pickWalkStarts();
+
+	/// Walk 'old' once, filling 'sa' with the offsets of rows [lo, hi)
+	/// or, if 'sa' is NULL, spilling those of all rows
+	void walk(TIndexOffU lo, TIndexOffU hi, TIndexOffU *sa);
+
+	/// Append the (row, offset) pairs in 'buf' to block b's spill
+	void spillPairs(TIndexOffU b, vector<TIndexOffU>& buf);
+
+	/// Fill 'sa' with the spilled offsets of rows [lo, hi) of block b
+	void readSpilled(TIndexOffU b, TIndexOffU lo, TIndexOffU hi, TIndexOffU *sa);
+
+	const Ebwt<TStr>& _old;
+	const TIndexOffU _newLen;     /// length of the new text N
+	const TIndexOffU _oldLen;     /// length of the old text O
+	const int _nthreads;          /// # threads walking 'old'
+	const string _spillFn;        /// name for the spill file
+	const TIndexOffU _nblocks;    /// # blocks of rows of 'old'
+	OffSpillFile _spill;          /// block b's pairs start at 2*b*bucketSz
+	vector<uint64_t> _spilled;    /// # offsets spilled for each block
+	tthread::mutex _spillMutex;   /// protects _spill and _spilled
+	String<TIndexOffU> _newOrder; /// suffixes of N in sorted order
+	String<TIndexOffU> _newRank;  /// # rows of 'old' preceding each
+	vector<pair<TIndexOffU, TIndexOffU> > _starts; /// (row, offset) walk starts
+	TIndexOffU _cur;              /// first row of 'old' in next block
+	TIndexOffU _curNew;           /// next element of _newOrder
+};
+
+/**
+ * Find, for every suffix of N.O starting in N, how many rows of 'old'
+ * precede it and its order among the other suffixes starting in N.
+ */
+template<typename TStr>
+void MergedBlockwiseSA<TStr>::rankNew() {
+	const TStr& t = this->text();
+	const TIndexOffU n = _newLen;
+	const EbwtParams& eh = _old.eh();
+	// Landing row of each suffix, by backward search on the new text
+	String<TIndexOffU> rows;
+	{
+		Timer timer(cout, "  Backward search for new suffixes time: ", this->verbose());
+		VMSG_NL("Finding rows of the old index preceding each of " << n << " new suffixes");
+		resize(rows, n, Exact());
+		TIndexOffU row = _old.zOff();
+		for(TIndexOffU i = n; i > 0; i--) {
+			SideLocus l(row, eh, _old.ebwt());
+			row = _old.mapLF(l, (int)(Dna)t[i-1]);
+			assert_leq(row, _oldLen);
+			rows[i-1] = row;
+		}
+	}
+	// Order suffixes landing between the same rows.  Comparing two of
+	// them comes down to comparing their landing rows, then their
+	// first characters, then the suffixes one character on.  So
+	// replace each character by the rank of its (row, char) pair and
+	// suffix-sort that string, ending it with a symbol ranked between
+	// the pairs landing before and after row zOff - that's O itself.
+	String<TIndexOff> isa, sa;
+	{
+		Timer timer(cout, "  Sorting new suffixes time: ", this->verbose());
+		VMSG_NL("Sorting new suffixes landing between the same rows");
+		vector<uint64_t> keys;
+		keys.reserve(n + 1);
+		for(TIndexOffU i = 0; i < n; i++) {
+			keys.push_back(((uint64_t)rows[i] << 3) | ((int)(Dna)t[i] << 1));
+		}
+		keys.push_back(((uint64_t)_old.zOff() << 3) | 7);
+		vector<uint64_t> names(keys);
+		sort(names.begin(), names.end());
+		names.erase(unique(names.begin(), names.end()), names.end());
+		resize(isa, n + 2, Exact());
+		resize(sa, n + 2, Exact());
+		for(TIndexOffU i = 0; i <= n; i++) {
+			isa[i] = (TIndexOff)(lower_bound(names.begin(), names.end(), keys[i]) - names.begin());
+		}
+		isa[n+1] = (TIndexOff)names.size();
+		_Context_LSS<TIndexOff> c;
+		c.suffixsort(
+			(TIndexOff*)begin(isa, Standard()),
+			(TIndexOff*)begin(sa, Standard()),
+			n + 1,
+			(TIndexOff)names.size() + 1,
+			0);
+	}
+	// sa[0] is the end-of-string; skip it and O's suffix
+	reserve(_newOrder, n, Exact());
+	reserve(_newRank, n, Exact());
+	for(TIndexOffU i = 1; i <= n + 1; i++) {
+		TIndexOffU off = (TIndexOffU)sa[i];
+		if(off == n) continue;
+		assert(length(_newRank) == 0 || _newRank[length(_newRank)-1] <= rows[off]);
+		appendValue(_newOrder, off);
+		appendValue(_newRank, rows[off]);
+	}
+	assert_eq(n, length(_newOrder));
+}
+
+/**
+ * Split the backward walk over 'old' into one stretch per thread,
+ * each starting at a sampled row near an even share of the text.
+ */
+template<typename TStr>
+void MergedBlockwiseSA<TStr>::pickWalkStarts() {
+	const EbwtParams& eh = _old.eh();
+	vector<TIndexOffU> best(_nthreads, OFF_MASK);
+	if(_nthreads > 1) {
+		for(TIndexOffU i = 0; i < eh._offsLen; i++) {
+			TIndexOffU off = _old.offAt(i);
+			for(int j = 1; j < _nthreads; j++) {
+				TIndexOffU target = (TIndexOffU)(((uint64_t)_oldLen * j) / _nthreads);
+				if(off >= target && off < _oldLen &&
+				   (best[j] == OFF_MASK || off < _old.offAt(best[j])))
+				{
+					best[j] = i;
+				}
+			}
+		}
+	}
+	for(int j = 1; j < _nthreads; j++) {
+		if(best[j] == OFF_MASK) continue;
+		TIndexOffU row = best[j] << eh._offRate;
+		if(_starts.empty() || _starts.back().second != _old.offAt(best[j])) {
+			_starts.push_back(make_pair(row, _old.offAt(best[j])));
+		}
+	}
+	// The last row is the empty suffix, at offset |O|
+	_starts.push_back(make_pair(_oldLen, _oldLen));
+}
+
+template<typename TStr>
+void MergedBlockwiseSA<TStr>::walkWorker(void *vp) {
+	WalkChunk& w = *(WalkChunk*)vp;
+	const Ebwt<TStr>& old = w.msa->_old;
+	const EbwtParams& eh = old.eh();
+	const TIndexOffU newLen = w.msa->_newLen;
+	const TIndexOffU bsz = w.msa->bucketSz();
+	TIndexOffU row = w.row;
+	TIndexOffU pos = w.pos;
+	while(true) {
+		if(w.sa == NULL) {
+			TIndexOffU b = row / bsz;
+			vector<TIndexOffU>& buf = w.bufs[b];
+			buf.push_back(row - b * bsz);
+			buf.push_back(pos + newLen);
+			if(buf.size() >= 2 * w.bufPairs) w.msa->spillPairs(b, buf);
+		} else if(row >= w.lo && row < w.hi) {
+			w.sa[row - w.lo] = pos + newLen;
+		}
+		if(pos == w.stop) break;
+		assert_neq(row, old.zOff());
+		SideLocus l(row, eh, old.ebwt());
+		row = old.mapLF(l);
+		pos--;
+	}
+	if(w.sa == NULL) {
+		for(size_t b = 0; b < w.bufs.size(); b++) {
+			if(!w.bufs[b].empty()) w.msa->spillPairs((TIndexOffU)b, w.bufs[b]);
+		}
+	}
+}
+
+template<typename TStr>
+void MergedBlockwiseSA<TStr>::walk(TIndexOffU lo, TIndexOffU hi, TIndexOffU *sa) {
+	vector<WalkChunk> chunks(_starts.size());
+	// Keep the spill buffers of all threads together to about a block
+	size_t bufPairs = this->bucketSz() / (2 * chunks.size() * _nblocks);
+	bufPairs = max<size_t>(min<size_t>(bufPairs, 64 * 1024), 64);
+	for(size_t i = 0; i < chunks.size(); i++) {
+		chunks[i].msa = this;
+		chunks[i].row = _starts[i].first;
+		chunks[i].pos = _starts[i].second;
+		chunks[i].stop = (i == 0) ? 0 : _starts[i-1].second + 1;
+		chunks[i].lo = lo;
+		chunks[i].hi = hi;
+		chunks[i].sa = sa;
+		chunks[i].bufPairs = bufPairs;
+		if(sa == NULL) chunks[i].bufs.resize(_nblocks);
+	}
+	if(chunks.size() == 1) {
+		walkWorker((void*)&chunks[0]);
+	} else {
+		vector<tthread::thread*> threads;
+		for(size_t i = 0; i < chunks.size(); i++) {
+			threads.push_back(new tthread::thread(walkWorker, (void*)&chunks[i]));
+		}
+		for(size_t i = 0; i < chunks.size(); i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+	}
+}
+
+template<typename TStr>
+void MergedBlockwiseSA<TStr>::spillPairs(TIndexOffU b, vector<TIndexOffU>& buf) {
+	tthread::lock_guard<tthread::mutex> guard(_spillMutex);
+	uint64_t pos = 2 * (uint64_t)b * this->bucketSz() + _spilled[b];
+	_spill.write(pos, &buf[0], buf.size());
+	_spilled[b] += buf.size();
+	buf.clear();
+}
+
+template<typename TStr>
+void MergedBlockwiseSA<TStr>::readSpilled(TIndexOffU b, TIndexOffU lo, TIndexOffU hi, TIndexOffU *sa) {
+	assert_eq((uint64_t)b * this->bucketSz(), lo);
+	assert_eq(2 * (uint64_t)(hi - lo), _spilled[b]);
+	const size_t chunkPairs = 64 * 1024;
+	vector<TIndexOffU> buf(2 * min<size_t>(hi - lo, chunkPairs));
+	uint64_t pos = 2 * (uint64_t)lo;
+	for(TIndexOffU done = 0; done < hi - lo; ) {
+		size_t n = min<size_t>(hi - lo - done, chunkPairs);
+		_spill.read(pos, &buf[0], 2 * n);
+		for(size_t i = 0; i < n; i++) {
+			assert_lt(buf[2*i], hi - lo);
+			sa[buf[2*i]] = buf[2*i+1];
+		}
+		pos += 2 * n;
+		done += (TIndexOffU)n;
+	}
+}
+
+/**
+ * Merge the rows of 'old' in the next range with the new suffixes
+ * that precede them.  The walk (or the spill) writes the rows' offsets
+ * to the end of the bucket and the merge then moves forward through it in place;
+ * the write cursor never passes the read cursor since it's ahead only
+ * by the number of new suffixes merged so far.
+ */
+template<typename TStr>
+void MergedBlockwiseSA<TStr>::nextBlock() {
+	assert(hasMoreBlocks());
+	if(_nblocks > 1 && !_spill.isOpen()) {
+		Timer timer(cout, "  Spilling offsets of the old index time: ", this->verbose());
+		VMSG_NL("Spilling offsets of the " << _nblocks << " blocks of the old index to "
+		        << _spillFn);
+		_spill.open(_spillFn);
+		_spilled.assign(_nblocks, 0);
+		walk(0, _oldLen + 1, NULL);
+	}
+	TIndexOffU lo = _cur;
+	TIndexOffU hi = _oldLen + 1;
+	if(hi - lo > this->bucketSz()) hi = lo + this->bucketSz();
+	TIndexOffU newEnd = _curNew;
+	while(newEnd < length(_newOrder) && _newRank[newEnd] < hi) newEnd++;
+	TIndexOffU nnew = newEnd - _curNew;
+	VMSG_NL("Merging rows " << lo << " through " << (hi-1) << " of the old index with "
+	        << nnew << " new suffixes");
+	clear(this->_itrBucket);
+	resize(this->_itrBucket, (hi - lo) + nnew, Exact());
+	TIndexOffU *bucket = begin(this->_itrBucket, Standard());
+	if(_spill.isOpen()) {
+		readSpilled(lo / this->bucketSz(), lo, hi, bucket + nnew);
+	} else {
+		walk(lo, hi, bucket + nnew);
+	}
+	TIndexOffU out = 0;
+	for(TIndexOffU r = lo; r < hi; r++) {
+		while(_curNew < newEnd && _newRank[_curNew] == r) {
+			bucket[out++] = _newOrder[_curNew++];
+		}
+		assert_leq(out, nnew + (r - lo));
+		bucket[out++] = bucket[nnew + (r - lo)];
+	}
+	assert_eq(_curNew, newEnd);
+	assert_eq(out, length(this->_itrBucket));
+	assert(hi <= _oldLen || _curNew == length(_newOrder));
+	_cur = hi;
+}
+
+#endif /*MERGED_SA_H_*/
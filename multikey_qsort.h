@@ -2,6 +2,7 @@
 #define MULTIKEY_QSORT_H_
 
 #include <iostream>
+#include <vector>
 #include <seqan/basic.h>
 #include <seqan/file.h>
 #include <seqan/sequence.h>
@@ -10,6 +11,7 @@
 #include "assert_helpers.h"
 #include "diff_sample.h"
 #include "btypes.h"
+#include "threading.h"
 
 using namespace std;
 using namespace seqan;
@@ -474,12 +476,27 @@ void mkeyQSortSuf(
 	if(sanityCheck) sanityCheckOrderedSufs(host, hlen, s, slen, upto);
 }
 
+/**
+ * A range of suffixes [begin, end) that agree on their first 'depth'
+ * characters and still need sorting; lets several threads share one
+ * multikey quicksort.
+ */
+struct MkeyQSortTask {
+	MkeyQSortTask(size_t b, size_t e, size_t d) : begin(b), end(e), depth(d) { }
+	size_t begin;
+	size_t end;
+	size_t depth;
+};
+
 /**
  * Just like mkeyQSortSuf but all swaps are applied to s2 as well as s.
  * This is a helpful variant if, for example, the caller would like to
  * see how their input was permuted by the sort routine (in that case,
  * the caller would let s2 be an array s2[] where s2 is the same length
  * as s and s2[i] = i).
+ *
+ * If 'tasks' is non-NULL, partitions with more than 'grain' elements
+ * are appended to 'tasks' rather than sorted here.
  */
 template<typename T>
 void mkeyQSortSuf2(
@@ -492,14 +509,20 @@ void mkeyQSortSuf2(
 	size_t begin,
 	size_t end,
 	size_t depth,
-	size_t upto = OFF_MASK)
+	size_t upto = OFF_MASK,
+	vector<MkeyQSortTask>* tasks = NULL,
+	size_t grain = 0)
 {
 	// Helper for making the recursive call; sanity-checks arguments to
 	// make sure that the problem actually got smaller.
 	#define MQS_RECURSE_SUF_DS(nbegin, nend, ndepth) { \
 		assert(nbegin > begin || nend < end || ndepth > depth); \
 		if(ndepth < upto) { /* don't exceed depth of 'upto' */ \
-			mkeyQSortSuf2(host, hlen, s, slen, s2, hi, nbegin, nend, ndepth, upto); \
+			if(tasks != NULL && (nend) - (nbegin) > grain) { \
+				tasks->push_back(MkeyQSortTask(nbegin, nend, ndepth)); \
+			} else { \
+				mkeyQSortSuf2(host, hlen, s, slen, s2, hi, nbegin, nend, ndepth, upto, tasks, grain); \
+			} \
 		} \
 	}
 	assert_leq(begin, slen);
@@ -570,9 +593,60 @@ void mkeyQSortSuf2(
 	}
 }
 
+/**
+ * State shared by the threads of a parallel mkeyQSortSuf2.
+ */
+template<typename T>
+struct MkeyQSortSuf2Work {
+	const T*              host;
+	size_t                hlen;
+	TIndexOffU           *s;
+	size_t                slen;
+	TIndexOffU           *s2;
+	int                   hi;
+	size_t                upto;
+	size_t                grain;  // ranges this small are sorted by one thread
+	vector<MkeyQSortTask> tasks;  // ranges waiting for a thread
+	int                   active; // # threads partitioning a range
+	tthread::mutex        mutex;
+	tthread::condition_variable cond;
+};
+
+/**
+ * Thread body for a parallel mkeyQSortSuf2.  Repeatedly takes a range,
+ * partitions it (sorting small partitions outright) and hands large
+ * partitions back to the pool, until no work is left.
+ */
+template<typename T>
+static void mkeyQSortSuf2Worker(void *vp) {
+	MkeyQSortSuf2Work<T>& w = *(MkeyQSortSuf2Work<T>*)vp;
+	vector<MkeyQSortTask> sub;
+	w.mutex.lock();
+	while(true) {
+		while(w.tasks.empty() && w.active > 0) {
+			w.cond.wait(w.mutex);
+		}
+		if(w.tasks.empty()) break; // nothing queued and nobody partitioning
+		MkeyQSortTask t = w.tasks.back();
+		w.tasks.pop_back();
+		w.active++;
+		w.mutex.unlock();
+		sub.clear();
+		mkeyQSortSuf2(*w.host, w.hlen, w.s, w.slen, w.s2, w.hi,
+		              t.begin, t.end, t.depth, w.upto, &sub, w.grain);
+		w.mutex.lock();
+		w.tasks.insert(w.tasks.end(), sub.begin(), sub.end());
+		w.active--;
+		w.cond.notify_all();
+	}
+	w.mutex.unlock();
+}
+
 /**
  * Toplevel function for multikey quicksort over suffixes with double
- * swapping.
+ * swapping.  With nthreads > 1, partitions are sorted concurrently;
+ * elements that are equal up to 'upto' may then end up in a different
+ * (but still sorted) order than with one thread.
  */
 template<typename T>
 void mkeyQSortSuf2(
@@ -583,7 +657,8 @@ void mkeyQSortSuf2(
 	int hi,
 	bool verbose = false,
 	bool sanityCheck = false,
-	size_t upto = OFF_MASK)
+	size_t upto = OFF_MASK,
+	int nthreads = 1)
 {
 	size_t hlen = length(host);
 	if(sanityCheck) sanityCheckInputSufs(s, slen);
@@ -592,7 +667,27 @@ void mkeyQSortSuf2(
 		sOrig = new TIndexOffU[slen];
 		memcpy(sOrig, s, OFF_SIZE * slen);
 	}
-	mkeyQSortSuf2(host, hlen, s, slen, s2, hi, (size_t)0, slen, (size_t)0, upto);
+	if(nthreads > 1 && slen > 0) {
+		MkeyQSortSuf2Work<T> w;
+		w.host = &host; w.hlen = hlen;
+		w.s = s; w.slen = slen; w.s2 = s2;
+		w.hi = hi; w.upto = upto;
+		// Enough pieces to keep every thread busy to the end
+		w.grain = max<size_t>(slen / (nthreads * 64), 1024);
+		w.tasks.push_back(MkeyQSortTask(0, slen, 0));
+		w.active = 0;
+		vector<tthread::thread*> threads;
+		for(int i = 0; i < nthreads; i++) {
+			threads.push_back(new tthread::thread(mkeyQSortSuf2Worker<T>, (void*)&w));
+		}
+		for(int i = 0; i < nthreads; i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+		assert(w.tasks.empty());
+	} else {
+		mkeyQSortSuf2(host, hlen, s, slen, s2, hi, (size_t)0, slen, (size_t)0, upto);
+	}
 	if(sanityCheck) {
 		sanityCheckOrderedSufs(host, hlen, s, slen, upto);
 		for(size_t i = 0; i < slen; i++) {
@@ -677,25 +772,6 @@ void qsortSufDc(const T& host,
 	if(end > begin+cur+1) qsortSufDc(host, hlen, s, slen, dc, begin+cur+1, end);
 }
 
-/**
- * Toplevel function for multikey quicksort over suffixes.
- */
-template<typename T1, typename T2>
-void mkeyQSortSufDcU8(const T1& host1,
-                      const T2& host,
-                      size_t hlen,
-                      TIndexOffU* s,
-                      size_t slen,
-                      const DifferenceCoverSample<T1>& dc,
-                      int hi,
-                      bool verbose = false,
-                      bool sanityCheck = false)
-{
-	if(sanityCheck) sanityCheckInputSufs(s, slen);
-	mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, 0, slen, 0, sanityCheck);
-	if(sanityCheck) sanityCheckOrderedSufs(host1, hlen, s, slen, OFF_MASK);
-}
-
 /**
  * Return a boolean indicating whether s1 < s2 using the difference
  * cover to break the tie.
@@ -779,9 +855,6 @@ void qsortSufDcU8(const T1& host1,
 #define BUCKET_SORT_CUTOFF (4 * 1024 * 1024)
 #define SELECTION_SORT_CUTOFF 6
 
-// 5 64-element buckets for bucket-sorting A, C, G, T, $
-static TIndexOffU bkts[4][4 * 1024 * 1024];
-
 /**
  * Straightforwardly obtain a uint8_t-ized version of t[off].  This
  * works fine as long as TStr is not packed.
@@ -954,6 +1027,7 @@ static void bucketSortSufDcU8(
         size_t slen,
         const DifferenceCoverSample<T1>& dc,
         uint8_t hi,
+        TIndexOffU* bkts,
         size_t begin,
         size_t end,
         size_t depth,
@@ -961,7 +1035,7 @@ static void bucketSortSufDcU8(
 {
 	size_t cnts[] = { 0, 0, 0, 0, 0 };
 	#define BKT_RECURSE_SUF_DC_U8(nbegin, nend) { \
-		bucketSortSufDcU8<T1,T2>(host1, host, hlen, s, slen, dc, hi, \
+		bucketSortSufDcU8<T1,T2>(host1, host, hlen, s, slen, dc, hi, bkts, \
 		                         (nbegin), (nend), depth+1, sanityCheck); \
 	}
 	assert_gt(end, begin);
@@ -985,6 +1059,8 @@ static void bucketSortSufDcU8(
 		}
 		return;
 	}
+	// Bucket c (for C, G, T, $) occupies bkts[(c-1)*n .. c*n)
+	size_t n = end - begin;
 	for(size_t i = begin; i < end; i++) {
 		size_t off = depth + s[i];
 		uint8_t c = (off < hlen) ? get_uint8(host, off) : hi;
@@ -992,15 +1068,15 @@ static void bucketSortSufDcU8(
 		if(c == 0) {
 			s[begin + cnts[0]++] = s[i];
 		} else {
-			bkts[c-1][cnts[c]++] = s[i];
+			bkts[(c-1)*n + cnts[c]++] = s[i];
 		}
 	}
 	assert_eq(cnts[0] + cnts[1] + cnts[2] + cnts[3] + cnts[4], end - begin);
 	size_t cur = begin + cnts[0];
-	if(cnts[1] > 0) { memcpy(&s[cur], bkts[0], cnts[1] << (OFF_SIZE/4 + 1)); cur += cnts[1]; }
-	if(cnts[2] > 0) { memcpy(&s[cur], bkts[1], cnts[2] << (OFF_SIZE/4 + 1)); cur += cnts[2]; }
-	if(cnts[3] > 0) { memcpy(&s[cur], bkts[2], cnts[3] << (OFF_SIZE/4 + 1)); cur += cnts[3]; }
-	if(cnts[4] > 0) { memcpy(&s[cur], bkts[3], cnts[4] << (OFF_SIZE/4 + 1)); }
+	if(cnts[1] > 0) { memcpy(&s[cur], bkts,       cnts[1] << (OFF_SIZE/4 + 1)); cur += cnts[1]; }
+	if(cnts[2] > 0) { memcpy(&s[cur], bkts + n,   cnts[2] << (OFF_SIZE/4 + 1)); cur += cnts[2]; }
+	if(cnts[3] > 0) { memcpy(&s[cur], bkts + 2*n, cnts[3] << (OFF_SIZE/4 + 1)); cur += cnts[3]; }
+	if(cnts[4] > 0) { memcpy(&s[cur], bkts + 3*n, cnts[4] << (OFF_SIZE/4 + 1)); }
 	// This frame is now totally finished with bkts[][], so recursive
 	// callees can safely clobber it; we're not done with cnts[], but
 	// that's local to the stack frame.
@@ -1047,6 +1123,7 @@ void mkeyQSortSufDcU8(const T1& host1,
                       size_t slen,
                       const DifferenceCoverSample<T1>& dc,
                       int hi,
+                      TIndexOffU* bkts,
                       size_t begin,
                       size_t end,
                       size_t depth,
@@ -1056,7 +1133,7 @@ void mkeyQSortSufDcU8(const T1& host1,
 	// make sure that the problem actually got smaller.
 	#define MQS_RECURSE_SUF_DC_U8(nbegin, nend, ndepth) { \
 		assert(nbegin > begin || nend < end || ndepth > depth); \
-		mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, nbegin, nend, ndepth, sanityCheck); \
+		mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, bkts, nbegin, nend, ndepth, sanityCheck); \
 	}
 	assert_leq(begin, slen);
 	assert_leq(end, slen);
@@ -1075,7 +1152,7 @@ void mkeyQSortSufDcU8(const T1& host1,
 	if(n <= BUCKET_SORT_CUTOFF) {
 		// Bucket sort remaining items
 		bucketSortSufDcU8(host1, host, hlen, s, slen, dc,
-		                  (uint8_t)hi, begin, end, depth, sanityCheck);
+		                  (uint8_t)hi, bkts, begin, end, depth, sanityCheck);
 		if(sanityCheck) {
 			sanityCheckOrderedSufs(host1, hlen, s, slen, OFF_MASK, begin, end);
 		}
@@ -1144,5 +1221,56 @@ void mkeyQSortSufDcU8(const T1& host1,
 	}
 }
 
+/**
+ * Return the number of words of bucket-sort scratch space that
+ * mkeyQSortSufDcU8 needs to sort slen suffixes.
+ */
+static inline size_t mkeyQSortSufDcU8Scratch(size_t slen) {
+	// 4 buckets (C, G, T, $) for bucket-sorting; A stays in place
+	return 4 * min<size_t>(slen, BUCKET_SORT_CUTOFF);
+}
+
+/**
+ * Toplevel function for multikey quicksort over suffixes.  'bkts' is
+ * scratch space for the bucket sort of at least
+ * mkeyQSortSufDcU8Scratch(slen) words; callers sorting many blocks
+ * keep one per thread and reuse it.
+ */
+template<typename T1, typename T2>
+void mkeyQSortSufDcU8(const T1& host1,
+                      const T2& host,
+                      size_t hlen,
+                      TIndexOffU* s,
+                      size_t slen,
+                      const DifferenceCoverSample<T1>& dc,
+                      int hi,
+                      TIndexOffU* bkts,
+                      bool verbose = false,
+                      bool sanityCheck = false)
+{
+	if(sanityCheck) sanityCheckInputSufs(s, slen);
+	mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, bkts, 0, slen, 0, sanityCheck);
+	if(sanityCheck) sanityCheckOrderedSufs(host1, hlen, s, slen, OFF_MASK);
+}
+
+/**
+ * Toplevel function for multikey quicksort over suffixes that
+ * allocates its own scratch space.
+ */
+template<typename T1, typename T2>
+void mkeyQSortSufDcU8(const T1& host1,
+                      const T2& host,
+                      size_t hlen,
+                      TIndexOffU* s,
+                      size_t slen,
+                      const DifferenceCoverSample<T1>& dc,
+                      int hi,
+                      bool verbose = false,
+                      bool sanityCheck = false)
+{
+	TIndexOffU *bkts = new TIndexOffU[mkeyQSortSufDcU8Scratch(slen)];
+	mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, bkts, verbose, sanityCheck);
+	delete[] bkts;
+}
 
 #endif /*MULTIKEY_QSORT_H_*/
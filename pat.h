@@ -19,9 +19,17 @@
 #include "qual.h"
 #include "hit_set.h"
 #include "search_globals.h"
+#include "revcomp.h"
 
 #include <zlib.h>
 #include <bzlib.h>
+#ifdef BOWTIE_MM
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 /**
  * Classes and routines for reading reads from various input sources.
  */
@@ -117,6 +125,7 @@ struct ReadBuf {
 		primer = '?';
 		trimc = '?';
 		seed = 0;
+		revs = 0;
 		RESET_BUF(patFw, patBufFw, Dna5);
 		RESET_BUF(patRc, patBufRc, Dna5);
 		RESET_BUF(qual, qualBuf, char);
@@ -157,6 +166,7 @@ struct ReadBuf {
 		primer = '?';
 		trimc = '?';
 		seed = 0;
+		revs = 0;
 	}
 
 	/// Return true iff the read (pair) is empty
@@ -170,63 +180,55 @@ struct ReadBuf {
 	}
 
 	/**
-	 * Construct reverse complement of the pattern and the fuzzy
-	 * alternative patters.  If read is in colorspace, just reverse
-	 * them.
+	 * Forget the reversed and reverse-complemented versions of the
+	 * read; the accessors below rebuild each from patFw, qual and the
+	 * fuzzy alternatives the first time it's asked for.  Call whenever
+	 * those change.
 	 */
-	void constructRevComps() {
-		uint32_t len = length();
-		assert_gt(len, 0);
-		RESET_BUF_LEN(patRc, patBufRc, len, Dna5);
-		for(int j = 0; j < alts; j++) {
-			RESET_BUF_LEN(altPatRc[j], altPatBufRc[j], len, Dna5);
-		}
-		if(color) {
-			for(uint32_t i = 0; i < len; i++) {
-				// Reverse the sequence
-				patBufRc[i]  = patBufFw[len-i-1];
-				for(int j = 0; j < alts; j++) {
-					// Reverse the fuzzy alternatives
-					altPatBufRc[j][i] = altPatBufFw[j][len-i-1];
-				}
-			}
-		} else {
-			for(uint32_t i = 0; i < len; i++) {
-				// Reverse-complement the sequence
-				patBufRc[i]  = (patBufFw[len-i-1] == 4) ? 4 : (patBufFw[len-i-1] ^ 3);
-				for(int j = 0; j < alts; j++) {
-					// Reverse-complement the fuzzy alternatives
-					altPatBufRc[j][i] = (altPatBufFw[j][len-i-1] == 4) ? 4 : (altPatBufFw[j][len-i-1] ^ 3);
-				}
-			}
-		}
+	void resetRevs() {
+		revs = 0;
 	}
 
-	/**
-	 * Given patFw, patRc, and qual, construct the *Rev versions in
-	 * place.  Assumes constructRevComps() was called previously.
-	 */
-	void constructReverses() {
-		uint32_t len = length();
-		assert_gt(len, 0);
-		RESET_BUF_LEN(patFwRev, patBufFwRev, len, Dna5);
-		RESET_BUF_LEN(patRcRev, patBufRcRev, len, Dna5);
-		RESET_BUF_LEN(qualRev, qualBufRev, len, char);
-		for(int j = 0; j < alts; j++) {
-			RESET_BUF_LEN(altPatFwRev[j], altPatBufFwRev[j], len, Dna5);
-			RESET_BUF_LEN(altPatRcRev[j], altPatBufRcRev[j], len, Dna5);
-			RESET_BUF_LEN(altQualRev[j], altQualBufRev[j], len, char);
-		}
-		for(uint32_t i = 0; i < len; i++) {
-			patFwRev[i]  = patFw[len-i-1];
-			patRcRev[i]  = patRc[len-i-1];
-			qualRev[i]   = qual[len-i-1];
-			for(int j = 0; j < alts; j++) {
-				altPatFwRev[j][i] = altPatFw[j][len-i-1];
-				altPatRcRev[j][i] = altPatRc[j][len-i-1];
-				altQualRev[j][i]  = altQual[j][len-i-1];
-			}
-		}
+	/// Reverse complement of patFw (reverse, if in colorspace)
+	String<Dna5>& getPatRc() {
+		if((revs & REV_RC) == 0) constructRevComps();
+		return patRc;
+	}
+
+	/// patFw reversed
+	String<Dna5>& getPatFwRev() {
+		if((revs & REV_FW_REV) == 0) constructFwRevs();
+		return patFwRev;
+	}
+
+	/// Reverse complement of patFw reversed, i.e. its complement
+	String<Dna5>& getPatRcRev() {
+		if((revs & REV_RC_REV) == 0) constructRcRevs();
+		return patRcRev;
+	}
+
+	/// qual reversed
+	String<char>& getQualRev() {
+		if((revs & REV_QUAL) == 0) constructQualRevs();
+		return qualRev;
+	}
+
+	/// As above, for the (up to 3) fuzzy alternatives
+	String<Dna5>* getAltPatRc() {
+		if((revs & REV_RC) == 0) constructRevComps();
+		return altPatRc;
+	}
+	String<Dna5>* getAltPatFwRev() {
+		if((revs & REV_FW_REV) == 0) constructFwRevs();
+		return altPatFwRev;
+	}
+	String<Dna5>* getAltPatRcRev() {
+		if((revs & REV_RC_REV) == 0) constructRcRevs();
+		return altPatRcRev;
+	}
+	String<char>* getAltQualRev() {
+		if((revs & REV_QUAL) == 0) constructQualRevs();
+		return altQualRev;
 	}
 
 	/**
@@ -323,32 +325,14 @@ struct ReadBuf {
 
 	String<Dna5>  patFw;               // forward-strand sequence
 	uint8_t       patBufFw[BUF_SIZE];  // forward-strand sequence buffer
-	String<Dna5>  patRc;               // reverse-complement sequence
-	uint8_t       patBufRc[BUF_SIZE];  // reverse-complement sequence buffer
 	String<char>  qual;                // quality values
 	char          qualBuf[BUF_SIZE];   // quality value buffer
 
 	String<Dna5>  altPatFw[3];              // forward-strand sequence
 	uint8_t       altPatBufFw[3][BUF_SIZE]; // forward-strand sequence buffer
-	String<Dna5>  altPatRc[3];              // reverse-complement sequence
-	uint8_t       altPatBufRc[3][BUF_SIZE]; // reverse-complement sequence buffer
 	String<char>  altQual[3];               // quality values for alternate basecalls
 	char          altQualBuf[3][BUF_SIZE];  // quality value buffer for alternate basecalls
 
-	String<Dna5>  patFwRev;               // forward-strand sequence reversed
-	uint8_t       patBufFwRev[BUF_SIZE];  // forward-strand sequence buffer reversed
-	String<Dna5>  patRcRev;               // reverse-complement sequence reversed
-	uint8_t       patBufRcRev[BUF_SIZE];  // reverse-complement sequence buffer reversed
-	String<char>  qualRev;                // quality values reversed
-	char          qualBufRev[BUF_SIZE];   // quality value buffer reversed
-
-	String<Dna5>  altPatFwRev[3];              // forward-strand sequence reversed
-	uint8_t       altPatBufFwRev[3][BUF_SIZE]; // forward-strand sequence buffer reversed
-	String<Dna5>  altPatRcRev[3];              // reverse-complement sequence reversed
-	uint8_t       altPatBufRcRev[3][BUF_SIZE]; // reverse-complement sequence buffer reversed
-	String<char>  altQualRev[3];              // quality values for alternate basecalls reversed
-	char          altQualBufRev[3][BUF_SIZE]; // quality value buffer for alternate basecalls reversed
-
 	// For remembering the exact input text used to define a read
 	char          readOrigBuf[FileBuf::LASTN_BUF_SZ];
 	size_t        readOrigBufLen;
@@ -370,6 +354,267 @@ struct ReadBuf {
 	int           trimmed5;            // amount actually trimmed off 5' end
 	int           trimmed3;            // amount actually trimmed off 3' end
 	HitSet        hitset;              // holds previously-found hits; for chaining
+
+private:
+
+	static const int REV_RC     = 1;
+	static const int REV_FW_REV = 2;
+	static const int REV_RC_REV = 4;
+	static const int REV_QUAL   = 8;
+
+	/**
+	 * Construct reverse complement of the pattern and the fuzzy
+	 * alternative patters.  If read is in colorspace, just reverse
+	 * them.
+	 */
+	void constructRevComps() {
+		uint32_t len = length();
+		RESET_BUF_LEN(patRc, patBufRc, len, Dna5);
+		revCopy((const uint8_t*)patFw.data_begin, len, patBufRc, !color);
+		for(int j = 0; j < alts; j++) {
+			RESET_BUF_LEN(altPatRc[j], altPatBufRc[j], len, Dna5);
+			revCopy((const uint8_t*)altPatFw[j].data_begin, len, altPatBufRc[j], !color);
+		}
+		revs |= REV_RC;
+	}
+
+	/**
+	 * Construct the forward pattern and fuzzy alternatives reversed.
+	 */
+	void constructFwRevs() {
+		uint32_t len = length();
+		RESET_BUF_LEN(patFwRev, patBufFwRev, len, Dna5);
+		revCopy((const uint8_t*)patFw.data_begin, len, patBufFwRev, false);
+		for(int j = 0; j < alts; j++) {
+			RESET_BUF_LEN(altPatFwRev[j], altPatBufFwRev[j], len, Dna5);
+			revCopy((const uint8_t*)altPatFw[j].data_begin, len, altPatBufFwRev[j], false);
+		}
+		revs |= REV_FW_REV;
+	}
+
+	/**
+	 * Construct the reverse complements reversed; that's the forward
+	 * pattern complemented, or just copied if in colorspace.
+	 */
+	void constructRcRevs() {
+		uint32_t len = length();
+		RESET_BUF_LEN(patRcRev, patBufRcRev, len, Dna5);
+		for(int j = 0; j < alts; j++) {
+			RESET_BUF_LEN(altPatRcRev[j], altPatBufRcRev[j], len, Dna5);
+		}
+		if(color) {
+			memcpy(patBufRcRev, patFw.data_begin, len);
+			for(int j = 0; j < alts; j++) {
+				memcpy(altPatBufRcRev[j], altPatFw[j].data_begin, len);
+			}
+		} else {
+			compCopy((const uint8_t*)patFw.data_begin, len, patBufRcRev);
+			for(int j = 0; j < alts; j++) {
+				compCopy((const uint8_t*)altPatFw[j].data_begin, len, altPatBufRcRev[j]);
+			}
+		}
+		revs |= REV_RC_REV;
+	}
+
+	/**
+	 * Construct the qualities and fuzzy alternative qualities
+	 * reversed.
+	 */
+	void constructQualRevs() {
+		uint32_t len = length();
+		RESET_BUF_LEN(qualRev, qualBufRev, len, char);
+		revCopy((const uint8_t*)qual.data_begin, len, (uint8_t*)qualBufRev, false);
+		for(int j = 0; j < alts; j++) {
+			RESET_BUF_LEN(altQualRev[j], altQualBufRev[j], len, char);
+			revCopy((const uint8_t*)altQual[j].data_begin, len, (uint8_t*)altQualBufRev[j], false);
+		}
+		revs |= REV_QUAL;
+	}
+
+	String<Dna5>  patRc;               // reverse-complement sequence
+	uint8_t       patBufRc[BUF_SIZE];  // reverse-complement sequence buffer
+	String<Dna5>  altPatRc[3];              // reverse-complement sequence
+	uint8_t       altPatBufRc[3][BUF_SIZE]; // reverse-complement sequence buffer
+
+	String<Dna5>  patFwRev;               // forward-strand sequence reversed
+	uint8_t       patBufFwRev[BUF_SIZE];  // forward-strand sequence buffer reversed
+	String<Dna5>  patRcRev;               // reverse-complement sequence reversed
+	uint8_t       patBufRcRev[BUF_SIZE];  // reverse-complement sequence buffer reversed
+	String<char>  qualRev;                // quality values reversed
+	char          qualBufRev[BUF_SIZE];   // quality value buffer reversed
+
+	String<Dna5>  altPatFwRev[3];              // forward-strand sequence reversed
+	uint8_t       altPatBufFwRev[3][BUF_SIZE]; // forward-strand sequence buffer reversed
+	String<Dna5>  altPatRcRev[3];              // reverse-complement sequence reversed
+	uint8_t       altPatBufRcRev[3][BUF_SIZE]; // reverse-complement sequence buffer reversed
+	String<char>  altQualRev[3];              // quality values for alternate basecalls reversed
+	char          altQualBufRev[3][BUF_SIZE]; // quality value buffer for alternate basecalls reversed
+
+	int           revs;                // REV_* flags of the versions above that are built
+};
+
+class PatternSource;
+
+/// Most reads, and bytes of read text, taken from a shared read file
+/// per critical section
+static const uint32_t READ_BATCH_READS = 128;
+static const size_t   READ_BATCH_BYTES = 128 * 1024;
+
+/**
+ * The raw text of a run of whole records that one search thread took
+ * from a PatternSource in a single critical section, so that it can
+ * parse them without holding the PatternSource's lock.  Owned by the
+ * thread; see PatternSource::nextBatch() and nextReadBatched().  The
+ * records are copied into 'text', or, if the source holds its whole
+ * input in (writable, private) memory, referenced where they are.
+ */
+struct RawReadBatch {
+	RawReadBatch() : src(NULL), fb(NULL), ext(NULL), extLen(0), cnt(0), left(0), first(true) { }
+	~RawReadBatch() { delete fb; }
+
+	PatternSource *src; // source the records came from
+	std::string text;   // the records, if copied
+	FileBuf  *fb;       // reads the records
+	const char *ext;    // the records, if not copied
+	size_t   extLen;
+	uint64_t cnt;       // read count before the next record
+	uint32_t left;      // # records not yet parsed
+	bool     first;     // next record is the first in the batch
+
+	/**
+	 * Drop the records.
+	 */
+	void clear() {
+		text.clear();
+		ext = NULL;
+		extLen = 0;
+	}
+
+	/**
+	 * Point fb at the first record.
+	 */
+	void rewind() {
+		first = true;
+		if(fb == NULL) fb = new FileBuf();
+		if(ext != NULL) {
+			fb->newBuf(ext, extLen);
+		} else {
+			fb->newBuf(text.data(), text.length());
+		}
+	}
+
+	/**
+	 * Trade records with 'o', keeping each side's buffers for reuse.
+	 * Both batches are rewound.
+	 */
+	void swap(RawReadBatch& o) {
+		std::swap(src, o.src);
+		text.swap(o.text);
+		std::swap(ext, o.ext);
+		std::swap(extLen, o.extLen);
+		std::swap(cnt, o.cnt);
+		std::swap(left, o.left);
+		rewind();
+		o.rewind();
+	}
+
+private:
+	RawReadBatch(const RawReadBatch&);
+	RawReadBatch& operator=(const RawReadBatch&);
+};
+
+/// Number of batches (of each mate) that the input thread may parse
+/// ahead of the search threads
+static const size_t READ_QUEUE_BATCHES = 32;
+
+/**
+ * A bounded, lock-free queue of RawReadBatches that one input thread
+ * fills and any number of search threads drain.  Each slot holds a
+ * batch of 1st mates or unpaired reads and a parallel batch of 2nd
+ * mates (b.src == NULL if unpaired).  Batches are swapped in and out
+ * of the slots so that their buffers get reused.  A slot's sequence
+ * number says whose turn it is: it equals the push position while the
+ * slot is free and that position + 1 while it is full.
+ */
+class RawReadBatchQueue {
+public:
+	RawReadBatchQueue(size_t sz) : head_(0), tail_(0), done_(false), stop_(false) {
+		size_t n = 1;
+		while(n < sz) n <<= 1;
+		mask_ = n - 1;
+		slots_ = new Slot[n];
+		for(size_t i = 0; i < n; i++) slots_[i].seq = i;
+	}
+
+	~RawReadBatchQueue() { delete[] slots_; }
+
+	/**
+	 * Swap 'a' and 'b' into the next slot once it is free.  Only for
+	 * the input thread.  Returns false if the queue was stopped first.
+	 */
+	bool push(RawReadBatch& a, RawReadBatch& b) {
+		Slot& s = slots_[tail_ & mask_];
+		while(__atomic_load_n(&s.seq, __ATOMIC_ACQUIRE) != tail_) {
+			if(__atomic_load_n(&stop_, __ATOMIC_ACQUIRE)) return false;
+			tthread::this_thread::yield();
+		}
+		s.a.swap(a);
+		s.b.swap(b);
+		__atomic_store_n(&s.seq, tail_ + 1, __ATOMIC_RELEASE);
+		tail_++;
+		return true;
+	}
+
+	/**
+	 * Swap the oldest full slot into 'a' and 'b', waiting for the
+	 * input thread if need be.  Returns false once the queue is empty
+	 * and finish() has been called.
+	 */
+	bool pop(RawReadBatch& a, RawReadBatch& b) {
+		size_t pos = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+		while(true) {
+			Slot& s = slots_[pos & mask_];
+			intptr_t d = (intptr_t)(__atomic_load_n(&s.seq, __ATOMIC_ACQUIRE) - (pos + 1));
+			if(d == 0) {
+				if(__sync_bool_compare_and_swap(&head_, pos, pos + 1)) {
+					a.swap(s.a);
+					b.swap(s.b);
+					__atomic_store_n(&s.seq, pos + mask_ + 1, __ATOMIC_RELEASE);
+					return true;
+				}
+			} else if(d < 0) {
+				// Not pushed yet
+				if(__atomic_load_n(&done_, __ATOMIC_ACQUIRE)) {
+					// Every push happened before done_ was set
+					d = (intptr_t)(__atomic_load_n(&s.seq, __ATOMIC_ACQUIRE) - (pos + 1));
+					if(d < 0) return false;
+					continue;
+				}
+				tthread::this_thread::yield();
+			}
+			pos = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+		}
+	}
+
+	/// The input thread calls this after its last push()
+	void finish() { __atomic_store_n(&done_, true, __ATOMIC_RELEASE); }
+
+	/// Make a waiting push() give up
+	void stop() { __atomic_store_n(&stop_, true, __ATOMIC_RELEASE); }
+
+private:
+	struct Slot {
+		size_t seq;
+		RawReadBatch a;
+		RawReadBatch b;
+	};
+
+	Slot  *slots_;
+	size_t mask_;
+	size_t head_; // next position to pop
+	size_t tail_; // next position to push; input thread only
+	bool   done_;
+	bool   stop_;
 };
 
 /**
@@ -437,13 +682,11 @@ public:
 			// TODO: Perhaps bundle all of the following up into a
 			// finalize() member in the ReadBuf class?
 
-			// Construct the reversed versions of the fw and rc seqs
-			// and quals
-			ra.constructRevComps();
-			ra.constructReverses();
+			// The reversed versions of the fw and rc seqs and quals
+			// are built as they're needed
+			ra.resetRevs();
 			if(!rb.empty()) {
-				rb.constructRevComps();
-				rb.constructReverses();
+				rb.resetRevs();
 			}
 			// Fill in the random-seed field using a combination of
 			// information from the user-specified seed and the read
@@ -473,28 +716,33 @@ public:
 		// nextPatternImpl does the reading from the ultimate source;
 		// it is implemented in concrete subclasses
 		nextReadImpl(r, patid);
-		if(!r.empty()) {
-			// Possibly randomize the qualities so that they're more
-			// scattered throughout the range of possible values
-			if(randomizeQuals_) {
-				randomizeQuals(r);
-			}
-			// Construct the reversed versions of the fw and rc seqs
-			// and quals
-			r.constructRevComps();
-			r.constructReverses();
-			// Fill in the random-seed field using a combination of
-			// information from the user-specified seed and the read
-			// sequence, qualities, and name
-			r.seed = genRandSeed(r.patFw, r.qual, r.name, seed_);
-			// Output it, if desired
-			if(dumpfile_ != NULL) {
-				dumpBuf(r);
-			}
-			if(verbose_) {
-				cout << "Parsed read: "; r.dump(cout);
-			}
-		}
+		if(!r.empty()) finishRead(r);
+	}
+
+	/**
+	 * Like nextRead(), but parse the read from the records this
+	 * thread took earlier with nextBatch(), outside of the lock.
+	 * Leaves r empty once 'b' is used up.
+	 */
+	void nextReadBatched(RawReadBatch& b, ReadBuf& r, uint32_t& patid) {
+		assert(b.src == this);
+		readBatched(b, r, patid);
+		if(!r.empty()) finishRead(r);
+	}
+
+	/**
+	 * Return true iff this source can hand out raw records with
+	 * nextBatch().
+	 */
+	virtual bool batchable() const { return false; }
+
+	/**
+	 * Replace 'b' with up to 'n' whole records (and up to about
+	 * 'maxBytes' bytes of them) taken in one critical section.  b.left
+	 * is 0 once the input is exhausted.  Only for batchable() sources.
+	 */
+	virtual void nextBatch(RawReadBatch& b, uint32_t n, size_t maxBytes) {
+		throw 1;
 	}
 
 	/**
@@ -515,6 +763,14 @@ public:
 	 */
 	virtual void nextReadImpl(ReadBuf& r, uint32_t& patid) = 0;
 
+	/**
+	 * Implementation to be provided by batchable() subclasses: parse
+	 * the next read from 'b' into 'r', without locking.
+	 */
+	virtual void readBatched(RawReadBatch& b, ReadBuf& r, uint32_t& patid) {
+		throw 1;
+	}
+
 	/// Reset state to start over again with the first read
 	virtual void reset() { readCnt_ = 0; }
 
@@ -543,6 +799,33 @@ public:
 
 protected:
 
+	/**
+	 * Finish off a newly-parsed unpaired read or mate: forget its old
+	 * reversed and reverse-complemented versions, build its random
+	 * seed, and dump it if requested.
+	 */
+	void finishRead(ReadBuf& r) {
+		// Possibly randomize the qualities so that they're more
+		// scattered throughout the range of possible values
+		if(randomizeQuals_) {
+			randomizeQuals(r);
+		}
+		// The reversed versions of the fw and rc seqs and quals are
+		// built as they're needed
+		r.resetRevs();
+		// Fill in the random-seed field using a combination of
+		// information from the user-specified seed and the read
+		// sequence, qualities, and name
+		r.seed = genRandSeed(r.patFw, r.qual, r.name, seed_);
+		// Output it, if desired
+		if(dumpfile_ != NULL) {
+			dumpBuf(r);
+		}
+		if(verbose_) {
+			cout << "Parsed read: "; r.dump(cout);
+		}
+	}
+
 	/**
 	 * Mix up the quality values for ReadBuf r.  There's probably a
 	 * more (pseudo-)randomly rigorous way to do this; the output looks
@@ -571,13 +854,13 @@ protected:
 	/**
 	 * Dump the contents of the ReadBuf to the dump file.
 	 */
-	void dumpBuf(const ReadBuf& r) {
+	void dumpBuf(ReadBuf& r) {
 		assert(dumpfile_ != NULL);
 		dump(out_, r.patFw,
 		     empty(r.qual) ? String<char>("(empty)") : r.qual,
 		     empty(r.name)   ? String<char>("(empty)") : r.name);
-		dump(out_, r.patRc,
-		     empty(r.qualRev) ? String<char>("(empty)") : r.qualRev,
+		dump(out_, r.getPatRc(),
+		     empty(r.qual) ? String<char>("(empty)") : r.getQualRev(),
 		     empty(r.name)   ? String<char>("(empty)") : r.name);
 	}
 
@@ -623,6 +906,17 @@ public:
 	virtual bool nextReadPair(ReadBuf& ra, ReadBuf& rb, uint32_t& patid) = 0;
 	virtual pair<uint64_t,uint64_t> readCnt() const = 0;
 
+	/**
+	 * Like nextReadPair(), but the calling thread may take reads in
+	 * batches, keeping those it hasn't used yet in 'ba' and 'bb'.  By
+	 * default it takes them one at a time.
+	 */
+	virtual bool nextReadPair(ReadBuf& ra, ReadBuf& rb, uint32_t& patid,
+	                          RawReadBatch& ba, RawReadBatch& bb)
+	{
+		return nextReadPair(ra, rb, patid);
+	}
+
 	/**
 	 * Lock this PairedPatternSource, usually because one of its shared
 	 * fields is being updated.
@@ -747,7 +1041,8 @@ public:
 	PairedDualPatternSource(const vector<PatternSource*>& srca,
 	                        const vector<PatternSource*>& srcb,
 	                        uint32_t seed) :
-		PairedPatternSource(seed), cur_(0), srca_(srca), srcb_(srcb)
+		PairedPatternSource(seed), cur_(0), srca_(srca), srcb_(srcb),
+		queue_(NULL), input_(NULL), noInput_(false), inputErr_(false)
 	{
 		// srca_ and srcb_ must be parallel
 		assert_eq(srca_.size(), srcb_.size());
@@ -762,7 +1057,7 @@ public:
 		}
 	}
 
-	virtual ~PairedDualPatternSource() { }
+	virtual ~PairedDualPatternSource() { stopInput(); }
 
 	/**
 	 * Call this whenever this PairedPatternSource is wrapped by a new
@@ -783,6 +1078,7 @@ public:
 	 * the next call to nextReadPair gets the very first read pair.
 	 */
 	virtual void reset() {
+		stopInput();
 		for(size_t i = 0; i < srca_.size(); i++) {
 			srca_[i]->reset();
 			if(srcb_[i] != NULL) {
@@ -870,6 +1166,94 @@ public:
 		return false;
 	}
 
+	/**
+	 * Like nextReadPair(), but take reads from batchable() sources
+	 * READ_BATCH_READS at a time and parse them outside of any lock.
+	 * 'ba' and 'bb' hold this thread's unparsed 1st and 2nd mates.
+	 * If every source is batchable(), the batches come from an input
+	 * thread that reads ahead, so that reading and decompressing
+	 * overlap with the search.
+	 */
+	virtual bool nextReadPair(ReadBuf& ra, ReadBuf& rb, uint32_t& patid,
+	                          RawReadBatch& ba, RawReadBatch& bb)
+	{
+		while(true) {
+			if(ba.left > 0 && bb.src == NULL) {
+				// Unpaired reads
+				ba.src->nextReadBatched(ba, ra, patid);
+				if(seqan::empty(ra.patFw)) continue;
+				ra.patid = patid;
+				ra.mate  = 0;
+				return false; // unpaired
+			} else if(ba.left > 0) {
+				// Parallel mates; taken together, so they line up
+				// unless the mate files disagree
+				uint32_t patid_a = 0;
+				uint32_t patid_b = 0;
+				ba.src->nextReadBatched(ba, ra, patid_a);
+				bb.src->nextReadBatched(bb, rb, patid_b);
+				while(patid_a != patid_b &&
+				      !seqan::empty(ra.patFw) && !seqan::empty(rb.patFw))
+				{
+					if(patid_a < patid_b) {
+						ba.src->nextReadBatched(ba, ra, patid_a);
+					} else {
+						bb.src->nextReadBatched(bb, rb, patid_b);
+					}
+				}
+				if(seqan::empty(ra.patFw) || seqan::empty(rb.patFw)) {
+					ba.left = bb.left = 0;
+					continue;
+				}
+				ra.fixMateName(1);
+				rb.fixMateName(2);
+				patid = patid_a;
+				ra.patid = patid;
+				rb.patid = patid;
+				ra.mate  = 1;
+				rb.mate  = 2;
+				return true; // paired
+			}
+			// This thread's batch is used up; take another
+			if(startInput()) {
+				if(!queue_->pop(ba, bb)) {
+					if(inputErr_) throw 1;
+					return false;
+				}
+				continue;
+			}
+			lock();
+			uint32_t cur = cur_;
+			unlock();
+			if(cur >= srca_.size()) return false;
+			if(!srca_[cur]->batchable() ||
+			   (srcb_[cur] != NULL && !srcb_[cur]->batchable()))
+			{
+				return nextReadPair(ra, rb, patid);
+			}
+			if(srcb_[cur] == NULL) {
+				srca_[cur]->nextBatch(ba, READ_BATCH_READS, READ_BATCH_BYTES);
+				bb.src = NULL;
+			} else {
+				// Lock to ensure that this thread gets parallel reads
+				// in the two mate files
+				lock();
+				srca_[cur]->nextBatch(ba, READ_BATCH_READS, READ_BATCH_BYTES);
+				srcb_[cur]->nextBatch(bb, ba.left, (size_t)-1);
+				unlock();
+				// Pairs run out when either mate file does
+				ba.left = bb.left = min(ba.left, bb.left);
+			}
+			if(ba.left == 0) {
+				// If patFw is empty, that's our signal that the
+				// input dried up
+				lock();
+				if(cur + 1 > cur_) cur_++;
+				unlock();
+			}
+		}
+	}
+
 	/**
 	 * Return the number of reads attempted.
 	 */
@@ -888,9 +1272,89 @@ public:
 
 protected:
 
+	/**
+	 * Start the input thread unless it's already running or some
+	 * source isn't batchable().  Return true iff it's running.
+	 */
+	bool startInput() {
+		lock();
+		if(input_ == NULL && !noInput_) {
+			for(size_t i = 0; i < srca_.size(); i++) {
+				if(!srca_[i]->batchable() ||
+				   (srcb_[i] != NULL && !srcb_[i]->batchable()))
+				{
+					noInput_ = true;
+				}
+			}
+			if(!noInput_) {
+				queue_ = new RawReadBatchQueue(READ_QUEUE_BATCHES);
+				input_ = new tthread::thread(inputWorker, (void*)this);
+			}
+		}
+		bool running = (input_ != NULL);
+		unlock();
+		return running;
+	}
+
+	/**
+	 * Stop and join the input thread, if it's running.  Only for the
+	 * master thread.
+	 */
+	void stopInput() {
+		if(input_ != NULL) {
+			queue_->stop();
+			input_->join();
+			delete input_;
+			input_ = NULL;
+		}
+		delete queue_;
+		queue_ = NULL;
+		noInput_ = false;
+		inputErr_ = false;
+	}
+
+	static void inputWorker(void *vp) {
+		((PairedDualPatternSource*)vp)->readAhead();
+	}
+
+	/**
+	 * Body of the input thread: read, decompress and split the input
+	 * into batches ahead of the search threads, which parse them.
+	 * Mate batches are taken together so that they line up.
+	 */
+	void readAhead() {
+		RawReadBatch ba, bb;
+		try {
+			size_t cur = 0;
+			while(cur < srca_.size()) {
+				srca_[cur]->nextBatch(ba, READ_BATCH_READS, READ_BATCH_BYTES);
+				if(srcb_[cur] == NULL) {
+					bb.src = NULL;
+				} else {
+					srcb_[cur]->nextBatch(bb, ba.left, (size_t)-1);
+					// Pairs run out when either mate file does
+					ba.left = bb.left = min(ba.left, bb.left);
+				}
+				if(ba.left == 0) {
+					cur++;
+					continue;
+				}
+				if(!queue_->push(ba, bb)) return; // stopped
+			}
+		} catch(int e) {
+			// Surface the error in the search threads
+			inputErr_ = true;
+		}
+		queue_->finish();
+	}
+
 	volatile uint32_t cur_; // current element in parallel srca_, srcb_ vectors
 	vector<PatternSource*> srca_; /// PatternSources for 1st mates and/or unpaired reads
 	vector<PatternSource*> srcb_; /// PatternSources for 2nd mates
+	RawReadBatchQueue *queue_;    /// batches parsed ahead by input_
+	tthread::thread *input_;      /// input thread, if running
+	bool noInput_;   /// some source isn't batchable(); don't use input_
+	bool inputErr_;  /// input thread hit an error
 };
 
 /**
@@ -973,8 +1437,16 @@ public:
  */
 class WrappedPatternSourcePerThread : public PatternSourcePerThread {
 public:
-	WrappedPatternSourcePerThread(PairedPatternSource& __patsrc) :
-		patsrc_(__patsrc)
+	/**
+	 * If 'share' is non-NULL, take reads from the same raw batches as
+	 * 'share' does, so that reads drawn from the two in turn come in
+	 * input order.  'share' must outlive this object.
+	 */
+	WrappedPatternSourcePerThread(PairedPatternSource& __patsrc,
+	                              WrappedPatternSourcePerThread* share = NULL) :
+		patsrc_(__patsrc),
+		batcha_(share == NULL ? &ownBatcha_ : share->batcha_),
+		batchb_(share == NULL ? &ownBatchb_ : share->batchb_)
 	{
 		patsrc_.addWrapper();
 	}
@@ -988,7 +1460,7 @@ public:
 		ASSERT_ONLY(uint32_t lastPatid = patid_);
 		buf1_.clearAll();
 		buf2_.clearAll();
-		patsrc_.nextReadPair(buf1_, buf2_, patid_);
+		patsrc_.nextReadPair(buf1_, buf2_, patid_, *batcha_, *batchb_);
 		assert(buf1_.empty() || patid_ != lastPatid);
 	}
 
@@ -996,6 +1468,12 @@ private:
 
 	/// Container for obtaining paired reads from PatternSources
 	PairedPatternSource& patsrc_;
+	/// Reads taken from patsrc_ but not yet parsed, for 1st mates
+	/// (or unpaired reads) and 2nd mates; ours unless shared
+	RawReadBatch ownBatcha_;
+	RawReadBatch ownBatchb_;
+	RawReadBatch *batcha_;
+	RawReadBatch *batchb_;
 };
 
 /**
@@ -1015,12 +1493,16 @@ public:
 
 	/**
 	 * Create a new heap-allocated vector of heap-allocated
-	 * WrappedPatternSourcePerThreads.
+	 * WrappedPatternSourcePerThreads.  They share the first one's raw
+	 * batches, so reads taken from them in turn are in input order.
 	 */
 	virtual std::vector<PatternSourcePerThread*>* create(uint32_t n) const {
 		std::vector<PatternSourcePerThread*>* v = new std::vector<PatternSourcePerThread*>;
+		WrappedPatternSourcePerThread* first = NULL;
 		for(size_t i = 0; i < n; i++) {
-			v->push_back(new WrappedPatternSourcePerThread(patsrc_));
+			WrappedPatternSourcePerThread* p = new WrappedPatternSourcePerThread(patsrc_, first);
+			if(first == NULL) first = p;
+			v->push_back(p);
 			assert(v->back() != NULL);
 		}
 		return v;
@@ -1301,6 +1783,78 @@ extern void tooFewQualities(const String<char>& read_name);
 extern void tooManyQualities(const String<char>& read_name);
 extern void tooManySeqChars(const String<char>& read_name);
 
+/**
+ * Convert the 'len' nucleotides at 's' (ACGTN in either case, or '.'
+ * for N) to Dna5 codes in 'dst', 16 at a time where SSE2 is available;
+ * if 'dst' is NULL, just check them.  Return false if any other
+ * character turns up.
+ */
+static inline bool asciiToDna5(const char *s, size_t len, uint8_t *dst) {
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i caseMask = _mm_set1_epi8((char)0xDF);
+	for(; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+		__m128i u = _mm_and_si128(x, caseMask); // upper case
+		__m128i isA = _mm_cmpeq_epi8(u, _mm_set1_epi8('A'));
+		__m128i isC = _mm_cmpeq_epi8(u, _mm_set1_epi8('C'));
+		__m128i isG = _mm_cmpeq_epi8(u, _mm_set1_epi8('G'));
+		__m128i isT = _mm_cmpeq_epi8(u, _mm_set1_epi8('T'));
+		__m128i isN = _mm_or_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('N')),
+		                           _mm_cmpeq_epi8(x, _mm_set1_epi8('.')));
+		__m128i ok = _mm_or_si128(_mm_or_si128(isA, isC),
+		                          _mm_or_si128(_mm_or_si128(isG, isT), isN));
+		if(_mm_movemask_epi8(ok) != 0xffff) return false;
+		__m128i code = _mm_or_si128(
+			_mm_or_si128(_mm_and_si128(isC, _mm_set1_epi8(1)),
+			             _mm_and_si128(isG, _mm_set1_epi8(2))),
+			_mm_or_si128(_mm_and_si128(isT, _mm_set1_epi8(3)),
+			             _mm_and_si128(isN, _mm_set1_epi8(4))));
+		if(dst != NULL) _mm_storeu_si128((__m128i*)(dst + i), code);
+	}
+#endif
+	for(; i < len; i++) {
+		int c = (unsigned char)s[i];
+		if(c == '.') c = 'N';
+		int u = c & 0xDF;
+		if(u != 'A' && u != 'C' && u != 'G' && u != 'T' && u != 'N') return false;
+		if(dst != NULL) dst[i] = charToDna5[c];
+	}
+	return true;
+}
+
+/**
+ * Return true iff the 'len' characters at 's' are all valid Phred+33
+ * qualities, checking 16 at a time where SSE2 is available.
+ */
+static inline bool allPhred33(const char *s, size_t len) {
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i bad = _mm_setzero_si128();
+	for(; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+		// Signed, like the char comparison in charToPhred33()
+		bad = _mm_or_si128(bad, _mm_cmplt_epi8(x, _mm_set1_epi8(33)));
+	}
+	if(_mm_movemask_epi8(bad) != 0) return false;
+#endif
+	for(; i < len; i++) {
+		if(s[i] < 33) return false;
+	}
+	return true;
+}
+
+/**
+ * Return the length of the line from 's' to the newline at 'nl', less
+ * any carriage returns at its end, or -1 if it has one in the middle.
+ */
+static inline int lineLenNoCR(const char *s, const char *nl) {
+	const char *e = nl;
+	while(e > s && e[-1] == '\r') e--;
+	if(memchr(s, '\r', e - s) != NULL) return -1;
+	return (int)(e - s);
+}
+
 /**
  * Encapsulates a source of patterns which is an in-memory vector.
  */
@@ -1532,6 +2086,11 @@ public:
 			assert_gt(qinfiles_.size(), 0);
 			qfb_.close();
 		}
+#ifdef BOWTIE_MM
+		for(size_t i = 0; i < maps_.size(); i++) {
+			munmap(maps_[i].first, maps_[i].second);
+		}
+#endif
 	}
 
 	/**
@@ -1627,6 +2186,44 @@ public:
 		// If ra.patFw is empty, then the caller knows that we are
 		// finished with the reads
 	}
+
+	/**
+	 * Replace 'b' with up to 'n' whole records from the read files,
+	 * taken in one critical section; the caller parses them with
+	 * nextReadBatched() without holding the lock.
+	 */
+	virtual void nextBatch(RawReadBatch& b, uint32_t n, size_t maxBytes) {
+		assert(batchable());
+		b.src = this;
+		b.clear();
+		// We are entering a critical region, because we're
+		// manipulating our file handle and filecur_ state
+		lock();
+		uint32_t taken = takeRecords(b, n, maxBytes);
+		if(first_ && taken == 0) {
+			// No reads could be extracted from the first _infile
+			cerr << "Warning: Could not find any reads in \"" << infiles_[0] << "\"" << endl;
+		}
+		first_ = false;
+		while(taken == 0 && filecur_ < infiles_.size()) {
+			// Open next file
+			open();
+			resetForNextFile(); // reset state to handle a fresh file
+			b.clear();
+			taken = takeRecords(b, n, maxBytes);
+			if(taken == 0) {
+				// No reads could be extracted from this _infile
+				cerr << "Warning: Could not find any reads in \"" << infiles_[filecur_] << "\"" << endl;
+			}
+			filecur_++;
+		}
+		b.cnt = readCnt_;
+		readCnt_ += taken;
+		// Leaving critical region
+		unlock();
+		b.left = taken;
+		b.rewind();
+	}
 	/**
 	 * Reset state so that we read start reading again from the
 	 * beginning of the first file.  Should only be called by the
@@ -1647,6 +2244,33 @@ protected:
 	virtual void readPair(ReadBuf& ra, ReadBuf& rb, uint32_t& patid) = 0;
 	/// Reset state to handle a fresh file
 	virtual void resetForNextFile() { }
+
+	/// Put up to 'n' whole records from the input file into b, stopping
+	/// once they hold 'maxBytes' bytes, and return the number of reads;
+	/// overridden by batchable() formats
+	virtual uint32_t takeRecords(RawReadBatch& b, uint32_t n, size_t maxBytes) {
+		return 0;
+	}
+
+	/// Parse another read from a batch; overridden by batchable()
+	/// formats
+	virtual void readFrom(RawReadBatch& b, ReadBuf& r, uint32_t& patid) {
+		throw 1;
+	}
+
+	/**
+	 * Parse the next read from 'b' that isn't skipped, or leave r
+	 * empty if there is none.
+	 */
+	virtual void readBatched(RawReadBatch& b, ReadBuf& r, uint32_t& patid) {
+		while(b.left > 0) {
+			b.left--;
+			readFrom(b, r, patid);
+			if(!seqan::empty(r.patFw) && patid >= skip_) return;
+		}
+		r.clearAll();
+	}
+
 	void open() {
 		if(fb_.isOpen()) fb_.close();
 		if(qfb_.isOpen()) qfb_.close();
@@ -1658,13 +2282,22 @@ protected:
 			if(infiles_[filecur_] == "-") {
 				in = stdin;
 			} else if (infiles_[filecur_].substr (infiles_[filecur_].size() - 3) == ".gz") { // reading .gz file
-				gzin = new gzFile; // TODO: to delete this...
-			 	*gzin = gzopen (infiles_[filecur_].c_str(), "r");
-				if (*gzin == Z_NULL) {
-					cerr << "cannot gzopen file " << infiles_[filecur_] << endl;
-					exit (1);
+				// BGZF and indexed files can be inflated in parallel
+				BgzfReader *bgzfin = NULL;
+				if(gInflateThreads > 1) {
+					bgzfin = BgzfReader::open(infiles_[filecur_], gInflateThreads);
+				}
+				if(bgzfin != NULL) {
+					fb_.newFile(bgzfin);
+				} else {
+					gzin = new gzFile; // TODO: to delete this...
+				 	*gzin = gzopen (infiles_[filecur_].c_str(), "r");
+					if (*gzin == Z_NULL) {
+						cerr << "cannot gzopen file " << infiles_[filecur_] << endl;
+						exit (1);
+					}
+					fb_.newFile(gzin);
 				}
-				fb_.newFile(gzin);
 			} else if (infiles_[filecur_].substr (infiles_[filecur_].size() - 4) == ".bz2") { // reading .bz2 file
 				in = fopen(infiles_[filecur_].c_str(), "rb");
 				if (in==NULL) {
@@ -1686,7 +2319,7 @@ protected:
 				filecur_++;
 				continue;
 			}
-			if (in && !bz2in) fb_.newFile(in);
+			if (in && !bz2in && !mapReads(in)) fb_.newFile(in);
 			// Open quality /// not gonna support gzip for separated quality file...
 			if(!qinfiles_.empty()) {
 				FILE *in;
@@ -1706,6 +2339,33 @@ protected:
 		}
 		throw 1;
 	}
+	/**
+	 * Map a plain read file into memory and read it from there, so
+	 * that batches can refer to its records instead of copying them.
+	 * Return false, leaving 'in' to be read with fread(), if that
+	 * isn't possible.  Mappings last as long as the source, since
+	 * batches may still refer to a file after we've moved on.
+	 */
+	bool mapReads(FILE *in) {
+#ifdef BOWTIE_MM
+		if(in == stdin) return false;
+		struct stat st;
+		if(fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			return false;
+		}
+		size_t len = (size_t)st.st_size;
+		void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+		if(p == MAP_FAILED) return false;
+		madvise(p, len, MADV_SEQUENTIAL);
+		maps_.push_back(make_pair(p, len));
+		fclose(in);
+		fb_.newBuf((const char*)p, len);
+		return true;
+#else
+		return false;
+#endif
+	}
+
 	vector<string> infiles_; /// filenames for read files
 	vector<string> qinfiles_; /// filenames for quality files
 	vector<bool> errs_; /// whether we've already printed an error for each file
@@ -1714,6 +2374,9 @@ protected:
 	FileBuf qfb_; /// quality file currently being read from
 	uint32_t skip_;     /// number of reads to skip
 	bool first_;
+#ifdef BOWTIE_MM
+	vector<pair<void*, size_t> > maps_; /// read files mapped by mapReads()
+#endif
 };
 
 /**
@@ -2559,6 +3222,74 @@ protected:
 
 	/// Read another pattern from a FASTQ input file
 	virtual void read(ReadBuf& r, uint32_t& patid) {
+		parse(fb_, first_, readCnt_, r, patid);
+	}
+
+	/// Parse another pattern from the records in a batch
+	virtual void readFrom(RawReadBatch& b, ReadBuf& r, uint32_t& patid) {
+		parse(*b.fb, b.first, b.cnt, r, patid);
+	}
+
+	/**
+	 * FASTQ records can be taken whole without parsing them, except
+	 * when integer qualities may run over several lines.
+	 */
+	virtual bool batchable() const { return !intQuals_; }
+
+	/**
+	 * Take whole records: the @ line, sequence lines up to the + line,
+	 * and the quality line, as parse() reads them.  Reads of length 0,
+	 * which parse() skips, aren't counted.  Records of a mapped file
+	 * are only scanned, not copied.
+	 */
+	virtual uint32_t takeRecords(RawReadBatch& b, uint32_t n, size_t maxBytes) {
+		if(first_) {
+			// parse() skips whitespace before the first record
+			while(isspace(fb_.peek())) fb_.get();
+			first_ = false;
+		}
+		std::string *text = fb_.inMemory() ? NULL : &b.text;
+		const char *start = fb_.inMemory() ? fb_.cursor() : NULL;
+		uint32_t taken = 0;
+		size_t bytes = 0, len;
+		while(taken < n && bytes < maxBytes) {
+			if(fb_.getLine(text, len) < 0) break; // @ line
+			bytes += len;
+			int c;
+			// Skip blank lines, then sequence lines until the + line
+			bool empty = true;
+			while((c = fb_.peek()) >= 0 && c != '+') {
+				if(c != '\n' && c != '\r') empty = false;
+				fb_.getLine(text, len);
+				bytes += len;
+			}
+			if(c < 0) break; // truncated record
+			fb_.getLine(text, len); // + line
+			bytes += len;
+			if(!empty) {
+				if(fb_.getLine(text, len) < 0) break; // quality line
+				bytes += len;
+			}
+			// Take any blank lines, as parse() does
+			while((c = fb_.peek()) == '\n' || c == '\r') {
+				fb_.getLine(text, len);
+				bytes += len;
+			}
+			if(!empty) taken++;
+		}
+		if(start != NULL) {
+			b.ext = start;
+			b.extLen = (size_t)(fb_.cursor() - start);
+		}
+		return taken;
+	}
+
+	/**
+	 * Parse a pattern from 'fb'.  'first' is set if the next record is
+	 * the first from 'fb'; 'cnt' counts the patterns parsed.
+	 */
+	void parse(FileBuf& fb, bool& first, uint64_t& cnt, ReadBuf& r, uint32_t& patid) {
+		if(fb.inMemory() && parseInPlace(fb, first, cnt, r, patid)) return;
 		const int bufSz = ReadBuf::BUF_SIZE;
 		while(true) {
 			int c;
@@ -2569,11 +3300,11 @@ protected:
 			r.primer = -1;
 			r.alts = 0;
 			// Pick off the first at
-			if(first_) {
-				c = fb_.get();
+			if(first) {
+				c = fb.get();
 				if(c != '@') {
-					c = getOverNewline(fb_);
-					if(c < 0) { bail(r); return; }
+					c = getOverNewline(fb);
+					if(c < 0) { bail(fb, r); return; }
 				}
 				if(c != '@') {
 					cerr << c << " Error: reads file does not look like a FASTQ file" << endl;
@@ -2581,19 +3312,19 @@ protected:
 					throw 1;
 				}
 				assert_eq('@', c);
-				first_ = false;
+				first = false;
 			}
 
 			// Read to the end of the id line, sticking everything after the '@'
 			// into *name
 			while(true) {
-				c = fb_.get();
-				if(c < 0) { bail(r); return; }
+				c = fb.get();
+				if(c < 0) { bail(fb, r); return; }
 				if(c == '\n' || c == '\r') {
 					// Break at end of line, after consuming all \r's, \n's
 					while(c == '\n' || c == '\r') {
-						c = fb_.get();
-						if(c < 0) { bail(r); return; }
+						c = fb.get();
+						if(c < 0) { bail(fb, r); return; }
 					}
 					break;
 				}
@@ -2613,7 +3344,7 @@ protected:
 			// c now holds the first character on the line after the
 			// @name line
 
-			// fb_ now points just past the first character of a
+			// fb now points just past the first character of a
 			// sequence line, and c holds the first character
 			int charsRead = 0;
 			uint8_t *sbuf = r.patBufFw;
@@ -2628,7 +3359,7 @@ protected:
 				c = toupper(c);
 				if(asc2dnacat[c] > 0) {
 					// First char is a DNA char
-					int c2 = toupper(fb_.peek());
+					int c2 = toupper(fb.peek());
 					// Second char is a color char
 					if(asc2colcat[c2] > 0) {
 						r.primer = c;
@@ -2636,7 +3367,7 @@ protected:
 						mytrim5 += 2; // trim primer and first color
 					}
 				}
-				if(c < 0) { bail(r); return; }
+				if(c < 0) { bail(fb, r); return; }
 			}
 			int trim5 = mytrim5;
 			if(c == '+') {
@@ -2644,8 +3375,8 @@ protected:
 				if(!quiet) {
 					cerr << "Warning: Skipping read (" << r.name << ") because it had length 0" << endl;
 				}
-				peekToEndOfLine(fb_);
-				fb_.get();
+				peekToEndOfLine(fb);
+				fb.get();
 				continue;
 			}
 			while(c != '+') {
@@ -2666,7 +3397,7 @@ protected:
 				} else if(fuzzy_ && c == ' ') {
 					trim5 = 0; // disable 5' trimming for now
 					if(charsRead == 0) {
-						c = fb_.get();
+						c = fb.get();
 						continue;
 					}
 					charsRead = 0;
@@ -2678,8 +3409,8 @@ protected:
 					sbuf = r.altPatBufFw[altBufIdx++];
 					dstLenCur = &dstLens[altBufIdx];
 				}
-				c = fb_.get();
-				if(c < 0) { bail(r); return; }
+				c = fb.get();
+				if(c < 0) { bail(fb, r); return; }
 			}
 			// Trim from 3' end
 			dstLen = dstLens[0];
@@ -2691,7 +3422,7 @@ protected:
 			assert_eq('+', c);
 
 			// Chew up the optional name on the '+' line
-			peekToEndOfLine(fb_);
+			peekToEndOfLine(fb);
 
 			// Now read the qualities
 			if (intQuals_) {
@@ -2701,7 +3432,7 @@ protected:
 				if(color_ && r.primer != -1) mytrim5--;
 				while (qualsRead < charsRead) {
 					vector<string> s_quals;
-					if(!tokenizeQualLine(fb_, buf, 4096, s_quals)) break;
+					if(!tokenizeQualLine(fb, buf, 4096, s_quals)) break;
 					for (unsigned int j = 0; j < s_quals.size(); ++j) {
 						char c = intToPhred33(atoi(s_quals[j].c_str()), solQuals_);
 						assert_geq(c, 33);
@@ -2726,7 +3457,7 @@ protected:
 				}
 				_setBegin(r.qual, (char*)r.qualBuf);
 				_setLength(r.qual, dstLen);
-				peekOverNewline(fb_);
+				peekOverNewline(fb);
 			} else {
 				// Non-integer qualities
 				char *qbuf = r.qualBuf;
@@ -2737,7 +3468,7 @@ protected:
 				int qualsRead[4] = {0, 0, 0, 0};
 				int *qualsReadCur = &qualsRead[0];
 				while(true) {
-					c = fb_.get();
+					c = fb.get();
 					if (!fuzzy_ && c == ' ') {
 						wrongQualityFormat(r.name);
 					} else if(c == ' ') {
@@ -2751,7 +3482,7 @@ protected:
 						qualsReadCur = &qualsRead[altBufIdx];
 						continue;
 					}
-					if(c < 0) { bail(r); return; }
+					if(c < 0) { bail(fb, r); return; }
 					if (c != '\r' && c != '\n') {
 						if (*qualsReadCur >= trim5) {
 							size_t off = (*qualsReadCur) - trim5;
@@ -2823,20 +3554,20 @@ protected:
 				}
 
 				if(c == '\r' || c == '\n') {
-					c = peekOverNewline(fb_);
+					c = peekOverNewline(fb);
 				} else {
-					c = peekToEndOfLine(fb_);
+					c = peekToEndOfLine(fb);
 				}
 			}
-			r.readOrigBufLen = fb_.copyLastN(r.readOrigBuf);
-			fb_.resetLastN();
+			r.readOrigBufLen = fb.copyLastN(r.readOrigBuf);
+			fb.resetLastN();
 
-			c = fb_.get();
+			c = fb.get();
 			assert(c == -1 || c == '@');
 
 			// Set up a default name if one hasn't been set
 			if(nameLen == 0) {
-				itoa10((int)readCnt_, r.nameBuf);
+				itoa10((int)cnt, r.nameBuf);
 				_setBegin(r.name, r.nameBuf);
 				nameLen = (int)strlen(r.nameBuf);
 				_setLength(r.name, nameLen);
@@ -2844,11 +3575,105 @@ protected:
 			r.trimmed3 = this->trim3_;
 			r.trimmed5 = mytrim5;
 			assert_gt(nameLen, 0);
-			readCnt_++;
-			patid = (uint32_t)(readCnt_-1);
+			cnt++;
+			patid = (uint32_t)(cnt-1);
 			return;
 		}
 	}
+	/**
+	 * parse() for the common case of a four-line record in memory
+	 * ('fb' reads a batch or a mapped file): find its lines with
+	 * memchr, convert the bases 16 at a time and check and copy
+	 * Phred+33 qualities in one go, rather than going through fb.get()
+	 * a character at a time.  Returns false, having consumed nothing,
+	 * if the record or the options need the general parser.
+	 */
+	bool parseInPlace(FileBuf& fb, bool& first, uint64_t& cnt, ReadBuf& r, uint32_t& patid) {
+		if(color_ || fuzzy_ || intQuals_) return false;
+		const char *s = fb.cursor();
+		const char *end = fb.bufEnd();
+		// The record's '@' was consumed along with the previous record,
+		// except for the first
+		size_t atLen = fb.lastNLen();
+		if(first) {
+			if(s == end || *s != '@') return false;
+			s++;
+			atLen = 1;
+		}
+		const char *nl = (const char*)memchr(s, '\n', end - s);
+		if(nl == NULL) return false;
+		const char *name = s;
+		int nameLen = lineLenNoCR(name, nl);
+		if(nameLen < 0 || nameLen > ReadBuf::BUF_SIZE - 2) return false;
+		// One sequence line, then the + line
+		const char *seq = nl + 1;
+		if(seq == end || (nl = (const char*)memchr(seq, '\n', end - seq)) == NULL) return false;
+		int seqLen = lineLenNoCR(seq, nl);
+		const char *plus = nl + 1;
+		if(seqLen <= 0 || plus == end || *plus != '+') return false;
+		if((nl = (const char*)memchr(plus, '\n', end - plus)) == NULL) return false;
+		const char *qual = nl + 1;
+		if(qual == end || (nl = (const char*)memchr(qual, '\n', end - qual)) == NULL) return false;
+		int qualLen = lineLenNoCR(qual, nl);
+		// Blank lines after the record belong to it
+		const char *next = nl + 1;
+		while(next < end && (*next == '\n' || *next == '\r')) next++;
+		if(next < end && *next != '@') return false;
+		int trim5 = this->trim5_;
+		int trim3 = this->trim3_;
+		int len = seqLen - trim5 - trim3;
+		if(qualLen != seqLen || len <= 0 || seqLen - trim5 > 1024) return false;
+		if(atLen + (size_t)(next - s) > FileBuf::LASTN_BUF_SZ) return false;
+		// Trimmed-off bases must be valid too, since the general parser
+		// doesn't count other characters; they may not fit in patBufFw
+		if(!asciiToDna5(seq, trim5, NULL) ||
+		   !asciiToDna5(seq + trim5, seqLen - trim5, r.patBufFw))
+		{
+			return false;
+		}
+		const char *q = qual + trim5;
+		if(!solQuals_ && !phred64Quals_) {
+			if(!allPhred33(q, seqLen - trim5)) return false;
+			memcpy(r.qualBuf, q, seqLen - trim5);
+		} else {
+			for(int i = 0; i < seqLen - trim5; i++) {
+				r.qualBuf[i] = charToPhred33(q[i], solQuals_, phred64Quals_);
+			}
+		}
+		// Committed to this record
+		if(first) {
+			fb.get(); // '@'
+			first = false;
+		}
+		r.fuzzy = false;
+		r.color = false;
+		r.primer = -1;
+		r.alts = 0;
+		memcpy(r.nameBuf, name, nameLen);
+		_setBegin(r.name, r.nameBuf);
+		_setLength(r.name, nameLen);
+		_setBegin(r.patFw, (Dna5*)r.patBufFw);
+		_setLength(r.patFw, len);
+		_setBegin(r.qual, r.qualBuf);
+		_setLength(r.qual, len);
+		memcpy(r.readOrigBuf, fb.lastN(), atLen);
+		memcpy(r.readOrigBuf + atLen, s, next - s);
+		r.readOrigBufLen = atLen + (next - s);
+		fb.skip(next - fb.cursor());
+		fb.resetLastN();
+		fb.get(); // next record's '@'
+		// Set up a default name if one hasn't been set
+		if(nameLen == 0) {
+			itoa10((int)cnt, r.nameBuf);
+			_setLength(r.name, strlen(r.nameBuf));
+		}
+		r.trimmed3 = trim3;
+		r.trimmed5 = trim5;
+		cnt++;
+		patid = (uint32_t)(cnt-1);
+		return true;
+	}
+
 	/// Read another read pair from a FASTQ input file
 	virtual void readPair(ReadBuf& ra, ReadBuf& rb, uint32_t& patid) {
 		// (For now, we shouldn't ever be here)
@@ -2875,9 +3700,9 @@ private:
 	 * read, usually because we reached the end of the input without
 	 * finishing.
 	 */
-	void bail(ReadBuf& r) {
+	void bail(FileBuf& fb, ReadBuf& r) {
 		seqan::clear(r.patFw);
-		fb_.resetLastN();
+		fb.resetLastN();
 	}
 
 	bool first_;
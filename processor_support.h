@@ -49,7 +49,7 @@ public:
 #elif defined(USING_GCC_COMPILER)
         __get_cpuid(0x1, &regs.EAX, &regs.EBX, &regs.ECX, &regs.EDX);
 #else
-        std::cerr << “ERROR: please define __cpuid() for this build.\n”; 
+        std::cerr << "ERROR: please define __cpuid() for this build.\n"; 
         assert(0);
 #endif
         if( !( (regs.ECX & BIT(20)) && (regs.ECX & BIT(23)) ) ) return false;
@@ -60,6 +60,51 @@ public:
     return true;
     }
 
+    // AVX2 (CPUID.07H:EBX.AVX2[bit 5]) additionally needs the OS to
+    // save the YMM state (CPUID.01H:ECX.OSXSAVE[bit 27] and XCR0 bits
+    // 1 and 2)
+    bool AVX2enabled()
+    {
+#if defined(USING_GCC_COMPILER) && defined(__x86_64__)
+        regs_t regs;
+        if(!POPCNTenabled()) return false;
+        if( !__get_cpuid(0x1, &regs.EAX, &regs.EBX, &regs.ECX, &regs.EDX) ) return false;
+        if( !(regs.ECX & BIT(27)) ) return false;
+        if( (xgetbv0() & 0x6) != 0x6 ) return false;
+        if( __get_cpuid_max(0, 0) < 0x7 ) return false;
+        __cpuid_count(0x7, 0, regs.EAX, regs.EBX, regs.ECX, regs.EDX);
+        return (regs.EBX & BIT(5)) != 0;
+#else
+        return false;
+#endif
+    }
+
+    // AVX-512 VPOPCNTDQ (CPUID.07H:ECX[bit 14]) on top of AVX512F
+    // (CPUID.07H:EBX[bit 16]); the OS must also save the opmask and
+    // ZMM state (XCR0 bits 5-7)
+    bool AVX512POPCNTenabled()
+    {
+#if defined(USING_GCC_COMPILER) && defined(__x86_64__)
+        regs_t regs;
+        if(!AVX2enabled()) return false;
+        if( (xgetbv0() & 0xe6) != 0xe6 ) return false;
+        __cpuid_count(0x7, 0, regs.EAX, regs.EBX, regs.ECX, regs.EDX);
+        return (regs.EBX & BIT(16)) && (regs.ECX & BIT(14));
+#else
+        return false;
+#endif
+    }
+
+private:
+#if defined(USING_GCC_COMPILER) && defined(__x86_64__)
+    static unsigned long long xgetbv0()
+    {
+        unsigned int eax, edx;
+        __asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+        return ((unsigned long long)edx << 32) | eax;
+    }
+#endif
+
 #endif // POPCNT_CAPABILITY
 };
 
@@ -11,17 +11,34 @@
 #include <utility>
 #include <iostream>
 #include <stdexcept>
+#include <set>
 #include <map>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef BOWTIE_MM
+#include <sys/mman.h>
+#endif
 #include "ebwt.h"
 #include "row_chaser.h"
+#include "word_io.h"
 
 #define RANGE_NOT_SET OFF_MASK
 #define RANGE_CACHE_BAD_ALLOC OFF_MASK
 
+/// Bump when the layout of saved range-cache files changes
+#define RANGE_CACHE_FILE_VERSION 1
+
 /**
  * Manages a pool of memory used exclusively for range cache entries.
- * This manager is allocate-only; it exists mainly so that we can avoid
- * lots of new[]s and delete[]s.
+ * This manager is allocate-only until it is reset() as a whole; it
+ * exists mainly so that we can avoid lots of new[]s and delete[]s.
+ * Allocation is a lock-free bump of the occupancy counter, so one pool
+ * can be shared by many threads.
  *
  * A given stretch of words may be one of two types: a cache entry, or
  * a cache entry wrapper.  A cache entry has a length and a list of
@@ -32,8 +49,10 @@
  */
 class RangeCacheMemPool {
 public:
-	RangeCacheMemPool(TIndexOffU lim /* max cache size in bytes */) :
-		lim_(lim >> 2 /* convert to words */), occ_(0), buf_(NULL),
+	RangeCacheMemPool(size_t lim /* max cache size in bytes */) :
+		lim_((TIndexOffU)std::min<size_t>(lim / OFF_SIZE /* convert to words */,
+		                                  (size_t)OFF_MASK - 1)),
+		occ_(0), buf_(NULL),
 		closed_(false)
 	{
 		if(lim_ > 0) {
@@ -48,7 +67,7 @@ public:
 			assert(buf_ != NULL);
 			// Fill with 1s to signal that these elements are
 			// uninitialized
-			memset(buf_, 0xff, lim_ << 2 /* convert back to bytes */);
+			memset(buf_, 0xff, lim_ * OFF_SIZE /* convert back to bytes */);
 		}
 	}
 
@@ -58,31 +77,32 @@ public:
 	}
 
 	/**
-	 * Allocate numElts elements from the word pool.
+	 * Allocate numElts elements from the word pool.  Safe to call from
+	 * several threads at once.
 	 */
 	TIndexOffU alloc(TIndexOffU numElts) {
 		assert_gt(numElts, 0);
-		assert_leq(occ_, lim_);
-		if(occ_ + numElts > lim_ || numElts >= CACHE_WRAPPER_BIT) {
+		if(closed() || numElts >= CACHE_WRAPPER_BIT || numElts > lim_) {
 			return RANGE_CACHE_BAD_ALLOC;
 		}
 		assert_gt(lim_, 0);
-		TIndexOffU ret = occ_;
-		assert(allocs_.find(ret) == allocs_.end());
-		ASSERT_ONLY(allocs_.insert(ret));
-		// Clear the first elt so that we don't think there's already
-		// something there
+		TIndexOffU ret = __sync_fetch_and_add(&occ_, numElts);
+		if(ret + numElts > lim_ || ret + numElts < ret) {
+			// Lost the race for the last words
+			__atomic_store_n(&closed_, true, __ATOMIC_RELAXED);
+			return RANGE_CACHE_BAD_ALLOC;
+		}
 #ifndef NDEBUG
 		for(TIndexOffU i = 0; i < numElts; i++) {
-			assert_eq(OFF_MASK, buf_[occ_ + i]);
+			assert_eq(OFF_MASK, buf_[ret + i]);
 		}
 #endif
-		buf_[occ_] = 0;
-		occ_ += numElts;
-		assert_leq(occ_, lim_);
-		if(lim_ - occ_ < 10) {
+		// Clear the first elt so that we don't think there's already
+		// something there
+		buf_[ret] = 0;
+		if(lim_ - (ret + numElts) < 10) {
 			// No more room - don't try anymore
-			closed_ = true;
+			__atomic_store_n(&closed_, true, __ATOMIC_RELAXED);
 		}
 		return ret;
 	}
@@ -91,119 +111,284 @@ public:
 	 * Turn a pool-array index into a pointer; check that it doesn't
 	 * fall outside the pool first.
 	 */
-	inline TIndexOffU *get(TIndexOffU off) {
+	inline TIndexOffU *get(TIndexOffU off) const {
 		assert_gt(lim_, 0);
 		assert_lt(off, lim_);
-		assert(allocs_.find(off) != allocs_.end());
 		TIndexOffU *ret = buf_ + off;
 		assert_neq(CACHE_WRAPPER_BIT, ret[0]);
 		assert_neq(OFF_MASK, ret[0]);
 		return ret;
 	}
 
+	/**
+	 * Like get(), but without checking what's there; for readers that
+	 * may race with a reset() and check for that afterwards.
+	 */
+	inline TIndexOffU *at(TIndexOffU off) const {
+		return buf_ + off;
+	}
+
+	/**
+	 * Return true iff the n words starting at off are inside the pool.
+	 */
+	inline bool holds(TIndexOffU off, TIndexOffU n) const {
+		return off < lim_ && n <= lim_ - off;
+	}
+
+	/// Return the number of words in the pool
+	TIndexOffU lim() const { return lim_; }
+
 	/**
 	 * Return true iff there's no more room in the cache.
 	 */
-	inline bool closed() {
-		return closed_;
+	inline bool closed() const {
+		return __atomic_load_n(&closed_, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Free every entry.  No other thread may be allocating from or
+	 * writing to the pool.
+	 */
+	void reset() {
+		if(lim_ > 0) memset(buf_, 0xff, lim_ * OFF_SIZE);
+		__atomic_store_n(&occ_, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&closed_, false, __ATOMIC_RELAXED);
 	}
 
 private:
-	TIndexOffU lim_;  /// limit on number of 32-bit words to dish out in total
-	TIndexOffU occ_;  /// number of occupied words
-	TIndexOffU *buf_; /// buffer of 32-bit words
+	TIndexOffU lim_;  /// limit on number of words to dish out in total
+	TIndexOffU occ_;  /// number of occupied words; may overshoot lim_
+	TIndexOffU *buf_; /// buffer of words
 	bool closed_;   ///
-#ifndef NDEBUG
-	std::set<TIndexOffU> allocs_; // elements allocated
-#endif
 };
 
 /**
- * A view to a range of cached reference positions.
+ * One generation of a RangeCache: a table mapping range tops to
+ * entries, and the pool the entries are carved from.  The table is an
+ * open-addressing (linear probing) hash table whose slots are claimed
+ * with compare-and-swap.
+ *
+ * A generation is emptied with clear() to make room for new entries
+ * while other threads may still hold RangeCacheEntrys into it.  Its
+ * epoch tells them apart: it is bumped to an odd value before the
+ * clear and to the next even value after it.  Readers note the epoch
+ * before reading and check with validate() afterwards that it hasn't
+ * moved, seqlock-style.  Writers bracket their writes with
+ * beginWrite()/endWrite(), which fails once the epoch has moved, and
+ * clear() waits for the writers already inside to leave.
  */
-class RangeCacheEntry {
+class RangeCacheGen {
+public:
+	RangeCacheGen(size_t lim) :
+		cap_(tableSlots(lim)), mask_(cap_ - 1),
+		keys_(NULL), vals_(NULL), size_(0), full_(false),
+		pool_(lim - std::min<size_t>(lim, (size_t)cap_ * 2 * OFF_SIZE)),
+		epoch_(0), writers_(0)
+	{
+		if(lim > 0) {
+			try {
+				keys_ = new TIndexOffU[cap_];
+				vals_ = new TIndexOffU[cap_];
+			} catch(std::bad_alloc& e) {
+				cerr << "Allocation error allocating " << cap_
+				     << " range-cache slots" << endl;
+				throw 1;
+			}
+			memset(keys_, 0xff, cap_ * OFF_SIZE);
+			memset(vals_, 0xff, cap_ * OFF_SIZE);
+		}
+	}
 
-	typedef Ebwt<String<Dna> > TEbwt;
-	typedef RowChaser<String<Dna> > TRowChaser;
+	~RangeCacheGen() {
+		delete[] keys_;
+		delete[] vals_;
+	}
+
+	/// Return the current epoch; odd while the generation is cleared
+	uint32_t epoch() const { return __atomic_load_n(&epoch_, __ATOMIC_ACQUIRE); }
 
-public:
 	/**
-	 *
+	 * Return true iff the generation hasn't been cleared since it was
+	 * at the given epoch, so that whatever was read from it since then
+	 * is good.
 	 */
-	RangeCacheEntry(bool sanity = false) :
-		top_(OFF_MASK), jumps_(0), len_(0), ents_(NULL), ebwt_(NULL),
-		sanity_(sanity)
-	{ }
+	bool validate(uint32_t epoch) const {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		return __atomic_load_n(&epoch_, __ATOMIC_RELAXED) == epoch;
+	}
 
 	/**
-	 * Create a new RangeCacheEntry from the data in the pool at 'ents'.
+	 * Start writing to the generation as it was at the given epoch.
+	 * Return false, having done nothing, if it's been cleared since;
+	 * otherwise it won't be until endWrite() is called.
 	 */
-	RangeCacheEntry(RangeCacheMemPool& pool, TIndexOffU top,
-			TIndexOffU ent, TEbwt* ebwt, bool sanity = false) :
-	    sanity_(sanity)
-	{
-		init(pool, top, ent, ebwt);
+	bool beginWrite(uint32_t epoch) {
+		__atomic_fetch_add(&writers_, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&epoch_, __ATOMIC_SEQ_CST) != epoch) {
+			endWrite();
+			return false;
+		}
+		return true;
 	}
 
+	/// Finish writing begun with a successful beginWrite()
+	void endWrite() { __atomic_fetch_sub(&writers_, 1, __ATOMIC_RELEASE); }
+
 	/**
-	 * Initialize a RangeCacheEntry from the data in the pool at 'ents'.
+	 * Evict every entry.  Only one thread may clear a generation at a
+	 * time, and it must not be writing to it.
 	 */
-	void init(RangeCacheMemPool& pool, TIndexOffU top, TIndexOffU ent, TEbwt* ebwt) {
-		assert(ebwt != NULL);
-		top_ = top;
-		ebwt_ = ebwt;
-		TIndexOffU *ents = pool.get(ent);
-		assert_neq(CACHE_WRAPPER_BIT, ents[0]);
-		// Is hi bit set?
-		if((ents[0] & CACHE_WRAPPER_BIT) != 0) {
-			// If so, the target is a wrapper and the non-hi bits
-			// contain the # jumps
-			jumps_ = (ents[0] & ~CACHE_WRAPPER_BIT);
-			assert_gt(jumps_, 0);
-			assert_leq(jumps_, ebwt_->_eh._len);
-			// Get the target entry
-			TIndexOffU *dest = pool.get(ents[1]);
-			// Get the length from the target entry
-			len_ = dest[0];
-			assert_leq(top_ + len_, ebwt_->_eh._len);
-			assert_gt(len_, 0);
-			assert_leq(len_, ebwt_->_eh._len);
-			// Get the pointer to the entries themselves
-			ents_ = dest + 1;
-		} else {
-			// Not a wrapper, so there are no jumps
-			jumps_ = 0;
-			// Get the length from the target entry
-			len_  = ents[0];
-			assert_leq(top_ + len_, ebwt_->_eh._len);
-			assert_gt(len_, 0);
-			assert_leq(len_, ebwt_->_eh._len);
-			// Get the pointer to the entries themselves
-			ents_ = ents + 1;
+	void clear() {
+		__atomic_fetch_add(&epoch_, 1, __ATOMIC_SEQ_CST);
+		while(__atomic_load_n(&writers_, __ATOMIC_SEQ_CST) != 0) {
+			tthread::this_thread::yield();
 		}
-		assert(sanityCheckEnts());
+		if(keys_ != NULL) {
+			memset(keys_, 0xff, cap_ * OFF_SIZE);
+			memset(vals_, 0xff, cap_ * OFF_SIZE);
+		}
+		pool_.reset();
+		__atomic_store_n(&size_, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&full_, false, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&epoch_, 1, __ATOMIC_RELEASE);
 	}
 
 	/**
-	 * Initialize a wrapper with given number of jumps and given target
-	 * entry index.
+	 * Return true iff the pool or the table has filled up.
 	 */
-	void init(RangeCacheMemPool& pool, TIndexOffU top, TIndexOffU jumps,
-			TIndexOffU ent, TEbwt* ebwt)
+	bool full() const {
+		return pool_.closed() || __atomic_load_n(&full_, __ATOMIC_RELAXED);
+	}
+
+	RangeCacheMemPool& pool() { return pool_; }
+	const RangeCacheMemPool& pool() const { return pool_; }
+
+	/// Return the number of table slots
+	TIndexOffU cap() const { return cap_; }
+
+	/// Return the top in table slot i, or OFF_MASK if there's none
+	TIndexOffU keyAt(TIndexOffU i) const { return __atomic_load_n(&keys_[i], __ATOMIC_ACQUIRE); }
+
+	/// Return the pool index in table slot i, or OFF_MASK if there's none
+	TIndexOffU valAt(TIndexOffU i) const { return __atomic_load_n(&vals_[i], __ATOMIC_ACQUIRE); }
+
+	/**
+	 * Return the pool index of the entry for the given top, or OFF_MASK
+	 * if there is none (or if another thread is still publishing it).
+	 */
+	TIndexOffU find(TIndexOffU top) const {
+		TIndexOffU i = slot(top);
+		for(TIndexOffU n = 0; n < cap_; n++) {
+			TIndexOffU k = __atomic_load_n(&keys_[i], __ATOMIC_ACQUIRE);
+			if(k == top) return __atomic_load_n(&vals_[i], __ATOMIC_ACQUIRE);
+			if(k == OFF_MASK) break;
+			i = (i + 1) & mask_;
+		}
+		return OFF_MASK;
+	}
+
+	/**
+	 * Map top to the fully-initialized entry at pool index idx.
+	 * Return false if top is already mapped (perhaps by another
+	 * thread) or if the table is full.  Past three quarters full the
+	 * table counts as full, to keep probe sequences short.
+	 */
+	bool insert(TIndexOffU top, TIndexOffU idx) {
+		assert_neq(OFF_MASK, top);
+		assert_neq(OFF_MASK, idx);
+		if(__atomic_load_n(&size_, __ATOMIC_RELAXED) >= cap_ - (cap_ >> 2)) {
+			__atomic_store_n(&full_, true, __ATOMIC_RELAXED);
+			return false;
+		}
+		TIndexOffU i = slot(top);
+		for(TIndexOffU n = 0; n < cap_; n++) {
+			TIndexOffU k = __atomic_load_n(&keys_[i], __ATOMIC_ACQUIRE);
+			if(k == OFF_MASK) {
+				k = __sync_val_compare_and_swap(&keys_[i], OFF_MASK, top);
+				if(k == OFF_MASK) {
+					// Claimed the slot; publish the entry
+					__atomic_store_n(&vals_[i], idx, __ATOMIC_RELEASE);
+					__atomic_fetch_add(&size_, 1, __ATOMIC_RELAXED);
+					return true;
+				}
+			}
+			if(k == top) return false;
+			i = (i + 1) & mask_;
+		}
+		__atomic_store_n(&full_, true, __ATOMIC_RELAXED);
+		return false;
+	}
+
+protected:
+
+	/**
+	 * Return the number of hash-table slots to use for a generation of
+	 * lim bytes: the largest power of 2 such that the table takes no
+	 * more than 1/8 of the budget.
+	 */
+	static TIndexOffU tableSlots(size_t lim) {
+		TIndexOffU slots = 1;
+		while((size_t)slots * 2 * 2 * OFF_SIZE * 8 <= lim) slots <<= 1;
+		return slots;
+	}
+
+	/// Home slot for the given top (Fibonacci hashing)
+	TIndexOffU slot(TIndexOffU top) const {
+		return (TIndexOffU)(((uint64_t)top * 0x9E3779B97F4A7C15llu) >> 32) & mask_;
+	}
+
+	TIndexOffU cap_;          /// # slots in hash table; a power of 2
+	TIndexOffU mask_;         /// cap_ - 1
+	TIndexOffU *keys_;        /// range tops; OFF_MASK = empty slot
+	TIndexOffU *vals_;        /// pool indexes; OFF_MASK = not yet published
+	TIndexOffU size_;         /// # slots claimed
+	bool full_;               /// table is full
+	RangeCacheMemPool pool_;  /// Memory pool
+	uint32_t epoch_;          /// # times cleared, times 2; odd while clearing
+	uint32_t writers_;        /// # threads between beginWrite() and endWrite()
+};
+
+/**
+ * A view to a range of cached reference positions.  The entry lives in
+ * a RangeCacheGen that may be cleared while we hold it; get() and
+ * install() check the generation's epoch so that they then act as
+ * though the entry were empty.
+ */
+class RangeCacheEntry {
+
+	typedef Ebwt<String<Dna> > TEbwt;
+	typedef RowChaser<String<Dna> > TRowChaser;
+
+public:
+	/**
+	 *
+	 */
+	RangeCacheEntry(bool sanity = false) :
+		top_(OFF_MASK), jumps_(0), len_(0), ents_(NULL), ebwt_(NULL),
+		gen_(NULL), epoch_(0), verbose_(false), sanity_(sanity)
+	{ }
+
+	/**
+	 * Initialize a RangeCacheEntry for the range at 'top', whose len
+	 * offsets, 'jumps' tunnel-jumps to the left, are at 'ents' in
+	 * generation 'gen' as of the given epoch.
+	 */
+	void init(TIndexOffU top, TIndexOffU jumps, TIndexOffU len,
+	          TIndexOffU *ents, TEbwt* ebwt, RangeCacheGen* gen,
+	          uint32_t epoch)
 	{
 		assert(ebwt != NULL);
-		ebwt_ = ebwt;
+		assert(gen != NULL);
 		top_ = top;
 		jumps_ = jumps;
-		TIndexOffU *ents = pool.get(ent);
-		// Must not be a wrapper
-		assert_eq(0, ents[0] & CACHE_WRAPPER_BIT);
-		// Get the length from the target entry
-		len_ = ents[0];
+		len_ = len;
+		ents_ = ents;
+		ebwt_ = ebwt;
+		gen_ = gen;
+		epoch_ = epoch;
 		assert_gt(len_, 0);
 		assert_leq(len_, ebwt_->_eh._len);
-		// Get the pointer to the entries themselves
-		ents_ = ents + 1;
+		assert_leq(jumps_, ebwt_->_eh._len);
 		assert_leq(top_ + len_, ebwt_->_eh._len);
 		assert(sanityCheckEnts());
 	}
@@ -241,7 +426,8 @@ public:
 	/**
 	 * Install a result obtained by a client of this cache; be sure to
 	 * adjust for how many jumps down the tunnel the cache entry is
-	 * situated.
+	 * situated.  Other threads may be reading or installing the same
+	 * element; they can only ever agree on its value.
 	 */
 	void install(TIndexOffU elt, TIndexOffU val) {
 		if(ents_ == NULL) {
@@ -255,6 +441,10 @@ public:
 		assert_leq(top_ + len_, ebwt_->_eh._len);
 		if(elt < len_) {
 			val -= jumps_;
+			if(!gen_->beginWrite(epoch_)) {
+				// Evicted; the memory may hold another entry now
+				return;
+			}
 			if(verbose_) cout << "Installed reference offset: " << (top_ + elt) << endl;
 			ASSERT_ONLY(TIndexOffU sanity = TRowChaser::toFlatRefOff(ebwt_, 1, top_ + elt));
 			assert_eq(sanity, val);
@@ -264,7 +454,8 @@ public:
 				assert_neq(val, ents_[i]);
 			}
 #endif
-			ents_[elt] = val;
+			__atomic_store_n(&ents_[elt], val, __ATOMIC_RELAXED);
+			gen_->endWrite();
 		} else {
 			// ignore install request
 			if(verbose_) cout << "Fell off end of cache entry for install: " << (top_ + elt) << endl;
@@ -282,9 +473,15 @@ public:
 		assert(ents_ != NULL);
 		assert(ebwt_ != NULL);
 		assert_leq(top_ + len_, ebwt_->_eh._len);
-		if(elt < len_ && ents_[elt] != RANGE_NOT_SET) {
+		TIndexOffU ent = RANGE_NOT_SET;
+		if(elt < len_) ent = __atomic_load_n(&ents_[elt], __ATOMIC_RELAXED);
+		if(ent != RANGE_NOT_SET && !gen_->validate(epoch_)) {
+			// Evicted; what we read may belong to another entry
+			ent = RANGE_NOT_SET;
+		}
+		if(ent != RANGE_NOT_SET) {
 			if(verbose_) cout << "Retrieved result from cache: " << (top_ + elt) << endl;
-			TIndexOffU ret = ents_[elt] + jumps_;
+			TIndexOffU ret = ent + jumps_;
 			ASSERT_ONLY(TIndexOffU sanity = TRowChaser::toFlatRefOff(ebwt_, 1, top_ + elt));
 			assert_eq(sanity, ret);
 			return ret;
@@ -334,23 +531,40 @@ private:
 	TIndexOffU len_;   /// # of entries in cache entry
 	TIndexOffU *ents_; /// ptr to entries, which are flat offs within joined ref
 	TEbwt    *ebwt_; /// index that alignments are in
+	RangeCacheGen *gen_; /// generation holding the entry
+	uint32_t epoch_;   /// gen_'s epoch when the entry was looked up
 	bool     verbose_; /// be talkative?
 	bool     sanity_;  /// do consistency checks?
 };
 
 /**
- *
+ * Maps the top of a BWT range to the cache entry holding the resolved
+ * reference offsets for its rows.  One RangeCache can be shared by all
+ * search threads.  Memory is bounded by the size given to the
+ * constructor, which is split between two RangeCacheGens.  New entries
+ * go into the current generation, and lookups try it and then the
+ * other one.  When the current generation fills, the other one is
+ * cleared and becomes current, so the older half of the entries is
+ * evicted at a time and the cache keeps up as the reads move on to
+ * other ranges.
  */
 class RangeCache {
 
 	typedef Ebwt<String<Dna> > TEbwt;
 	typedef std::vector<TIndexOffU> TUVec;
-	typedef std::map<TIndexOffU, TIndexOffU> TMap;
-	typedef std::map<TIndexOffU, TIndexOffU>::iterator TMapItr;
 
 public:
 	RangeCache(size_t lim, TEbwt* ebwt) :
-		lim_(lim), map_(), pool_(lim), closed_(false), ebwt_(ebwt), sanity_(true) { }
+		lim_(lim), cur_(0), rotating_(false), ebwt_(ebwt), sanity_(true)
+	{
+		gens_[0] = new RangeCacheGen(lim_ > 0 ? (lim_ + 1) / 2 : 0);
+		gens_[1] = new RangeCacheGen(lim_ > 0 ? (lim_ + 1) / 2 : 0);
+	}
+
+	~RangeCache() {
+		delete gens_[0];
+		delete gens_[1];
+	}
 
 	/**
 	 * Given top and bot offsets, retrieve the canonical cache entry
@@ -363,49 +577,192 @@ public:
 		if(ebwt_ == NULL || lim_ == 0) return false;
 		assert_gt(bot, top);
 		ent.reset();
-		TMapItr itr = map_.find(top);
-		if(itr == map_.end()) {
-			// No cache entry for the given 'top' offset
-			if(closed_) {
-				return false; // failed to get cache entry
-			} else {
-				if(pool_.closed()) {
-					closed_ = true;
-					return false; // failed to get cache entry
+		uint32_t c = cur();
+		for(uint32_t i = 0; i < 2; i++) {
+			RangeCacheGen& g = *gens_[c ^ i];
+			uint32_t epoch = g.epoch();
+			if((epoch & 1) != 0) continue; // being cleared
+			TIndexOffU jumps, idx, len;
+			if(resolve(g, epoch, top, jumps, idx, len)) {
+				// There is a cache entry for the given 'top' offset
+				ent.init(top, jumps, len, g.pool().at(idx) + 1, ebwt_, &g, epoch);
+				return true; // success
+			}
+		}
+		// No cache entry for the given 'top' offset; use the tunnel
+		return tunnel(top, bot, ent);
+	}
+
+	/**
+	 * Write every published entry that has at least one resolved
+	 * offset, plus the wrappers pointing to them, to the given file.
+	 * The file is tagged with the index fingerprint fp and is written
+	 * under a temporary name then renamed into place, so runs sharing
+	 * a cache file never see a partial one.  Must not be called while
+	 * other threads are using the cache.  Return false on I/O error.
+	 *
+	 * File layout (native endianness; rejected otherwise):
+	 *   uint32_t   1 (endianness hint)
+	 *   uint32_t   RANGE_CACHE_FILE_VERSION
+	 *   uint32_t   OFF_SIZE
+	 *   uint32_t   0 (padding)
+	 *   uint64_t   index fingerprint
+	 *   TIndexOffU # entry records, then that many of:
+	 *                top, len, len x offset (OFF_MASK = unresolved)
+	 *   TIndexOffU # wrapper records, then that many of:
+	 *                top, jumps, top of target entry
+	 */
+	bool save(const std::string& fn, uint64_t fp) const {
+		if(lim_ == 0) return true;
+		typedef std::pair<uint32_t, TIndexOffU> TGenIdx;
+		// Map (generation, pool index) of entries worth saving to their
+		// tops, and list the ones to write, current generation first so
+		// that its copy of a range wins
+		std::map<TGenIdx, TIndexOffU> idxToTop;
+		std::vector<TGenIdx> ents;
+		std::set<TIndexOffU> tops;
+		const uint32_t c = cur();
+		for(uint32_t gi = 0; gi < 2; gi++) {
+			const RangeCacheGen& g = *gens_[c ^ gi];
+			for(TIndexOffU i = 0; i < g.cap(); i++) {
+				TIndexOffU top = g.keyAt(i), idx = g.valAt(i);
+				if(top == OFF_MASK || idx == OFF_MASK) continue;
+				const TIndexOffU *e = g.pool().get(idx);
+				if((e[0] & CACHE_WRAPPER_BIT) != 0) continue;
+				for(TIndexOffU j = 1; j <= e[0]; j++) {
+					if(e[j] != RANGE_NOT_SET) {
+						idxToTop[TGenIdx(c ^ gi, idx)] = top;
+						if(tops.insert(top).second) {
+							ents.push_back(TGenIdx(c ^ gi, idx));
+						}
+						break;
+					}
 				}
 			}
-			// Use the tunnel
-			bool ret = tunnel(top, bot, ent);
-			return ret;
-		} else {
-			// There is a cache entry for the given 'top' offset
-			TIndexOffU ret = itr->second;
-			ent.init(pool_, top, ret, ebwt_);
-			return true; // success
 		}
+		char pidbuf[32];
+		snprintf(pidbuf, sizeof(pidbuf), ".tmp.%ld", (long)getpid());
+		std::string tmp = fn + pidbuf;
+		std::ofstream out(tmp.c_str(), std::ios::binary);
+		if(!out.good()) {
+			std::cerr << "Warning: could not open range cache file \"" << tmp << "\" for writing" << std::endl;
+			return false;
+		}
+		writeU<uint32_t>(out, 1);
+		writeU<uint32_t>(out, RANGE_CACHE_FILE_VERSION);
+		writeU<uint32_t>(out, OFF_SIZE);
+		writeU<uint32_t>(out, 0);
+		writeU<uint64_t>(out, fp);
+		writeU<TIndexOffU>(out, (TIndexOffU)ents.size());
+		for(size_t i = 0; i < ents.size(); i++) {
+			const TIndexOffU *e = gens_[ents[i].first]->pool().get(ents[i].second);
+			writeU<TIndexOffU>(out, idxToTop[ents[i]]);
+			out.write((const char*)e, (e[0] + 1) * OFF_SIZE);
+		}
+		std::vector<TIndexOffU> wraps;
+		for(uint32_t gi = 0; gi < 2; gi++) {
+			const RangeCacheGen& g = *gens_[c ^ gi];
+			for(TIndexOffU i = 0; i < g.cap(); i++) {
+				TIndexOffU top = g.keyAt(i), idx = g.valAt(i);
+				if(top == OFF_MASK || idx == OFF_MASK || tops.count(top) > 0) continue;
+				const TIndexOffU *e = g.pool().get(idx);
+				if((e[0] & CACHE_WRAPPER_BIT) == 0) continue;
+				std::map<TGenIdx, TIndexOffU>::const_iterator itr =
+					idxToTop.find(TGenIdx(c ^ gi, e[1]));
+				if(itr == idxToTop.end()) continue;
+				tops.insert(top);
+				wraps.push_back(top);
+				wraps.push_back(e[0] & ~CACHE_WRAPPER_BIT);
+				wraps.push_back(itr->second);
+			}
+		}
+		writeU<TIndexOffU>(out, (TIndexOffU)(wraps.size() / 3));
+		if(!wraps.empty()) out.write((const char*)&wraps[0], wraps.size() * OFF_SIZE);
+		out.close();
+		if(out.fail() || rename(tmp.c_str(), fn.c_str()) != 0) {
+			std::cerr << "Warning: could not write range cache file \"" << fn << "\"" << std::endl;
+			remove(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Pre-populate the cache from a file written by save() for the
+	 * index with fingerprint fp.  Silently does nothing if the file
+	 * doesn't exist; warns and ignores it if it belongs to another
+	 * index or is malformed.  Must be called before any thread uses
+	 * the cache.  Return the number of entries loaded.
+	 */
+	size_t load(const std::string& fn, uint64_t fp, bool verbose) {
+		if(lim_ == 0 || ebwt_ == NULL) return 0;
+		int fd = open(fn.c_str(), O_RDONLY);
+		if(fd < 0) return 0;
+		struct stat sbuf;
+		if(fstat(fd, &sbuf) < 0) {
+			::close(fd);
+			return 0;
+		}
+		size_t sz = (size_t)sbuf.st_size;
+		const char *buf = NULL;
+		char *heapBuf = NULL;
+#ifdef BOWTIE_MM
+		void *mm = (sz > 0) ? mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		if(mm != MAP_FAILED) buf = (const char*)mm;
+#endif
+		if(buf == NULL) {
+			heapBuf = new char[sz + 1];
+			size_t got = 0;
+			while(got < sz) {
+				ssize_t n = read(fd, heapBuf + got, sz - got);
+				if(n <= 0) break;
+				got += (size_t)n;
+			}
+			sz = got;
+			buf = heapBuf;
+		}
+		::close(fd);
+		size_t loaded = parse(buf, sz, fp, fn);
+#ifdef BOWTIE_MM
+		if(heapBuf == NULL) munmap((void*)buf, (size_t)sbuf.st_size);
+#endif
+		delete[] heapBuf;
+		if(verbose) {
+			std::cerr << "Loaded " << loaded << " range cache entries from \"" << fn << "\"" << std::endl;
+		}
+		return loaded;
 	}
 
+	/// Return the index this cache resolves rows of
+	TEbwt* ebwt() const { return ebwt_; }
+
 	/**
-	 * Exhaustively check all entries linked to from map_ to ensure
-	 * they're well-formed.
+	 * Exhaustively check all entries linked to from the table to
+	 * ensure they're well-formed.  Entries are filled in after they
+	 * are published, so only call this while no other thread is using
+	 * the cache.
 	 */
 	bool repOk() {
 #ifndef NDEBUG
-		for(TMapItr itr = map_.begin(); itr != map_.end(); itr++) {
-			TIndexOffU top = itr->first;
-			TIndexOffU idx = itr->second;
-			TIndexOffU jumps = 0;
-			assert_leq(top, ebwt_->_eh._len);
-			TIndexOffU *ents = pool_.get(idx);
-			if((ents[0] & CACHE_WRAPPER_BIT) != 0) {
-				jumps = ents[0] & ~CACHE_WRAPPER_BIT;
-				assert_leq(jumps, ebwt_->_eh._len);
-				idx = ents[1];
-				ents = pool_.get(idx);
+		for(uint32_t gi = 0; gi < 2; gi++) {
+			const RangeCacheGen& g = *gens_[gi];
+			for(TIndexOffU i = 0; i < g.cap(); i++) {
+				TIndexOffU top = g.keyAt(i);
+				TIndexOffU idx = g.valAt(i);
+				if(top == OFF_MASK || idx == OFF_MASK) continue;
+				TIndexOffU jumps = 0;
+				assert_leq(top, ebwt_->_eh._len);
+				const TIndexOffU *ents = g.pool().get(idx);
+				if((ents[0] & CACHE_WRAPPER_BIT) != 0) {
+					jumps = ents[0] & ~CACHE_WRAPPER_BIT;
+					assert_leq(jumps, ebwt_->_eh._len);
+					idx = ents[1];
+					ents = g.pool().get(idx);
+				}
+				TIndexOffU len = ents[0];
+				assert_leq(top + len, ebwt_->_eh._len);
+				RangeCacheEntry::sanityCheckEnts(len, const_cast<TIndexOffU*>(ents) + 1, ebwt_);
 			}
-			TIndexOffU len = ents[0];
-			assert_leq(top + len, ebwt_->_eh._len);
-			RangeCacheEntry::sanityCheckEnts(len, ents + 1, ebwt_);
 		}
 #endif
 		return true;
@@ -413,15 +770,144 @@ public:
 
 protected:
 
+	/**
+	 * Install the records in a saved range-cache image.  Return the
+	 * number of records installed.
+	 */
+	size_t parse(const char *buf, size_t sz, uint64_t fp, const std::string& fn) {
+		const size_t hdrSz = 4 * sizeof(uint32_t) + sizeof(uint64_t);
+		if(sz < hdrSz + OFF_SIZE) {
+			std::cerr << "Warning: ignoring truncated range cache file \"" << fn << "\"" << std::endl;
+			return 0;
+		}
+		const uint32_t *hdr = (const uint32_t*)buf;
+		uint64_t filefp;
+		memcpy(&filefp, buf + 4 * sizeof(uint32_t), sizeof(filefp));
+		if(hdr[0] != 1 || hdr[1] != RANGE_CACHE_FILE_VERSION || hdr[2] != OFF_SIZE) {
+			std::cerr << "Warning: ignoring range cache file \"" << fn << "\" with unsupported format" << std::endl;
+			return 0;
+		}
+		if(filefp != fp) {
+			std::cerr << "Warning: ignoring range cache file \"" << fn << "\" saved for a different index" << std::endl;
+			return 0;
+		}
+		const TIndexOffU len = ebwt_->_eh._len;
+		// No other thread uses the cache yet, so the current generation
+		// can be filled directly; whatever doesn't fit is left out
+		RangeCacheGen& g = *gens_[cur()];
+		RangeCacheMemPool& pool = g.pool();
+		const TIndexOffU *w = (const TIndexOffU*)(buf + hdrSz);
+		const TIndexOffU *end = (const TIndexOffU*)(buf + sz - (sz - hdrSz) % OFF_SIZE);
+		size_t installed = 0;
+		TIndexOffU nents = *w++;
+		for(TIndexOffU i = 0; i < nents; i++) {
+			if(end - w < 2) return malformed(fn, installed);
+			TIndexOffU top = w[0], spread = w[1];
+			if(top > len || spread == 0 || spread > len - top ||
+			   (TIndexOffU)(end - w - 2) < spread)
+			{
+				return malformed(fn, installed);
+			}
+			TIndexOffU idx = pool.alloc(spread + 1);
+			if(idx == RANGE_CACHE_BAD_ALLOC) return installed;
+			TIndexOffU *ents = pool.get(idx);
+			ents[0] = spread;
+			for(TIndexOffU j = 0; j < spread; j++) {
+				TIndexOffU off = w[2 + j];
+				ents[j + 1] = (off <= len) ? off : RANGE_NOT_SET;
+			}
+			if(g.insert(top, idx)) installed++;
+			w += 2 + spread;
+		}
+		if(end - w < 1) return malformed(fn, installed);
+		TIndexOffU nwraps = *w++;
+		if((TIndexOffU)(end - w) / 3 < nwraps) return malformed(fn, installed);
+		for(TIndexOffU i = 0; i < nwraps; i++, w += 3) {
+			TIndexOffU top = w[0], jumps = w[1];
+			TIndexOffU target = g.find(w[2]);
+			if(top > len || jumps == 0 || jumps > len || target == OFF_MASK) continue;
+			if((pool.get(target)[0] & CACHE_WRAPPER_BIT) != 0) continue;
+			TIndexOffU idx = pool.alloc(2);
+			if(idx == RANGE_CACHE_BAD_ALLOC) return installed;
+			TIndexOffU *ents = pool.get(idx);
+			ents[0] = CACHE_WRAPPER_BIT | jumps;
+			ents[1] = target;
+			if(g.insert(top, idx)) installed++;
+		}
+		if(sanity_) assert(repOk());
+		return installed;
+	}
+
+	/**
+	 * Warn that a range cache file is malformed and return 'installed'.
+	 */
+	static size_t malformed(const std::string& fn, size_t installed) {
+		std::cerr << "Warning: range cache file \"" << fn << "\" is malformed; ignoring the rest of it" << std::endl;
+		return installed;
+	}
+
+	/// Return the index of the generation taking new entries
+	uint32_t cur() const { return __atomic_load_n(&cur_, __ATOMIC_ACQUIRE); }
+
+	/**
+	 * Look up the entry for 'top' in generation g as of the given
+	 * epoch, following a wrapper to its target.  On success, set
+	 * 'jumps', the pool index of the target entry and its length.
+	 * Return false if there's none, or if g was cleared meanwhile.
+	 */
+	bool resolve(RangeCacheGen& g, uint32_t epoch, TIndexOffU top,
+	             TIndexOffU& jumps, TIndexOffU& idx, TIndexOffU& len) const
+	{
+		const RangeCacheMemPool& pool = g.pool();
+		// A concurrent clear() may tear what we read here, so bounds-
+		// check it before following it and validate it at the end
+		idx = g.find(top);
+		if(idx == OFF_MASK || !pool.holds(idx, 2)) return false;
+		TIndexOffU hdr = pool.at(idx)[0];
+		jumps = 0;
+		if((hdr & CACHE_WRAPPER_BIT) != 0) {
+			jumps = hdr & ~CACHE_WRAPPER_BIT;
+			idx = pool.at(idx)[1];
+			if(!pool.holds(idx, 2)) return false;
+			hdr = pool.at(idx)[0];
+			if((hdr & CACHE_WRAPPER_BIT) != 0) return false;
+		}
+		len = hdr;
+		if(len == 0 || len >= pool.lim() || !pool.holds(idx, len + 1)) return false;
+		return g.validate(epoch);
+	}
+
+	/**
+	 * Make room for new entries after generation c filled up: clear
+	 * the other generation, evicting its entries, and make it the
+	 * current one.  Does nothing if another thread is doing so or
+	 * already has.
+	 */
+	void rotate(uint32_t c) {
+		if(!__sync_bool_compare_and_swap(&rotating_, false, true)) return;
+		if(cur() == c) {
+			gens_[c ^ 1]->clear();
+			__atomic_store_n(&cur_, c ^ 1, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&rotating_, false, __ATOMIC_RELEASE);
+	}
+
 	/**
 	 * Tunnel through to the first range that 1) includes all the same
 	 * suffixes (though longer) as the given range, and 2) has a cache
-	 * entry for it.
+	 * entry for it.  New entries go in the current generation.
 	 */
 	bool tunnel(TIndexOffU top, TIndexOffU bot, RangeCacheEntry& ent) {
 		assert_gt(bot, top);
 		TUVec tops;
 		const TIndexOffU spread = bot - top;
+		const uint32_t c = cur();
+		RangeCacheGen& g = *gens_[c];
+		const uint32_t epoch = g.epoch();
+		if((epoch & 1) != 0 || spread >= g.pool().lim()) {
+			// Being cleared, or the range would never fit
+			return false;
+		}
 		SideLocus tloc, bloc;
 		SideLocus::initFromTopBot(top, bot, ebwt_->_eh, ebwt_->_ebwt, tloc, bloc);
 		TIndexOffU newtop = top, newbot = bot;
@@ -444,37 +930,34 @@ protected:
 			// be confident that the new range includes all of the same
 			// suffixes as the last range (though longer by 1 char)
 			if((newbot - newtop) == spread) {
-				// Check if newtop is already cached
-				TMapItr itr = map_.find(newtop);
 				jumps++;
-				if(itr != map_.end()) {
+				// Check if newtop is already cached in either generation
+				for(uint32_t i = 0; i < 2; i++) {
+					RangeCacheGen& h = *gens_[c ^ i];
+					uint32_t hepoch = h.epoch();
+					if((hepoch & 1) != 0) continue;
+					TIndexOffU hjumps, idx, len;
+					if(!resolve(h, hepoch, newtop, hjumps, idx, len)) continue;
 					// This range, which is further to the left in the
 					// same tunnel as the query range, has a cache
 					// entry already, so use that
-					TIndexOffU idx = itr->second;
-					TIndexOffU *ents = pool_.get(idx);
-					if((ents[0] & CACHE_WRAPPER_BIT) != 0) {
-						// The cache entry we found was a wrapper; make
-						// a new wrapper that points to that wrapper's
-						// target, with the appropriate number of jumps
-						jumps += (ents[0] & ~CACHE_WRAPPER_BIT);
-						idx = ents[1];
-					}
-					// Allocate a new wrapper
-					TIndexOffU newentIdx = pool_.alloc(2);
-					if(newentIdx != RANGE_CACHE_BAD_ALLOC) {
-						// We successfully made a new wrapper entry;
-						// now populate it and install it in map_
-						TIndexOffU *newent = pool_.get(newentIdx); // get ptr to it
-						assert_eq(0, newent[0]);
-						newent[0] = CACHE_WRAPPER_BIT | jumps; // set jumps
-						newent[1] = idx;                // set target
-						assert(map_.find(top) == map_.end());
-						map_[top] = newentIdx;
-						if(sanity_) assert(repOk());
+					hjumps += jumps;
+					if(i == 0 && g.beginWrite(epoch)) {
+						// Make a wrapper for the query range that
+						// points to the entry
+						TIndexOffU newentIdx = g.pool().alloc(2);
+						if(newentIdx != RANGE_CACHE_BAD_ALLOC) {
+							TIndexOffU *newent = g.pool().get(newentIdx);
+							assert_eq(0, newent[0]);
+							newent[0] = CACHE_WRAPPER_BIT | hjumps; // set jumps
+							newent[1] = idx;                        // set target
+							g.insert(top, newentIdx);
+						}
+						g.endWrite();
+						if(g.full()) rotate(c);
 					}
 					// Initialize the entry
-					ent.init(pool_, top, jumps, idx, ebwt_);
+					ent.init(top, hjumps, len, h.pool().at(idx) + 1, ebwt_, &h, hepoch);
 					return true;
 				}
 				// Save this range
@@ -491,53 +974,55 @@ protected:
 		assert_eq(jumps, tops.size());
 		// Try to create a new cache entry for the leftmost range in
 		// the tunnel (which might be the query range)
-		TIndexOffU newentIdx = pool_.alloc(spread + 1);
-		if(newentIdx != RANGE_CACHE_BAD_ALLOC) {
-			// Successfully allocated new range cache entry; install it
-			TIndexOffU *newent = pool_.get(newentIdx);
-			assert_eq(0, newent[0]);
-			// Store cache-range length in first word
-			newent[0] = spread;
-			assert_lt(newent[0], CACHE_WRAPPER_BIT);
-			assert_eq(spread, newent[0]);
-			TIndexOffU entTop = top;
-			TIndexOffU jumps = 0;
-			if(tops.size() > 0) {
-				entTop = tops.back();
-				jumps = tops.size();
-			}
-			// Cache the entry for the end of the tunnel
-			assert(map_.find(entTop) == map_.end());
-			map_[entTop] = newentIdx;
-			if(sanity_) assert(repOk());
-			ent.init(pool_, entTop, jumps, newentIdx, ebwt_);
-			assert_eq(spread, newent[0]);
-			if(jumps > 0) {
-				assert_neq(entTop, top);
-				// Cache a wrapper entry for the query range (if possible)
-				TIndexOffU wrapentIdx = pool_.alloc(2);
-				if(wrapentIdx != RANGE_CACHE_BAD_ALLOC) {
-					TIndexOffU *wrapent = pool_.get(wrapentIdx);
-					assert_eq(0, wrapent[0]);
-					wrapent[0] = CACHE_WRAPPER_BIT | jumps;
-					wrapent[1] = newentIdx;
-					assert(map_.find(top) == map_.end());
-					map_[top] = wrapentIdx;
-					if(sanity_) assert(repOk());
-				}
-			}
-			return true;
-		} else {
-			// Could not allocate new range cache entry
+		if(!g.beginWrite(epoch)) return false;
+		TIndexOffU newentIdx = g.pool().alloc(spread + 1);
+		if(newentIdx == RANGE_CACHE_BAD_ALLOC) {
+			// Could not allocate new range cache entry; evict the
+			// older entries so that later lookups can
+			g.endWrite();
+			rotate(c);
 			return false;
 		}
+		// Successfully allocated new range cache entry; install it
+		TIndexOffU *newent = g.pool().get(newentIdx);
+		assert_eq(0, newent[0]);
+		// Store cache-range length in first word
+		newent[0] = spread;
+		assert_lt(newent[0], CACHE_WRAPPER_BIT);
+		assert_eq(spread, newent[0]);
+		TIndexOffU entTop = top;
+		jumps = 0;
+		if(tops.size() > 0) {
+			entTop = tops.back();
+			jumps = tops.size();
+		}
+		// Cache the entry for the end of the tunnel.  If another
+		// thread beat us to it, our copy still serves this lookup.
+		bool installed = g.insert(entTop, newentIdx);
+		ent.init(entTop, jumps, spread, newent + 1, ebwt_, &g, epoch);
+		assert_eq(spread, newent[0]);
+		if(jumps > 0 && installed) {
+			assert_neq(entTop, top);
+			// Cache a wrapper entry for the query range (if possible)
+			TIndexOffU wrapentIdx = g.pool().alloc(2);
+			if(wrapentIdx != RANGE_CACHE_BAD_ALLOC) {
+				TIndexOffU *wrapent = g.pool().get(wrapentIdx);
+				assert_eq(0, wrapent[0]);
+				wrapent[0] = CACHE_WRAPPER_BIT | jumps;
+				wrapent[1] = newentIdx;
+				g.insert(top, wrapentIdx);
+			}
+		}
+		g.endWrite();
+		if(g.full()) rotate(c);
+		return true;
 	}
 
-	TIndexOffU lim_;           /// Total number of key/val bytes to keep in cache
-	TMap map_;               ///
-	RangeCacheMemPool pool_; /// Memory pool
-	bool closed_;            /// Out of space; no new entries
-	TEbwt* ebwt_;            /// Index that alignments are in
+	size_t lim_;              /// Total number of key/val bytes to keep in cache
+	RangeCacheGen *gens_[2];  /// Current and previous generations of entries
+	uint32_t cur_;            /// Index of the generation taking new entries
+	bool rotating_;           /// A thread is clearing a generation
+	TEbwt* ebwt_;             /// Index that alignments are in
 	bool sanity_;
 };
 
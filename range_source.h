@@ -1837,9 +1837,9 @@ public:
 		ReadBuf* buf = mate1_ ? &patsrc->bufa() : &patsrc->bufb();
 		len_ = buf->length();
 		rs_->setQuery(*buf, r);
-		initRangeSource((fw_ == ebwtFw_) ? buf->qual : buf->qualRev,
+		initRangeSource((fw_ == ebwtFw_) ? buf->qual : buf->getQualRev(),
 		                buf->fuzzy, buf->alts,
-		                (fw_ == ebwtFw_) ? buf->altQual : buf->altQualRev);
+		                (fw_ == ebwtFw_) ? buf->altQual : buf->getAltQualRev());
 		assert_gt(len_, 0);
 		if(this->done) return;
 		ASSERT_ONLY(allTops_.clear());
@@ -301,4 +301,26 @@ static RefRecord fastaRefReadAppend(FileBuf& in,
 	return RefRecord((TIndexOffU)off, (TIndexOffU)len, first);
 }
 
+/**
+ * Reverse each unambiguous stretch of the joined reference dst in
+ * place, turning a reference read with REF_READ_FORWARD into the one
+ * fastaRefReadAppend would have built with REF_READ_REVERSE_EACH.
+ */
+template <typename TStr>
+static void reverseEachRecord(TStr& dst, const vector<RefRecord>& recs) {
+	typedef typename Value<TStr>::Type TVal;
+	size_t ilen = 0;
+	for(size_t r = 0; r < recs.size(); r++) {
+		size_t nlen = ilen + recs[r].len;
+		for(size_t i = ilen, j = nlen; i + 1 < j; i++) {
+			j--;
+			TVal tmp = dst[i];
+			dst[i] = dst[j];
+			dst[j] = tmp;
+		}
+		ilen = nlen;
+	}
+	assert_eq(ilen, length(dst));
+}
+
 #endif /*ndef REF_READ_H_*/
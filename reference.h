@@ -5,6 +5,7 @@
 #include "endian_swap.h"
 #include "mm.h"
 #include "shmem.h"
+#include "index_io.h"
 #include "timer.h"
 #include "btypes.h"
 
@@ -91,10 +92,7 @@ public:
 				throw 1;
 			}
 			if(mmSweep) {
-				TIndexOff sum = 0;
-				for(off_t i = 0; i < sbuf.st_size; i += 1024) {
-					sum += (TIndexOff) mmFile[i];
-				}
+				TIndexOff sum = (TIndexOff)parallelSweep(mmFile, sbuf.st_size, s4.c_str(), verbose_ || startVerbose);
 				if(startVerbose) {
 					cerr << "  Swept the memory-mapped ref index file; checksum: " << sum << ": ";
 					logTime(cerr);
@@ -279,15 +277,13 @@ public:
 					return;
 				}
 				// Read the whole thing in
-				size_t ret = fread(buf_, 1, cumsz >> 2, f4);
-				// Didn't read all of it?
-				if(ret != (cumsz >> 2)) {
-					cerr << "Only read " << ret << " bytes (out of " << (cumsz >> 2) << ") from reference index file " << s4 << endl;
+				if(!parallelRead(f4, s4.c_str(), buf_, cumsz >> 2, "ref", verbose_ || startVerbose)) {
+					cerr << "Could not read " << (cumsz >> 2) << " bytes from reference index file " << s4 << endl;
 					throw 1;
 				}
 				// Make sure there's no more
 				char c;
-				ret = fread(&c, 1, 1, f4);
+				ASSERT_ONLY(size_t ret =) fread(&c, 1, 1, f4);
 				assert_eq(0, ret); // should have failed
 				fclose(f4);
 				if(useShmem_) NOTIFY_SHARED(buf_, (cumsz >> 2));
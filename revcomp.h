@@ -0,0 +1,136 @@
+/*
+ * revcomp.h
+ *
+ * Reversing and complementing reads held as arrays of Dna5 codes (0-4)
+ * or quality characters: 16 characters at a time with SSE2, which
+ * every x86-64 processor has, or 32 at a time with AVX2 where the
+ * processor has it.
+ */
+
+#ifndef REVCOMP_H_
+#define REVCOMP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define REVCOMP_SIMD
+#include <immintrin.h>
+#ifdef POPCNT_CAPABILITY
+#include <iostream>
+#include <cassert>
+#include "processor_support.h"
+#endif
+#endif
+
+/// Complement of a Dna5 code; N stays N
+static inline uint8_t compDna5(uint8_t c) {
+	return (c == 4) ? 4 : (c ^ 3);
+}
+
+#ifdef REVCOMP_SIMD
+
+/// Reverse the order of the 16 bytes in x
+static inline __m128i rev16Sse2(__m128i x) {
+	x = _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3));  // dwords
+	x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1)); // words within dwords
+	x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)); // bytes
+}
+
+/// Complement the 16 Dna5 codes in x
+static inline __m128i comp16Sse2(__m128i x) {
+	__m128i notN = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(4)),
+	                                _mm_set1_epi8(3));
+	return _mm_xor_si128(x, notN);
+}
+
+/// Reverse the order of the 32 bytes in x
+__attribute__((target("avx2")))
+static inline __m256i rev32Avx2(__m256i x) {
+	const __m256i m = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	                                   15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	x = _mm256_shuffle_epi8(x, m); // within 128-bit lanes
+	return _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 0, 3, 2)); // swap lanes
+}
+
+/// Complement the 32 Dna5 codes in x by table lookup
+__attribute__((target("avx2")))
+static inline __m256i comp32Avx2(__m256i x) {
+	const __m256i t = _mm256_setr_epi8(3, 2, 1, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                   3, 2, 1, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	return _mm256_shuffle_epi8(t, x);
+}
+
+/**
+ * Copy 'len' characters from 'src' to 'dst' in reverse order,
+ * complementing them if 'comp' is set; AVX2 version.  Leaves the last
+ * len % 32 characters of 'dst' for the caller.  Returns how many it
+ * wrote.
+ */
+__attribute__((target("avx2")))
+static inline size_t revCopyAvx2(const uint8_t *src, size_t len, uint8_t *dst, bool comp) {
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(src + len - i - 32));
+		x = rev32Avx2(x);
+		if(comp) x = comp32Avx2(x);
+		_mm256_storeu_si256((__m256i*)(dst + i), x);
+	}
+	return i;
+}
+
+/**
+ * Return true iff AVX2 may be used; asks the processor only once.
+ */
+static inline bool revCompAvx2() {
+#ifdef POPCNT_CAPABILITY
+	static const bool avx2 = ProcessorSupport().AVX2enabled();
+	return avx2;
+#else
+	return false;
+#endif
+}
+
+#endif /* REVCOMP_SIMD */
+
+/**
+ * Copy 'len' characters from 'src' to 'dst' in reverse order, also
+ * complementing them if 'comp' is set (they must then be Dna5 codes).
+ * 'src' and 'dst' must not overlap.
+ */
+static inline void revCopy(const uint8_t *src, size_t len, uint8_t *dst, bool comp) {
+	size_t i = 0;
+#ifdef REVCOMP_SIMD
+	if(len >= 32 && revCompAvx2()) {
+		i = revCopyAvx2(src, len, dst, comp);
+	}
+	for(; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + len - i - 16));
+		x = rev16Sse2(x);
+		if(comp) x = comp16Sse2(x);
+		_mm_storeu_si128((__m128i*)(dst + i), x);
+	}
+#endif
+	if(comp) {
+		for(; i < len; i++) dst[i] = compDna5(src[len - i - 1]);
+	} else {
+		for(; i < len; i++) dst[i] = src[len - i - 1];
+	}
+}
+
+/**
+ * Copy 'len' Dna5 codes from 'src' to 'dst', complementing them.
+ */
+static inline void compCopy(const uint8_t *src, size_t len, uint8_t *dst) {
+	size_t i = 0;
+#ifdef REVCOMP_SIMD
+	for(; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), comp16Sse2(x));
+	}
+#endif
+	for(; i < len; i++) dst[i] = compDna5(src[i]);
+}
+
+#endif /* REVCOMP_H_ */
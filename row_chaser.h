@@ -85,7 +85,11 @@ public:
 			return;
 		} else if((row_ & eh_->_offMask) == row_) {
 			// We arrived at a marked row
-			off_ = ebwt_->_offs[row_ >> eh_->_offRate];
+			off_ = ebwt_->offAt(row_ >> eh_->_offRate);
+			done = true;
+			return;
+		} else if(ebwt_->_hotOffs.lookup(row_, off_)) {
+			// We arrived at a row marked by the second-level sample
 			done = true;
 			return;
 		}
@@ -118,7 +122,11 @@ public:
 				done = true;
 			} else if((row_ & eh_->_offMask) == row_) {
 				// We arrived at a marked row
-				off_ = ebwt_->_offs[row_ >> eh_->_offRate] + jumps_;
+				off_ = ebwt_->offAt(row_ >> eh_->_offRate) + jumps_;
+				done = true;
+			} else if(ebwt_->_hotOffs.lookup(row_, off_)) {
+				// We arrived at a row marked by the second-level sample
+				off_ += jumps_;
 				done = true;
 			}
 			prep();
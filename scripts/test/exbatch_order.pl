@@ -0,0 +1,63 @@
+#!/usr/bin/perl -w
+
+##
+# exbatch_order.pl
+#
+# Check that matching reads in lock-step (-v 0 with the default
+# --exbatch) gives byte-for-byte the same output, --al and --un files
+# as matching them one at a time (--exbatch 1).
+#
+
+use strict;
+use warnings;
+
+my $bowtie = "./bowtie";
+if(system("$bowtie --version > /dev/null") != 0) {
+	$bowtie = `which bowtie`;
+	chomp($bowtie);
+	if(system("$bowtie --version > /dev/null") != 0) {
+		die "Could not find bowtie in current directory or in PATH\n";
+	}
+}
+
+if(! -f "e_coli.1.ebwt") {
+	print STDERR "Making e_coli index\n";
+	my $bowtie_build = "./bowtie-build";
+	if(system("$bowtie_build --version > /dev/null") != 0) {
+		print STDERR "Could not execute ./bowtie-build; looking in PATH...\n";
+		$bowtie_build = `which bowtie-build`;
+		chomp($bowtie_build);
+		if(system("$bowtie_build --version > /dev/null") != 0) {
+			die "Could not find bowtie-build in current directory or in PATH\n";
+		}
+	}
+	system("$bowtie_build genomes/NC_008253.fna e_coli") && die;
+} else {
+	print STDERR "e_coli index already present...\n";
+}
+
+my $reads = "reads/e_coli_10000snp.fq";
+my $tmp = ".exbatch_order.tmp";
+
+##
+# Run bowtie with the given arguments, writing alignments, --al and
+# --un output to files with the given suffix.
+#
+sub run($$) {
+	my ($args, $suf) = @_;
+	my $cmd = "$bowtie --quiet $args e_coli $reads ".
+	          "--al $tmp.al$suf --un $tmp.un$suf > $tmp.out$suf";
+	print "$cmd\n";
+	system($cmd) && die "Bad exitlevel from bowtie: $?";
+}
+
+for my $a ("-v 0 -p 1", "-v 0 -p 1 -k 2", "-v 0 -p 1 -S --sam-nohead") {
+	run("$a", ".b");
+	run("$a --exbatch 1", ".1");
+	for my $f ("out", "al", "un") {
+		system("cmp $tmp.$f.b $tmp.$f.1") &&
+			die "Lock-step and per-read $f output differ for '$a'\n";
+	}
+}
+unlink glob("$tmp.*");
+print "PASSED\n";
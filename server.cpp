@@ -0,0 +1,399 @@
+/*
+ * server.cpp
+ *
+ * bowtie --server <socket> [options] <ebwt> loads the given indexes
+ * (and their references) once, then listens on a UNIX domain socket
+ * for alignment jobs.  Each job is an ordinary bowtie command line; the
+ * server forks a child for it, which shares the loaded indexes with the
+ * server copy-on-write, runs bowtie() on the command line and exits.
+ * Jobs run concurrently, each with as many search threads as its own
+ * -p asks for.
+ *
+ * bowtie --client <socket> [options] <ebwt> <reads> [<hits>] sends a
+ * job.  The client passes its working directory and its standard
+ * input, output and error descriptors (SCM_RIGHTS) along with the
+ * command line, so the job reads streamed reads from the client's
+ * stdin, writes alignments to the client's stdout and resolves
+ * relative paths as the client would.  The server replies with the
+ * job's exit status once the job finishes.
+ *
+ * Wire format, all integers in network byte order:
+ *
+ *   request: uint32 SERVER_PROTOCOL, uint32 length, sent along with
+ *            the three descriptors; then 'length' bytes holding the
+ *            working directory and each argument, each terminated by
+ *            a NUL
+ *   reply:   uint32 exit status (128 + signal if the job was killed)
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "server.h"
+
+#ifdef BOWTIE_SERVER
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#endif
+
+using namespace std;
+
+extern "C" {
+	int bowtie(int argc, const char **argv);
+}
+
+#ifdef BOWTIE_SERVER
+
+/// Changes whenever the request or reply format does
+static const uint32_t SERVER_PROTOCOL = 1;
+/// Longest request payload accepted
+static const uint32_t SERVER_MAX_REQUEST = 1024 * 1024;
+
+static volatile sig_atomic_t serverStop = 0;
+
+static void onStopSignal(int) {
+	serverStop = 1;
+}
+
+static bool writeFully(int fd, const void *buf, size_t len) {
+	const char *p = (const char*)buf;
+	while(len > 0) {
+		ssize_t r = write(fd, p, len);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return false;
+		p += r; len -= r;
+	}
+	return true;
+}
+
+static bool readFully(int fd, void *buf, size_t len) {
+	char *p = (char*)buf;
+	while(len > 0) {
+		ssize_t r = read(fd, p, len);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return false;
+		p += r; len -= r;
+	}
+	return true;
+}
+
+/**
+ * Fill in the address of the socket at 'path'.
+ */
+static bool unixAddress(const char *path, struct sockaddr_un& addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		cerr << "Error: socket path " << path << " is too long" << endl;
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	return true;
+}
+
+/**
+ * Send a job request: the protocol header along with descriptors 0, 1
+ * and 2, then the payload.
+ */
+static bool sendRequest(int fd, const string& payload) {
+	uint32_t hdr[2] = { htonl(SERVER_PROTOCOL), htonl((uint32_t)payload.length()) };
+	int fds[3] = { 0, 1, 2 };
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	memset(cbuf, 0, sizeof(cbuf));
+	struct iovec iov;
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(hdr);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	ssize_t r;
+	while((r = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR) { }
+	if(r != (ssize_t)sizeof(hdr)) return false;
+	return writeFully(fd, payload.data(), payload.length());
+}
+
+/**
+ * Receive a job request, setting 'fds' to the client's standard
+ * descriptors, 'cwd' to its working directory and 'args' to its
+ * command line.
+ */
+static bool recvRequest(int fd, int fds[3], string& cwd, vector<string>& args) {
+	uint32_t hdr[2];
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov;
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(hdr);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	ssize_t r;
+	while((r = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR) { }
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	   cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+	{
+		return false;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+	uint32_t len = ntohl(hdr[1]);
+	if(r != (ssize_t)sizeof(hdr) || ntohl(hdr[0]) != SERVER_PROTOCOL || len > SERVER_MAX_REQUEST) {
+		for(int i = 0; i < 3; i++) close(fds[i]);
+		return false;
+	}
+	string payload(len, '\0');
+	if(len > 0 && !readFully(fd, &payload[0], len)) {
+		for(int i = 0; i < 3; i++) close(fds[i]);
+		return false;
+	}
+	size_t start = 0;
+	for(size_t i = 0; i < payload.length(); i++) {
+		if(payload[i] != '\0') continue;
+		args.push_back(payload.substr(start, i - start));
+		start = i + 1;
+	}
+	if(args.empty()) {
+		for(int i = 0; i < 3; i++) close(fds[i]);
+		return false;
+	}
+	cwd = args[0];
+	args.erase(args.begin());
+	return true;
+}
+
+static void sendStatus(int conn, int status) {
+	uint32_t st = htonl((uint32_t)status);
+	writeFully(conn, &st, sizeof(st));
+}
+
+/**
+ * Fork a child to run the job requested on 'conn'.  Running jobs are
+ * recorded in 'jobs' by pid, with the connection to reply on.
+ */
+static void startJob(int conn,
+                     int listenFd,
+                     const char *argv0,
+                     map<pid_t, int>& jobs)
+{
+	int fds[3];
+	string cwd;
+	vector<string> args;
+	struct timeval tv = { 10, 0 }; // don't let a silent client stall the server
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	char c;
+	if(recv(conn, &c, 1, MSG_PEEK) <= 0) {
+		// Connected and left without a request, e.g. another server
+		// checking whether this one is alive
+		close(conn);
+		return;
+	}
+	if(!recvRequest(conn, fds, cwd, args)) {
+		cerr << "Warning: ignoring malformed request" << endl;
+		close(conn);
+		return;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if(pid == 0) {
+		// Job: behave like a bowtie started by the client
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		close(listenFd);
+		close(conn);
+		for(map<pid_t, int>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+			close(it->second);
+		}
+		for(int i = 0; i < 3; i++) {
+			dup2(fds[i], i);
+			if(fds[i] > 2) close(fds[i]);
+		}
+		clearerr(stdin);
+		if(chdir(cwd.c_str()) != 0) {
+			cerr << "Error: could not change to directory " << cwd << ": " << strerror(errno) << endl;
+			_exit(1);
+		}
+		vector<const char*> argv;
+		argv.push_back(argv0);
+		for(size_t i = 0; i < args.size(); i++) argv.push_back(args[i].c_str());
+		int ret = bowtie((int)argv.size(), &argv[0]);
+		cout.flush();
+		cerr.flush();
+		fflush(stdout);
+		fflush(stderr);
+		_exit(ret & 0xff);
+	}
+	for(int i = 0; i < 3; i++) close(fds[i]);
+	if(pid < 0) {
+		cerr << "Error: could not fork a job: " << strerror(errno) << endl;
+		sendStatus(conn, 1);
+		close(conn);
+		return;
+	}
+	jobs[pid] = conn;
+}
+
+/**
+ * Collect finished jobs and send their exit statuses, waiting for all
+ * of them if 'block' is set.
+ */
+static void reapJobs(map<pid_t, int>& jobs, bool block) {
+	while(!jobs.empty()) {
+		int st = 0;
+		pid_t pid = waitpid(-1, &st, block ? 0 : WNOHANG);
+		if(pid < 0 && errno == EINTR) continue;
+		if(pid <= 0) break;
+		map<pid_t, int>::iterator it = jobs.find(pid);
+		if(it == jobs.end()) continue;
+		int status = 1;
+		if(WIFEXITED(st)) {
+			status = WEXITSTATUS(st);
+		} else if(WIFSIGNALED(st)) {
+			status = 128 + WTERMSIG(st);
+		}
+		sendStatus(it->second, status);
+		close(it->second);
+		jobs.erase(it);
+	}
+}
+
+/**
+ * Serve jobs on the socket at 'path' until interrupted, with the
+ * indexes named by argc/argv (options, then <ebwt>) kept loaded.
+ */
+int bowtieServer(const char *path, int argc, const char **argv) {
+	struct sockaddr_un addr;
+	if(!unixAddress(path, addr)) return 1;
+	// Don't take over a socket another server is still listening on
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		cerr << "Error: a bowtie server is already listening on " << path << endl;
+		close(probe);
+		return 1;
+	}
+	if(probe >= 0) close(probe);
+	int ret = bowtiePreload(argc, argv);
+	if(ret != 0) return ret;
+
+	unlink(path);
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenFd < 0 ||
+	   bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+	   listen(listenFd, 128) != 0)
+	{
+		cerr << "Error: could not listen on " << path << ": " << strerror(errno) << endl;
+		return 1;
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onStopSignal; // no SA_RESTART: interrupt poll()
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	cerr << "Listening for jobs on " << path << endl;
+
+	map<pid_t, int> jobs;
+	while(!serverStop) {
+		reapJobs(jobs, false);
+		// Watch the listening socket, plus each job's connection in
+		// case its client goes away
+		vector<struct pollfd> pfds(1);
+		vector<pid_t> pids(1, 0);
+		pfds[0].fd = listenFd;
+		pfds[0].events = POLLIN;
+		for(map<pid_t, int>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+			struct pollfd p = { it->second, POLLIN, 0 };
+			pfds.push_back(p);
+			pids.push_back(it->first);
+		}
+		if(poll(&pfds[0], pfds.size(), 200) <= 0) continue;
+		for(size_t i = 1; i < pfds.size(); i++) {
+			if(pfds[i].revents != 0) {
+				// Clients send nothing after the request, so this is
+				// a hang-up; the job's output has nowhere to go
+				kill(pids[i], SIGTERM);
+			}
+		}
+		if(pfds[0].revents & POLLIN) {
+			int conn = accept(listenFd, NULL, NULL);
+			if(conn >= 0) startJob(conn, listenFd, argv[0], jobs);
+		}
+	}
+	close(listenFd);
+	unlink(path);
+	reapJobs(jobs, true);
+	return 0;
+}
+
+/**
+ * Send the job given by argc/argv to the server listening on the
+ * socket at 'path', and return the job's exit status.
+ */
+int bowtieClient(const char *path, int argc, const char **argv) {
+	struct sockaddr_un addr;
+	if(!unixAddress(path, addr)) return 1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		cerr << "Error: could not connect to a bowtie server on " << path << ": " << strerror(errno) << endl;
+		return 1;
+	}
+	char cwd[PATH_MAX];
+	if(getcwd(cwd, sizeof(cwd)) == NULL) {
+		cerr << "Error: could not get the working directory: " << strerror(errno) << endl;
+		return 1;
+	}
+	string payload(cwd);
+	payload.push_back('\0');
+	for(int i = 1; i < argc; i++) {
+		payload += argv[i];
+		payload.push_back('\0');
+	}
+	if(!sendRequest(fd, payload)) {
+		cerr << "Error: could not send the job to the bowtie server on " << path << endl;
+		return 1;
+	}
+	uint32_t status;
+	if(!readFully(fd, &status, sizeof(status))) {
+		cerr << "Error: the bowtie server on " << path << " closed the connection without a result" << endl;
+		return 1;
+	}
+	close(fd);
+	return (int)ntohl(status);
+}
+
+#else
+
+int bowtieServer(const char *path, int argc, const char **argv) {
+	cerr << "Error: --server is not supported on this platform" << endl;
+	return 1;
+}
+
+int bowtieClient(const char *path, int argc, const char **argv) {
+	cerr << "Error: --client is not supported on this platform" << endl;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * server.h
+ *
+ * A long-running bowtie that keeps its indexes loaded and runs
+ * alignment jobs sent to it over a UNIX domain socket.
+ */
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+extern int bowtieServer(const char *path, int argc, const char **argv);
+
+extern int bowtieClient(const char *path, int argc, const char **argv);
+
+extern "C" {
+	int bowtiePreload(int argc, const char **argv);
+}
+
+#endif /* SERVER_H_ */
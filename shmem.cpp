@@ -3,35 +3,382 @@
  *
  *  Created on: August 13, 2009
  *      Author: Ben Langmead
+ *
+ * Index arrays shared between processes live in POSIX shared-memory
+ * segments (shm_open + mmap), one per array, named after a hash of the
+ * index file's real path.  Each segment starts with a SharedMemHeader
+ * describing the data after it.  Two fcntl() byte-range locks on the
+ * segment coordinate the processes using it:
+ *
+ *  - byte 0, the loader lock, is held exclusively while a process
+ *    inspects the header and, if it's the leader, while it reads the
+ *    data in.  Others block on it rather than polling.
+ *  - byte 1, the user lock, is held shared by every attached process
+ *    for as long as it's attached.  The kernel drops it if a process
+ *    dies, so it tells us whether the 'users' count can be trusted.
+ *
+ * Segments stay resident after the last user detaches so that later
+ * runs can attach without reloading.  A segment whose header doesn't
+ * match the index file (rebuilt index, older layout) is unlinked and
+ * recreated; processes still using the old copy keep it until they
+ * exit.
  */
 
 #ifdef BOWTIE_SHARED_MEM
 
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <map>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
-#include <sys/shm.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "shmem.h"
+#include "threading.h"
+#include "assert_helpers.h"
 
 using namespace std;
 
+#define SHMEM_MAGIC   0x68734242 // "BBsh"
+#define SHMEM_VERSION 2          // 1 was the SysV layout
+#define SHMEM_UNINIT  0xafba4242
+#define SHMEM_INIT    0xffaa6161
+
+/// Bytes reserved for the header; keeps the data page-aligned
+static const size_t SHMEM_HDR_LEN = 4096;
+/// Distance between the bytes sampled for the data checksum
+static const size_t SHMEM_SAMPLE = 64 * 1024;
+/// Names tried for keys whose hashes collide
+static const int SHMEM_MAX_PROBES = 16;
+
+/**
+ * Header at the start of every segment.  Only read or written while
+ * holding the segment's loader lock.
+ */
+struct SharedMemHeader {
+	uint32_t magic;     // SHMEM_MAGIC
+	uint32_t version;   // SHMEM_VERSION
+	uint32_t state;     // SHMEM_UNINIT until the leader has loaded the data
+	int32_t  users;     // # processes attached
+	uint64_t len;       // bytes of data following the header
+	uint64_t fileId;    // identity of the index file (device, inode, size, mtime)
+	uint64_t checksum;  // sampled checksum of the data, set once loaded
+	char     key[2048]; // key the segment was created for
+};
+
+/// A segment mapped by this process
+struct SharedSeg {
+	string name;
+	int    fd;
+	char  *base;
+	size_t mapLen;
+	int    refs; // # allocSharedMem() calls in this process using it
+};
+
+static MUTEX_T                   shmemMutex;
+static map<string, SharedSeg>    shmemSegs; // by segment name
+static map<void*, string>        shmemData; // data pointer -> segment name
+
+/**
+ * 64-bit FNV-1a over 'len' bytes, continuing from 'h'.
+ */
+static uint64_t fnv1a(const void *p, size_t len, uint64_t h = 14695981039346656037ull) {
+	const unsigned char *c = (const unsigned char*)p;
+	for(size_t i = 0; i < len; i++) {
+		h ^= c[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/**
+ * Sampled checksum of a segment's data: cheap enough to check on every
+ * attach, and enough to catch a segment that was never fully written.
+ */
+static uint64_t dataChecksum(const char *data, size_t len) {
+	uint64_t h = fnv1a(&len, sizeof(len));
+	for(size_t i = 0; i < len; i += SHMEM_SAMPLE) {
+		h = fnv1a(data + i, min<size_t>(8, len - i), h);
+	}
+	if(len > 0) h = fnv1a(data + len - 1, 1, h);
+	return h;
+}
+
+/**
+ * Split a key like "idx.1.ebwt[ebwt]" into the file part and the
+ * suffix, and canonicalize the file part so that the same index
+ * reached by different relative paths shares one segment.
+ */
+static string canonicalKey(const string& key, string& path) {
+	size_t br = key.rfind('[');
+	path = (br != string::npos && !key.empty() && key[key.length()-1] == ']') ? key.substr(0, br) : key;
+	string suffix = key.substr(path.length());
+	char buf[PATH_MAX];
+	if(realpath(path.c_str(), buf) != NULL) path = buf;
+	return path + suffix;
+}
+
+/**
+ * Identity of the file at 'path': changes when the index is rebuilt.
+ */
+static uint64_t fileIdentity(const string& path) {
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	if(stat(path.c_str(), &st) != 0) return 0;
+	uint64_t v[5] = { (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+	                  (uint64_t)st.st_mtime, 0 };
+#ifdef __linux__
+	v[4] = (uint64_t)st.st_mtim.tv_nsec;
+#endif
+	return fnv1a(v, sizeof(v));
+}
+
+/**
+ * Name of the segment for 'key'; 'probe' > 0 gives the alternates
+ * used when another key's segment already has the name.
+ */
+static string segmentName(const string& key, int probe) {
+	ostringstream os;
+	os << "/bowtie-" << hex << fnv1a(key.data(), key.length());
+	if(probe > 0) os << "-" << dec << probe;
+	return os.str();
+}
+
+/**
+ * Take (type F_WRLCK or F_RDLCK), or release (F_UNLCK) byte 'which' of
+ * segment 'fd', waiting if necessary.
+ */
+static bool lockByte(int fd, int which, short type) {
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = which;
+	fl.l_len = 1;
+	while(fcntl(fd, F_SETLKW, &fl) < 0) {
+		if(errno != EINTR) return false;
+	}
+	return true;
+}
+
+/**
+ * Return true iff another process holds a lock on byte 'which'.
+ */
+static bool lockedByOthers(int fd, int which) {
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = which;
+	fl.l_len = 1;
+	if(fcntl(fd, F_GETLK, &fl) < 0) return true;
+	return fl.l_type != F_UNLCK;
+}
+
+#define LOADER_LOCK 0
+#define USER_LOCK   1
+
+/**
+ * Attach to (or create) the shared-memory segment for 'key', which
+ * holds 'len' bytes of data, and set '*dst' to the start of the data.
+ * Returns true if this process is the leader: it then holds the loader
+ * lock, so others wait in here until it calls notifySharedMem().
+ */
+bool allocSharedSeg(const string& key,
+                    size_t len,
+                    void **dst,
+                    const char *memName,
+                    bool verbose)
+{
+	ThreadSafe ts(&shmemMutex);
+	string path;
+	string ckey = canonicalKey(key, path);
+	uint64_t fileId = fileIdentity(path);
+	size_t mapLen = SHMEM_HDR_LEN + len;
+	if(verbose) {
+		cerr << "Reading " << len << " bytes into shared memory for " << memName << endl;
+	}
+	for(int probe = 0; probe < SHMEM_MAX_PROBES; ) {
+		string name = segmentName(ckey, probe);
+		map<string, SharedSeg>::iterator it = shmemSegs.find(name);
+		if(it != shmemSegs.end() && it->second.mapLen == mapLen) {
+			// Already attached by this process
+			it->second.refs++;
+			*dst = it->second.base + SHMEM_HDR_LEN;
+			shmemData[*dst] = name;
+			return false;
+		}
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0666);
+		if(fd < 0) {
+			cerr << "Could not open shared-memory segment " << name << " for " << memName
+			     << ": " << strerror(errno) << endl;
+			throw 1;
+		}
+		if(!lockByte(fd, LOADER_LOCK, F_WRLCK)) {
+			cerr << "Could not lock shared-memory segment " << name << ": " << strerror(errno) << endl;
+			close(fd);
+			throw 1;
+		}
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			cerr << "Could not stat shared-memory segment " << name << ": " << strerror(errno) << endl;
+			close(fd);
+			throw 1;
+		}
+		if(st.st_nlink == 0) {
+			// Replaced by another process while we waited for the lock
+			close(fd);
+			continue;
+		}
+		bool fresh = (st.st_size == 0);
+		if(fresh) {
+			int ret = ftruncate(fd, (off_t)mapLen);
+#ifdef __linux__
+			// Reserve the pages now; tmpfs otherwise reports a full
+			// /dev/shm with SIGBUS in the middle of loading
+			if(ret == 0) ret = errno = posix_fallocate(fd, 0, (off_t)mapLen);
+#endif
+			if(ret != 0) {
+				cerr << "Out of memory allocating shared area " << memName << " (" << mapLen
+				     << " bytes): " << strerror(errno) << endl;
+				shm_unlink(name.c_str());
+				close(fd);
+				throw 1;
+			}
+		} else if((size_t)st.st_size < SHMEM_HDR_LEN) {
+			// Not one of ours, or its creator died before sizing it
+			shm_unlink(name.c_str());
+			close(fd);
+			continue;
+		}
+		size_t segLen = fresh ? mapLen : (size_t)st.st_size;
+		char *base = (char*)mmap(NULL, segLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(base == (char*)MAP_FAILED) {
+			cerr << "Failed to map shared-memory segment " << name << " for " << memName
+			     << ": " << strerror(errno) << endl;
+			close(fd);
+			throw 1;
+		}
+		SharedMemHeader *hdr = (SharedMemHeader*)base;
+		if(!fresh && hdr->magic == SHMEM_MAGIC && strncmp(hdr->key, ckey.c_str(), sizeof(hdr->key)) != 0) {
+			// Hash collision with another index; try the next name
+			munmap(base, segLen);
+			close(fd);
+			probe++;
+			continue;
+		}
+		if(!fresh && (hdr->magic != SHMEM_MAGIC ||
+		              hdr->version != SHMEM_VERSION ||
+		              hdr->len != len ||
+		              hdr->fileId != fileId ||
+		              segLen != mapLen))
+		{
+			// Left over from an older index or an older bowtie
+			if(verbose || hdr->magic == SHMEM_MAGIC) {
+				cerr << "Warning: shared-memory segment " << name << " for " << memName
+				     << " is stale; replacing it" << endl;
+			}
+			shm_unlink(name.c_str());
+			munmap(base, segLen);
+			close(fd);
+			continue;
+		}
+		// Nobody holds the user lock, so any 'users' count is left
+		// over from processes that died without detaching
+		bool othersAttached = lockedByOthers(fd, USER_LOCK);
+		if(!lockByte(fd, USER_LOCK, F_RDLCK)) {
+			cerr << "Could not lock shared-memory segment " << name << ": " << strerror(errno) << endl;
+			munmap(base, segLen);
+			close(fd);
+			throw 1;
+		}
+		bool leader = fresh || hdr->state != SHMEM_INIT;
+		if(!leader && dataChecksum(base + SHMEM_HDR_LEN, len) != hdr->checksum) {
+			cerr << "Warning: checksum mismatch in shared-memory segment " << name << " for "
+			     << memName << "; reloading it" << endl;
+			leader = true;
+		}
+		if(leader) {
+			// Fresh segment, or the previous leader died mid-load
+			memset(hdr, 0, sizeof(*hdr));
+			hdr->magic = SHMEM_MAGIC;
+			hdr->version = SHMEM_VERSION;
+			hdr->state = SHMEM_UNINIT;
+			hdr->len = len;
+			hdr->fileId = fileId;
+			strncpy(hdr->key, ckey.c_str(), sizeof(hdr->key) - 1);
+		}
+		if(!othersAttached) hdr->users = 0;
+		hdr->users++;
+		if(verbose) {
+			cerr << "  I (pid = " << getpid() << ") " << (leader ? "am loading" : "attached to")
+			     << " shared-memory segment " << name << " for " << memName
+			     << " (" << hdr->users << " user(s))" << endl;
+		}
+		if(!leader) lockByte(fd, LOADER_LOCK, F_UNLCK);
+		SharedSeg seg = { name, fd, base, mapLen, 1 };
+		shmemSegs[name] = seg;
+		*dst = base + SHMEM_HDR_LEN;
+		shmemData[*dst] = name;
+		return leader;
+	}
+	cerr << "Too many shared-memory segment names in use for " << memName
+	     << "; remove stale /bowtie-* segments and try again" << endl;
+	throw 1;
+}
+
 /**
  * Notify other users of a shared-memory chunk that the leader has
- * finished initializing it.
+ * finished initializing it, and let them in.
  */
 void notifySharedMem(void *mem, size_t len) {
-	((volatile uint32_t*)((char*)mem + len))[0] = SHMEM_INIT;
+	ThreadSafe ts(&shmemMutex);
+	map<void*, string>::iterator d = shmemData.find(mem);
+	if(d == shmemData.end()) return;
+	SharedSeg& seg = shmemSegs[d->second];
+	SharedMemHeader *hdr = (SharedMemHeader*)seg.base;
+	hdr->checksum = dataChecksum((const char*)mem, len);
+	__sync_synchronize();
+	hdr->state = SHMEM_INIT;
+	lockByte(seg.fd, LOADER_LOCK, F_UNLCK);
 }
 
 /**
  * Wait until the leader of a shared-memory chunk has finished
- * initializing it.
+ * initializing it.  allocSharedMem() only hands followers a segment
+ * whose leader is done, so there's nothing left to wait for; this just
+ * checks that.
  */
 void waitSharedMem(void *mem, size_t len) {
-	while(((volatile uint32_t*)((char*)mem + len))[0] != SHMEM_INIT) {
-		sleep(1);
+	assert_eq(SHMEM_INIT, ((SharedMemHeader*)((char*)mem - SHMEM_HDR_LEN))->state);
+}
+
+/**
+ * Detach from a shared-memory chunk.  The segment itself stays
+ * resident for later runs.
+ */
+void freeSharedMem(void *mem) {
+	ThreadSafe ts(&shmemMutex);
+	map<void*, string>::iterator d = shmemData.find(mem);
+	if(d == shmemData.end()) return;
+	map<string, SharedSeg>::iterator it = shmemSegs.find(d->second);
+	shmemData.erase(d);
+	if(it == shmemSegs.end() || --it->second.refs > 0) return;
+	SharedSeg& seg = it->second;
+	SharedMemHeader *hdr = (SharedMemHeader*)seg.base;
+	if(lockByte(seg.fd, LOADER_LOCK, F_WRLCK)) {
+		if(hdr->users > 0) hdr->users--;
+		lockByte(seg.fd, USER_LOCK, F_UNLCK);
+		lockByte(seg.fd, LOADER_LOCK, F_UNLCK);
 	}
+	munmap(seg.base, seg.mapLen);
+	close(seg.fd);
+	shmemSegs.erase(it);
 }
 
 #endif
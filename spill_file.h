@@ -0,0 +1,92 @@
+/*
+ * spill_file.h
+ *
+ * Temporary file of suffix-array offsets for bowtie-build to spill to
+ * when it can't hold them all in memory.
+ */
+
+#ifndef SPILL_FILE_H_
+#define SPILL_FILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include "assert_helpers.h"
+#include "btypes.h"
+
+/**
+ * A file of TIndexOffUs, in the host's endianness, that can be written
+ * and read at any element offset.  The file is removed when closed.
+ * Not thread-safe; callers sharing one must serialize their calls.
+ */
+class OffSpillFile {
+
+public:
+
+	OffSpillFile() : f_(NULL) { }
+
+	~OffSpillFile() { close(); }
+
+	/**
+	 * Create the file, truncating it if it exists.
+	 */
+	void open(const std::string& fn) {
+		close();
+		fn_ = fn;
+		f_ = fopen(fn_.c_str(), "w+b");
+		if(f_ == NULL) {
+			std::cerr << "Could not open temporary file for writing: \"" << fn_ << "\"" << std::endl;
+			throw 1;
+		}
+	}
+
+	/// Return true iff the file is open
+	bool isOpen() const { return f_ != NULL; }
+
+	/// Return the file's name
+	const std::string& name() const { return fn_; }
+
+	/**
+	 * Write n offsets from buf, the first at element offset pos.
+	 */
+	void write(uint64_t pos, const TIndexOffU *buf, size_t n) {
+		assert(isOpen());
+		if(fseeko(f_, (off_t)(pos * OFF_SIZE), SEEK_SET) != 0 ||
+		   fwrite(buf, OFF_SIZE, n, f_) != n)
+		{
+			std::cerr << "Error writing temporary file \"" << fn_ << "\"; please check whether the disk is full." << std::endl;
+			throw 1;
+		}
+	}
+
+	/**
+	 * Read n offsets into buf, the first from element offset pos.
+	 */
+	void read(uint64_t pos, TIndexOffU *buf, size_t n) {
+		assert(isOpen());
+		if(fseeko(f_, (off_t)(pos * OFF_SIZE), SEEK_SET) != 0 ||
+		   fread(buf, OFF_SIZE, n, f_) != n)
+		{
+			std::cerr << "Error reading temporary file \"" << fn_ << "\"" << std::endl;
+			throw 1;
+		}
+	}
+
+	/**
+	 * Close and remove the file, if it's open.
+	 */
+	void close() {
+		if(f_ == NULL) return;
+		fclose(f_);
+		f_ = NULL;
+		remove(fn_.c_str());
+	}
+
+private:
+
+	std::string fn_;
+	FILE       *f_;
+};
+
+#endif /*SPILL_FILE_H_*/